@@ -21,6 +21,7 @@
 
 #include "LSDGrainMatrix.hpp"
 #include "LSDRainfallRunoff.hpp"
+#include "LSDio.hpp"
 
 #include "TNT/tnt.h"   // Template Numerical Toolkit library
 
@@ -32,16 +33,36 @@
 #ifndef LSDCatchmentModel_geodecomp_H
 #define LSDCatchmentModel_geodecomp_H
 
+class LSDCatchmentModel;
+
 
 void runSimulation(std::string pfname);
 
+/// @brief Runs a model whose parameters and terrain are loaded, on the
+/// ranks of LSDEnsemble::communicator().
+void runCatchment(LSDCatchmentModel *catchment);
+
 
 
 class LSDCatchmentModel: public LSDRaster
 {
   friend class Cell;
+  template<int LANES> friend class EnsembleCell;
   friend class CellInitializer;
+  template<int LANES> friend class EnsembleCellInitializer;
   friend class Typemaps;
+  friend class GaugeWriter;
+  friend class MassBalanceSteerer;
+  friend class DerivedFieldWriter;
+  friend class RegionWriter;
+  friend class CheckpointWriter;
+  friend class StabilitySteerer;
+  friend class ConvergenceSteerer;
+  friend class KernelTest;
+  friend class LSDEnsemble;
+  friend class LSDTaskFarm;
+  friend void runSimulation(std::string pfname);
+  friend void runCatchment(LSDCatchmentModel *catchment);
   
 public:
 
@@ -93,9 +114,36 @@ public:
   void initialise_variables(std::string pfname);
 
   /// @brief initialises array sizes based on DEM dimensions
-  /// @details also sets 'hard-coded' parameters to start the model
+  /// @details also sets 'hard-coded' parameters to start the model. Keeps
+  /// elev if it already has the size of the DEM (see load_terrain()).
   void initialise_arrays();
+
+  /// @brief Reads the DEM header and elevations on rank 0 and broadcasts
+  /// them to the other ranks of LSDEnsemble::communicator().
+  void load_terrain();
+
+  /// @brief Takes the DEM extents and elevations of another model on this
+  /// rank. The elevations are shared, not copied (TNT arrays are reference
+  /// counted), so ensemble members hold the terrain once per rank.
+  void share_terrain(const LSDCatchmentModel& source);
+
+  /// The parameters held in static members, which all models on a rank
+  /// share. Ensemble members that run one after the other on the same
+  /// ranks restore them before reading their own parameters.
+  struct StaticParameters
+  {
+    double DX, DY, no_data_value, water_depth_erosion_threshold, edgeslope, hflow_threshold, mannings,
+      froude_limit, time_factor, courant_number, maxdepth, input_output_difference, in_out_difference_allowed,
+      water_input_depth;
+    bool fast_friction;
+  };
+  static StaticParameters get_static_parameters();
+  static void set_static_parameters(const StaticParameters& parameters);
   
+  /// @brief The type of the cell in column x and row y of the DEM, from
+  /// its position on the domain edges.
+  Cell::CellType cell_type(int x, int y) const;
+
   int get_imax() const { return imax; }
   int get_jmax() const { return jmax; }
 
@@ -115,6 +163,20 @@ public:
   /// @author dav
   void load_data();
 
+  /// @brief Reads the gauge point file and converts each point to a grid row/col.
+  /// @details Each line holds a gauge name and either an easting/northing pair or,
+  /// if gauge_coordinates is set to 'grid', a row/col pair. Points outside the DEM
+  /// are skipped with a warning. Needs the DEM header (xll, yll, DX) to be set.
+  void read_gauge_points();
+
+  /// @brief Builds the output regions declared in the parameter file.
+  /// @details Each region is declared with 'output_region: name' and
+  /// described by region_<name>_shape (rect or polygon), region_<name>_coords
+  /// (comma separated pairs, row,col or easting,northing depending on
+  /// region_<name>_coordinates), region_<name>_fields and region_<name>_interval.
+  /// Needs the DEM header (xll, yll, DX) to be set.
+  void resolve_output_regions();
+
   /// Prints the initial values set by user from param file
   /// as well as those default initial values in the code.
   void print_parameters();
@@ -128,6 +190,10 @@ public:
   /// @return Returns a vector of vector<float>. (A 2D-like vector).
   std::vector< std::vector<float> > read_rainfalldata(std::string FILENAME);
 
+  /// @brief Reads the rainfall data file on rank 0 and broadcasts it to
+  /// hourly_rain_data on every rank.
+  void load_rainfall_data();
+
     /// @brief Reads in the grain data file, note, that this is not a raster and in
   /// a special format like the rainfall file.
   /// @author DAV
@@ -150,9 +216,11 @@ public:
   void save_raster_data(double tempcycle);
 
   /// @brief Writes the timeseries file for current timestep.
-  /// @detail Writes discharge and sediment flux according to
-  /// the same format as found in the CAESAR-Lisflood catchmetn
-  void write_output_timeseries(runoffGrid& runoff);
+  /// @detail Writes discharge according to the same format as found in the
+  /// CAESAR-Lisflood catchment model, followed by the distributed mass balance
+  /// terms (outflow per domain edge, stored volume, wetted cells). Sediment
+  /// columns are not written until erosion is ported. Called on rank 0 only.
+  void write_output_timeseries();
 
   void save_raster_output();
 
@@ -187,6 +255,62 @@ public:
   double get_cycle() const { return cycle; }
   int get_maxcycle() const { return maxcycle; }
 
+  /// @brief Moves the model clock to the next rain event when the catchment is dry.
+  /// @details Called before each step. Only acts on a fresh storage sample of
+  /// the mass balance reduction (see MassBalanceSteerer) that shows no more
+  /// than dry_weather_wet_cells wet cells, while the rainfall series is zero.
+  /// The TOPMODEL saturation deficit decays over the skipped period with its
+  /// analytic zero-rain solution (see topmodel_decay()). Nothing reads that
+  /// runoff until the rainfall input is ported to the kernel, so
+  /// runCatchment refuses dry_weather_skip for now.
+  /// @return whether the clock was moved
+  bool skip_dry_weather();
+
+  /// @brief Model time (minutes) of the first rainfall record at or after
+  /// the given time that is not zero, or the end of the series.
+  double next_rain_time(double from) const;
+
+  /// @brief Applies the TOPMODEL recession over a period without rain.
+  /// @details With no rain, dj/dt = -j^2/M, so j = jo / (1 + jo t / M) and
+  /// the mean runoff over the period is M / t ln(1 + jo t / M).
+  void topmodel_decay(double seconds);
+
+  /// @brief Writes the model counters and timestep state as 'name value' lines
+  /// @details Used for checkpoints, together with the cells of the grid.
+  void save_counters(std::ostream& out) const;
+
+  /// @brief Reads the 'name value' lines written by save_counters().
+  /// @details Unknown names are ignored, so older checkpoints remain readable.
+  void load_counters(std::istream& in);
+
+  /// @brief Cuts the time series and gauge files back to the rows the
+  /// counters account for, so a run restarted from a checkpoint, or rolled
+  /// back to a snapshot, does not repeat the rows written after it. Call on
+  /// rank 0, after load_counters().
+  void truncate_outputs() const;
+
+  /// @brief Starts the time series and gauge files afresh after a warm start
+  /// from the spin-up cache, whose counters count the rows of the run that
+  /// cached it rather than those of the files in write_path.
+  void reset_outputs();
+
+  /// @brief Runs the spin-up on the DEM coarsened by coarse_spinup_factor.
+  /// @details Block averages the DEM, runs the model on it until
+  /// coarse_spinup_duration, and prolongs the final water surface and
+  /// discharges onto water_depth, initial_qx and initial_qy (see
+  /// LSDSpinup.hpp). The model clock carries on from the end of the
+  /// spin-up. The coarse run has the step limit of no_of_iterations too,
+  /// and says so when that ends it early.
+  void run_coarse_spinup();
+
+  /// @brief Content hash identifying a spin-up, as 16 hex digits.
+  /// @details Covers a version string, the DEM elevations, the initial
+  /// depths and discharges, every static parameter, the parameters that
+  /// change the course of the spin-up, the rainfall records up to its end
+  /// and spinup_duration, so runs that only differ after the spin-up share
+  /// the same key. Call on rank 0 (it reads the rainfall file).
+  std::string spinup_cache_key() const;
+
   /// @brief Zeros certain arrays which have to be reset every timestep
   /// or every certain number of timesteps.
   void zero_values();
@@ -306,6 +430,12 @@ public:
   /// during periods of low water flow. (e.g. inter-storm periods.)
   void set_inputoutput_diff();
 
+  /// @brief Stores the water budget totals reduced across all ranks.
+  /// @param totals the LSDMassBalance::Term sums (volumes, and a cell count)
+  /// @param interval_seconds model time over which the volumes were accumulated
+  /// @param storage_sampled whether the stored volume and wetted cells were sampled
+  void update_water_budget(const double *totals, double interval_seconds, bool storage_sampled);
+
 
   
   // skipped vegetation growth, see original code
@@ -313,6 +443,8 @@ public:
   
   TNT::Array2D<double> elev;
   TNT::Array2D<double> water_depth;
+  TNT::Array2D<double> initial_qx;    // initial discharges, set by the coarse spin-up
+  TNT::Array2D<double> initial_qy;
   
   // simulation options
   int no_of_iterations = 100;
@@ -338,6 +470,112 @@ public:
   int water_depth_visit_interval = 1;
   int pixels_per_cell = 10;
 
+  // downsampled preview images, see PreviewWriter
+  bool elevation_preview = false;
+  bool water_depth_preview = false;
+  int elevation_preview_interval = 1;
+  int water_depth_preview_interval = 1;
+  double water_depth_preview_max = 1.0;
+  int preview_block_size = 10;
+  std::string preview_block_method = "mean";
+  bool preview_compression = false;
+
+  // gauge point hydrograph options
+  bool gauge_output = false;
+  std::string gauge_file;
+  std::string gauge_coordinates = "geo";
+  std::string gauge_output_format = "csv";
+  std::string gauge_fname = "gauges.csv";
+  double gauge_save_interval = 1.0;  // model minutes
+  int gauge_window_radius = 0;
+  int gauge_buffer_rows = 100;
+  std::vector<std::string> gauge_names;
+  std::vector<int> gauge_rows;
+  std::vector<int> gauge_cols;
+
+  // state of the GaugeWriter, saved with the counters so that a restart
+  // carries the series on
+  double gauge_next_output_time = 0.0;       // model minutes
+  long gauge_rows_written = 0;               // rows in the gauge file after its header
+  std::vector<double> gauge_row_buffer;      // rank 0: rows not yet appended to the file
+
+  // derived field rasters (velocity etc.), comma separated, see DerivedFieldWriter
+  std::string derived_fields;
+  int derived_fields_interval = 1;
+
+  // region of interest outputs, see RegionWriter
+  std::vector<std::string> output_region_names;
+  std::map<std::string, std::string> region_params;
+  std::vector<OutputRegion> output_regions;
+
+  // checkpoint/restart, see CheckpointWriter
+  double checkpoint_interval = 0;            // model minutes, 0 = off
+  double checkpoint_wallclock_interval = 0;  // wallclock seconds, 0 = off
+  int checkpoint_check_period = 100;         // steps between checks
+  std::string checkpoint_path;
+  bool restart_from_checkpoint = false;
+
+  // warm start from a cached spin-up, see spinup_cache_key()
+  double spinup_duration = 0;                // model minutes, 0 = off
+  std::string spinup_cache_path = "./spinup_cache";
+
+  // spin-up on a coarsened DEM, see run_coarse_spinup()
+  int coarse_spinup_factor = 1;              // 2 or 4, 1 = off
+  double coarse_spinup_duration = 0;         // model minutes
+
+  // steady state monitor, see ConvergenceSteerer
+  unsigned steady_state_interval = 0;        // steps, 0 = off
+  double steady_state_depth_tolerance = 1e-7;      // m/s
+  double steady_state_discharge_tolerance = 1e-6;  // m2/s per s
+  double steady_state_max_ratio = 10;
+  unsigned steady_state_checks = 3;
+  std::string steady_state_action = "stop";  // stop or coarsen
+  double steady_state_output_factor = 10;
+
+  // dry weather fast-forward, see skip_dry_weather()
+  bool dry_weather_skip = false;
+  double dry_weather_wet_cells = 0;
+  unsigned storage_samples = 0;
+  unsigned dry_weather_checked_samples = 0;
+
+  // run time profile, see LSDProfile
+  bool profile_output = false;
+  unsigned profile_sample_interval = 10;     // steps between timed kernel sweeps
+  std::string profile_file;                  // default write_path/profile.csv
+  bool profile_hardware_counters = false;    // see LSDHardwareCounters
+  std::string profile_counters_file;         // default write_path/profile_counters.csv
+
+  // finer DEMs over parts of the catchment, run by the openmp simulator, see LSDOpenMPEngine
+  std::vector<std::string> nest_dems;
+
+  // compare the fast and the reference friction kernels instead of running, see LSDFriction
+  bool friction_validation = false;
+
+  // ensemble mode, see LSDEnsemble
+  std::string ensemble_table;                // parameter overrides, one row per member
+  int ensemble_ranks_per_member = 1;
+  int ensemble_lanes = 1;                    // members per EnsembleCell, 1 (off), 4 or 8
+  int ensemble_raster_interval = 0;          // steps between lane depth rasters, 0: last step only
+  std::string ensemble_member;               // the member this model runs, if any
+
+  // task farm mode, see LSDTaskFarm
+  std::string task_farm_manifest;            // params files of the catchments, one per line
+  int task_farm_ranks_per_group = 1;         // ranks per large catchment
+  long task_farm_serial_cells = 250000;      // DEM cells up to which a catchment runs on one rank
+
+  // rank x rank communication matrix, see LSDCommMatrix
+  bool comm_matrix_output = false;
+  std::string comm_matrix_prefix;            // default write_path/comm
+
+  // stability monitor and rollback, see StabilitySteerer
+  unsigned stability_check_interval = 0;     // steps, 0 = off
+  unsigned stability_snapshot_interval = 100;
+  unsigned stability_snapshots = 3;
+  double stability_max_velocity = 20.0;      // m/s
+  double stability_depth_tolerance = 0.0;    // m below zero before a depth counts as negative
+  double stability_courant_factor = 0.5;
+  double stability_min_courant = 0.05;
+
   string dem_read_extension;
   string dem_write_extension;
   string write_path;
@@ -356,8 +594,15 @@ public:
   double time_1 = 1;
   double waterinput = 0;
   double waterOut = 0;
-  double input_output_difference = 0;
-  double in_out_difference_allowed = 0;
+  static double input_output_difference;
+  static double in_out_difference_allowed;
+
+  // distributed mass balance, see LSDMassBalance
+  unsigned mass_balance_interval = 10;
+  double edge_waterOut[4] = {0, 0, 0, 0};  // W, N, E, S
+  double stored_water_volume = 0;
+  double wetted_cells = 0;
+  int timeseries_row = 0;
   static double mannings;
 
   /// no. of rainfall cells
@@ -386,6 +631,8 @@ public:
   static double edgeslope;
   static double froude_limit;
   static double hflow_threshold;
+  static bool fast_friction;                 // see LSDFriction
+  static double water_input_depth;          // m added to every cell per step (water_input_depth), until the rainfall input is ported
 
   double tx = 60;
 
@@ -395,8 +642,6 @@ public:
   std::vector<int> catchment_input_x_coord;
   std::vector<int> catchment_input_y_coord;
 
-  TNT::Array1D<double> vel_dir;
-
   std::vector<double> hourly_m_value;
   std::vector< std::vector<float> > hourly_rain_data;
   std::vector<double> old_j_mean_store;
@@ -413,6 +658,7 @@ public:
   double k_evap = 0.0;
 
   double rain_data_time_step = 60; // time step for rain data - default is 60.
+  double rainfall_scale = 1.0;     // multiplies the rainfall records
 
   // lisflood caesar adaptation globals
   std::vector<int> catchment_input_counter;
@@ -0,0 +1,102 @@
+// LSDCheckpoint.hpp
+//
+// Header file for checkpoint/restart of the catchment model
+//
+// Every rank writes the cells of its own subdomain to its own binary file
+// (through the Boost serialization of Cell in boostserialization.h), and
+// rank 0 then writes a manifest with the model counters and the bounding
+// box of every rank file, in a scratch directory that is renamed to
+// checkpoint_<step> once complete. A checkpoint without a manifest is
+// incomplete and is ignored on restart. As each rank file records the coordinates
+// of its cells, a run can be restarted on a different number of ranks.
+
+#include <vector>
+#include <string>
+
+#include <mpi.h>
+
+#include <libgeodecomp/io/parallelwriter.h>
+#include <libgeodecomp/misc/clonable.h>
+#include <libgeodecomp/storage/gridbase.h>
+
+#include "catchmentmodel/cell.hpp"
+
+#ifndef LSDCheckpoint_geodecomp_H
+#define LSDCheckpoint_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief Writes a checkpoint at a model time and/or wallclock interval.
+/// @details Whether a checkpoint is due is decided on rank 0 and broadcast
+/// every `period` steps, and applies to the next of these checks, so that
+/// all ranks know in advance to keep the cells of that step.
+class CheckpointWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, CheckpointWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param catchment_in the catchment whose counters are saved with the cells
+  /// @param path directory holding the checkpoint_<step> directories
+  /// @param period number of steps between checks whether a checkpoint is due
+  /// @param model_interval model minutes between checkpoints (0 = off)
+  /// @param wallclock_interval wallclock seconds between checkpoints (0 = off)
+  CheckpointWriter(LSDCatchmentModel *catchment_in, const std::string& path, unsigned period,
+		   double model_interval, double wallclock_interval);
+
+  /// @brief Writes a single checkpoint, at the first check at or after model_time,
+  /// instead of the intervals.
+  void write_once_at(double model_time);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+private:
+  LSDCatchmentModel *catchment;
+  std::string path;
+  bool single;
+  bool done;
+  double model_interval;
+  double wallclock_interval;
+  double next_model_time;
+  double last_wallclock;
+  bool checkpoint_due;
+
+  // cells of this rank for the checkpoint step, by streak
+  std::vector<int> streaks;   // y, x origin and length of each streak
+  std::vector<Cell> cells;
+
+  void write_checkpoint(unsigned step);
+};
+
+
+
+/// @brief Finds the latest complete checkpoint and restores it.
+class CheckpointReader
+{
+public:
+  /// @brief Looks for the latest checkpoint with a manifest in path.
+  CheckpointReader(const std::string& path);
+
+  /// @brief Whether a complete checkpoint was found.
+  bool found() const { return step_found; }
+
+  /// @brief The time step the checkpoint was written at.
+  unsigned get_step() const { return step; }
+
+  /// @brief Restores the model counters saved in the manifest.
+  void restore_counters(LSDCatchmentModel *catchment) const;
+
+  /// @brief Sets every cell of the subgrid from the rank files that overlap it.
+  void restore_subgrid(LibGeoDecomp::GridBase<Cell, 2> *subgrid) const;
+
+private:
+  bool step_found;
+  unsigned step;
+  std::string directory;
+  std::vector<int> rank_boxes;   // x, y, width, height of each rank file
+};
+
+#endif
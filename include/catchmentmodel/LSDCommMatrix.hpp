@@ -0,0 +1,120 @@
+// LSDCommMatrix.hpp
+//
+// Header file for the communication matrix of the catchment model
+//
+// The ghost zone exchanges happen inside LibGeoDecomp, so they are observed
+// through the MPI profiling interface: LSDCommMatrix.cpp defines the
+// point-to-point calls (MPI_Isend, MPI_Irecv, MPI_Send, MPI_Recv) and every
+// call that completes or frees a request (the Wait, Test and Request_free
+// families), which record the bytes and messages per peer rank and the
+// time spent blocked on each peer before passing the call on to the PMPI_
+// version. Sends are booked when they are posted, receives when they
+// complete, with the size from their status. Only point-to-point traffic
+// is counted, and only while recording is switched on by the
+// CommMatrixSteerer, i.e. during the time steps.
+//
+// Calls that complete several requests at once (MPI_Waitall, MPI_Waitsome)
+// are passed on as they are, so the order in which the messages arrived is
+// not known: their blocked time is shared evenly between the peers of the
+// requests they complete, and the per-peer times add up to the total
+// blocked time.
+//
+// At the end of the run the rows of all ranks are gathered and rank 0
+// writes rank x rank matrices of bytes and messages sent and received and
+// seconds waited, plus the bounding box and cell count of each rank's
+// subdomain.
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+
+#ifndef LSDCommMatrix_geodecomp_H
+#define LSDCommMatrix_geodecomp_H
+
+
+/// @brief Per-peer point-to-point traffic and wait times of this rank.
+class LSDCommMatrix
+{
+public:
+  /// @brief Sizes the per-peer rows for the number of ranks.
+  static void initialise();
+
+  /// @brief Records the subdomain of this rank for the layout report.
+  static void set_layout(const LibGeoDecomp::CoordBox<2>& box, std::size_t cells);
+
+  /// @brief Gathers the rows of all ranks and writes prefix_bytes.csv,
+  /// prefix_messages.csv, prefix_bytes_received.csv,
+  /// prefix_messages_received.csv, prefix_wait.csv and prefix_layout.csv
+  /// on rank 0. Rows are the recording rank, columns the peer.
+  static void write_report(const std::string& prefix);
+
+  /// Whether the MPI calls are being recorded
+  static bool recording;
+
+  /// An outstanding non-blocking call posted while recording
+  struct Request
+  {
+    int peer;                    // -1 for any source
+    MPI_Comm comm;
+    MPI_Datatype receive_type;   // MPI_DATATYPE_NULL for sends
+  };
+
+  // called by the MPI wrappers, peers are ranks of the model's
+  // communicator (see LSDEnsemble)
+  static void add_send(int peer, double bytes);
+  static void add_wait(int peer, double seconds);
+  static int model_rank(MPI_Comm comm, int rank);
+
+  /// @brief Books a completed receive of the given datatype.
+  /// @return the peer it came from, -1 if not a rank of the model
+  static int add_receive(MPI_Comm comm, MPI_Datatype datatype, const MPI_Status& status);
+
+  /// @brief Remembers a request posted while recording.
+  static void track(MPI_Request request, int peer, MPI_Comm comm, MPI_Datatype receive_type);
+
+  /// @brief Books a request that has completed and forgets it.
+  /// @return its peer, -1 if unknown, -2 if the request is not tracked
+  static int complete(MPI_Request request, const MPI_Status& status);
+
+  /// @brief Forgets a request, e.g. one that was freed.
+  static void forget(MPI_Request request);
+
+  /// @brief Whether any request is tracked.
+  static bool tracking() { return !pending.empty(); }
+
+private:
+  static std::map<MPI_Request, Request> pending;
+  static std::vector<double> bytes_sent;
+  static std::vector<double> messages_sent;
+  static std::vector<double> bytes_received;
+  static std::vector<double> messages_received;
+  static std::vector<double> wait_seconds;
+  static std::vector<int> layout;
+};
+
+
+
+/// @brief Switches the recording on for the time steps and keeps track of
+/// this rank's subdomain.
+class CommMatrixSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, CommMatrixSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  CommMatrixSteerer();
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  LibGeoDecomp::Region<2> region;
+};
+
+#endif
@@ -0,0 +1,112 @@
+// LSDConvergence.hpp
+//
+// Header file for the steady state monitor of the catchment model
+//
+// On sampled steps each cell measures how much its water depth and
+// discharges changed during the step, into per-thread partial maxima and
+// sums of squares. ConvergenceSteerer reduces them across ranks and, once
+// the catchment has drained or settled to equilibrium within a tolerance,
+// either ends the simulation or switches to a coarser output cadence.
+
+#include <vector>
+
+#include <omp.h>
+#include <mpi.h>
+
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDThreadSlots.hpp"
+
+#ifndef LSDConvergence_geodecomp_H
+#define LSDConvergence_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief Thread-local maxima and sums of squares of the per-step changes.
+/// @details One slot per thread, see LSDThreadSlots.
+class LSDConvergence
+{
+public:
+  enum Term {MAX_DEPTH_CHANGE=0, MAX_DISCHARGE_CHANGE=1,
+	     SUM_SQ_DEPTH_CHANGE=2, SUM_SQ_DISCHARGE_CHANGE=3, NUM_CELLS=4, NUM_TERMS=5};
+
+  /// @brief Sizes the partials for the number of OpenMP threads.
+  static void initialise();
+
+  /// @brief Adds the changes of one cell to this thread's partials.
+  static inline void add(double depth_change, double discharge_change)
+  {
+    double *slot = partials.local();
+    if (depth_change > slot[MAX_DEPTH_CHANGE]) slot[MAX_DEPTH_CHANGE] = depth_change;
+    if (discharge_change > slot[MAX_DISCHARGE_CHANGE]) slot[MAX_DISCHARGE_CHANGE] = discharge_change;
+    slot[SUM_SQ_DEPTH_CHANGE] += depth_change * depth_change;
+    slot[SUM_SQ_DISCHARGE_CHANGE] += discharge_change * discharge_change;
+    slot[NUM_CELLS] += 1.0;
+  }
+
+  /// @brief Combines the partials of all threads into maxima (2 long) and
+  /// sums (3 long, from SUM_SQ_DEPTH_CHANGE on), and zeroes them.
+  static void collect(double *maxima, double *sums);
+
+  /// Set on the steps where cells should measure their change
+  static bool sample;
+
+private:
+  static LSDThreadSlots<double, NUM_TERMS> partials;
+};
+
+
+
+/// @brief Stops the run or coarsens the outputs once nothing changes any more.
+/// @details Every interval steps the cells measure their change, and on the
+/// next step the maxima and sums are reduced with MPI_Allreduce. The changes
+/// are divided by the timestep, so the tolerances are rates (m/s for depth,
+/// m2/s per s for discharge). A check passes when the L2 (root mean square)
+/// rates are within the tolerances and the maximum rates within max_ratio
+/// times the tolerances. After num_checks passing checks in a row the
+/// steerer either ends the simulation or multiplies the time series and
+/// gauge save intervals by output_factor; the intervals are restored as
+/// soon as a check fails again.
+class ConvergenceSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ConvergenceSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  /// @param catchment_in the catchment whose output intervals are coarsened
+  /// @param interval steps between checks
+  /// @param depth_tolerance L2 tolerance of the rate of change of water depth
+  /// @param discharge_tolerance L2 tolerance of the rate of change of discharge
+  /// @param max_ratio allowed ratio of the maximum rates to the tolerances
+  /// @param num_checks passing checks in a row needed for steady state
+  /// @param stop end the simulation at steady state, rather than coarsen the outputs
+  /// @param output_factor factor applied to the output intervals at steady state
+  ConvergenceSteerer(LSDCatchmentModel *catchment_in, unsigned interval, double depth_tolerance,
+		     double discharge_tolerance, double max_ratio, unsigned num_checks, bool stop, double output_factor);
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  LSDCatchmentModel *catchment;
+  unsigned interval;
+  double depth_tolerance;
+  double discharge_tolerance;
+  double max_ratio;
+  unsigned num_checks;
+  bool stop;
+  double output_factor;
+
+  bool checking;
+  double sampled_time_step;
+  unsigned passed_checks;
+  bool coarsened;
+  double timeseries_interval;
+  double gauge_interval;
+
+  bool check();
+};
+
+#endif
@@ -0,0 +1,111 @@
+// LSDEnsemble.hpp
+//
+// Header file for the ensemble mode of the catchment model
+//
+// An ensemble runs many variants of one catchment (Manning's n, Courant
+// number, water input, ...) in one MPI job. The params file names an
+// override table with ensemble_table:
+//
+//   member    mannings_n   courant_number   water_input_depth
+//   n030      0.030        0.5              0.005
+//   n040_wet  0.040        0.5              0.0075
+//
+// a header row of parameter names after "member", then one row per member
+// (whitespace or comma separated, # starts a comment). rainfall_scale may
+// not be overridden: until the rainfall input is ported the kernel adds
+// water_input_depth to every cell, and the members would not differ.
+//
+// MPI_COMM_WORLD is split into groups of ensemble_ranks_per_member ranks,
+// which run the members concurrently, member m on group m % groups. The
+// DEM is read and broadcast once, and every member on a rank shares its
+// elevations.
+//
+// Each member writes to write_path/<member>/, which also holds the params
+// file it ran with (the base params file followed by its overrides), so a
+// member can be rerun on its own. The model addresses its ranks through
+// LSDEnsemble::communicator(), which is MPI_COMM_WORLD outside ensembles
+// (LSDEnsemble::rank(), size() and barrier() on it).
+//
+// With ensemble_lanes: 4 or 8, a group runs that many members at once in
+// one grid of EnsembleCell (see ensemble_cell.hpp), one member per lane.
+// The members may then only vary mannings_n, courant_number and
+// froude_limit, and write their water depth rasters (every
+// ensemble_raster_interval steps, and at the end) rather than the outputs
+// of a Cell run. Each lane takes the time step of its own Courant number,
+// so after the same steps the members are at different model times:
+// water_depth_times.txt in each member directory gives the model time of
+// every raster.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <mpi.h>
+
+#ifndef LSDEnsemble_geodecomp_H
+#define LSDEnsemble_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+class LSDEnsemble
+{
+public:
+  /// One row of the override table
+  struct Member
+  {
+    std::string name;
+    std::vector< std::pair<std::string, std::string> > overrides;
+  };
+
+  /// @brief The ranks of the model this rank belongs to: those of its
+  /// member in ensemble mode, of its catchment in task farm mode (see
+  /// LSDTaskFarm), MPI_COMM_WORLD otherwise.
+  static MPI_Comm communicator() { return comm; }
+
+  /// @brief The rank of this rank in communicator().
+  static int rank()
+  {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    return rank;
+  }
+
+  /// @brief The number of ranks in communicator().
+  static int size()
+  {
+    int size;
+    MPI_Comm_size(comm, &size);
+    return size;
+  }
+
+  /// @brief Waits for the ranks of communicator().
+  static void barrier() { MPI_Barrier(comm); }
+
+  /// @brief Reads the override table, see above. Exits on a malformed table.
+  static std::vector<Member> read_table(const std::string& filename);
+
+  /// @brief Runs the members of base's ensemble_table on groups of ranks.
+  /// @param pfname the base params file
+  /// @param base the model read from it, with the terrain loaded
+  static void run(const std::string& pfname, LSDCatchmentModel *base);
+
+private:
+  /// @brief Whether EnsembleCell can vary a parameter per lane.
+  static bool lane_parameter(const std::string& key);
+
+  /// @brief Runs a batch of up to LANES members in one EnsembleCell grid
+  /// on the ranks of comm, writing their depth rasters to directories.
+  template<int LANES>
+  static void run_lanes(LSDCatchmentModel *base, const std::vector<Member>& batch, const std::vector<std::string>& directories);
+
+  /// @brief Writes the params file of a member into its directory.
+  static void write_member_parameters(const std::string& pfname, const Member& member,
+				      const std::string& directory, const std::string& member_pfname);
+
+  static MPI_Comm comm;
+
+  friend class LSDTaskFarm;
+};
+
+#endif
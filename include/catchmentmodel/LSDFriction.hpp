@@ -0,0 +1,149 @@
+// LSDFriction.hpp
+//
+// Header file for the friction and Froude limit of the catchment model
+//
+// route() is the routing of one cell face (flow_route_x / flow_route_y with
+// the discharge checks), shared by the three kernels: Cell::update (see
+// cell_kernel.hpp), the lanes of EnsembleCell::update and the tiles of
+// LSDOpenMPEngine. It lives here rather than in cell_kernel.hpp so that the
+// shared-memory engine, built without LibGeoDecomp, can include it.
+//
+// The discharge update of a wet face comes in two variants:
+//
+// - the reference kernel, with std::pow(hflow, 10/3) in the Manning
+//   friction term and two square roots in the Froude check;
+// - the fast kernel (fast_friction: yes), which takes hflow^(10/3) as
+//   hflow^3 * cbrt(hflow), with the cube root from the exponent bits and
+//   three Halley steps (a few ulp), and computes sqrt(g * hflow) once for
+//   both the Froude test and the limit. It has no library calls besides
+//   sqrt, so the SIMD loop of the shared-memory engine vectorizes (built
+//   with -fno-math-errno -fno-trapping-math for that, see the Makefile).
+//
+// The fast kernel changes the rounding, not the equations. The validation
+// mode (friction_validation: yes) reports how far it is from the reference
+// kernel: validate() compares both on a sweep of face states, and the
+// shared-memory engine also runs the configured catchment with both.
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#ifndef LSDFriction_H
+#define LSDFriction_H
+
+
+namespace LSDFriction
+{
+  /// @brief Cube root of a positive, normal x.
+  inline double cbrt(double x)
+  {
+    // a third of the exponent, from the high word: about 5 correct bits
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof bits);
+    std::uint32_t high = std::uint32_t(bits >> 32) / 3 + 715094163u;
+    bits = std::uint64_t(high) << 32;
+    double y;
+    std::memcpy(&y, &bits, sizeof y);
+
+    // Halley steps triple the correct bits: 15, 45, then full precision
+    // (written out, a loop here would keep the SIMD loops scalar)
+    double y3 = y * y * y;
+    y = y * (y3 + 2.0 * x) / (2.0 * y3 + x);
+    y3 = y * y * y;
+    y = y * (y3 + 2.0 * x) / (2.0 * y3 + x);
+    y3 = y * y * y;
+    y = y * (y3 + 2.0 * x) / (2.0 * y3 + x);
+    return y;
+  }
+
+  /// @brief hflow^(10/3) for hflow > 0.
+  inline double pow_10_3(double hflow)
+  {
+    return hflow * hflow * hflow * LSDFriction::cbrt(hflow);
+  }
+
+  /// @brief The discharge after the friction update.
+  template<bool FAST>
+  inline double update_q(double q_old, double hflow, double tempslope, double local_time_factor,
+			 double gravity, double mannings)
+  {
+    double hflow_10_3 = FAST ? pow_10_3(hflow) : std::pow(hflow, (10.0 / 3.0));
+    return ((q_old - (gravity * hflow * local_time_factor * tempslope))
+	    / (1.0 + gravity * hflow * local_time_factor * (mannings * mannings)
+	       * std::abs(q_old) / hflow_10_3));
+  }
+
+  /// @brief The discharge limited to the Froude number limit.
+  /// @details Stops too much water moving from one cell to another in a
+  /// step, which gives negative depths and a large instability (in steep
+  /// catchments mostly).
+  template<bool FAST>
+  inline double froude_check(double q, double hflow, double gravity, double froude_limit)
+  {
+    if (FAST)
+      {
+	// |q / hflow| / sqrt(g hflow) > limit, without the division
+	double q_limit = hflow * (std::sqrt(gravity * hflow) * froude_limit);
+	return (std::abs(q) > q_limit) ? std::copysign(q_limit, q) : q;
+      }
+    if ((std::abs(q / hflow) / std::sqrt(gravity * hflow)) > froude_limit)
+      {
+	q = std::copysign(hflow * (std::sqrt(gravity * hflow) * froude_limit), q);
+      }
+    return q;
+  }
+
+  /// @brief The new discharge across the west or north face of a cell.
+  /// @details h and z are the water depth and elevation of the cell,
+  /// upstream_h and upstream_z those of the cell across the face, delta the
+  /// cell size across the face. A face with no water on either side keeps
+  /// its discharge; one whose flow depth is not above hflow_threshold
+  /// carries none. Otherwise the friction update, the Froude limit and the
+  /// discharge check (no more than a quarter of the depth of the cell the
+  /// water leaves in one step) are applied in that order.
+  template<bool FAST>
+  inline double route(double q_old, double h, double z, double upstream_h, double upstream_z, double slope,
+		      double local_time_factor, double delta, double hflow_threshold, double gravity,
+		      double mannings, double froude_limit)
+  {
+    if (!(h > 0 || upstream_h > 0)) return q_old;
+
+    double hflow = std::max(z + h, upstream_z + upstream_h) - std::max(z, upstream_z);
+    if (!(hflow > hflow_threshold)) return 0.0;
+
+    double q = update_q<FAST>(q_old, hflow, slope, local_time_factor, gravity, mannings);
+    q = froude_check<FAST>(q, hflow, gravity, froude_limit);
+
+    // discharge_check
+    double criterion_magnitude = std::abs(q * local_time_factor / delta);
+    if (q > 0 && criterion_magnitude > (h / 4.0))
+      {
+	q = ((h * delta) / 5.0) / local_time_factor;
+      }
+    else if (q < 0 && criterion_magnitude > (upstream_h / 4.0))
+      {
+	q = -((upstream_h * delta) / 5.0) / local_time_factor;
+      }
+    return q;
+  }
+
+  /// Largest relative deviations of the fast kernel from the reference one
+  struct Deviation
+  {
+    double pow_10_3;
+    double discharge;
+    unsigned long samples;
+  };
+
+  /// @brief Compares the fast and the reference kernel on a sweep of face
+  /// states: flow depths from hflow_threshold to max_depth, velocities up
+  /// to +-10 m/s and water surface slopes up to +-1, at the given time step.
+  Deviation validate(double gravity, double mannings, double froude_limit,
+		     double hflow_threshold, double max_depth, double time_step);
+
+  /// @brief Prints the result of validate().
+  void report(const Deviation& deviation);
+}
+
+#endif
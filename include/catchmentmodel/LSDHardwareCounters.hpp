@@ -0,0 +1,118 @@
+// LSDHardwareCounters.hpp
+//
+// Header file for the hardware counter sampling of the catchment model
+//
+// On Linux the counters are opened with perf_event_open, without root:
+// cycles, instructions and last level cache misses are counted in user
+// space per OpenMP thread, each thread opening its own counters so that
+// the whole team working on the cell sweep is covered. Where the kernel
+// exposes the integrated memory controller (uncore_imc) PMUs and allows
+// system-wide counting, DRAM read and write bytes are counted too, by the
+// first rank on each node only, as they cover the whole socket.
+//
+// The counters run from the last steerer call of the step to the first
+// writer call, i.e. across the Cell::update sweep and its ghost zone
+// exchange. The counted steps lie half a profile_sample_interval after the
+// steps whose kernel phases the ProfileSteerer times (every other step if
+// that interval is 1), and the phase timing is off on them, so the clock
+// reads of LSD_PROFILE_PHASE are not counted as work of the kernel. The report gives per
+// rank the IPC and the bytes per cell update, estimated from the LLC
+// misses (64 bytes per line) and, where available, measured at the memory
+// controllers. Counters that cannot be opened are left out; on other
+// platforms nothing is counted.
+
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include <libgeodecomp/io/parallelwriter.h>
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+
+#ifndef LSDHardwareCounters_geodecomp_H
+#define LSDHardwareCounters_geodecomp_H
+
+
+/// @brief Per-thread core counters and per-node memory controller counters.
+class LSDHardwareCounters
+{
+public:
+  enum Counter {CYCLES=0, INSTRUCTIONS=1, LLC_MISSES=2, IMC_READ=3, IMC_WRITE=4, NUM_COUNTERS=5};
+
+  /// @brief Opens the counters on every OpenMP thread (and the memory
+  /// controllers on the first rank of each node).
+  /// @return false if none could be opened on any rank
+  static bool open();
+
+  /// @brief Starts counting a sampled sweep over the given number of cells.
+  static void start(double cells);
+
+  /// @brief Stops counting and adds the counts of the sweep to the totals.
+  static void stop();
+
+  /// @brief Closes all counters.
+  static void close();
+
+  /// @brief Writes per rank IPC and bytes per cell update to a CSV file on
+  /// rank 0. Collective over all ranks.
+  static void write_report(const std::string& filename);
+
+  /// Whether a sweep is being counted
+  static bool counting;
+
+private:
+  struct Event
+  {
+    int fd;
+    double scale;
+    unsigned long long value, enabled, running;
+  };
+  static std::vector<Event> events[NUM_COUNTERS];
+  static double totals[NUM_COUNTERS];
+  static double cell_updates;
+  static unsigned samples;
+  static MPI_Comm node_comm;
+
+  static void open_uncore(const std::string& pmu);
+  static double read_delta(Event& event, bool reset);
+};
+
+
+
+/// @brief Starts the counters on the sampled steps, after the steerers.
+class HardwareCounterSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, HardwareCounterSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  /// @param interval steps between sampled steps, as for the ProfileSteerer
+  /// (at least 2)
+  HardwareCounterSteerer(unsigned interval);
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  unsigned interval;
+  double cells;
+};
+
+
+
+/// @brief Stops the counters at the first writer call after the sweep.
+/// Must be added before any other writer.
+class HardwareCounterWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, HardwareCounterWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+
+  HardwareCounterWriter();
+
+  void stepFinished(const GridType& grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+};
+
+#endif
@@ -0,0 +1,70 @@
+// LSDISA.hpp
+//
+// Header file for the instruction set dispatch of the catchment model
+//
+// The binary is built for the x86-64 baseline (SSE2) so that it runs on
+// every node generation. The hot loops are compiled again for AVX2 and
+// AVX-512 within the same binary, and the variant is picked at startup
+// from CPUID:
+//
+// - the tile update of the shared-memory engine (LSDOpenMPEngine) has one
+//   member per level, declared LSD_TARGET_SSE2 / _AVX2 / _AVX512, chosen
+//   by LSDISA::select() from the "isa" parameter (auto, sse2, avx2 or
+//   avx512; auto takes the widest the CPU supports);
+// - the heavy topotools filters are marked LSD_TARGET_CLONES, for which
+//   the compiler emits one clone per level and the dynamic loader picks
+//   one from CPUID when the binary is loaded.
+//
+// The results should not depend on the node type a run lands on, so the
+// engine and the filters are compiled with -ffp-contract=off (see the
+// Makefile): AVX-512 brings fused multiply-adds, which round differently.
+// Other compilers and architectures build the baseline only.
+
+#include <string>
+
+#ifndef LSDISA_H
+#define LSDISA_H
+
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LSD_ISA_X86_64
+// flatten inlines the shared body into each variant, so all of it is
+// compiled for the variant's instruction set
+#define LSD_TARGET_SSE2 __attribute__((flatten))
+#define LSD_TARGET_AVX2 __attribute__((target("avx2"), flatten))
+#define LSD_TARGET_AVX512 __attribute__((target("avx512f"), flatten))
+#else
+#define LSD_TARGET_SSE2
+#endif
+
+// inlines the callees of a kernel into it, where a SIMD loop needs them
+// inlined to vectorize and the inliner's size limits would keep a call
+#if defined(__GNUC__)
+#define LSD_FLATTEN __attribute__((flatten))
+#else
+#define LSD_FLATTEN
+#endif
+
+#if defined(LSD_ISA_X86_64) && defined(__linux__) && !defined(__clang__) && __GNUC__ >= 6
+#define LSD_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LSD_TARGET_CLONES
+#endif
+
+
+namespace LSDISA
+{
+  enum Level {SSE2 = 0, AVX2 = 1, AVX512 = 2};
+
+  /// @brief The widest level that this CPU and this build support.
+  Level detect();
+
+  /// @brief The level to run: detect() for "auto", otherwise the named
+  /// level, limited to detect() with a message if the CPU lacks it.
+  Level select(const std::string& requested);
+
+  /// @brief The parameter file name of a level.
+  const char* name(Level level);
+}
+
+#endif
@@ -0,0 +1,92 @@
+// LSDMassBalance.hpp
+//
+// Header file for the distributed water mass balance of the catchment model
+//
+// Cells add their contribution to per-thread partial sums during the
+// LibGeoDecomp update. MassBalanceSteerer combines the partial sums of all
+// threads and ranks every mass_balance_interval steps and feeds the totals
+// back into the catchment (waterOut, waterinput, input_output_difference).
+
+#include <vector>
+
+#include <omp.h>
+#include <mpi.h>
+
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDThreadSlots.hpp"
+
+#ifndef LSDMassBalance_geodecomp_H
+#define LSDMassBalance_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief Thread-local partial sums of the water budget terms on this rank.
+/// @details Each thread adds to its own slot (see LSDThreadSlots), so cells
+/// can add to the totals from inside Cell::update without locking.
+/// Outflow and input are volumes accumulated over every step; the storage
+/// terms are only summed on steps flagged by sample_storage.
+class LSDMassBalance
+{
+public:
+  enum Term {OUTFLOW_WEST=0, OUTFLOW_NORTH=1, OUTFLOW_EAST=2, OUTFLOW_SOUTH=3,
+	     WATER_INPUT=4, STORED_VOLUME=5, WET_CELLS=6, NUM_TERMS=7};
+
+  /// @brief Sizes the partial sums for the number of OpenMP threads.
+  static void initialise();
+
+  /// @brief Adds a value to this thread's partial sum of a term.
+  static inline void add(Term term, double value)
+  {
+    partials.local()[term] += value;
+  }
+
+  /// @brief Sums the partials of all threads into totals (NUM_TERMS long)
+  /// and zeroes the partials.
+  static void collect(double *totals);
+
+  /// @brief Zeroes the partials and flags the interval as discarded, so
+  /// MassBalanceSteerer starts a new one (see StabilitySteerer).
+  static void discard();
+
+  /// Set on the steps where cells should also add their stored water
+  static bool sample_storage;
+
+  /// Set by discard(), cleared by MassBalanceSteerer
+  static bool discarded;
+
+private:
+  static LSDThreadSlots<double, NUM_TERMS> partials;
+};
+
+
+
+/// @brief Combines the per-thread mass balance partial sums across ranks.
+/// @details Runs before each step. Every mass_balance_interval steps it
+/// flags a storage sample, and on the following step reduces all terms with
+/// MPI_Allreduce, so every rank sees the same totals for the in/out
+/// difference timestep control. Rank 0 then writes the catchment time
+/// series at each timeseries_save_interval.
+class MassBalanceSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, MassBalanceSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  MassBalanceSteerer(LSDCatchmentModel *catchment_in, unsigned interval_in);
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  LSDCatchmentModel *catchment;
+  unsigned interval;
+  bool reduction_pending;
+  double interval_time;
+
+  void reduce(bool storage_sampled);
+};
+
+#endif
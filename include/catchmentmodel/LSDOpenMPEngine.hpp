@@ -0,0 +1,282 @@
+// LSDOpenMPEngine.hpp
+//
+// Header file for the shared-memory engine of the catchment model
+//
+// Runs the same cell physics as Cell::update (see cell_kernel.hpp) on a
+// single node, without MPI or LibGeoDecomp: the fields are held as plain
+// arrays (one per field, double-buffered), updated tile by tile by the
+// OpenMP threads, with the interior columns of each row in a SIMD loop.
+// It is chosen with "simulator: openmp", either in the MPI build (where
+// it runs on rank 0 only) or in HAIL-CAESAR.omp, built with "make openmp"
+// from the engine, the topotools and LSDUtils alone.
+//
+// The engine reads the parameters it needs from the same parameter file
+// and writes its own outputs: the catchment time series (write_fname, in
+// the same format as LSDCatchmentModel::write_output_timeseries), water
+// depth rasters every raster_output_interval model minutes
+// (write_waterdepth_file) and elevation and water depth PPM images
+// (elevation_ppm, water_depth_ppm). The LibGeoDecomp writers and steerers
+// (gauges, regions, checkpoints, stability and steady state monitors,
+// profiling) are not available.
+//
+// The tile update is built for SSE2, AVX2 and AVX-512 and the variant is
+// chosen at startup from CPUID, or with the "isa" parameter (see LSDISA.hpp).
+// With fast_friction the sweep uses the fast friction kernel (see
+// LSDFriction.hpp), and with friction_validation the engine runs the
+// catchment with both kernels and reports how far apart they end up.
+//
+// Nests: each nest_dem line of the parameter file names a finer DEM (in
+// read_path, with dem_read_extension) covering a block of the catchment,
+// say 2 m over a town in a 20 m catchment. Its cell size must divide that
+// of the catchment DEM, and its edges must lie on cell edges of the
+// catchment grid, at least one cell inside the grid and one cell away from
+// other nests. A nest is a grid of its own, with a ring of ghost cells
+// holding the surrounding cells of the outer grid. After each sweep the
+// outer cells under a nest take the mean depth of the nest cells, and the
+// outer faces on and under the nest boundary take the mean discharge of
+// the nest faces along them, so the water crossing the boundary is the same
+// on both levels and the coupling conserves mass. All grids advance with
+// the time step of the finest. Each nest writes its own water depth rasters
+// (waterdepth_outfile_name_<nest DEM>); the time series covers the whole
+// catchment on the outer grid.
+//
+// Local time stepping: with "local_time_stepping: yes" each grid advances
+// with its own Courant step, courant_number * DX / sqrt(g * maxdepth) for
+// its own cell size and depth bound, in place of the smallest of them. A
+// nest_maxdepth line after a nest_dem line sets the depth bound of that
+// nest, so a nest over a deep channel can take the small steps while the
+// floodplain around it, with a smaller maxdepth, takes large ones. A nest
+// takes as many steps per step of the outer grid as its own step fits into
+// that step, rounded up, with its ghost cells moving linearly from the
+// outer depths at the start to those at the end of the step. The nest
+// discharges across its boundary are summed over these steps, and the
+// outer cells along the boundary are corrected by the difference between
+// that sum and the water their own update moved across it, so mass is
+// still conserved.
+
+#include <string>
+#include <vector>
+
+#include "catchmentmodel/LSDISA.hpp"
+#include "catchmentmodel/LSDFriction.hpp"
+
+#ifndef LSDOpenMPEngine_H
+#define LSDOpenMPEngine_H
+
+
+/// @brief Runs the model with the shared-memory engine.
+void runSharedMemorySimulation(std::string pfname);
+
+
+
+/// @brief The catchment model on plain double-buffered arrays, for one node.
+class LSDOpenMPEngine
+{
+  friend class KernelTest;
+
+public:
+  /// @brief Reads the parameter file, the DEM and the DEMs of the nests.
+  LSDOpenMPEngine(const std::string& pfname);
+
+  ~LSDOpenMPEngine();
+  LSDOpenMPEngine(const LSDOpenMPEngine&) = delete;
+  LSDOpenMPEngine& operator=(const LSDOpenMPEngine&) = delete;
+
+  /// @brief Runs no_of_iterations time steps, writing the outputs on the way.
+  void run();
+
+  /// @brief Whether the parameter file asks for the friction validation.
+  bool validating_friction() const { return friction_validation; }
+
+  /// @brief Runs the catchment once with the fast and once with the reference
+  /// friction kernel, without outputs, and reports the largest relative
+  /// deviations of the final fields and of the outflow.
+  void validate_friction(const std::string& pfname);
+
+  int get_rows() const { return rows; }
+  int get_columns() const { return columns; }
+
+private:
+  // the water budget of a sweep, summed over the threads
+  struct Budget
+  {
+    double input;
+    double out_west, out_north, out_east, out_south;
+    double stored, wet;
+  };
+
+  // the pointers into the old and new arrays for one row of a tile
+  struct Row
+  {
+    const double *elevation, *depth, *qx, *qy;
+    const double *north_elevation, *north_depth;  // 0 on the first row
+    const double *south_qy;                       // 0 on the last row
+    double *new_depth, *new_qx, *new_qy;
+    bool first, last;
+  };
+
+  // INNER: an interior column of a row that is neither the first nor the last
+  enum Column {WEST_EDGE, INTERIOR, EAST_EDGE, INNER};
+
+  // A finer grid over a block of this one, see nest_dem
+  struct Nest
+  {
+    std::string name;                        // its DEM
+    LSDOpenMPEngine *grid;                   // its cells inside a ring of ghost cells
+    int row0, column0;                       // the first cell of this grid under the nest
+    int ratio;                               // nest cells per cell of this grid, along x and y
+    std::vector<double> flux;                // the discharges across its boundary, summed over its steps
+  };
+
+  /// @brief A nest: the parameters of pfname on the DEM nest_dem, with a
+  /// ring of ghost cells around it.
+  LSDOpenMPEngine(const std::string& pfname, const std::string& nest_dem);
+
+  void read_parameters(const std::string& pfname);
+  void load_dem(const std::string& fname);
+
+  /// @brief Places the nests on this grid, exits if one does not fit.
+  void attach_nests(const std::string& pfname);
+
+  /// @brief Copies the cells of this grid around a nest into the ghost ring
+  /// of a field of the nest, weight of the way from start to end.
+  void fill_ghosts(const Nest& nest, const std::vector<double>& start, const std::vector<double>& end,
+		   double weight, std::vector<double>& fine) const;
+
+  /// @brief The steps a nest takes per step of this grid, see local_time_stepping.
+  int nest_steps(const Nest& nest, double local_time_factor) const;
+
+  /// @brief Advances the nests over the sweep of this grid just done, and
+  /// puts their depths and boundary discharges onto this grid.
+  /// @return the cell updates of the nests
+  double sweep_nests(double local_time_factor, bool sample_storage, Budget& budget);
+
+  /// @brief Corrects the outer cells along the boundary of a nest for the
+  /// water the nest moved across it over its steps.
+  void reflux(const Nest& nest, int steps, double local_time_factor, bool sample_storage, Budget& budget);
+
+  /// @brief The discharges across the east and south boundary of a nest,
+  /// which its sweep treats as domain edges, from the ghost cells.
+  template<bool FAST_FRICTION>
+  void update_nest_boundary(double local_time_factor);
+
+  /// @brief The Courant step of this grid, or of the finest grid without
+  /// local_time_stepping.
+  double courant_step() const;
+
+  /// @brief Sets the time step as Cell::set_global_timefactor().
+  void set_global_timefactor();
+
+  /// @brief The time step of the coming sweep, as Cell::set_local_timefactor().
+  double local_timefactor() const;
+
+  /// @brief Updates every cell once, from the current to the other buffer.
+  void sweep(double local_time_factor, bool sample_storage, Budget& budget);
+
+  template<bool FAST_FRICTION>
+  void update_tile(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget);
+
+  // update_tile compiled for each instruction set, see LSDISA.hpp (the
+  // attributes of member templates only take effect on the declaration)
+  typedef void (LSDOpenMPEngine::*TileKernel)(int, int, int, int, double, bool, Budget&);
+  template<bool FAST_FRICTION> LSD_TARGET_SSE2
+  void update_tile_sse2(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget);
+#ifdef LSD_ISA_X86_64
+  template<bool FAST_FRICTION> LSD_TARGET_AVX2
+  void update_tile_avx2(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget);
+  template<bool FAST_FRICTION> LSD_TARGET_AVX512
+  void update_tile_avx512(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget);
+#endif
+
+  template<Column COLUMN, bool FAST_FRICTION>
+  inline double update_cell(const Row& row, int x, double local_time_factor);
+
+  /// @brief The new discharge across one cell face (LSDFriction::route with
+  /// the engine's parameters).
+  template<bool FAST_FRICTION>
+  inline double route(double q_old, double h, double z, double upstream_h, double upstream_z,
+		      double slope, double local_time_factor, double delta) const;
+
+  /// @brief Picks the tile update for isa and fast_friction.
+  void select_tile_kernel();
+
+  /// @brief Stores the water budget of the last mass balance interval and
+  /// writes the time series row when it is due, as MassBalanceSteerer.
+  void reduce(bool storage_sampled);
+
+  void write_output_timeseries();
+  void write_water_depth_raster();
+  void write_ppm(const std::vector<double>& field, double min_value, double max_value, const std::string& prefix, unsigned step) const;
+
+  // parameters, with the defaults of LSDCatchmentModel
+  std::string read_path, read_fname, dem_read_extension;
+  std::string write_path, write_fname = "catchment.dat", dem_write_extension = "asc";
+  int no_of_iterations = 100;
+  double output_file_save_interval = 60;     // model minutes
+  unsigned mass_balance_interval = 10;       // steps
+  double courant_number = 0.7;
+  double froude_limit = 0.8;
+  double mannings = 0.04;
+  double hflow_threshold = 0.00001;
+  double edgeslope = 0.001;
+  double water_depth_erosion_threshold = 1.0;
+  double in_out_difference_allowed = 0;
+  double water_input_depth = 0.005;          // m per step (water_input_depth), until the rainfall input is ported
+
+  // outputs
+  bool write_waterd_file = false;
+  std::string waterdepth_fname = "WaterDepths";
+  double raster_output_interval = 60;        // model minutes
+  bool elevation_ppm = false;
+  bool water_depth_ppm = false;
+  int elevation_ppm_interval = 1;
+  int water_depth_ppm_interval = 1;
+  int pixels_per_cell = 10;
+
+  // OpenMP tiles, in cells
+  int tile_rows = 16;
+  int tile_columns = 512;
+
+  // instruction set of the tile update
+  std::string isa_request = "auto";
+  LSDISA::Level isa = LSDISA::SSE2;
+  TileKernel tile_kernel = &LSDOpenMPEngine::update_tile_sse2<false>;
+
+  // friction kernel, see LSDFriction.hpp
+  bool fast_friction = false;
+  bool friction_validation = false;
+  bool outputs = true;                       // off for the validation runs
+
+  // the grid, row major, with the current buffer of each field at index current
+  int rows = 0, columns = 0;
+  double xll = 0, yll = 0, DX = 1.0, DY = 1.0, no_data_value = -9999;
+  int ghost = 0;                             // width of the ghost ring, 1 for nests
+  std::vector<double> elevation;
+  std::vector<double> depth[2], qx[2], qy[2];
+  int current = 0;
+
+  // nests, see nest_dem and local_time_stepping
+  std::vector<std::string> nest_dems;
+  std::vector<double> nest_maxdepths;        // 0 for the maxdepth of the catchment
+  std::vector<Nest> nests;
+  bool local_time_stepping = false;
+
+  // time stepping, as the LSDCatchmentModel statics
+  static constexpr double gravity = 9.81;
+  double time_factor = 1;
+  double maxdepth = 10;
+  double cycle = 0;
+  double tx = 60;
+  double next_raster_time = 0;
+
+  // water budget, as LSDCatchmentModel::update_water_budget()
+  Budget interval_budget;
+  double interval_time = 0;
+  double waterinput = 0, waterOut = 0;
+  double edge_waterOut[4] = {0, 0, 0, 0};    // W, N, E, S
+  double stored_water_volume = 0, wetted_cells = 0;
+  double input_output_difference = 0;
+  int timeseries_row = 0;
+};
+
+#endif
@@ -0,0 +1,206 @@
+// LSDProfile.hpp
+//
+// Header file for the run time instrumentation of the catchment model
+//
+// The kernel phases of Cell::update are timed on sampled steps into
+// per-thread accumulators. A phase of one cell takes about as long as the
+// two clock reads that time it, so the cost of the timing is calibrated at
+// start up (calibrate()), subtracted from each timed phase and reported as
+// a row of its own. Writers and steerers are timed on every call by
+// wrapping them in TimedWriter and TimedSteerer. ProfileSteerer times each
+// step as a whole; whatever is not accounted for by the kernel phases,
+// writers and steerers is the halo exchange wait and other simulator
+// overhead (including load balancing). At the end of the run the per-rank
+// totals are reduced to their minimum, mean and maximum across ranks and
+// written to a CSV file by rank 0.
+//
+// All times come from std::chrono::steady_clock. TNT::Stopwatch is not used
+// as it measures processor time with clock(), which adds up all threads.
+
+#include <chrono>
+#include <vector>
+#include <string>
+
+#include <omp.h>
+#include <mpi.h>
+
+#include <libgeodecomp/io/parallelwriter.h>
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDThreadSlots.hpp"
+
+#ifndef LSDProfile_geodecomp_H
+#define LSDProfile_geodecomp_H
+
+
+/// Times a kernel phase on sampled steps, e.g. LSD_PROFILE_PHASE(LSDProfile::FLOW_ROUTE_X, flow_route_x(neighborhood));
+#define LSD_PROFILE_PHASE(phase, call)					\
+  do									\
+    {									\
+      if (LSDProfile::sample)						\
+	{								\
+	  double phase_start = LSDProfile::now();			\
+	  call;								\
+	  LSDProfile::add(phase, LSDProfile::now() - phase_start);	\
+	}								\
+      else								\
+	{								\
+	  call;								\
+	}								\
+    }									\
+  while (0)
+
+
+class TimedWriter;
+class TimedSteerer;
+
+
+/// @brief Per-thread kernel phase times and per-rank region times.
+class LSDProfile
+{
+public:
+  enum Phase {WATER_INPUT=0, FLOW_ROUTE_X=1, FLOW_ROUTE_Y=2, DEPTH_UPDATE=3, BOUNDARY_FLUX=4, NUM_PHASES=5};
+
+  /// @brief Sizes the kernel accumulators for the number of OpenMP threads
+  /// and zeroes all times.
+  static void initialise();
+
+  /// @brief Monotonic wall clock time in seconds.
+  static inline double now()
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /// @brief Adds the time of one kernel phase of one cell on this thread.
+  static inline void add(Phase phase, double seconds)
+  {
+    phase_times.local()[phase] += seconds;
+    phase_calls.local()[phase] += 1.0;
+  }
+
+  /// @brief Measures the cost of timing a kernel phase (see timer_overhead
+  /// and timed_call_cost). Called by initialise().
+  static void calibrate();
+
+  /// @brief Registers a named region (a writer, steerer or the step) and
+  /// returns its index for add_region().
+  static int region(const std::string& name);
+
+  /// @brief Adds time to a region on this rank.
+  static void add_region(int index, double seconds);
+
+  /// @brief Reduces all phases and regions across ranks and writes
+  /// name, calls, min, mean and max seconds per rank to a CSV file on rank 0.
+  /// @param steps number of steps of the run
+  /// @param sampled_steps number of steps whose kernel phases were timed
+  static void write_report(const std::string& filename, unsigned steps, unsigned sampled_steps);
+
+  /// @brief Wraps a writer in a TimedWriter when profiling is enabled.
+  static LibGeoDecomp::ParallelWriter<Cell> *timed(LibGeoDecomp::ParallelWriter<Cell> *writer, const std::string& name);
+
+  /// @brief Wraps a steerer in a TimedSteerer when profiling is enabled.
+  static LibGeoDecomp::Steerer<Cell> *timed(LibGeoDecomp::Steerer<Cell> *steerer, const std::string& name);
+
+  /// Set on the steps where the kernel phases are timed
+  static bool sample;
+
+  /// Whether writers and steerers passed to timed() are wrapped
+  static bool enabled;
+
+  /// Seconds of the clock reads inside the interval of a timed phase, and
+  /// seconds a timed phase adds to the step in all, from calibrate()
+  static double timer_overhead;
+  static double timed_call_cost;
+
+private:
+  static LSDThreadSlots<double, NUM_PHASES> phase_times;
+  static LSDThreadSlots<double, NUM_PHASES> phase_calls;
+
+  static std::vector<std::string> region_names;
+  static std::vector<double> region_times;
+  static std::vector<double> region_calls;
+};
+
+
+
+/// @brief Times every call of another ParallelWriter.
+class TimedWriter : public LibGeoDecomp::ParallelWriter<Cell>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param delegate_in the writer to time, owned by this one
+  /// @param name name of the writer in the report
+  TimedWriter(LibGeoDecomp::ParallelWriter<Cell> *delegate_in, const std::string& name);
+  ~TimedWriter();
+
+  LibGeoDecomp::ParallelWriter<Cell> *clone() const;
+
+  void setRegion(const RegionType& newRegion);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+private:
+  LibGeoDecomp::ParallelWriter<Cell> *delegate;
+  std::string name;
+  int index;
+};
+
+
+
+/// @brief Times every call of another Steerer.
+class TimedSteerer : public LibGeoDecomp::Steerer<Cell>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param delegate_in the steerer to time, owned by this one
+  /// @param name name of the steerer in the report
+  TimedSteerer(LibGeoDecomp::Steerer<Cell> *delegate_in, const std::string& name);
+  ~TimedSteerer();
+
+  LibGeoDecomp::Steerer<Cell> *clone() const;
+
+  void setRegion(const RegionType& newRegion);
+
+  void nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  LibGeoDecomp::Steerer<Cell> *delegate;
+  std::string name;
+  int index;
+};
+
+
+
+/// @brief Times whole steps and flags the steps whose kernel phases are timed.
+class ProfileSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ProfileSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  /// @param interval steps between steps with timed kernel phases
+  ProfileSteerer(unsigned interval);
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+  /// Steps timed so far, and those with timed kernel phases
+  static unsigned steps;
+  static unsigned sampled_steps;
+
+private:
+  unsigned interval;
+  int index;
+  double last_time;
+};
+
+#endif
@@ -0,0 +1,78 @@
+// LSDSpinup.hpp
+//
+// Header file for the coarse grid spin-up of the catchment model
+//
+// The spin-up runs the ordinary model on a copy of the DEM coarsened by
+// block averaging, which has fewer cells and allows a proportionally longer
+// timestep. CoarseSpinupSteerer collects the coarse water depth and
+// discharges at the end of the spin-up, and prolong_spinup() spreads them
+// over the full resolution grid as its initial condition.
+
+#include <vector>
+
+#include <mpi.h>
+
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "TNT/tnt.h"
+#include "catchmentmodel/cell.hpp"
+
+#ifndef LSDSpinup_geodecomp_H
+#define LSDSpinup_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief Block averages a raster by an integer factor.
+/// @details Each coarse cell is the mean of the cells of its factor x factor
+/// block that are not no data. Blocks at the right and bottom edges may be
+/// partial, and blocks without any data become no data.
+TNT::Array2D<double> block_average(const TNT::Array2D<double>& fine, int factor, double no_data_value);
+
+
+/// @brief Prolongs a coarse water state onto the full resolution grid.
+/// @details The water surface is flat over each block, at the level that
+/// holds the block's coarse volume: with the whole block under water this
+/// is the coarse surface (elevation plus depth), and the fine depth is the
+/// surface less the fine elevation. Fine cells above the surface, and those
+/// that are no data in the fine DEM, stay dry. The wet cells take the unit
+/// discharges of their block.
+/// @param state coarse depth, qx and qy, one field after the other
+void prolong_spinup(const std::vector<double>& state, int coarse_rows, int coarse_cols, int factor,
+		    const TNT::Array2D<double>& elevation, double no_data_value,
+		    TNT::Array2D<double>& water_depth, TNT::Array2D<double>& qx, TNT::Array2D<double>& qy);
+
+
+
+/// @brief Ends the coarse spin-up at a model time and keeps its final state.
+/// @details Whether the spin-up is over is decided on rank 0 and broadcast
+/// at the end of each step, and the cells are taken on the next one (or at
+/// the end of the run, if that comes first). The ranks then sum their parts
+/// into the full coarse state with MPI_Allreduce; the coarse grid is small,
+/// so every rank can hold all of it for the prolongation.
+class CoarseSpinupSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, CoarseSpinupSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param catchment_in the catchment, for the model clock
+  /// @param end_time model time (minutes) at which the spin-up ends
+  /// @param state_in filled with the coarse depth, qx and qy, one field after the other
+  CoarseSpinupSteerer(LSDCatchmentModel *catchment_in, double end_time, std::vector<double> *state_in);
+
+  void nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  LSDCatchmentModel *catchment;
+  double end_time;
+  std::vector<double> *state;
+  std::vector<double> local_state;
+  bool capture_due;
+  bool captured;
+};
+
+#endif
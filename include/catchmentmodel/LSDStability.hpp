@@ -0,0 +1,123 @@
+// LSDStability.hpp
+//
+// Header file for the stability monitor of the catchment model
+//
+// On sampled steps each cell checks its new state for NaN, negative water
+// depth and implausible velocity, and counts failures in per-thread
+// counters. StabilitySteerer reduces the counts across ranks, keeps a small
+// ring of recent verified grid snapshots in memory, and on instability
+// rolls the grid and model counters back to the latest snapshot, reduces
+// the courant number and carries on, without touching disk.
+
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <omp.h>
+#include <mpi.h>
+
+#include <libgeodecomp/io/steerer.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDThreadSlots.hpp"
+
+#ifndef LSDStability_geodecomp_H
+#define LSDStability_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief Thread-local counts of cells that failed the stability check.
+/// @details One slot per thread, see LSDThreadSlots.
+class LSDStability
+{
+public:
+  /// @brief Sizes the counters for the number of OpenMP threads.
+  static void initialise();
+
+  /// @brief Counts a failed cell on this thread.
+  static inline void flag()
+  {
+    unstable_cells.local()[0] += 1;
+  }
+
+  /// @brief Sums the counts of all threads and zeroes them.
+  static long collect();
+
+  /// Set on the steps where cells should check their new state
+  static bool sample;
+
+  /// Largest plausible flow velocity (m/s)
+  static double max_velocity;
+
+  /// Water depths below minus this value count as negative
+  static double depth_tolerance;
+
+private:
+  static LSDThreadSlots<long, 1> unstable_cells;
+};
+
+
+
+/// @brief Keeps in-memory snapshots of the grid and rolls back on instability.
+/// @details Runs before each step. Every check_interval steps the cells check
+/// the state they compute, and on the next step the counts are reduced with
+/// MPI_Allreduce, so all ranks agree. When the check passes, the grid that
+/// was checked is kept as a snapshot (every snapshot_interval steps, in a ring
+/// of num_snapshots). When it fails, the step after restores the latest
+/// snapshot (or an older one if the last rollback did not help), multiplies
+/// the courant number by courant_factor (not below min_courant) and resets
+/// the timestep to match. The model clock is rolled back with the grid; the
+/// step number is not, so step based outputs simply carry on.
+class StabilitySteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, StabilitySteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param catchment_in the catchment whose counters are rolled back with the grid
+  /// @param check_interval steps between stability checks
+  /// @param snapshot_interval steps between snapshots (rounded up to a whole number of checks)
+  /// @param num_snapshots number of snapshots kept in the ring
+  /// @param courant_factor factor applied to the courant number on each rollback
+  /// @param min_courant lower limit of the courant number
+  StabilitySteerer(LSDCatchmentModel *catchment_in, unsigned check_interval, unsigned snapshot_interval,
+		   unsigned num_snapshots, double courant_factor, double min_courant);
+
+  void nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback);
+
+private:
+  struct Snapshot
+  {
+    unsigned step;
+    std::vector<int> streaks;   // y, x origin and length of each streak
+    std::vector<Cell> cells;
+    std::string counters;       // LSDCatchmentModel::save_counters()
+  };
+
+  LSDCatchmentModel *catchment;
+  unsigned check_interval;
+  unsigned checks_per_snapshot;
+  unsigned num_snapshots;
+  double courant_factor;
+  double min_courant;
+
+  bool first_step;
+  bool checking;
+  bool taking_snapshot;
+  bool rollback_pending;
+  unsigned checks_since_snapshot;
+  unsigned consecutive_rollbacks;
+
+  std::deque<Snapshot> ring;
+  Snapshot pending;
+
+  void store(const GridType& grid, const RegionType& validRegion);
+  void restore(GridType *grid, const RegionType& validRegion);
+  void finish_rollback();
+};
+
+#endif
@@ -0,0 +1,93 @@
+// LSDTaskFarm.hpp
+//
+// Header file for the task farm mode of the catchment model
+//
+// A task farm runs many independent catchments in one MPI job, in place of
+// one small batch job per catchment. The params file names a manifest with
+// task_farm_manifest:
+//
+//   # params file               name
+//   upper_tamar.params          tamar_01
+//   valency/valency.params
+//
+// one catchment per line: its params file (relative to read_path unless
+// absolute), and optionally a name, which defaults to the file name without
+// its extension (# starts a comment). The parameters of the manifest's own
+// params file are the defaults of every catchment.
+//
+// The catchments are sized by their DEM headers. Those with more than
+// task_farm_serial_cells cells run on groups of task_farm_ranks_per_group
+// ranks; the others run on single ranks, where the simulator has no halo
+// exchange to do. Both kinds are dealt out largest first: the large ones
+// to the groups, the small ones to every rank, each into a queue that the
+// group or the rank works through from the front. A group or rank whose
+// queue is empty steals from the back of the others, so there is no
+// dispatcher rank. Groups turn to the small catchments, one per rank, once
+// no large ones are left.
+//
+// Each queue is a pair of counters in an MPI window on the rank that owns
+// it (the first rank of a group), updated with passive target atomics
+// (MPI_Fetch_and_op). An owner takes from its own window, so it never
+// waits for another rank. A steal completes at once where the library does
+// the atomics in network hardware; otherwise it may wait until the rank it
+// steals from makes an MPI call, at the latest when that rank's catchment
+// ends. Such libraries complete steals sooner with their progress thread
+// on, MPIR_CVAR_ASYNC_PROGRESS=1 in MPICH or I_MPI_ASYNC_PROGRESS=1 in
+// Intel MPI.
+//
+// Each catchment writes to write_path/<name>/, which also holds the params
+// file it ran with, so it can be rerun on its own. write_path/task_farm.csv
+// lists every catchment with its size, ranks and run time.
+
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#ifndef LSDTaskFarm_geodecomp_H
+#define LSDTaskFarm_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+class LSDTaskFarm
+{
+public:
+  /// One line of the manifest
+  struct Catchment
+  {
+    std::string pfname;
+    std::string name;
+    long cells;          // DEM cells, or -1 if the DEM is missing
+  };
+
+  /// @brief Reads the manifest, see above. Exits on a malformed manifest.
+  static std::vector<Catchment> read_manifest(const std::string& filename, const std::string& read_path);
+
+  /// @brief Runs the catchments of base's task_farm_manifest on all ranks.
+  /// @param base the model read from the params file naming the manifest
+  static void run(LSDCatchmentModel *base);
+
+private:
+  /// @brief The number of DEM cells of a catchment, from its params file
+  /// and DEM header; -1 if there is no DEM.
+  static long size_catchment(const std::string& pfname);
+
+  /// @brief Runs one catchment on the ranks of LSDEnsemble::communicator().
+  static void run_catchment(const Catchment& catchment, const std::string& directory);
+
+  /// A queue of catchments: the slots [begin, end), and where its counters
+  /// are in the window
+  struct Queue
+  {
+    int begin;
+    int end;
+    int owner;           // the rank whose window holds the counters
+    int offset;          // of the counters in that window
+  };
+
+  /// @brief Takes a slot from the front (owner) or the back (thief) of a queue.
+  static bool take(MPI_Win window, const Queue& queue, bool front, int *slot);
+};
+
+#endif
@@ -0,0 +1,70 @@
+// LSDThreadSlots.hpp
+//
+// Header file for the per-thread accumulators of the catchment model
+//
+// The monitors (LSDMassBalance, LSDStability, LSDConvergence and
+// LSDProfile) total values over all cells from inside Cell::update, which
+// runs on every OpenMP thread of the rank. Instead of locks or atomics,
+// each thread adds into its own slot and the monitor combines the slots
+// between steps. At least a cache line separates the slots of two threads,
+// whatever the alignment of the storage, so no two threads write to the
+// same cache line (false sharing).
+
+#include <vector>
+
+#include <omp.h>
+
+#ifndef LSDThreadSlots_geodecomp_H
+#define LSDThreadSlots_geodecomp_H
+
+
+/// @brief A padded slot of SIZE values of type T per OpenMP thread.
+template<typename T, int SIZE>
+class LSDThreadSlots
+{
+public:
+  /// @brief Sizes the slots for the number of OpenMP threads and zeroes them.
+  void initialise()
+  {
+    values.assign(omp_get_max_threads() * STRIDE, T());
+  }
+
+  /// @brief The slot of the calling thread.
+  inline T *local()
+  {
+    return &values[omp_get_thread_num() * STRIDE];
+  }
+
+  /// @brief The slot of a thread.
+  inline const T *slot(int thread) const
+  {
+    return &values[thread * STRIDE];
+  }
+
+  /// @brief Number of thread slots, 0 before initialise().
+  int threads() const
+  {
+    return values.size() / STRIDE;
+  }
+
+  /// @brief Sum of one value over the slots of all threads.
+  T sum(int index) const
+  {
+    T total = T();
+    for (int thread = 0; thread < threads(); thread++) total += values[thread * STRIDE + index];
+    return total;
+  }
+
+  /// @brief Zeroes the slots of all threads.
+  void zero()
+  {
+    values.assign(values.size(), T());
+  }
+
+private:
+  // values per slot: SIZE plus at least 64 bytes, rounded up to 128 bytes
+  static const int STRIDE = (SIZE * sizeof(T) + 64 + 127) / 128 * 128 / sizeof(T);
+  std::vector<T> values;
+};
+
+#endif
@@ -54,6 +54,19 @@ namespace LSDUtils
     return (stat(filename.c_str(), &buffer) ==0);
   }
 
+  /// @brief 64 bit FNV-1a hash of a block of memory.
+  /// @details Pass the result of a previous call as hash to hash several
+  /// blocks as one. Used as a content hash, not for security.
+  unsigned long long fnv1a_hash(const void *data, std::size_t size,
+                                unsigned long long hash = 14695981039346656037ULL);
+
+  /// @brief Cuts a text file back to its first lines lines. Files that are
+  /// missing or no longer than that are left alone.
+  void truncate_lines(const std::string& filename, long lines);
+
+  /// @brief Cuts a binary file back to its first bytes bytes, as truncate_lines().
+  void truncate_bytes(const std::string& filename, long bytes);
+
   // A simple function to test OpenMP in the LSDTopoTools environment
   void quickOpenMPtest();
 }
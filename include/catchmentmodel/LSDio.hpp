@@ -0,0 +1,233 @@
+// LSDio.hpp
+//
+// Header file for the I/O classes of the catchment model
+//
+// These are LibGeoDecomp writers that run on every rank and only
+// communicate the few values they need, rather than gathering the
+// whole grid onto rank 0 like the CollectingWriter based outputs.
+
+#include <vector>
+#include <string>
+#include <sstream>
+
+#include <mpi.h>
+
+#include <libgeodecomp/io/parallelwriter.h>
+#include <libgeodecomp/misc/clonable.h>
+
+#include "catchmentmodel/cell.hpp"
+
+#ifndef LSDio_geodecomp_H
+#define LSDio_geodecomp_H
+
+class LSDCatchmentModel;
+
+
+/// @brief A named window of the grid with its own output fields and interval.
+/// @details Rectangles and polygons are both stored by their bounding box
+/// in grid coordinates (x = column, y = row, inclusive). For polygons, only
+/// cells whose centre lies inside the polygon are written, the others get
+/// the no data value.
+struct OutputRegion
+{
+  std::string name;
+  int x0, y0, x1, y1;
+  std::vector<double> polygon_x;   // polygon vertices in grid coordinates
+  std::vector<double> polygon_y;   // (empty for rectangles)
+  std::string fields;              // comma separated, as for DerivedFieldWriter
+  int interval;
+
+  /// @brief Whether the centre of cell (x, y) is part of the region.
+  bool contains(int x, int y) const;
+};
+
+
+/// @brief Writes hydrographs at a list of gauge points.
+/// @details Each rank works out once which gauge cells (or cells of the
+/// window around each gauge) lie in its own subdomain. At every gauge
+/// save interval the ranks reduce just those values onto rank 0, which
+/// buffers the rows and appends them to a CSV or raw binary file. There
+/// is no global gather of the grid. The discharges are those of the two
+/// faces a cell holds, its west face (qx) and its north face (qy). The
+/// output clock and the buffered rows are kept in the catchment, so that
+/// they are saved with checkpoints.
+class GaugeWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, GaugeWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// Number of values reduced per gauge: depth, stage, qx, qy at the
+  /// gauge cell, then the window depth sum and window cell count.
+  static const int NUM_SUM_FIELDS = 6;
+
+  /// Number of columns written per gauge
+  static const int NUM_OUTPUT_FIELDS = 8;
+
+  /// @param catchment_in the catchment holding the resolved gauge points
+  /// and the model clock
+  /// @param filename full path of the gauge time series file
+  GaugeWriter(LSDCatchmentModel *catchment_in, const std::string& filename);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+private:
+  LSDCatchmentModel *catchment;
+  std::string filename;
+  bool binary;
+
+  // window cells of each gauge that belong to this rank
+  bool owned_resolved;
+  std::vector<int> owned_gauge;
+  std::vector<CoordType> owned_coord;
+  std::vector<bool> owned_is_centre;
+
+  // per-rank partial values, reduced onto rank 0 at each output time
+  std::vector<double> local_sums;
+  std::vector<double> local_max;
+
+  void resolve_owned_cells();
+  void reset_partials();
+  void gather_and_buffer(double time);
+  void write_header();
+  void flush_rows();
+};
+
+
+
+/// @brief Writes rasters of fields derived from qx, qy and water depth.
+/// @details Velocity magnitude and direction, unit discharge and Froude
+/// number are only computed here, at output steps, so the cells carry no
+/// extra state during ordinary time steps. Each rank computes its own part
+/// of the grid and writes it straight into an ArcMap float raster
+/// (.flt with a .hdr header, as read by LSDRaster) using MPI-IO.
+class DerivedFieldWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, DerivedFieldWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  enum Field {VELOCITY=0, VELOCITY_DIRECTION=1, UNIT_DISCHARGE=2, FROUDE=3, NUM_FIELDS=4};
+
+  /// @param catchment_in the catchment (for the DEM header)
+  /// @param field_list comma separated field names, e.g. "velocity,froude"
+  /// @param prefix path and file name prefix of the rasters
+  /// @param period output interval in time steps
+  DerivedFieldWriter(LSDCatchmentModel *catchment_in, const std::string& field_list,
+		     const std::string& prefix, unsigned period);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+  /// @brief Computes one derived field for a single cell.
+  static float derived_value(Field field, const Cell& cell);
+
+  /// @brief Name of a field as used in the parameter file and file names.
+  static std::string field_name(Field field);
+
+private:
+  LSDCatchmentModel *catchment;
+  std::vector<Field> fields;
+
+  // values computed during this step, kept until the collective write
+  std::vector<MPI_Offset> streak_offsets;
+  std::vector<int> streak_lengths;
+  std::vector< std::vector<float> > values;
+
+  void write_rasters(unsigned step);
+};
+
+
+
+/// @brief Writes reduced resolution greyscale preview images of a cell field.
+/// @details The opposite of the PPMWriter upscaling: each pixel is the mean
+/// or maximum of a block_size x block_size block of cells. Every rank reduces
+/// its own cells into the small block grid, and the block grids are combined
+/// up a reduction tree onto rank 0 (MPI_Reduce), so no rank ever holds the
+/// full grid. Rank 0 writes a PNG when built with HAIL_CAESAR_ZLIB, and an
+/// uncompressed PGM otherwise.
+class PreviewWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, PreviewWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param member the cell field to preview, e.g. &Cell::water_depth
+  /// @param min_value field value shown as black
+  /// @param max_value field value shown as white
+  /// @param prefix path and file name prefix of the images
+  /// @param period output interval in time steps
+  /// @param block_size number of cells along each side of a pixel block
+  /// @param use_max take the block maximum rather than the block mean
+  /// @param compress write PNG (needs HAIL_CAESAR_ZLIB) rather than PGM
+  PreviewWriter(double Cell::*member, double min_value, double max_value, const std::string& prefix,
+		unsigned period, int block_size, bool use_max, bool compress);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+private:
+  double Cell::*member;
+  double min_value;
+  double max_value;
+  int block_size;
+  bool use_max;
+  bool compress;
+
+  // per-rank block sums and cell counts (interleaved), and block maxima
+  std::vector<double> block_sums;
+  std::vector<double> block_max;
+
+  std::vector<unsigned char> assemble_image(int width, int height);
+  void write_pgm(const std::string& filename, const std::vector<unsigned char>& image, int width, int height);
+  void write_png(const std::string& filename, const std::vector<unsigned char>& image, int width, int height);
+};
+
+
+
+/// @brief Writes full resolution rasters of one region of interest.
+/// @details Only the ranks whose subdomain overlaps the region take part:
+/// they are split off into their own communicator on the first call, and
+/// write their part of the window into ArcMap float rasters (.flt/.hdr)
+/// with MPI-IO on that communicator. All other ranks return straight away.
+class RegionWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, RegionWriter>
+{
+public:
+  typedef LibGeoDecomp::ParallelWriter<Cell>::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// Raw cell fields; derived fields follow, numbered from NUM_RAW_FIELDS
+  enum RawField {WATER_DEPTH=0, ELEVATION=1, QX=2, QY=3, NUM_RAW_FIELDS=4};
+
+  /// @param catchment_in the catchment (for the DEM header)
+  /// @param output_region the window, fields and interval to write
+  /// @param prefix path and file name prefix of the rasters
+  RegionWriter(LSDCatchmentModel *catchment_in, const OutputRegion& output_region, const std::string& prefix);
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall);
+
+private:
+  LSDCatchmentModel *catchment;
+  OutputRegion output_region;
+  std::vector<int> fields;
+  std::vector<std::string> field_names;
+
+  bool communicator_created;
+  MPI_Comm region_comm;
+
+  std::vector<MPI_Offset> streak_offsets;
+  std::vector<int> streak_lengths;
+  std::vector< std::vector<float> > values;
+
+  float field_value(int field, const Cell& cell) const;
+  void create_communicator();
+  void write_rasters(unsigned step);
+};
+
+#endif
@@ -10,6 +10,7 @@
 class Cell
 {
   friend class Typemaps;
+  friend class BoostSerialization;
   friend int main(int argc, char **argv);
   
   // refactor - Should replace these defines with type alias declarations (= C++11 template typedef)
@@ -58,10 +59,10 @@ public:
   explicit Cell(CellType celltype_in, double elevation_in, double water_depth_in, \
 	      double qx_in, double qy_in);
   
-  void set_global_timefactor();
-  double set_local_timefactor();
-  void froude_check(double &q, double hflow);
-  void update_q(const double &q_old, double &q_new, double hflow, double tempslope, double local_time_factor);
+  static void set_global_timefactor();
+  static double set_local_timefactor();
+  static double route(double q_old, double h, double z, double upstream_h, double upstream_z,
+		      double slope, double local_time_factor, double delta);
   
   template<typename COORD_MAP> void initialise_grid_value_updates(const COORD_MAP& neighborhood);
   template<typename COORD_MAP> void update(const COORD_MAP& neighborhood, unsigned nanoStep);
@@ -71,10 +72,10 @@ public:
   template<typename COORD_MAP> void flow_route_x(const COORD_MAP& neighborhood);
   template<typename COORD_MAP> void flow_route_y(const COORD_MAP& neighborhood);
   template<typename COORD_MAP> void depth_update(const COORD_MAP& neighborhood);
-  template<typename COORD_MAP> void update_qx(const COORD_MAP& neighborhood, double hflow, double tempslope, double local_time_factor);
-  template<typename COORD_MAP> void update_qy(const COORD_MAP& neighborhood, double hflow, double tempslope, double local_time_factor);
   template<typename COORD_MAP> void update_water_depth(const COORD_MAP& neighborhood, double east_qx, double south_qy, double local_time_factor);
-  template<typename COORD_MAP> void discharge_check(const COORD_MAP& neighborhood, double &q, double neighbour_water_depth, double Delta);
+  void sum_stored_water();
+  void check_stability();
+  template<typename COORD_MAP> void measure_change(const COORD_MAP& neighborhood);
   
 };
 
@@ -0,0 +1,457 @@
+// cell_kernel.hpp
+//
+// The Cell::update kernel and its phases, templated on the neighbourhood
+// type (COORD_MAP) so that LibGeoDecomp's neighbourhood and the mock
+// neighbourhood of the kernel benchmark (test/benchmark/kernelbench.cpp)
+// instantiate the same code. The non-template Cell members and the model
+// parameters they read are defined in cell.cpp.
+
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+#include "catchmentmodel/LSDStability.hpp"
+#include "catchmentmodel/LSDConvergence.hpp"
+#include "catchmentmodel/LSDProfile.hpp"
+#include "catchmentmodel/LSDFriction.hpp"
+
+#ifndef CELL_KERNEL_H
+#define CELL_KERNEL_H
+
+
+
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+//
+//   Overall update routine - this is what LibGeoDecomp calls each time step
+//
+// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+template<typename COORD_MAP>
+void Cell::update(const COORD_MAP& neighborhood, unsigned nanoStep)
+{
+  initialise_grid_value_updates(neighborhood);
+  set_global_timefactor();
+  
+  // Hydrological and flow routing processes
+  // (each phase is timed on the steps sampled by the ProfileSteerer)
+  // Add water to the catchment from rainfall input file
+  LSD_PROFILE_PHASE(LSDProfile::WATER_INPUT, catchment_waterinputs(neighborhood));
+  // Distribute the water with the LISFLOOD Cellular Automaton algorithm
+  LSD_PROFILE_PHASE(LSDProfile::FLOW_ROUTE_X, flow_route_x(neighborhood));
+  LSD_PROFILE_PHASE(LSDProfile::FLOW_ROUTE_Y, flow_route_y(neighborhood));
+  // Calculate the new water depths in the catchment
+  LSD_PROFILE_PHASE(LSDProfile::DEPTH_UPDATE, depth_update(neighborhood));
+  // Water outputs from edges/catchment outlet 
+  LSD_PROFILE_PHASE(LSDProfile::BOUNDARY_FLUX, water_flux_out(neighborhood));
+  // Stored water for the mass balance, only on sampled steps
+  if (LSDMassBalance::sample_storage) sum_stored_water();
+  // Stability monitor, only on sampled steps
+  if (LSDStability::sample) check_stability();
+  // Change during the step for the steady state monitor, only on sampled steps
+  if (LSDConvergence::sample) measure_change(neighborhood);
+}
+
+
+
+template<typename COORD_MAP>
+void Cell::catchment_waterinputs(const COORD_MAP& neighborhood) // refactor - incomplete (include runoffGrid for complex, i.e. spatially variable rainfall)
+{
+  
+  //waterinput = 0;
+  double local_time_factor = set_local_timefactor();
+  /*
+  if (spatially_complex_rainfall == true)
+    {
+      catchment_water_input_and_hydrology(local_time_factor, runoff);
+    }
+    else */
+  //  {
+  catchment_water_input_and_hydrology(neighborhood, local_time_factor);
+  //    }
+}
+
+
+
+template<typename COORD_MAP>
+void Cell::catchment_water_input_and_hydrology(const COORD_MAP& neighborhood, double local_time_factor)
+{
+  /*
+  for (unsigned i = 1; i<=rfnum; i++)
+    {
+      waterinput += j_mean[i] * nActualGridCells[i] * LSDCatchmentModel::DX * LSDCatchmentModel::DX;
+    }
+  
+    for (int z=1; z <= totalinputpoints; z++)
+    {
+      int i = catchment_input_x_coord[z];
+      int j = catchment_input_y_coord[z];
+      double water_add_amt = (j_mean[rfarea[i][j]] * nActualGridCells[rfarea[i][j]]) /
+        (catchment_input_counter[rfarea[i][j]]) * local_time_factor;    //
+      if (water_add_amt > ERODEFACTOR)
+	{
+	  water_add_amt = ERODEFACTOR;
+	}
+      
+  */
+	
+  // Until the rainfall input above is ported, every cell gains
+  // LSDCatchmentModel::water_input_depth per step in update_water_depth
+  
+      /*
+	}
+      */
+  
+  // if the input type flag is 1 then the discharge is input from the hydrograph
+  /*  if (cycle >= time_1)
+    {
+      do
+	{
+	  time_1++;
+	  topmodel_runoff(time_1);  // calc_J is based on the rainfall rate supplied to the cell
+
+	  if (time_factor > max_time_step) // && new_j_mean[1] > (0.2 / (jmax * imax * LSDCatchmentModel::DX * LSDCatchmentModel::DX)))
+	    {
+	      // Find the current maximum runoff amount
+	      double j_mean_max_temp = 0;
+	      for (unsigned n = 1; n <= rfnum; n++)
+		{
+		  if (new_j_mean[n] > j_mean_max_temp)
+		    {
+		      j_mean_max_temp = new_j_mean[n];
+		    }
+		}
+
+	      // check after the variable rainfall area has been added
+	      // stops code going too fast when there is actual flow in the channels greater than 0.2cu
+	      if (j_mean_max_temp > (0.2 / (imax * jmax * LSDCatchmentModel::DX * LSDCatchmentModel::DX)))
+		{
+		  cycle = time_1 + (max_time_step / 60);
+		 LSDCatchmentModel::time_factor = max_time_step;
+		}
+	    }
+	} while (time_1 < cycle);
+    }
+  
+
+  calchydrograph(time_1 - cycle);
+
+  double jmeanmax =0;
+  for (unsigned n=1; n <= rfnum; n++)
+    {
+      if (j_mean[n] > jmeanmax)
+	{
+	  jmeanmax = j_mean[n];
+	}
+    }
+  */
+
+
+  /*
+  // DV - This is for reading the discharge direct from an input file
+  if (jmeaninputfile_opt == true)
+    {
+      j_mean[1] = ((hourly_rain_data[(static_cast<int>(cycle / rain_data_time_step))][0] //check in original
+		    / std::pow(LSDCatchmentModel::DX, 2)) / nActualGridCells[1]);
+    }
+
+  if (jmeanmax >= baseflow) // > baseflow
+    {
+      baseflow = baseflow * 3;    // Magic number 3!? - DAV
+      zero_and_calc_drainage_area();         // Could this come from one of the LSDobject files? - DAV
+      get_catchment_input_points();
+    }
+
+  if (baseflow > (jmeanmax * 3) && baseflow > 0.000001) // DV reverted to match CL 1.8f (formerly 10^-7)
+    // Could make the baseflow threshold a parameter in param file?
+    {
+      baseflow = jmeanmax * 1.25;   // Where do these magic numbers come from? DAV
+      zero_and_calc_drainage_area();
+      get_catchment_input_points();
+    }
+  */
+
+}
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// WATER FLUXES OUT OF CATCHMENT
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// Calculate the water coming out and zero any water depths at the edges
+// This will actually set it to the minimum water depth
+// This must be done so that water can still move sediment to the edge of the catchment
+// and hence remove it from the catchment. (otherwise you would get sediment build
+// up around the edges.
+//
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+template<typename COORD_MAP>
+void Cell::water_flux_out(const COORD_MAP& neighborhood)
+{
+  // Totals across cells are accumulated per thread in LSDMassBalance and
+  // reduced across ranks by MassBalanceSteerer. Water leaves through the
+  // west and north faces of the grid with the discharges of the depth
+  // update (the east and south faces carry none), and as the depth above
+  // water_depth_erosion_threshold that is taken off the edge cells here.
+  // Corners count towards the west and east edges.
+  LSDMassBalance::Term edge;
+  double local_time_factor = set_local_timefactor();
+  double west_face_outflow = thisCell_old.qx * local_time_factor * LSDCatchmentModel::DY;
+  double north_face_outflow = thisCell_old.qy * local_time_factor * LSDCatchmentModel::DX;
+  switch(celltype){
+  case Cell::INTERNAL:
+  case Cell::NODATA:
+    return;
+  case Cell::EDGE_WEST:
+  case Cell::CORNER_SW:
+    LSDMassBalance::add(LSDMassBalance::OUTFLOW_WEST, west_face_outflow);
+    edge = LSDMassBalance::OUTFLOW_WEST;
+    break;
+  case Cell::CORNER_NW:
+    LSDMassBalance::add(LSDMassBalance::OUTFLOW_WEST, west_face_outflow);
+    LSDMassBalance::add(LSDMassBalance::OUTFLOW_NORTH, north_face_outflow);
+    edge = LSDMassBalance::OUTFLOW_WEST;
+    break;
+  case Cell::CORNER_NE:
+    LSDMassBalance::add(LSDMassBalance::OUTFLOW_NORTH, north_face_outflow);
+    edge = LSDMassBalance::OUTFLOW_EAST;
+    break;
+  case Cell::EDGE_EAST:
+  case Cell::CORNER_SE:
+    edge = LSDMassBalance::OUTFLOW_EAST;
+    break;
+  case Cell::EDGE_NORTH:
+    LSDMassBalance::add(LSDMassBalance::OUTFLOW_NORTH, north_face_outflow);
+    edge = LSDMassBalance::OUTFLOW_NORTH;
+    break;
+  case Cell::EDGE_SOUTH:
+    edge = LSDMassBalance::OUTFLOW_SOUTH;
+    break;
+  default:
+    std::cout << "\n\n WARNING: no water_flux_out rule specified for cell type " << celltype << "\n\n";
+    return;
+  }
+
+  if (thisCell_old.water_depth > LSDCatchmentModel::water_depth_erosion_threshold)
+    {
+      LSDMassBalance::add(edge, (water_depth - LSDCatchmentModel::water_depth_erosion_threshold) * LSDCatchmentModel::DX * LSDCatchmentModel::DY);
+      water_depth = LSDCatchmentModel::water_depth_erosion_threshold;
+    }
+}
+
+
+
+// Adds the change of this cell's water depth and discharges during the
+// step for ConvergenceSteerer
+template<typename COORD_MAP>
+void Cell::measure_change(const COORD_MAP& neighborhood)
+{
+  if (celltype == Cell::NODATA) return;
+  LSDConvergence::add(std::abs(water_depth - thisCell_old.water_depth),
+		      std::max(std::abs(qx - thisCell_old.qx), std::abs(qy - thisCell_old.qy)));
+}
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// THE WATER ROUTING ALGORITHM: LISFLOOD-FP
+//
+//           X direction
+//
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+template<typename COORD_MAP>
+void Cell::flow_route_x(const COORD_MAP& neighborhood)
+{
+  double tempslope;
+  double west_elevation_old;
+  double west_water_depth_old;
+  double local_time_factor = set_local_timefactor();
+
+  switch (celltype){
+  case Cell::INTERNAL:
+  case Cell::EDGE_NORTH:
+  case Cell::EDGE_SOUTH:
+    west_elevation_old = west_old.elevation;
+    west_water_depth_old = west_old.water_depth;
+    tempslope = ((west_elevation_old + west_water_depth_old) - (thisCell_old.elevation + thisCell_old.water_depth)) / LSDCatchmentModel::DX;
+    break;
+  case Cell::EDGE_WEST:
+  case Cell::CORNER_NW:
+  case Cell::CORNER_SW:
+    west_elevation_old = LSDCatchmentModel::no_data_value;
+    west_water_depth_old = 0.0;
+    tempslope = LSDCatchmentModel::edgeslope;
+    break;
+  case Cell::EDGE_EAST:
+  case Cell::CORNER_NE:
+  case Cell::CORNER_SE:
+    west_elevation_old = west_old.elevation;
+    west_water_depth_old = west_old.water_depth;
+    tempslope = LSDCatchmentModel::edgeslope;
+    break;
+  default:
+    std::cout << "\n\n WARNING: no x-direction flow route rule specified for cell type " << celltype << "\n\n";
+    break;
+  }
+
+
+  qx = route(thisCell_old.qx, thisCell_old.water_depth, thisCell_old.elevation, west_water_depth_old, west_elevation_old,
+	     tempslope, local_time_factor, LSDCatchmentModel::DX);
+
+
+
+
+  // Velocities are not stored per cell; they are derived from qx, qy and
+  // water_depth at output steps only (see DerivedFieldWriter in LSDio)
+
+}
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// THE WATER ROUTING ALGORITHM: LISFLOOD-FP
+//
+//           Y direction
+//
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+template<typename COORD_MAP>
+void Cell::flow_route_y(const COORD_MAP& neighborhood)
+{
+  double tempslope;
+  double north_elevation_old;
+  double north_water_depth_old;
+  double local_time_factor = set_local_timefactor();
+
+  switch (celltype){
+  case Cell::INTERNAL:
+  case Cell::EDGE_WEST:
+  case Cell::EDGE_EAST:
+    north_elevation_old = north_old.elevation;
+    north_water_depth_old = north_old.water_depth;
+    tempslope = ((north_elevation_old + north_water_depth_old) - (thisCell_old.elevation + thisCell_old.water_depth)) / LSDCatchmentModel::DY;
+    break;
+  case Cell::EDGE_NORTH:
+  case Cell::CORNER_NW:
+  case Cell::CORNER_NE:
+    north_elevation_old = LSDCatchmentModel::no_data_value;
+    north_water_depth_old = 0.0;
+    tempslope = LSDCatchmentModel::edgeslope;
+    break;
+  case Cell::EDGE_SOUTH:
+  case Cell::CORNER_SW:
+  case Cell::CORNER_SE:
+    north_elevation_old = north_old.elevation;
+    north_water_depth_old = north_old.water_depth;
+    tempslope = LSDCatchmentModel::edgeslope;
+    break;
+  default:
+    std::cout << "\n\n WARNING: no y-direction flow route rule specified for cell type " << static_cast<int>(celltype) << "\n\n";
+    break;
+  }
+
+
+  qy = route(thisCell_old.qy, thisCell_old.water_depth, thisCell_old.elevation, north_water_depth_old, north_elevation_old,
+	     tempslope, local_time_factor, LSDCatchmentModel::DY);
+
+
+
+
+  // Velocities are not stored per cell; they are derived from qx, qy and
+  // water_depth at output steps only (see DerivedFieldWriter in LSDio)
+}
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// DEPTH UPDATE
+//
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+template<typename COORD_MAP>
+void Cell::depth_update(const COORD_MAP& neighborhood)
+{
+  double east_qx_old;
+  double south_qy_old;
+
+  double local_time_factor = set_local_timefactor();
+
+  switch (celltype){
+  case Cell::INTERNAL:
+  case Cell::EDGE_NORTH:
+  case Cell::EDGE_WEST:
+  case Cell::CORNER_NW:
+    east_qx_old = east_old.qx;
+    south_qy_old = south_old.qy;
+    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
+    break;
+  case Cell::EDGE_EAST:
+  case Cell::CORNER_NE:
+    east_qx_old = 0.0;
+    south_qy_old = south_old.qy;
+    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
+    break;
+  case Cell::EDGE_SOUTH:
+  case Cell::CORNER_SW:
+    east_qx_old = east_old.qx;
+    south_qy_old = 0.0;
+    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
+    break;
+  case Cell::CORNER_SE:
+    east_qx_old = 0.0;
+    south_qy_old = 0.0;
+    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
+    break;
+  case Cell::NODATA:
+    water_depth = 0.0;
+    break;
+  default:
+    std::cout << "\n\n WARNING: no depth update rule specified for cell type " << Cell::CellType(int(celltype))<< "\n\n";
+    break;
+  }
+}
+
+
+
+// The point of this function is to initialise grid values of any quantities that
+// either need to be kept constant or that have multiple partial updates made to
+// them during each time step. By taking care of initialising such grid values in
+// this function based on their old values as read through the neighborhood object,
+// other functions can add to them *in any order* by always reading from and adding
+// to the new value, i.e. without needing to consider whether they are the first
+// function to update the value (which would need to read the neighborhood object
+// to access the old value). 
+template<typename COORD_MAP>
+void Cell::initialise_grid_value_updates(const COORD_MAP& neighborhood)
+{
+  water_depth = thisCell_old.water_depth;
+}
+
+
+
+template<typename COORD_MAP>
+void Cell::update_water_depth(const COORD_MAP& neighborhood, double east_qx_old, double south_qy_old, double local_time_factor)
+{
+  water_depth = LSDCatchmentModel::water_input_depth + thisCell_old.water_depth + local_time_factor * ( (east_qx_old - thisCell_old.qx)/LSDCatchmentModel::DX + (south_qy_old - thisCell_old.qy)/LSDCatchmentModel::DY );
+  LSDMassBalance::add(LSDMassBalance::WATER_INPUT, LSDCatchmentModel::water_input_depth * LSDCatchmentModel::DX * LSDCatchmentModel::DY);
+}
+
+
+
+// The face routing shared by all the kernels (see LSDFriction::route), for
+// the west or north face of this cell
+inline double Cell::route(double q_old, double h, double z, double upstream_h, double upstream_z,
+			  double slope, double local_time_factor, double delta)
+{
+  if (LSDCatchmentModel::fast_friction)
+    {
+      return LSDFriction::route<true>(q_old, h, z, upstream_h, upstream_z, slope, local_time_factor, delta,
+				      LSDCatchmentModel::hflow_threshold, Cell::gravity, LSDCatchmentModel::mannings,
+				      LSDCatchmentModel::froude_limit);
+    }
+  return LSDFriction::route<false>(q_old, h, z, upstream_h, upstream_z, slope, local_time_factor, delta,
+				   LSDCatchmentModel::hflow_threshold, Cell::gravity, LSDCatchmentModel::mannings,
+				   LSDCatchmentModel::froude_limit);
+}
+
+#endif
@@ -0,0 +1,87 @@
+// ensemble_cell.hpp
+//
+// A cell that carries several ensemble members at once (see LSDEnsemble,
+// ensemble_lanes). The terrain (cell type and elevation) is held once; the
+// water depth and the discharges have one lane per member, so one update
+// advances all members with the lanes filling the SIMD registers, and the
+// halo exchange of the simulator still sends one message per neighbour.
+//
+// The members may differ in the parameters the kernel reads per lane:
+// Manning's n, the Froude limit and the Courant number (through the time
+// step of each lane). Everything else is shared. The kernel is that of
+// Cell::update, lane by lane; it is in ensemble_cell_kernel.hpp.
+
+#include <libgeodecomp/misc/apitraits.h>
+#include <libgeodecomp/geometry/coord.h>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDISA.hpp"
+
+#ifndef ENSEMBLE_CELL_H
+#define ENSEMBLE_CELL_H
+
+
+template<int LANES>
+class EnsembleCell
+{
+  // the lanes are plain doubles, so the cell is sent as bytes
+  class API :
+    public LibGeoDecomp::APITraits::HasStencil<LibGeoDecomp::Stencils::VonNeumann<2,1> >,
+    public LibGeoDecomp::APITraits::HasCubeTopology<2>,
+    public LibGeoDecomp::APITraits::HasOpaqueMPIDataType<EnsembleCell<LANES> >
+  {};
+
+
+public:
+  static const int lanes = LANES;
+
+  // Terrain, shared by the members
+  Cell::CellType celltype;
+  double elevation;
+
+  // One value per member
+  double water_depth[LANES];
+  double qx[LANES];
+  double qy[LANES];
+
+  // Parameters per member, set by LSDEnsemble before the run
+  static double mannings[LANES];
+  static double froude_limit[LANES];
+  static double time_step[LANES];   // courant_number * DX / sqrt(g * maxdepth) of the member
+
+
+
+  explicit EnsembleCell(Cell::CellType celltype_in = Cell::INTERNAL, double elevation_in = 0.0, double water_depth_in = 0.0) :
+    celltype(celltype_in),
+    elevation(elevation_in)
+  {
+    for (int l = 0; l < LANES; l++)
+      {
+	water_depth[l] = water_depth_in;
+	qx[l] = 0.0;
+	qy[l] = 0.0;
+      }
+  }
+
+  /// @brief The time step of a member, as Cell::set_local_timefactor
+  /// gives it for that member's Courant number.
+  static double courant_time_step(double courant_number);
+
+  template<typename COORD_MAP> void update(const COORD_MAP& neighborhood, unsigned nanoStep);
+
+private:
+  template<bool FAST_FRICTION, bool INTERIOR, typename COORD_MAP> LSD_FLATTEN void update_lanes(const COORD_MAP& neighborhood);
+
+  template<bool FAST_FRICTION>
+  static double route(double q_old, double h, double z, double upstream_h, double upstream_z,
+		      double slope, int lane, double delta);
+};
+
+
+
+template<int LANES> double EnsembleCell<LANES>::mannings[LANES];
+template<int LANES> double EnsembleCell<LANES>::froude_limit[LANES];
+template<int LANES> double EnsembleCell<LANES>::time_step[LANES];
+
+
+#endif
@@ -0,0 +1,128 @@
+// ensemble_cell_kernel.hpp
+//
+// The EnsembleCell::update kernel: the phases of Cell::update (flow
+// routing in x and y, depth update, edge outflow) for every lane, in the
+// same order and with the same operations, so that each lane gives the
+// results of a Cell run with that member's parameters. The cell type is
+// tested once per cell, then the lane loops run without branches on it.
+//
+// The lanes vectorize with fast_friction: yes (the reference kernel calls
+// std::pow per lane), in translation units built with -fno-math-errno
+// -fno-trapping-math like the shared-memory engine (see the Makefile).
+// The monitors of Cell::update (mass balance, stability, convergence and
+// the phase profile) follow a single model and are not run here.
+
+#include <cmath>
+#include <algorithm>
+
+#include "catchmentmodel/ensemble_cell.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDFriction.hpp"
+
+#ifndef ENSEMBLE_CELL_KERNEL_H
+#define ENSEMBLE_CELL_KERNEL_H
+
+
+
+template<int LANES>
+double EnsembleCell<LANES>::courant_time_step(double courant_number)
+{
+  // set_global_timefactor keeps maxdepth at 0.1 or more
+  return courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * std::max(LSDCatchmentModel::maxdepth, 0.1)));
+}
+
+
+
+template<int LANES>
+template<typename COORD_MAP>
+void EnsembleCell<LANES>::update(const COORD_MAP& neighborhood, unsigned nanoStep)
+{
+  // interior cells take the lane loop without the edge rules
+  if (celltype == Cell::INTERNAL)
+    {
+      if (LSDCatchmentModel::fast_friction) update_lanes<true, true>(neighborhood);
+      else update_lanes<false, true>(neighborhood);
+    }
+  else
+    {
+      if (LSDCatchmentModel::fast_friction) update_lanes<true, false>(neighborhood);
+      else update_lanes<false, false>(neighborhood);
+    }
+}
+
+
+
+// flow_route_x / flow_route_y of one face of one lane, with the face
+// routing shared with Cell::update
+template<int LANES>
+template<bool FAST_FRICTION>
+inline double EnsembleCell<LANES>::route(double q_old, double h, double z, double upstream_h, double upstream_z,
+					 double slope, int lane, double delta)
+{
+  return LSDFriction::route<FAST_FRICTION>(q_old, h, z, upstream_h, upstream_z, slope, time_step[lane], delta,
+					   LSDCatchmentModel::hflow_threshold, Cell::gravity, mannings[lane], froude_limit[lane]);
+}
+
+
+
+// INTERIOR is celltype == INTERNAL, so that the edge tests fold away for
+// the interior cells
+template<int LANES>
+template<bool FAST_FRICTION, bool INTERIOR, typename COORD_MAP>
+void EnsembleCell<LANES>::update_lanes(const COORD_MAP& neighborhood)
+{
+  const EnsembleCell& old = thisCell_old;
+  if (!INTERIOR && celltype == Cell::NODATA)
+    {
+      for (int l = 0; l < LANES; l++) water_depth[l] = 0.0;
+      return;
+    }
+
+  const bool west_edge = !INTERIOR && (celltype == Cell::EDGE_WEST || celltype == Cell::CORNER_NW || celltype == Cell::CORNER_SW);
+  const bool east_edge = !INTERIOR && (celltype == Cell::EDGE_EAST || celltype == Cell::CORNER_NE || celltype == Cell::CORNER_SE);
+  const bool north_edge = !INTERIOR && (celltype == Cell::EDGE_NORTH || celltype == Cell::CORNER_NW || celltype == Cell::CORNER_NE);
+  const bool south_edge = !INTERIOR && (celltype == Cell::EDGE_SOUTH || celltype == Cell::CORNER_SW || celltype == Cell::CORNER_SE);
+  const double dx = LSDCatchmentModel::DX, dy = LSDCatchmentModel::DY;
+
+  // Neighbour lanes, dry beyond the domain edges
+  const double dry[LANES] = {};
+  const double *west_depth = west_edge ? dry : west_old.water_depth;
+  const double *north_depth = north_edge ? dry : north_old.water_depth;
+  const double *east_qx = east_edge ? dry : east_old.qx;
+  const double *south_qy = south_edge ? dry : south_old.qy;
+  const double west_elevation = west_edge ? LSDCatchmentModel::no_data_value : west_old.elevation;
+  const double north_elevation = north_edge ? LSDCatchmentModel::no_data_value : north_old.elevation;
+  const bool edge_slope_x = west_edge || east_edge;
+  const bool edge_slope_y = north_edge || south_edge;
+  const bool edge = west_edge || east_edge || north_edge || south_edge;
+  const double z = old.elevation;
+  const double edgeslope = LSDCatchmentModel::edgeslope;
+  const double erosion_threshold = LSDCatchmentModel::water_depth_erosion_threshold;
+  const double input_depth = LSDCatchmentModel::water_input_depth;
+
+#pragma omp simd
+  for (int l = 0; l < LANES; l++)
+    {
+      double h = old.water_depth[l];
+
+      // flow_route_x
+      double slope_x = edge_slope_x ? edgeslope : ((west_elevation + west_depth[l]) - (z + h)) / dx;
+      qx[l] = route<FAST_FRICTION>(old.qx[l], h, z, west_depth[l], west_elevation, slope_x, l, dx);
+
+      // flow_route_y
+      double slope_y = edge_slope_y ? edgeslope : ((north_elevation + north_depth[l]) - (z + h)) / dy;
+      qy[l] = route<FAST_FRICTION>(old.qy[l], h, z, north_depth[l], north_elevation, slope_y, l, dy);
+
+      // depth_update, from the old discharges
+      double new_depth = input_depth + h + time_step[l] * ( (east_qx[l] - old.qx[l])/dx + (south_qy[l] - old.qy[l])/dy );
+
+      // water_flux_out
+      if (edge && h > erosion_threshold)
+	{
+	  new_depth = erosion_threshold;
+	}
+      water_depth[l] = new_depth;
+    }
+}
+
+#endif
@@ -1,18 +1,34 @@
 #ifndef BOOSTSERIALIZATION_H
 #define BOOSTSERIALIZATION_H
 
-
+#include <include/catchmentmodel/cell.hpp>
 
 class BoostSerialization
 {
 public:
+    template<typename ARCHIVE>
+    inline
+    static void serialize(ARCHIVE& archive, Cell& object, const unsigned /*version*/)
+    {
+        int celltype = object.celltype;
+        archive & celltype;
+        object.celltype = Cell::CellType(celltype);
+        archive & object.elevation;
+        archive & object.qx;
+        archive & object.qy;
+        archive & object.water_depth;
+    }
 
 };
 
 namespace boost {
 namespace serialization {
 
-
+template<class ARCHIVE>
+void serialize(ARCHIVE& archive, Cell& object, const unsigned version)
+{
+    BoostSerialization::serialize(archive, object, version);
+}
 
 }
 }
@@ -1,4 +1,7 @@
 #include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
 #include <sys/stat.h> 
 
 #include <boost/assign/std/vector.hpp>
@@ -15,26 +18,30 @@
 #include <libgeodecomp/parallelization/hiparsimulator.h>
 #include <libgeodecomp/loadbalancer/noopbalancer.h>
 #include <libgeodecomp/io/bovwriter.h>
+#include <libgeodecomp/io/steerer.h>
 #include <libgeodecomp/geometry/partitions/recursivebisectionpartition.h>
 
 #include "catchmentmodel/cell.hpp"
 #include "catchmentmodel/LSDCatchmentModel.hpp"
 #include "catchmentmodel/LSDUtils.hpp"
+#include "catchmentmodel/LSDio.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+#include "catchmentmodel/LSDCheckpoint.hpp"
+#include "catchmentmodel/LSDStability.hpp"
+#include "catchmentmodel/LSDSpinup.hpp"
+#include "catchmentmodel/LSDConvergence.hpp"
+#include "catchmentmodel/LSDProfile.hpp"
+#include "catchmentmodel/cell_kernel.hpp"
+#include "catchmentmodel/LSDCommMatrix.hpp"
+#include "catchmentmodel/LSDHardwareCounters.hpp"
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+#include "catchmentmodel/LSDFriction.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+#include "catchmentmodel/LSDTaskFarm.hpp"
 
   
-
-// Initialising default values for static Cell variables
-double LSDCatchmentModel::DX = 1.0;
-double LSDCatchmentModel::DY = LSDCatchmentModel::DX;
-double LSDCatchmentModel::no_data_value = -9999;
-double LSDCatchmentModel::water_depth_erosion_threshold = 1.0;
-double LSDCatchmentModel::edgeslope = 0.001;
-double LSDCatchmentModel::hflow_threshold = 0.00001;
-double LSDCatchmentModel::mannings = 0.04;
-double LSDCatchmentModel::froude_limit = 0.8;
-double LSDCatchmentModel::time_factor = 1;
-double LSDCatchmentModel::courant_number = 0.7;
-double LSDCatchmentModel::maxdepth = 10;
+// The model parameters that Cell::update reads, and the non-template Cell
+// members, are defined in cell.cpp
 
 
 using namespace LSDUtils;
@@ -56,7 +63,7 @@ void LSDCatchmentModel::create()
 void LSDCatchmentModel::create(std::string pfname)
 {
   LSDCatchmentModel::initialise_variables(pfname);
-  if(LibGeoDecomp::MPILayer().rank() == 0)
+  if(LSDEnsemble::rank() == 0)
     {
       std::cout << "The user-defined parameters have been"
 		<< " ingested from the param file." << std::endl;
@@ -74,21 +81,6 @@ void LSDCatchmentModel::create(std::string pfname)
 
 
 
-
-
-
-
-// Cell default constructor
-Cell::Cell(Cell::CellType celltype_in = INTERNAL,	\
-	   double elevation_in = 0.0,			\
-	   double water_depth_in = 0.0,			\
-	   double qx_in = 0.0,				\
-	   double qy_in = 0.0) : celltype(celltype_in), elevation(elevation_in), water_depth(water_depth_in), qx(qx_in), qy(qy_in)
-{}
-
-
-
-
 template<typename Cell>
 class LibGeoDecomp::APITraits::SelectMPIDataType<Cell>  
 {
@@ -101,28 +93,6 @@ public:
 
 
 
-// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-//
-//   Overall update routine - this is what LibGeoDecomp calls each time step
-//
-// ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-template<typename COORD_MAP>
-void Cell::update(const COORD_MAP& neighborhood, unsigned nanoStep)
-{
-  initialise_grid_value_updates(neighborhood);
-  set_global_timefactor();
-  
-  // Hydrological and flow routing processes
-  // Add water to the catchment from rainfall input file
-  catchment_waterinputs(neighborhood);
-  // Distribute the water with the LISFLOOD Cellular Automaton algorithm
-  flow_route_x(neighborhood);
-  flow_route_y(neighborhood);
-  // Calculate the new water depths in the catchment
-  depth_update(neighborhood);
-  // Water outputs from edges/catchment outlet 
-  water_flux_out(neighborhood);
-}
 
 
 
@@ -135,167 +105,304 @@ void Cell::update(const COORD_MAP& neighborhood, unsigned nanoStep)
 
 
 
-void Cell::set_global_timefactor()
+
+void LSDCatchmentModel::zero_values()
 {
-  if (LSDCatchmentModel::maxdepth <= 0.1)
+  for(unsigned i=0; i < imax; i++)
     {
-      LSDCatchmentModel::maxdepth = 0.1;
+      for(unsigned j=0; j < jmax; j++)
+	{
+	  elev[i][j] = -9999;
+	  water_depth[i][j] = 0.0;
+	  rfarea[i][j] = 1;
+	}
     }
-  if (LSDCatchmentModel::time_factor < (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
+}
+
+
+
+
+
+// Advances the model time by the timestep the cells will use for the
+// coming update (see Cell::set_global_timefactor and set_local_timefactor)
+void LSDCatchmentModel::increment_counters()
+{
+  Cell::set_global_timefactor();
+  cycle += Cell::set_local_timefactor() / 60;
+}
+
+
+
+
+
+bool LSDCatchmentModel::skip_dry_weather()
+{
+  if (!rainfall_data_on || hourly_rain_data.empty()) return false;
+
+  // wait for a storage sample taken since the last check
+  if (storage_samples == dry_weather_checked_samples) return false;
+  dry_weather_checked_samples = storage_samples;
+  if (wetted_cells > dry_weather_wet_cells) return false;
+
+  double next_rain = next_rain_time(cycle);
+  if (next_rain <= cycle) return false;
+
+  topmodel_decay((next_rain - cycle) * 60);
+  if (LSDEnsemble::rank() == 0)
     {
-     LSDCatchmentModel::time_factor = (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth))));
+      std::cout << "Dry weather: skipping from model time " << cycle << " to " << next_rain << std::endl;
     }
-  /*    if (input_output_difference > in_out_difference_allowed &&LSDCatchmentModel::time_factor > (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
-	{
-  	time_factor =LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)));
-  	}*/
+  cycle = next_rain;
+  return true;
+}
+
+
 
+double LSDCatchmentModel::next_rain_time(double from) const
+{
+  for (std::size_t row = static_cast<std::size_t>(from / rain_data_time_step); row < hourly_rain_data.size(); row++)
+    {
+      for (std::size_t n = 0; n < hourly_rain_data[row].size(); n++)
+	{
+	  if (hourly_rain_data[row][n] > 0) return std::max(from, row * rain_data_time_step);
+	}
+    }
+  return std::max(from, hourly_rain_data.size() * rain_data_time_step);
 }
 
 
 
-template<typename COORD_MAP>
-void Cell::catchment_waterinputs(const COORD_MAP& neighborhood) // refactor - incomplete (include runoffGrid for complex, i.e. spatially variable rainfall)
+void LSDCatchmentModel::topmodel_decay(double seconds)
 {
-  
-  //waterinput = 0;
-  double local_time_factor = set_local_timefactor();
-  /*
-  if (spatially_complex_rainfall == true)
+  for (unsigned n = 1; n < jo.size(); n++)
     {
-      catchment_water_input_and_hydrology(local_time_factor, runoff);
+      j_mean[n] = (jo[n] > 0 && seconds > 0) ? M / seconds * std::log(1 + jo[n] * seconds / M) : 0.0;
+      jo[n] = j[n] = jo[n] / (1 + jo[n] * seconds / M);
     }
-    else */
-  //  {
-  catchment_water_input_and_hydrology(neighborhood, local_time_factor);
-  //    }
 }
 
-template<typename COORD_MAP>
-void Cell::catchment_water_input_and_hydrology(const COORD_MAP& neighborhood, double local_time_factor)
+
+
+std::vector< std::vector<float> > LSDCatchmentModel::read_rainfalldata(std::string FILENAME)
 {
-  /*
-  for (unsigned i = 1; i<=rfnum; i++)
+  std::vector< std::vector<float> > raingrid;
+  std::ifstream infile(FILENAME.c_str());
+  if (!infile)
     {
-      waterinput += j_mean[i] * nActualGridCells[i] * LSDCatchmentModel::DX * LSDCatchmentModel::DX;
+      std::cout << "No rainfall data file found by name of: " << FILENAME << std::endl;
+      exit(EXIT_FAILURE);
     }
-  
-    for (int z=1; z <= totalinputpoints; z++)
+
+  std::string line;
+  while (std::getline(infile, line))
     {
-      int i = catchment_input_x_coord[z];
-      int j = catchment_input_y_coord[z];
-      double water_add_amt = (j_mean[rfarea[i][j]] * nActualGridCells[rfarea[i][j]]) /
-        (catchment_input_counter[rfarea[i][j]]) * local_time_factor;    //
-      if (water_add_amt > ERODEFACTOR)
+      std::stringstream row_stream(line);
+      std::vector<float> row;
+      float value;
+      while (row_stream >> value) row.push_back(value);
+      if (!row.empty()) raingrid.push_back(row);
+    }
+  return raingrid;
+}
+
+
+
+void LSDCatchmentModel::load_rainfall_data()
+{
+  int rows = 0;
+  int cols = 0;
+  std::vector<float> values;
+  if (LSDEnsemble::rank() == 0)
+    {
+      std::vector< std::vector<float> > raingrid = read_rainfalldata(read_path + "/" + rainfall_data_file);
+      rows = raingrid.size();
+      for (int row = 0; row < rows; row++) cols = std::max(cols, int(raingrid[row].size()));
+      values.assign(rows * cols, 0.0f);
+      for (int row = 0; row < rows; row++)
 	{
-	  water_add_amt = ERODEFACTOR;
-	}
-      
-  */
-	
-  if(celltype == EDGE_WEST){ water_depth = water_depth + 0.01; }  // referring to new water_depth, which has already been added to by other functions during this update cycle
-  
-      /*
+	  std::copy(raingrid[row].begin(), raingrid[row].end(), values.begin() + row * cols);
 	}
-      */
-  
-  // if the input type flag is 1 then the discharge is input from the hydrograph
-  /*  if (cycle >= time_1)
-    {
-      do
-	{
-	  time_1++;
-	  topmodel_runoff(time_1);  // calc_J is based on the rainfall rate supplied to the cell
+    }
+  MPI_Bcast(&rows, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&cols, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  values.resize(rows * cols);
+  MPI_Bcast(values.data(), rows * cols, MPI_FLOAT, 0, LSDEnsemble::communicator());
 
-	  if (time_factor > max_time_step) // && new_j_mean[1] > (0.2 / (jmax * imax * LSDCatchmentModel::DX * LSDCatchmentModel::DX)))
-	    {
-	      // Find the current maximum runoff amount
-	      double j_mean_max_temp = 0;
-	      for (unsigned n = 1; n <= rfnum; n++)
-		{
-		  if (new_j_mean[n] > j_mean_max_temp)
-		    {
-		      j_mean_max_temp = new_j_mean[n];
-		    }
-		}
+  if (rainfall_scale != 1.0)
+    {
+      for (std::size_t v = 0; v < values.size(); v++) values[v] *= rainfall_scale;
+    }
 
-	      // check after the variable rainfall area has been added
-	      // stops code going too fast when there is actual flow in the channels greater than 0.2cu
-	      if (j_mean_max_temp > (0.2 / (imax * jmax * LSDCatchmentModel::DX * LSDCatchmentModel::DX)))
-		{
-		  cycle = time_1 + (max_time_step / 60);
-		 LSDCatchmentModel::time_factor = max_time_step;
-		}
-	    }
-	} while (time_1 < cycle);
+  hourly_rain_data.assign(rows, std::vector<float>(cols));
+  for (int row = 0; row < rows; row++)
+    {
+      std::copy(values.begin() + row * cols, values.begin() + (row + 1) * cols, hourly_rain_data[row].begin());
     }
-  
+}
+
 
-  calchydrograph(time_1 - cycle);
 
-  double jmeanmax =0;
-  for (unsigned n=1; n <= rfnum; n++)
+void LSDCatchmentModel::save_counters(std::ostream& out) const
+{
+  out << "cycle " << cycle << std::endl
+      << "tx " << tx << std::endl
+      << "time_factor " << LSDCatchmentModel::time_factor << std::endl
+      << "maxdepth " << LSDCatchmentModel::maxdepth << std::endl
+      << "courant_number " << LSDCatchmentModel::courant_number << std::endl
+      << "waterOut " << waterOut << std::endl
+      << "waterinput " << waterinput << std::endl
+      << "input_output_difference " << LSDCatchmentModel::input_output_difference << std::endl
+      << "timeseries_row " << timeseries_row << std::endl;
+  for (unsigned n = 1; n < jo.size(); n++)
+    {
+      out << "topmodel_jo " << n << " " << jo[n] << std::endl;
+    }
+  if (gauge_output)
     {
-      if (j_mean[n] > jmeanmax)
-	{
-	  jmeanmax = j_mean[n];
-	}
+      out << "gauge_next_output_time " << gauge_next_output_time << std::endl
+	  << "gauge_rows_written " << gauge_rows_written << std::endl
+	  << "gauge_row_buffer " << gauge_row_buffer.size();
+      for (std::size_t n = 0; n < gauge_row_buffer.size(); n++) out << " " << gauge_row_buffer[n];
+      out << std::endl;
     }
-  */
+}
+
 
 
-  /*
-  // DV - This is for reading the discharge direct from an input file
-  if (jmeaninputfile_opt == true)
+std::string LSDCatchmentModel::spinup_cache_key() const
+{
+  // bump with any change to what is hashed, or to how the model uses it,
+  // so older entries are never loaded into a run that would differ
+  const std::string version = "spinup_cache_key 2";
+  unsigned long long hash = fnv1a_hash(version.data(), version.size());
+
+  hash = fnv1a_hash(&imax, sizeof(imax), hash);
+  hash = fnv1a_hash(&jmax, sizeof(jmax), hash);
+  for (int i = 0; i < imax; i++)
     {
-      j_mean[1] = ((hourly_rain_data[(static_cast<int>(cycle / rain_data_time_step))][0] //check in original
-		    / std::pow(LSDCatchmentModel::DX, 2)) / nActualGridCells[1]);
+      hash = fnv1a_hash(&elev[i][0], jmax * sizeof(double), hash);
     }
 
-  if (jmeanmax >= baseflow) // > baseflow
+  // the initial water depths and discharges
+  for (int i = 0; i < imax; i++)
     {
-      baseflow = baseflow * 3;    // Magic number 3!? - DAV
-      zero_and_calc_drainage_area();         // Could this come from one of the LSDobject files? - DAV
-      get_catchment_input_points();
+      hash = fnv1a_hash(&water_depth[i][0], jmax * sizeof(double), hash);
+      hash = fnv1a_hash(&initial_qx[i][0], jmax * sizeof(double), hash);
+      hash = fnv1a_hash(&initial_qy[i][0], jmax * sizeof(double), hash);
     }
 
-  if (baseflow > (jmeanmax * 3) && baseflow > 0.000001) // DV reverted to match CL 1.8f (formerly 10^-7)
-    // Could make the baseflow threshold a parameter in param file?
-    {
-      baseflow = jmeanmax * 1.25;   // Where do these magic numbers come from? DAV
-      zero_and_calc_drainage_area();
-      get_catchment_input_points();
+  // every static parameter, then the members that change the spin-up
+  StaticParameters statics = get_static_parameters();
+  std::stringstream params;
+  params.precision(17);
+  params << statics.DX << " " << statics.DY << " " << statics.no_data_value << " "
+	 << statics.water_depth_erosion_threshold << " " << statics.edgeslope << " "
+	 << statics.hflow_threshold << " " << statics.mannings << " " << statics.froude_limit << " "
+	 << statics.time_factor << " " << statics.courant_number << " " << statics.maxdepth << " "
+	 << statics.input_output_difference << " " << statics.in_out_difference_allowed << " "
+	 << statics.water_input_depth << " " << statics.fast_friction << " "
+	 << M << " " << k_evap << " " << rfnum << " " << rain_data_time_step << " " << rainfall_scale << " "
+	 << rainfall_data_on << " " << spatially_complex_rainfall << " " << hydro_only << " "
+	 << mass_balance_interval << " " << dry_weather_skip << " " << dry_weather_wet_cells << " "
+	 << stability_check_interval << " " << stability_snapshot_interval << " " << stability_snapshots << " "
+	 << stability_max_velocity << " " << stability_depth_tolerance << " " << stability_courant_factor << " "
+	 << stability_min_courant << " "
+	 << spinup_duration << " " << coarse_spinup_factor << " " << coarse_spinup_duration;
+  std::string param_string = params.str();
+  hash = fnv1a_hash(param_string.data(), param_string.size(), hash);
+
+  // only the rainfall that falls during the spin-up
+  if (rainfall_data_on)
+    {
+      std::ifstream rainfall((read_path + "/" + rainfall_data_file).c_str());
+      int rows = static_cast<int>(std::ceil(spinup_duration / rain_data_time_step)) + 1;
+      std::string line;
+      for (int row = 0; row < rows && std::getline(rainfall, line); row++)
+	{
+	  hash = fnv1a_hash(line.data(), line.size(), hash);
+	}
     }
-  */
 
+  std::stringstream key;
+  key << std::hex << std::setfill('0') << std::setw(16) << hash;
+  return key.str();
 }
 
 
 
+void LSDCatchmentModel::load_counters(std::istream& in)
+{
+  std::string name;
+  while (in >> name)
+    {
+      if (name == "cycle") in >> cycle;
+      else if (name == "tx") in >> tx;
+      else if (name == "time_factor") in >> LSDCatchmentModel::time_factor;
+      else if (name == "maxdepth") in >> LSDCatchmentModel::maxdepth;
+      else if (name == "courant_number") in >> LSDCatchmentModel::courant_number;
+      else if (name == "waterOut") in >> waterOut;
+      else if (name == "waterinput") in >> waterinput;
+      else if (name == "input_output_difference") in >> LSDCatchmentModel::input_output_difference;
+      else if (name == "timeseries_row") in >> timeseries_row;
+      else if (name == "topmodel_jo")
+	{
+	  unsigned n;
+	  double value;
+	  in >> n >> value;
+	  if (n < jo.size()) jo[n] = j[n] = value;
+	}
+      else if (name == "gauge_next_output_time") in >> gauge_next_output_time;
+      else if (name == "gauge_rows_written") in >> gauge_rows_written;
+      else if (name == "gauge_row_buffer")
+	{
+	  std::size_t size;
+	  in >> size;
+	  gauge_row_buffer.resize(size);
+	  for (std::size_t n = 0; n < size; n++) in >> gauge_row_buffer[n];
+	}
+      else
+	{
+	  std::string rest;
+	  std::getline(in, rest);
+	}
+    }
+}
+
 
 
-void LSDCatchmentModel::zero_values()
+void LSDCatchmentModel::truncate_outputs() const
 {
-  for(unsigned i=0; i < imax; i++)
+  truncate_lines(write_path + "/" + write_fname, timeseries_row);
+  if (gauge_output)
     {
-      for(unsigned j=0; j < jmax; j++)
-	{
-	  elev[i][j] = -9999;
-	  water_depth[i][j] = 0.0;
-	  rfarea[i][j] = 1;
-	}
+      std::string filename = write_path + "/" + gauge_fname;
+      long row_length = 1 + long(gauge_names.size()) * GaugeWriter::NUM_OUTPUT_FIELDS;
+      if (gauge_output_format == "binary") truncate_bytes(filename, gauge_rows_written * row_length * long(sizeof(double)));
+      else truncate_lines(filename, gauge_rows_written + 1);   // and the header
     }
 }
 
 
 
+void LSDCatchmentModel::reset_outputs()
+{
+  timeseries_row = 0;
+  gauge_rows_written = 0;
+  gauge_row_buffer.clear();
+}
+
 
 
 // Initialise the relevant arrays
 void LSDCatchmentModel::initialise_arrays()
 {
-  elev = TNT::Array2D<double> (imax,jmax, -9999); 
+  if (elev.dim1() != int(imax) || elev.dim2() != int(jmax))
+    {
+      elev = TNT::Array2D<double> (imax,jmax, -9999);
+    }
   water_depth = TNT::Array2D<double> (imax,jmax, 0.0);
+  initial_qx = TNT::Array2D<double> (imax,jmax, 0.0);
+  initial_qy = TNT::Array2D<double> (imax,jmax, 0.0);
   
   // line to stop max time step being greater than rain time step
   if (rain_data_time_step < 1) rain_data_time_step = 1;
@@ -325,12 +432,12 @@ void LSDCatchmentModel::initialise_arrays()
 
   // Distributed Hydrological Model Arrays
   // j and jo need a very small initial value to get them going
-  /*  j = std::vector<double> (rfnum + 1, 0.000000001);
+  j = std::vector<double> (rfnum + 1, 0.000000001);
   jo = std::vector<double> (rfnum + 1, 0.000000001);
   j_mean = std::vector<double> (rfnum + 1);
   // std::vectors will be default initalised to 0, unless specified
   old_j_mean = std::vector<double> (rfnum + 1);
-  new_j_mean = std::vector<double> (rfnum + 1);*/
+  new_j_mean = std::vector<double> (rfnum + 1);
   rfarea = TNT::Array2D<int> (imax + 2, jmax + 2, 0);
  
   nActualGridCells = std::vector<int> (rfnum + 1);
@@ -348,409 +455,156 @@ void LSDCatchmentModel::initialise_arrays()
 
 
 
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// WATER FLUXES OUT OF CATCHMENT
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-//
-// Calculate the water coming out and zero any water depths at the edges
-// This will actually set it to the minimum water depth
-// This must be done so that water can still move sediment to the edge of the catchment
-// and hence remove it from the catchment. (otherwise you would get sediment build
-// up around the edges.
-//
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-template<typename COORD_MAP>
-void Cell::water_flux_out(const COORD_MAP& neighborhood)
-{
-  // must still figure out best way to accumulate total across cells during update executed by LibGeodecomp
-  switch(celltype){
-  case Cell::INTERNAL:
-    break;
-  case Cell::EDGE_WEST:
-  case Cell::EDGE_NORTH:
-  case Cell::EDGE_EAST:
-  case Cell::EDGE_SOUTH:
-  case Cell::CORNER_NW:
-  case Cell::CORNER_NE:
-  case Cell::CORNER_SE:
-  case Cell::CORNER_SW:
-    if (thisCell_old.water_depth > LSDCatchmentModel::water_depth_erosion_threshold) water_depth = LSDCatchmentModel::water_depth_erosion_threshold;
-    break;
-  default:
-    std::cout << "\n\n WARNING: no water_flux_out rule specified for cell type " << celltype << "\n\n";
-    break;
-  }
-}
-
-
-
 
 
 
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// THE WATER ROUTING ALGORITHM: LISFLOOD-FP
-//
-//           X direction
-//
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-template<typename COORD_MAP>
-void Cell::flow_route_x(const COORD_MAP& neighborhood)
+void LSDCatchmentModel::set_inputoutput_diff()
 {
-  double hflow;
-  double tempslope;
-  double west_elevation_old;
-  double west_water_depth_old;
-  double local_time_factor = set_local_timefactor();
-
-  switch (celltype){
-  case Cell::INTERNAL:
-  case Cell::EDGE_NORTH:
-  case Cell::EDGE_SOUTH:
-    west_elevation_old = west_old.elevation;
-    west_water_depth_old = west_old.water_depth;
-    tempslope = ((west_elevation_old + west_water_depth_old) - (thisCell_old.elevation + thisCell_old.water_depth)) / LSDCatchmentModel::DX;
-    break;
-  case Cell::EDGE_WEST:
-  case Cell::CORNER_NW:
-  case Cell::CORNER_SW:
-    west_elevation_old = LSDCatchmentModel::no_data_value;
-    west_water_depth_old = 0.0;
-    tempslope = LSDCatchmentModel::edgeslope;
-    break;
-  case Cell::EDGE_EAST:
-  case Cell::CORNER_NE:
-  case Cell::CORNER_SE:
-    west_elevation_old = west_old.elevation;
-    west_water_depth_old = west_old.water_depth;
-    tempslope = LSDCatchmentModel::edgeslope;
-    break;
-  default:
-    std::cout << "\n\n WARNING: no x-direction flow route rule specified for cell type " << celltype << "\n\n";
-    break;
-  }
-
-
-  if (thisCell_old.water_depth > 0 || west_water_depth_old > 0)
-    {
-      hflow = std::max(thisCell_old.elevation + thisCell_old.water_depth, west_elevation_old + west_water_depth_old) - std::max(thisCell_old.elevation, west_elevation_old);
-      if (hflow > LSDCatchmentModel::hflow_threshold)
-	{
-	  update_qx(neighborhood, hflow, tempslope, local_time_factor);
-	  froude_check(qx, hflow);
-	  discharge_check(neighborhood, qx, west_water_depth_old, LSDCatchmentModel::DX);
-	}
-      else
-	{
-	  qx = 0.0;
-	  // qxs = 0.0;
-	}
-    }
-
-
-
-
-  // calc velocity now
-  //if (qx > 0)
-  //  {
-  //	vel_dir[7] = qx / hflow;
-  //  }
-  // refactor: old code tries to update vel_dir belonging to neighbour sites - can't do this because neighborhood is passed as a CONST. Should make flow_route only modify its own vel_dir components, based on neighbouring qx qy (i.e. flip around the current logic of modifying neigbouring vel_dir based on local qx qy)
-  // But need all cells to record their hflow (or precompute and store -qx/hflow)
-  /*	if (qx < 0)
-  	{
-  	west_old.vel_dir[3] = (0 - qx) / hflow;
-  	}
-
-  	}*/
-
+  input_output_difference = std::abs(waterinput - waterOut);
 }
 
 
 
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// THE WATER ROUTING ALGORITHM: LISFLOOD-FP
-//
-//           Y direction
-//
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-template<typename COORD_MAP>
-void Cell::flow_route_y(const COORD_MAP& neighborhood)
+void LSDCatchmentModel::update_water_budget(const double *totals, double interval_seconds, bool storage_sampled)
 {
-  double hflow;
-  double tempslope;
-  double north_elevation_old;
-  double north_water_depth_old;
-  double local_time_factor = set_local_timefactor();
-
-  switch (celltype){
-  case Cell::INTERNAL:
-  case Cell::EDGE_WEST:
-  case Cell::EDGE_EAST:
-    north_elevation_old = north_old.elevation;
-    north_water_depth_old = north_old.water_depth;
-    tempslope = ((north_elevation_old + north_water_depth_old) - (thisCell_old.elevation + thisCell_old.water_depth)) / LSDCatchmentModel::DY;
-    break;
-  case Cell::EDGE_NORTH:
-  case Cell::CORNER_NW:
-  case Cell::CORNER_NE:
-    north_elevation_old = LSDCatchmentModel::no_data_value;
-    north_water_depth_old = 0.0;
-    tempslope = LSDCatchmentModel::edgeslope;
-    break;
-  case Cell::EDGE_SOUTH:
-  case Cell::CORNER_SW:
-  case Cell::CORNER_SE:
-    north_elevation_old = north_old.elevation;
-    north_water_depth_old = north_old.water_depth;
-    tempslope = LSDCatchmentModel::edgeslope;
-    break;
-  default:
-    std::cout << "\n\n WARNING: no y-direction flow route rule specified for cell type " << static_cast<int>(celltype) << "\n\n";
-    break;
-  }
-
-
-  if (thisCell_old.water_depth > 0 || north_water_depth_old > 0)
+  if (interval_seconds > 0)
     {
-      hflow = std::max(thisCell_old.elevation + thisCell_old.water_depth, north_elevation_old + north_water_depth_old) - std::max(thisCell_old.elevation, north_elevation_old);
-      if (hflow > LSDCatchmentModel::hflow_threshold)
-	{
-	  update_qy(neighborhood, hflow, tempslope, local_time_factor);
-	  froude_check(qy, hflow);
-	  discharge_check(neighborhood, qy, north_water_depth_old, LSDCatchmentModel::DY);
-	}
-      else
+      for (int edge = 0; edge < 4; edge++)
 	{
-	  qy = 0.0;
-	  // qys = 0.0;
+	  edge_waterOut[edge] = totals[LSDMassBalance::OUTFLOW_WEST + edge] / interval_seconds;
 	}
+      waterOut = edge_waterOut[0] + edge_waterOut[1] + edge_waterOut[2] + edge_waterOut[3];
+      waterinput = totals[LSDMassBalance::WATER_INPUT] / interval_seconds;
+      set_inputoutput_diff();
+    }
+  if (storage_sampled)
+    {
+      stored_water_volume = totals[LSDMassBalance::STORED_VOLUME];
+      wetted_cells = totals[LSDMassBalance::WET_CELLS];
+      storage_samples++;
     }
-
-
-
-
-  // calc velocity now
-  //if (qy > 0)
-  //  {
-  //vel_dir[1] = qy / hflow;
-  // }
-  //refactor: old code tries to update vel_dir belonging to neighbour sites - can't do this because neighborhood is passed as a CONST. Should make flow_route only modify its own vel_dir components, based on neighbouring qx qy (i.e. flip around the current logic of modifying neigbouring vel_dir based on local qx qy)
-  // But need all cells to record their hflow (or precompute and store -qx/hflow)
-
-  /*		if (qx < 0)
-  		{
-  		north_old.vel_dir[5] = (0 - qy) / hflow;
-  		}
-
-  		}*/
 }
 
 
 
-
-
-
-
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// DEPTH UPDATE
-//
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-template<typename COORD_MAP>
-void Cell::depth_update(const COORD_MAP& neighborhood)
-{
-  double east_qx_old;
-  double south_qy_old;
-
-  double local_time_factor = set_local_timefactor();
-
-  switch (celltype){
-  case Cell::INTERNAL:
-  case Cell::EDGE_NORTH:
-  case Cell::EDGE_WEST:
-  case Cell::CORNER_NW:
-    east_qx_old = east_old.qx;
-    south_qy_old = south_old.qy;
-    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
-    break;
-  case Cell::EDGE_EAST:
-  case Cell::CORNER_NE:
-    east_qx_old = 0.0;
-    south_qy_old = south_old.qy;
-    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
-    break;
-  case Cell::EDGE_SOUTH:
-  case Cell::CORNER_SW:
-    east_qx_old = east_old.qx;
-    south_qy_old = 0.0;
-    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
-    break;
-  case Cell::CORNER_SE:
-    east_qx_old = 0.0;
-    south_qy_old = 0.0;
-    update_water_depth(neighborhood, east_qx_old, south_qy_old, local_time_factor);
-    break;
-  case Cell::NODATA:
-    water_depth = 0.0;
-    break;
-  default:
-    std::cout << "\n\n WARNING: no depth update rule specified for cell type " << Cell::CellType(int(celltype))<< "\n\n";
-    break;
-  }
-}
-
-
-// The point of this function is to initialise grid values of any quantities that
-// either need to be kept constant or that have multiple partial updates made to
-// them during each time step. By taking care of initialising such grid values in
-// this function based on their old values as read through the neighborhood object,
-// other functions can add to them *in any order* by always reading from and adding
-// to the new value, i.e. without needing to consider whether they are the first
-// function to update the value (which would need to read the neighborhood object
-// to access the old value). 
-template<typename COORD_MAP>
-void Cell::initialise_grid_value_updates(const COORD_MAP& neighborhood)
+void LSDCatchmentModel::write_output_timeseries()
 {
-  water_depth = thisCell_old.water_depth;
-}
+  std::string OUTPUT_FILE = write_path + "/" + write_fname;
+  std::ofstream write_timeseries;
+  write_timeseries.open(OUTPUT_FILE.c_str(), (timeseries_row == 0) ? std::ios_base::trunc : std::ios_base::app);
 
-
-template<typename COORD_MAP>
-void Cell::update_water_depth(const COORD_MAP& neighborhood, double east_qx_old, double south_qy_old, double local_time_factor)
-{
-  water_depth = 0.005 + thisCell_old.water_depth + local_time_factor * ( (east_qx_old - thisCell_old.qx)/LSDCatchmentModel::DX + (south_qy_old - thisCell_old.qy)/LSDCatchmentModel::DY );
+  timeseries_row++;
+  write_timeseries << timeseries_row << " " << std::setprecision(8) << waterOut << " " << waterinput;
+  for (int edge = 0; edge < 4; edge++)
+    {
+      write_timeseries << " " << edge_waterOut[edge];
+    }
+  write_timeseries << " " << stored_water_volume << " " << wetted_cells << std::endl;
 }
 
 
 
-template<typename COORD_MAP>
-void Cell::update_qx(const COORD_MAP& neighborhood, double hflow, double tempslope, double local_time_factor)
-{
-  update_q(thisCell_old.qx, qx, hflow, tempslope, local_time_factor);
-}
-
-
-template<typename COORD_MAP>
-void Cell::update_qy(const COORD_MAP& neighborhood, double hflow, double tempslope, double local_time_factor)
-{
-  update_q(thisCell_old.qy, qy, hflow, tempslope, local_time_factor);
-}
 
 
-void Cell::update_q(const double &q_old, double &q_new, double hflow, double tempslope, double local_time_factor)
-{
-  q_new = ((q_old - (Cell::gravity * hflow * local_time_factor * tempslope)) \
-	   / (1.0 + Cell::gravity * hflow * local_time_factor * (LSDCatchmentModel::mannings * LSDCatchmentModel::mannings) \
-	      * std::abs(q_old) / std::pow(hflow, (10.0 / 3.0))));
-}
-    
 
-  // FROUDE NUMBER CHECK
-  // need to have these lines to stop too much water moving from
-  // one cell to another - resulting in negative discharges
-  // which causes a large instability to develop
-  // - only in steep catchments really
-void Cell::froude_check(double &q, double hflow)
-{
-  if ((std::abs(q / hflow) / std::sqrt(Cell::gravity * hflow)) > LSDCatchmentModel::froude_limit) // correctly reads newly calculated value of q, not thisCell_old.q
-    {
-      q = std::copysign(hflow * (std::sqrt(Cell::gravity*hflow) * LSDCatchmentModel::froude_limit), q);
-    }
-}
 
 
-// DISCHARGE MAGNITUDE/TIMESTEP CHECKS
-// If the discharge is too high for this timestep, scale back...
-template<typename COORD_MAP>
-void Cell::discharge_check(const COORD_MAP& neighborhood, double &q, double neighbour_water_depth, double Delta)
+Cell::CellType LSDCatchmentModel::cell_type(int x, int y) const
 {
-  double local_time_factor = set_local_timefactor();
-  double criterion_magnitude = std::abs(q * local_time_factor / Delta);
-
-  if (q > 0 && criterion_magnitude > (thisCell_old.water_depth / 4.0))
+  if (y == 0)
     {
-      q = ((thisCell_old.water_depth * Delta) / 5.0) / local_time_factor;
+      if (x == 0) return Cell::CORNER_NW;
+      else if (x == int(jmax)-1) return Cell::CORNER_NE;
+      else return Cell::EDGE_NORTH;
     }
-  else if (q < 0 && criterion_magnitude > (neighbour_water_depth / 4.0))
+  else if (y == int(imax)-1)
     {
-      q = -((neighbour_water_depth * Delta) / 5.0) / local_time_factor;
+      if (x == 0) return Cell::CORNER_SW;
+      else if (x == int(jmax)-1) return Cell::CORNER_SE;
+      else return Cell::EDGE_SOUTH;
     }
-}
-  
-
-
-
-double Cell::set_local_timefactor()
-{
-  double local_time_factor = LSDCatchmentModel::time_factor;
-  if (local_time_factor > (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX  / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
+  else
     {
-      local_time_factor = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)));
+      if (x == 0) return Cell::EDGE_WEST;
+      else if (x == int(jmax)-1) return Cell::EDGE_EAST;
+      else return Cell::INTERNAL;
     }
-  return local_time_factor;
 }
 
 
 
-  // /*  void set_inputoutput_diff()
-  // {
-  //   input_output_difference = std::abs(waterinput - waterOut);
-  //   }*/
-
-
-
-
-
-
-
-
 class CellInitializer : public LibGeoDecomp::SimpleInitializer<Cell>
 {
 public:
   using LibGeoDecomp::SimpleInitializer<Cell>::gridDimensions; 
   
-  CellInitializer(LSDCatchmentModel *catchment_in) : LibGeoDecomp::SimpleInitializer<Cell>(LibGeoDecomp::Coord<2>(catchment_in->elev.dim2(), catchment_in->elev.dim1()), catchment_in->no_of_iterations)
+  CellInitializer(LSDCatchmentModel *catchment_in, CheckpointReader *restart_in = 0) : LibGeoDecomp::SimpleInitializer<Cell>(LibGeoDecomp::Coord<2>(catchment_in->elev.dim2(), catchment_in->elev.dim1()), catchment_in->no_of_iterations)
   {
     catchment = catchment_in;
+    restart = restart_in;
+  }
+
+  // A restarted run carries on from the step of its checkpoint
+  unsigned startStep() const
+  {
+    return restart ? restart->get_step() : 0;
   }
   
   void grid(LibGeoDecomp::GridBase<Cell, 2> *subgrid)
   {
-    Cell::CellType celltype;
+    if (restart)
+      {
+	restart->restore_subgrid(subgrid);
+	return;
+      }
+
     LibGeoDecomp::CoordBox<2> subgridBoundingBox = subgrid->boundingBox();
     
     for (int x=0; x<=catchment->jmax-1; x++)
       {
 	for (int y=0; y<=catchment->imax-1; y++)
 	  {
-	    if (y == 0)
-	      {
-		if (x == 0) celltype = Cell::CORNER_NW;
-		else if (x == catchment->jmax-1) celltype = Cell::CORNER_NE;
-		else celltype = Cell::EDGE_NORTH;
-	      }
-	    else if (y == catchment->imax-1)
-	      {
-		if (x == 0) celltype = Cell::CORNER_SW;
-		else if (x == catchment->jmax-1) celltype = Cell::CORNER_SE;
-		else celltype = Cell::EDGE_SOUTH;
-	      }
-	    else  
-	      {
-		if (x == 0) celltype = Cell::EDGE_WEST;
-		else if (x == catchment->jmax-1) celltype = Cell::EDGE_EAST;
-		else celltype = Cell::INTERNAL;
-	      }
-	    
 	    LibGeoDecomp::Coord<2> coordinate(x, y);
 	    
 	    // ensure each rank only initialises its subgrid
 	    if (subgridBoundingBox.inBounds(coordinate))
 	      {
-		subgrid->set(coordinate, Cell(celltype, catchment->elev[y][x], catchment->water_depth[y][x], 0.0, 0.0));
+		subgrid->set(coordinate, Cell(catchment->cell_type(x, y), catchment->elev[y][x], catchment->water_depth[y][x], \
+					      catchment->initial_qx[y][x], catchment->initial_qy[y][x]));
 	      }
 	  }
       }
   }
+private:
+  LSDCatchmentModel *catchment;
+  CheckpointReader *restart;
+};
+
+
+
+
+// Advances the model clock (cycle, in model minutes) once per time step
+// on every rank, before the cells are updated. Writers and steerers that
+// act on model time rather than step number read catchment->get_cycle().
+// With dry_weather_skip, the clock first jumps over dry spells.
+class ModelClockSteerer : public LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ModelClockSteerer>
+{
+public:
+  typedef LibGeoDecomp::Steerer<Cell>::GridType GridType;
+
+  ModelClockSteerer(LSDCatchmentModel *catchment_in) :
+    LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ModelClockSteerer>(1),
+    catchment(catchment_in)
+  {}
+
+  void nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+		unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+  {
+    if (!lastCall) return;
+    if (catchment->dry_weather_skip) catchment->skip_dry_weather();
+    catchment->increment_counters();
+  }
+
 private:
   LSDCatchmentModel *catchment;
 };
@@ -888,33 +742,221 @@ void LSDCatchmentModel::load_data()
 
 
 
+void LSDCatchmentModel::load_terrain()
+{
+  // Read model domain extent from DEM file on rank 0
+  if (LSDEnsemble::rank() == 0)
+    {
+      initialise_model_domain_extents();
+    }
 
+  // Broadcast model domain extent from rank 0 to all other ranks to allow each to initialise their arrays
+  MPI_Bcast(&imax, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&jmax, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&xll, 1, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&yll, 1, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&LSDCatchmentModel::DX, 1, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+  MPI_Bcast(&LSDCatchmentModel::no_data_value, 1, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+  LSDCatchmentModel::DY = LSDCatchmentModel::DX;
 
+  // Load terrain elevation data from DEM file on rank 0
+  if (LSDEnsemble::rank() == 0)
+    {
+      load_data();
+    }
+  else
+    {
+      elev = TNT::Array2D<double> (imax, jmax);
+    }
 
+  // Broadcast terrain elevation data to all processes (TNT arrays are stored row by row in one block)
+  MPI_Bcast(&elev[0][0], imax * jmax, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+}
 
 
 
+void LSDCatchmentModel::share_terrain(const LSDCatchmentModel& source)
+{
+  imax = source.imax;
+  jmax = source.jmax;
+  xll = source.xll;
+  yll = source.yll;
+  elev = source.elev;
+}
 
 
 
+LSDCatchmentModel::StaticParameters LSDCatchmentModel::get_static_parameters()
+{
+  StaticParameters parameters = {DX, DY, no_data_value, water_depth_erosion_threshold, edgeslope, hflow_threshold, mannings,
+				 froude_limit, time_factor, courant_number, maxdepth, input_output_difference, in_out_difference_allowed,
+				 water_input_depth, fast_friction};
+  return parameters;
+}
 
 
 
+void LSDCatchmentModel::set_static_parameters(const StaticParameters& parameters)
+{
+  DX = parameters.DX;
+  DY = parameters.DY;
+  no_data_value = parameters.no_data_value;
+  water_depth_erosion_threshold = parameters.water_depth_erosion_threshold;
+  edgeslope = parameters.edgeslope;
+  hflow_threshold = parameters.hflow_threshold;
+  mannings = parameters.mannings;
+  froude_limit = parameters.froude_limit;
+  time_factor = parameters.time_factor;
+  courant_number = parameters.courant_number;
+  maxdepth = parameters.maxdepth;
+  input_output_difference = parameters.input_output_difference;
+  in_out_difference_allowed = parameters.in_out_difference_allowed;
+  water_input_depth = parameters.water_input_depth;
+  fast_friction = parameters.fast_friction;
+}
 
 
-//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// This function gets all the data from a parameter file
-//
-// Update: It also intialises the other params that are set internally
-// Some functions have been taken out of mainloop()
-//
-// DAV - this is a bit of a clunky method - perhaps replace it with the
-//   paramter ingestion method used in CHILD one day?
-//
-//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void LSDCatchmentModel::resolve_output_regions()
+{
+  for (std::size_t r = 0; r < output_region_names.size(); r++)
+    {
+      std::string key = "region_" + output_region_names[r] + "_";
+      OutputRegion output_region;
+      output_region.name = output_region_names[r];
+      output_region.fields = region_params.count(key + "fields") ? region_params[key + "fields"] : "water_depth";
+      output_region.interval = region_params.count(key + "interval") ? atoi(region_params[key + "interval"].c_str()) : 1;
+      bool geo = !(region_params.count(key + "coordinates") && region_params[key + "coordinates"] == "grid");
+      bool polygon = (region_params.count(key + "shape") && region_params[key + "shape"] == "polygon");
+
+      // vertices (or rectangle corners) in grid coordinates, x = column, y = row
+      std::vector<double> xs, ys;
+      std::stringstream coords(region_params[key + "coords"]);
+      std::string first, second;
+      while (std::getline(coords, first, ',') && std::getline(coords, second, ','))
+	{
+	  if (geo)
+	    {
+	      xs.push_back((atof(first.c_str()) - xll) / LSDCatchmentModel::DX);
+	      ys.push_back(imax - (atof(second.c_str()) - yll) / LSDCatchmentModel::DY);
+	    }
+	  else
+	    {
+	      ys.push_back(atof(first.c_str()));
+	      xs.push_back(atof(second.c_str()));
+	    }
+	}
+
+      if ((polygon && xs.size() < 3) || (!polygon && xs.size() != 2))
+	{
+	  if(LSDEnsemble::rank() == 0)
+	    {
+	      std::cout << "WARNING: output region " << output_region.name << " has the wrong number of coordinates, skipping it." << std::endl;
+	    }
+	  continue;
+	}
+
+      if (polygon)
+	{
+	  output_region.polygon_x = xs;
+	  output_region.polygon_y = ys;
+	}
+      output_region.x0 = std::max(0, static_cast<int>(std::floor(*std::min_element(xs.begin(), xs.end()))));
+      output_region.x1 = std::min(static_cast<int>(jmax) - 1, static_cast<int>(std::floor(*std::max_element(xs.begin(), xs.end()))));
+      output_region.y0 = std::max(0, static_cast<int>(std::floor(*std::min_element(ys.begin(), ys.end()))));
+      output_region.y1 = std::min(static_cast<int>(imax) - 1, static_cast<int>(std::floor(*std::max_element(ys.begin(), ys.end()))));
+
+      if (output_region.x0 > output_region.x1 || output_region.y0 > output_region.y1)
+	{
+	  if(LSDEnsemble::rank() == 0)
+	    {
+	      std::cout << "WARNING: output region " << output_region.name << " lies outside the model domain, skipping it." << std::endl;
+	    }
+	  continue;
+	}
+      output_regions.push_back(output_region);
+    }
+}
+
+
+
+void LSDCatchmentModel::read_gauge_points()
+{
+  std::string FILENAME = read_path + "/" + gauge_file;
+
+  if (!does_file_exist(FILENAME))
+    {
+      std::cout << "No gauge point file found by name of: " << FILENAME
+		<< std::endl
+		<< "You must supply a correct path and filename "
+		<< "in the input parameter file" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+  std::ifstream data_in(FILENAME.c_str());
+  std::string line;
+  while (std::getline(data_in, line))
+    {
+      if (line.empty() || line[0] == '#') continue;
+
+      std::istringstream fields(line);
+      std::string name;
+      double first, second;
+      if (!(fields >> name >> first >> second)) continue;
+
+      int row, col;
+      if (gauge_coordinates == "grid")
+	{
+	  row = static_cast<int>(first);
+	  col = static_cast<int>(second);
+	}
+      else
+	{
+	  // easting/northing, measured from the lower left corner of the DEM
+	  col = static_cast<int>(std::floor((first - xll) / LSDCatchmentModel::DX));
+	  row = static_cast<int>(imax) - 1 - static_cast<int>(std::floor((second - yll) / LSDCatchmentModel::DY));
+	}
+
+      if (row < 0 || row >= static_cast<int>(imax) || col < 0 || col >= static_cast<int>(jmax))
+	{
+	  if(LSDEnsemble::rank() == 0)
+	    {
+	      std::cout << "WARNING: gauge " << name << " lies outside the model domain, skipping it." << std::endl;
+	    }
+	  continue;
+	}
+
+      gauge_names.push_back(name);
+      gauge_rows.push_back(row);
+      gauge_cols.push_back(col);
+    }
+
+  if(LSDEnsemble::rank() == 0)
+    {
+      std::cout << "Number of gauge points: " << gauge_names.size() << std::endl;
+    }
+}
+
+
+
+
+
+
+
+
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This function gets all the data from a parameter file
+//
+// Update: It also intialises the other params that are set internally
+// Some functions have been taken out of mainloop()
+//
+// DAV - this is a bit of a clunky method - perhaps replace it with the
+//   paramter ingestion method used in CHILD one day?
+//
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 void LSDCatchmentModel::initialise_variables(std::string pfname)
 {
-  if(LibGeoDecomp::MPILayer().rank() == 0)
+  if(LSDEnsemble::rank() == 0)
     {
       std::cout << "Initialising the model parameters..." << std::endl;
     }
@@ -948,7 +990,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
       dem_read_extension = value;
       dem_read_extension = RemoveControlCharactersFromEndOfString(
                               dem_read_extension);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "DEM file extension: " << dem_read_extension << std::endl;
 	} 
@@ -958,7 +1000,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
       dem_write_extension = value;
       dem_write_extension = RemoveControlCharactersFromEndOfString(
                               dem_write_extension);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "dem_write_extension: " << dem_write_extension << std::endl;
 	}
@@ -967,7 +1009,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     {
       write_path = value;
       write_path = RemoveControlCharactersFromEndOfString(write_path);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "output write path: " << write_path << std::endl;
 	}
@@ -976,7 +1018,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     {
       write_fname = value;
       write_fname = RemoveControlCharactersFromEndOfString(write_fname);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "write_fname: " << write_fname << std::endl;
 	}
@@ -985,7 +1027,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     {
       read_path = value;
       read_path = RemoveControlCharactersFromEndOfString(read_path);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "read_path: " << read_path << std::endl;
 	}
@@ -994,7 +1036,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     {
       read_fname = value;
       read_fname = RemoveControlCharactersFromEndOfString(read_fname);
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "DEM file name: " << read_fname << std::endl;
 	}
@@ -1011,7 +1053,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "hydroindex_file")
     {
       hydroindex_fname = value;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "hydroindex_file: " << hydroindex_fname << std::endl;
 	}
@@ -1019,7 +1061,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "rainfall_data_file")
     {
       rainfall_data_file = value;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "rainfall_data_file: " << rainfall_data_file << std::endl;
 	}
@@ -1028,10 +1070,27 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     //=-=-=-=-=-=-=-=-=-=-=-=-=-=
     // Numerical
     //=-=-=-=-=-=-=-=-=-=-=-=-=-=
+    else if (lower == "timeseries_save_interval")
+    {
+      output_file_save_interval = atof(value.c_str());
+      if (output_file_save_interval <= 0) output_file_save_interval = 1;
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "timeseries save interval (model minutes): " << output_file_save_interval << std::endl;
+	}
+    }
+    else if (lower == "mass_balance_interval")
+    {
+      mass_balance_interval = atoi(value.c_str());
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "mass balance reduction interval (steps): " << mass_balance_interval << std::endl;
+	}
+    }
     else if (lower == "no_of_iterations")
     {
       no_of_iterations = atoi(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "no of iterations: " << no_of_iterations << std::endl;
 	}
@@ -1051,7 +1110,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "hydro_model_only")
     {
       hydro_only = (value == "yes") ? true : false;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "run hydro model only (NO EROSION): "
 		    << hydro_only << std::endl;
@@ -1061,7 +1120,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "rainfall_data_on")
     {
       rainfall_data_on = (value == "yes") ? true : false;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "rainfall_data_on: " << rainfall_data_on << std::endl;
 	}
@@ -1070,7 +1129,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "topmodel_m_value")
     {
       M = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "topmodel m value: " << M << std::endl;
 	}
@@ -1092,11 +1151,19 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
 		  << rain_data_time_step << std::endl;
       }
     }
+    else if (lower == "rainfall_scale")
+    {
+      rainfall_scale = atof(value.c_str());
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "rainfall scale: " << rainfall_scale << std::endl;
+	}
+    }
 
     else if (lower == "spatial_var_rain")
     {
       spatially_var_rainfall = (value == "yes") ? true : false;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Spatially variable rainfall: "
 		    << spatially_var_rainfall << std::endl;
@@ -1106,8 +1173,8 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
 
     else if (lower == "in_out_difference")
     {
-      in_out_difference_allowed = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      LSDCatchmentModel::in_out_difference_allowed = atof(value.c_str());
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "in-output difference allowed (cumecs): "
 		    << in_out_difference_allowed << std::endl;
@@ -1117,7 +1184,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "hflow_threshold")
     {
       LSDCatchmentModel::hflow_threshold = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Horizontal flow threshold: "
 		    << LSDCatchmentModel::hflow_threshold << std::endl;
@@ -1127,7 +1194,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "water_depth_erosion_threshold")
     {
       LSDCatchmentModel::water_depth_erosion_threshold = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Water depth for erosion threshold: "
 		    << LSDCatchmentModel::water_depth_erosion_threshold << std::endl;
@@ -1137,7 +1204,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "slope_on_edge_cell")
     {
       LSDCatchmentModel::edgeslope = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Slope on model domain edge: "
 		    << LSDCatchmentModel::edgeslope << std::endl;
@@ -1147,7 +1214,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "evaporation_rate")
     {
       k_evap = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Evaporation rate: " << k_evap << std::endl;
 	}
@@ -1156,7 +1223,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "courant_number")
     {
       LSDCatchmentModel::courant_number = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Courant number: " << LSDCatchmentModel::courant_number << std::endl;
 	}
@@ -1165,7 +1232,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "froude_num_limit")
     {
       LSDCatchmentModel::froude_limit = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Froude number limit: " << LSDCatchmentModel::froude_limit << std::endl;
 	}
@@ -1174,15 +1241,35 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
     else if (lower == "mannings_n")
     {
       LSDCatchmentModel::mannings = atof(value.c_str());
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "mannings: " << LSDCatchmentModel::mannings << std::endl;
 	}
     }
+    else if (lower == "fast_friction")
+    {
+      LSDCatchmentModel::fast_friction = (value == "yes") ? true : false;
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "fast friction kernel: " << LSDCatchmentModel::fast_friction << std::endl;
+	}
+    }
+    else if (lower == "water_input_depth")
+    {
+      LSDCatchmentModel::water_input_depth = atof(value.c_str());
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "water input depth per step: " << LSDCatchmentModel::water_input_depth << std::endl;
+	}
+    }
+    else if (lower == "friction_validation")
+    {
+      friction_validation = (value == "yes") ? true : false;
+    }
     else if (lower == "spatially_complex_rainfall_on")
     {
       spatially_complex_rainfall = (value == "yes") ? true : false;
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Spatially complex rainfall option: "
 		    << spatially_complex_rainfall << std::endl;
@@ -1202,6 +1289,42 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
       {
 	LSDCatchmentModel::simulator = value;
       }
+    else if (lower == "nest_dem")
+      {
+	nest_dems.push_back(value);
+      }
+
+    // Ensemble mode
+    else if (lower == "ensemble_table")
+      {
+	ensemble_table = (value == "none") ? "" : value;
+      }
+    else if (lower == "ensemble_ranks_per_member")
+      {
+	ensemble_ranks_per_member = atoi(value.c_str());
+      }
+    else if (lower == "ensemble_lanes")
+      {
+	ensemble_lanes = atoi(value.c_str());
+      }
+    else if (lower == "ensemble_raster_interval")
+      {
+	ensemble_raster_interval = atoi(value.c_str());
+      }
+
+    // Task farm mode
+    else if (lower == "task_farm_manifest")
+      {
+	task_farm_manifest = (value == "none") ? "" : value;
+      }
+    else if (lower == "task_farm_ranks_per_group")
+      {
+	task_farm_ranks_per_group = atoi(value.c_str());
+      }
+    else if (lower == "task_farm_serial_cells")
+      {
+	task_farm_serial_cells = atol(value.c_str());
+      }
     
     
     // Visualisation
@@ -1238,11 +1361,282 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
 	LSDCatchmentModel::water_depth_visit_interval = atoi(value.c_str());
       }
 
+    // Downsampled previews
+    else if (lower == "elevation_preview")
+      {
+	LSDCatchmentModel::elevation_preview = (value == "yes") ? true : false;
+      }
+    else if (lower == "elevation_preview_interval")
+      {
+	LSDCatchmentModel::elevation_preview_interval = atoi(value.c_str());
+      }
+    else if (lower == "water_depth_preview")
+      {
+	LSDCatchmentModel::water_depth_preview = (value == "yes") ? true : false;
+      }
+    else if (lower == "water_depth_preview_interval")
+      {
+	LSDCatchmentModel::water_depth_preview_interval = atoi(value.c_str());
+      }
+    else if (lower == "water_depth_preview_max")
+      {
+	LSDCatchmentModel::water_depth_preview_max = atof(value.c_str());
+      }
+    else if (lower == "preview_block_size")
+      {
+	LSDCatchmentModel::preview_block_size = atoi(value.c_str());
+      }
+    else if (lower == "preview_block_method")
+      {
+	LSDCatchmentModel::preview_block_method = value;
+      }
+    else if (lower == "preview_compression")
+      {
+	LSDCatchmentModel::preview_compression = (value == "yes") ? true : false;
+      }
+
+    // Derived output fields
+    else if (lower == "derived_fields")
+      {
+	LSDCatchmentModel::derived_fields = value;
+      }
+    else if (lower == "derived_fields_interval")
+      {
+	LSDCatchmentModel::derived_fields_interval = atoi(value.c_str());
+      }
+
+    // Region of interest outputs
+    else if (lower == "output_region")
+      {
+	std::string name = value;
+	for (unsigned int i=0; i<name.length(); ++i) name[i] = std::tolower(name[i]);
+	output_region_names.push_back(name);
+      }
+    else if (lower.compare(0, 7, "region_") == 0)
+      {
+	region_params[lower] = value;
+      }
+
+    // Checkpoint/restart
+    else if (lower == "checkpoint_interval")
+      {
+	checkpoint_interval = atof(value.c_str());
+      }
+    else if (lower == "checkpoint_wallclock_interval")
+      {
+	checkpoint_wallclock_interval = atof(value.c_str());
+      }
+    else if (lower == "checkpoint_check_period")
+      {
+	checkpoint_check_period = atoi(value.c_str());
+      }
+    else if (lower == "checkpoint_path")
+      {
+	checkpoint_path = value;
+      }
+    else if (lower == "restart_from_checkpoint")
+      {
+	restart_from_checkpoint = (value == "yes") ? true : false;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "restart from checkpoint: " << restart_from_checkpoint << std::endl;
+	  }
+      }
+
+    // Warm start from a cached spin-up
+    else if (lower == "spinup_duration")
+      {
+	spinup_duration = atof(value.c_str());
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "spin-up duration (model minutes): " << spinup_duration << std::endl;
+	  }
+      }
+    else if (lower == "spinup_cache_path")
+      {
+	spinup_cache_path = value;
+      }
+    else if (lower == "coarse_spinup_factor")
+      {
+	coarse_spinup_factor = atoi(value.c_str());
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "coarse spin-up factor: " << coarse_spinup_factor << std::endl;
+	  }
+      }
+    else if (lower == "coarse_spinup_duration")
+      {
+	coarse_spinup_duration = atof(value.c_str());
+      }
+
+    // Steady state monitor
+    else if (lower == "steady_state_interval")
+      {
+	steady_state_interval = atoi(value.c_str());
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "steady state check interval (steps): " << steady_state_interval << std::endl;
+	  }
+      }
+    else if (lower == "steady_state_depth_tolerance")
+      {
+	steady_state_depth_tolerance = atof(value.c_str());
+      }
+    else if (lower == "steady_state_discharge_tolerance")
+      {
+	steady_state_discharge_tolerance = atof(value.c_str());
+      }
+    else if (lower == "steady_state_max_ratio")
+      {
+	steady_state_max_ratio = atof(value.c_str());
+      }
+    else if (lower == "steady_state_checks")
+      {
+	steady_state_checks = atoi(value.c_str());
+      }
+    else if (lower == "steady_state_action")
+      {
+	steady_state_action = value;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "at steady state: " << steady_state_action << std::endl;
+	  }
+      }
+    else if (lower == "steady_state_output_factor")
+      {
+	steady_state_output_factor = atof(value.c_str());
+      }
+
+    // Dry weather fast-forward
+    else if (lower == "dry_weather_skip")
+      {
+	dry_weather_skip = (value == "yes") ? true : false;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "skip dry weather: " << dry_weather_skip << std::endl;
+	  }
+      }
+    else if (lower == "dry_weather_wet_cells")
+      {
+	dry_weather_wet_cells = atof(value.c_str());
+      }
+
+    // Run time profiling
+    else if (lower == "profile_output")
+      {
+	profile_output = (value == "yes") ? true : false;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "run time profile: " << profile_output << std::endl;
+	  }
+      }
+    else if (lower == "profile_sample_interval")
+      {
+	profile_sample_interval = atoi(value.c_str());
+      }
+    else if (lower == "profile_file")
+      {
+	profile_file = value;
+      }
+    else if (lower == "profile_hardware_counters")
+      {
+	profile_hardware_counters = (value == "yes") ? true : false;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "hardware counters: " << profile_hardware_counters << std::endl;
+	  }
+      }
+    else if (lower == "profile_counters_file")
+      {
+	profile_counters_file = value;
+      }
+    else if (lower == "comm_matrix_output")
+      {
+	comm_matrix_output = (value == "yes") ? true : false;
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "communication matrix: " << comm_matrix_output << std::endl;
+	  }
+      }
+    else if (lower == "comm_matrix_prefix")
+      {
+	comm_matrix_prefix = value;
+      }
+
+    // Stability monitor and rollback
+    else if (lower == "stability_check_interval")
+      {
+	stability_check_interval = atoi(value.c_str());
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "stability check interval (steps): " << stability_check_interval << std::endl;
+	  }
+      }
+    else if (lower == "stability_snapshot_interval")
+      {
+	stability_snapshot_interval = atoi(value.c_str());
+      }
+    else if (lower == "stability_snapshots")
+      {
+	stability_snapshots = atoi(value.c_str());
+      }
+    else if (lower == "stability_max_velocity")
+      {
+	stability_max_velocity = atof(value.c_str());
+      }
+    else if (lower == "stability_depth_tolerance")
+      {
+	stability_depth_tolerance = atof(value.c_str());
+      }
+    else if (lower == "stability_courant_factor")
+      {
+	stability_courant_factor = atof(value.c_str());
+      }
+    else if (lower == "stability_min_courant")
+      {
+	stability_min_courant = atof(value.c_str());
+      }
+
+    // Gauge point hydrographs
+    else if (lower == "gauge_file")
+      {
+	gauge_file = value;
+	gauge_output = !gauge_file.empty();
+	if(LSDEnsemble::rank() == 0)
+	  {
+	    std::cout << "gauge_file: " << gauge_file << std::endl;
+	  }
+      }
+    else if (lower == "gauge_coordinates")
+      {
+	gauge_coordinates = value;
+      }
+    else if (lower == "gauge_save_interval")
+      {
+	gauge_save_interval = atof(value.c_str());
+      }
+    else if (lower == "gauge_window_radius")
+      {
+	gauge_window_radius = atoi(value.c_str());
+      }
+    else if (lower == "gauge_output_format")
+      {
+	gauge_output_format = value;
+      }
+    else if (lower == "gauge_fname")
+      {
+	gauge_fname = value;
+      }
+    else if (lower == "gauge_buffer_rows")
+      {
+	gauge_buffer_rows = atoi(value.c_str());
+      }
+
 
     
   }
 
-  if(LibGeoDecomp::MPILayer().rank() == 0)
+  if(LSDEnsemble::rank() == 0)
     {
       std::cout << "No other parameters found, parameter ingestion complete."
 		<< std::endl;
@@ -1253,7 +1647,7 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
   
   if (spatially_var_rainfall == false)
     {
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
 	  std::cout << "Making sure no of rain cells is set to 1, "
 		    << "for uniform rainfall input.."
@@ -1270,106 +1664,425 @@ void LSDCatchmentModel::initialise_variables(std::string pfname)
 
 
 
+// Sets up the simulator chosen by the simulator parameter
+LibGeoDecomp::DistributedSimulator<Cell> *make_simulator(LSDCatchmentModel *catchment, CellInitializer *initialiser)
+{
+  LibGeoDecomp::DistributedSimulator<Cell> *sim = 0;
+  bool part = (LSDEnsemble::communicator() != MPI_COMM_WORLD);
+  if(catchment->simulator == "striping" && part)
+    {
+      // the striping simulator always spans MPI_COMM_WORLD
+      if(LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "simulator: striping cannot run an ensemble member or a task farm catchment, using hipar" << std::endl;
+	}
+    }
+  if(catchment->simulator == "striping" && !part)
+    {
+      sim = new LibGeoDecomp::StripingSimulator<Cell>(initialiser, LSDEnsemble::rank()? 0 : new LibGeoDecomp::NoOpBalancer(), 1);
+    }
+  else if(catchment->simulator == "hipar" || catchment->simulator == "striping")
+    {
+      sim = new LibGeoDecomp::HiParSimulator<Cell, LibGeoDecomp::RecursiveBisectionPartition<2> >(initialiser, LSDEnsemble::rank() ? 0 : new LibGeoDecomp::NoOpBalancer(), 1, 1,
+														  LSDEnsemble::communicator());
+    }
+  return sim;
+}
+
+
+
+void LSDCatchmentModel::run_coarse_spinup()
+{
+  // keep the full resolution grid aside while the model runs on the coarse one
+  int fine_imax = imax;
+  int fine_jmax = jmax;
+  double fine_DX = LSDCatchmentModel::DX;
+  TNT::Array2D<double> fine_elev = elev;
+  TNT::Array2D<double> fine_water_depth = water_depth;
+
+  elev = block_average(fine_elev, coarse_spinup_factor, LSDCatchmentModel::no_data_value);
+  water_depth = block_average(fine_water_depth, coarse_spinup_factor, LSDCatchmentModel::no_data_value);
+  imax = elev.dim1();
+  jmax = elev.dim2();
+  TNT::Array2D<double> fine_qx = initial_qx;
+  TNT::Array2D<double> fine_qy = initial_qy;
+  initial_qx = TNT::Array2D<double> (imax, jmax, 0.0);
+  initial_qy = TNT::Array2D<double> (imax, jmax, 0.0);
+  LSDCatchmentModel::DX = LSDCatchmentModel::DY = fine_DX * coarse_spinup_factor;
+
+  if (LSDEnsemble::rank() == 0)
+    {
+      std::cout << "Coarse spin-up on a " << jmax << " x " << imax << " grid until model time "
+		<< coarse_spinup_duration << std::endl;
+    }
+
+  std::vector<double> coarse_state;
+  LibGeoDecomp::DistributedSimulator<Cell> *sim = make_simulator(this, new CellInitializer(this));
+  sim->addSteerer(new CoarseSpinupSteerer(this, coarse_spinup_duration, &coarse_state));
+  sim->addSteerer(new ModelClockSteerer(this));
+  sim->run();
+  delete sim;
+
+  int coarse_rows = imax;
+  int coarse_cols = jmax;
+  imax = fine_imax;
+  jmax = fine_jmax;
+  LSDCatchmentModel::DX = LSDCatchmentModel::DY = fine_DX;
+  elev = fine_elev;
+  water_depth = fine_water_depth;
+  initial_qx = fine_qx;
+  initial_qy = fine_qy;
+  prolong_spinup(coarse_state, coarse_rows, coarse_cols, coarse_spinup_factor, elev, LSDCatchmentModel::no_data_value,
+		 water_depth, initial_qx, initial_qy);
+
+  // set_global_timefactor() only ever raises the timestep, so bring it down to the fine grid's
+  LSDCatchmentModel::time_factor = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * std::max(LSDCatchmentModel::maxdepth, 0.1)));
+
+  if (LSDEnsemble::rank() == 0)
+    {
+      std::cout << "Coarse spin-up finished at model time " << cycle << std::endl;
+      // the coarse run has the same step limit as the full one
+      if (cycle < coarse_spinup_duration)
+	{
+	  std::cout << "Coarse spin-up stopped by no_of_iterations (" << no_of_iterations << " steps) before coarse_spinup_duration ("
+		    << coarse_spinup_duration << "), raise no_of_iterations for a complete spin-up" << std::endl;
+	}
+    }
+}
+
+
+
 void runSimulation(std::string pfname)
 {
   // Read model params on each rank (can replace with MPI_Bcast if overhead ever becomes too large)
   LSDCatchmentModel *catchment = new LSDCatchmentModel(pfname); 
-  
-  // Read model domain extent from DEM file on rank 0
-  if (LibGeoDecomp::MPILayer().rank() == 0)
+
+  // Task farm mode: the catchments of the manifest run on groups of ranks or single ranks
+  if (!catchment->task_farm_manifest.empty())
+    {
+      LSDTaskFarm::run(catchment);
+      return;
+    }
+
+  // Ensemble mode: the members run on groups of ranks and share the terrain read here
+  if (!catchment->ensemble_table.empty())
     {
-      catchment->initialise_model_domain_extents();
+      catchment->load_terrain();
+      LSDEnsemble::run(pfname, catchment);
+      return;
     }
   
-  // Broadcast model domain extent from rank 0 to all other ranks to allow each to initialise their arrays
-  MPI_Bcast(&catchment->imax, 1, MPI_INT, 0, MPI_COMM_WORLD);
-  MPI_Bcast(&catchment->jmax, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  // The shared-memory engine needs no decomposition, so it runs on rank 0 alone
+  if (catchment->simulator == "openmp")
+    {
+      if (LSDEnsemble::rank() == 0)
+	{
+	  if (LSDEnsemble::size() > 1)
+	    {
+	      std::cout << "The openmp simulator runs on rank 0 only, the other ranks are idle" << std::endl;
+	    }
+	  runSharedMemorySimulation(pfname);
+	}
+      LSDEnsemble::barrier();
+      return;
+    }
+
+  catchment->load_terrain();
+  runCatchment(catchment);
+}
+
+
+
+void runCatchment(LSDCatchmentModel *catchment)
+{
+  // Nests need grids of their own, which the LibGeoDecomp simulators do not have
+  if (!catchment->nest_dems.empty() && LSDEnsemble::rank() == 0)
+    {
+      std::cout << "nest_dem: nests are run by the openmp simulator only, running the catchment DEM alone" << std::endl;
+    }
+
+  // The skip decays the TOPMODEL runoff of the rainfall input, which the
+  // kernel does not read: its only water input is water_input_depth
+  if (catchment->dry_weather_skip)
+    {
+      if (LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "dry_weather_skip: not effective until the rainfall input is ported to the kernel,"
+		    << " whose only water input is water_input_depth; remove the line to run" << std::endl;
+	}
+      exit(EXIT_FAILURE);
+    }
+
+  // Validation mode: compare the friction kernels at the time step of this DEM, then stop
+  if (catchment->friction_validation)
+    {
+      if (LSDEnsemble::rank() == 0)
+	{
+	  double time_step = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * LSDCatchmentModel::maxdepth));
+	  LSDFriction::report(LSDFriction::validate(Cell::gravity, LSDCatchmentModel::mannings, LSDCatchmentModel::froude_limit,
+						    LSDCatchmentModel::hflow_threshold, LSDCatchmentModel::maxdepth, time_step));
+	}
+      return;
+    }
+
   catchment->initialise_arrays();
-  
-  double elevation[catchment->imax][catchment->jmax];
-  
-  // Load terrain elevation data from DEM file on rank 0
-  if (LibGeoDecomp::MPILayer().rank() == 0)
+  if (catchment->rainfall_data_on)
     {
-      catchment->load_data();
+      catchment->load_rainfall_data();
+    }
 
-      // Convert elev to standard 2D array of doubles
-      // This is to avoid having to define the MPI Typemap for a TNT::Array2D
-      for(int i=0; i<catchment->imax; i++)
+  // Gauge points are few, so each rank resolves them itself from the broadcast DEM header
+  if (catchment->gauge_output)
+    {
+      catchment->read_gauge_points();
+    }
+  catchment->resolve_output_regions();
+  
+  // Resume from the latest complete checkpoint, if asked to and there is one
+  if (catchment->checkpoint_path.empty()) catchment->checkpoint_path = catchment->write_path + "/checkpoints";
+  CheckpointReader *restart = 0;
+  if (catchment->restart_from_checkpoint)
+    {
+      restart = new CheckpointReader(catchment->checkpoint_path);
+      if (restart->found())
 	{
-	  for(int j=0; j<catchment->jmax; j++)
+	  restart->restore_counters(catchment);
+	  if (LSDEnsemble::rank() == 0)
 	    {
-	      elevation[i][j] = catchment->elev[i][j];
+	      std::cout << "Restarting from the checkpoint at step " << restart->get_step() << std::endl;
+	      catchment->truncate_outputs();
 	    }
 	}
+      else
+	{
+	  if (LSDEnsemble::rank() == 0)
+	    {
+	      std::cout << "No complete checkpoint found in " << catchment->checkpoint_path << ", starting from scratch." << std::endl;
+	    }
+	  delete restart;
+	  restart = 0;
+	}
     }
-  
-  // Broadcast terrain elevation data to all processes
-  int bufferSize = catchment->imax * catchment->jmax;
-  MPI_Bcast(&elevation, bufferSize, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-  
-  // Convert elevation back to TNT::Array2D and store in catchment object
-  for(int i=0; i<catchment->imax; i++)
+
+  // Otherwise skip the spin-up if one with the same terrain, parameters and
+  // duration has been cached
+  std::string spinup_path;
+  if (catchment->spinup_duration > 0)
     {
-      for(int j=0; j<catchment->jmax; j++)
+      char key[17] = "";
+      if (LSDEnsemble::rank() == 0)
+	{
+	  std::string hash = catchment->spinup_cache_key();
+	  std::copy(hash.begin(), hash.end(), key);
+	}
+      MPI_Bcast(key, 17, MPI_CHAR, 0, LSDEnsemble::communicator());
+      spinup_path = catchment->spinup_cache_path + "/" + key;
+
+      if (!restart)
 	{
-	  catchment->elev[i][j] = elevation[i][j];
+	  restart = new CheckpointReader(spinup_path);
+	  if (restart->found())
+	    {
+	      restart->restore_counters(catchment);
+	      catchment->reset_outputs();
+	      if (LSDEnsemble::rank() == 0)
+		{
+		  std::cout << "Warm start from the cached spin-up " << key << ", model time " << catchment->get_cycle() << std::endl;
+		}
+	    }
+	  else
+	    {
+	      delete restart;
+	      restart = 0;
+	    }
 	}
     }
-  
-  
+
+  // Spin up on a coarser grid first, unless the state was restored above
+  if (!restart && catchment->coarse_spinup_factor > 1 && catchment->get_cycle() < catchment->coarse_spinup_duration)
+    {
+      LSDMassBalance::initialise();
+      catchment->run_coarse_spinup();
+    }
+
   // Initialise grid (each rank initialises its own subgrid)
-  CellInitializer *initialiser = new CellInitializer(catchment);
+  CellInitializer *initialiser = new CellInitializer(catchment, restart);
 
   // Set up simulator
-  LibGeoDecomp::DistributedSimulator<Cell> *sim = 0;
-  if(catchment->simulator == "striping")
+  LibGeoDecomp::DistributedSimulator<Cell> *sim = make_simulator(catchment, initialiser);
+  
+  // Time the steps, and every writer and steerer added below
+  LSDProfile::enabled = catchment->profile_output;
+  if(catchment->profile_output)
     {
-      sim = new LibGeoDecomp::StripingSimulator<Cell>(initialiser, LibGeoDecomp::MPILayer().rank()? 0 : new LibGeoDecomp::NoOpBalancer(), 1);
+      LSDProfile::initialise();
+      sim->addSteerer(new ProfileSteerer(catchment->profile_sample_interval));
     }
-  else if(catchment->simulator == "hipar")
+
+  // Count cycles, instructions and cache misses across the sampled sweeps;
+  // the writer stopping the counters has to come before all other writers
+  bool hardware_counters = catchment->profile_hardware_counters && LSDHardwareCounters::open();
+  if(catchment->profile_hardware_counters && !hardware_counters)
     {
-      sim = new LibGeoDecomp::HiParSimulator<Cell, LibGeoDecomp::RecursiveBisectionPartition<2> >(initialiser, LibGeoDecomp::MPILayer().rank() ? 0 : new LibGeoDecomp::NoOpBalancer(), 1, 1);
+      if(LSDEnsemble::rank() == 0) std::cout << "No hardware counters available, check /proc/sys/kernel/perf_event_paranoid" << std::endl;
+      LSDHardwareCounters::close();
     }
-  
-  // Set up visualisation outputs  
+  if(hardware_counters)
+    {
+      sim->addWriter(new HardwareCounterWriter());
+    }
+
+  // Record the point-to-point traffic between the ranks during the steps
+  if(catchment->comm_matrix_output)
+    {
+      LSDCommMatrix::initialise();
+      sim->addSteerer(new CommMatrixSteerer());
+    }
+
+  // Set up visualisation outputs, in the model's directory for ensembles and task farms
+  std::string image_path = (LSDEnsemble::communicator() == MPI_COMM_WORLD) ? "" : catchment->write_path + "/";
   LibGeoDecomp::PPMWriter<Cell> *elevationPPMWriter = 0;
   LibGeoDecomp::PPMWriter<Cell> *water_depthPPMWriter = 0;
   if(catchment->elevation_ppm)
     {
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
-	  system("mkdir -p elevation/ppm");
-	  elevationPPMWriter = new LibGeoDecomp::PPMWriter<Cell>(&Cell::elevation, 0.0, 255.0, "elevation/ppm/elevation", \
+	  system(("mkdir -p " + image_path + "elevation/ppm").c_str());
+	  elevationPPMWriter = new LibGeoDecomp::PPMWriter<Cell>(&Cell::elevation, 0.0, 255.0, image_path + "elevation/ppm/elevation", \
 								 catchment->elevation_ppm_interval, LibGeoDecomp::Coord<2>(catchment->pixels_per_cell, catchment->pixels_per_cell));
 	}
-      LibGeoDecomp::CollectingWriter<Cell> *elevationPPMCollectingWriter = new LibGeoDecomp::CollectingWriter<Cell>(elevationPPMWriter);
-      sim->addWriter(elevationPPMCollectingWriter);
+      LibGeoDecomp::CollectingWriter<Cell> *elevationPPMCollectingWriter = new LibGeoDecomp::CollectingWriter<Cell>(elevationPPMWriter, 0, LSDEnsemble::communicator());
+      sim->addWriter(LSDProfile::timed(elevationPPMCollectingWriter, "writer:elevation_ppm"));
     }
   if(catchment->water_depth_ppm)
     {
-      if(LibGeoDecomp::MPILayer().rank() == 0)
+      if(LSDEnsemble::rank() == 0)
 	{
-	  system("mkdir -p water_depth/ppm");
-	  water_depthPPMWriter = new LibGeoDecomp::PPMWriter<Cell>(&Cell::water_depth, 0.0, 1.0, "water_depth/ppm/water_depth", \
+	  system(("mkdir -p " + image_path + "water_depth/ppm").c_str());
+	  water_depthPPMWriter = new LibGeoDecomp::PPMWriter<Cell>(&Cell::water_depth, 0.0, 1.0, image_path + "water_depth/ppm/water_depth", \
 								   catchment->water_depth_ppm_interval, LibGeoDecomp::Coord<2>(catchment->pixels_per_cell, catchment->pixels_per_cell));
 	}
-      LibGeoDecomp::CollectingWriter<Cell> *water_depthPPMCollectingWriter = new LibGeoDecomp::CollectingWriter<Cell>(water_depthPPMWriter);
-      sim->addWriter(water_depthPPMCollectingWriter);
+      LibGeoDecomp::CollectingWriter<Cell> *water_depthPPMCollectingWriter = new LibGeoDecomp::CollectingWriter<Cell>(water_depthPPMWriter, 0, LSDEnsemble::communicator());
+      sim->addWriter(LSDProfile::timed(water_depthPPMCollectingWriter, "writer:water_depth_ppm"));
     }
   if(catchment->water_depth_bov)
     {
-      system("mkdir -p water_depth/bov");
-      sim->addWriter(new LibGeoDecomp::BOVWriter<Cell>(LibGeoDecomp::Selector<Cell>(&Cell::water_depth, "water_depth"), "water_depth/bov/water_depth", \
-						      catchment->water_depth_bov_interval));
+      system(("mkdir -p " + image_path + "water_depth/bov").c_str());
+      sim->addWriter(LSDProfile::timed(new LibGeoDecomp::BOVWriter<Cell>(LibGeoDecomp::Selector<Cell>(&Cell::water_depth, "water_depth"), image_path + "water_depth/bov/water_depth", \
+						      catchment->water_depth_bov_interval, LibGeoDecomp::Coord<2>(), LSDEnsemble::communicator()), "writer:water_depth_bov"));
+    }
+
+  if(catchment->elevation_preview)
+    {
+      if(LSDEnsemble::rank() == 0){ system(("mkdir -p " + image_path + "elevation/preview").c_str()); }
+      sim->addWriter(LSDProfile::timed(new PreviewWriter(&Cell::elevation, 0.0, 255.0, image_path + "elevation/preview/elevation", catchment->elevation_preview_interval, \
+				       catchment->preview_block_size, catchment->preview_block_method == "max", catchment->preview_compression), "writer:elevation_preview"));
+    }
+  if(catchment->water_depth_preview)
+    {
+      if(LSDEnsemble::rank() == 0){ system(("mkdir -p " + image_path + "water_depth/preview").c_str()); }
+      sim->addWriter(LSDProfile::timed(new PreviewWriter(&Cell::water_depth, 0.0, catchment->water_depth_preview_max, image_path + "water_depth/preview/water_depth", \
+				       catchment->water_depth_preview_interval, catchment->preview_block_size, \
+				       catchment->preview_block_method == "max", catchment->preview_compression), "writer:water_depth_preview"));
+    }
+
+  if(!catchment->derived_fields.empty())
+    {
+      system(("mkdir -p " + catchment->write_path + "/derived").c_str());
+      sim->addWriter(LSDProfile::timed(new DerivedFieldWriter(catchment, catchment->derived_fields, catchment->write_path + "/derived/derived", \
+					    catchment->derived_fields_interval), "writer:derived_fields"));
+    }
+
+  for (std::size_t r = 0; r < catchment->output_regions.size(); r++)
+    {
+      std::string region_path = catchment->write_path + "/regions/" + catchment->output_regions[r].name;
+      if(LSDEnsemble::rank() == 0){ system(("mkdir -p " + region_path).c_str()); }
+      sim->addWriter(LSDProfile::timed(new RegionWriter(catchment, catchment->output_regions[r], region_path + "/" + catchment->output_regions[r].name), "writer:region_" + catchment->output_regions[r].name));
+    }
+
+  if(catchment->gauge_output)
+    {
+      sim->addWriter(LSDProfile::timed(new GaugeWriter(catchment, catchment->write_path + "/" + catchment->gauge_fname), "writer:gauges"));
+    }
+
+  if(catchment->checkpoint_interval > 0 || catchment->checkpoint_wallclock_interval > 0)
+    {
+      sim->addWriter(LSDProfile::timed(new CheckpointWriter(catchment, catchment->checkpoint_path, catchment->checkpoint_check_period, \
+					  catchment->checkpoint_interval, catchment->checkpoint_wallclock_interval), "writer:checkpoint"));
+    }
+
+  // Cache the state at the end of the spin-up for later runs
+  if(catchment->spinup_duration > 0 && (!restart || catchment->get_cycle() < catchment->spinup_duration))
+    {
+      CheckpointWriter *spinup_writer = new CheckpointWriter(catchment, spinup_path, 1, 0, 0);
+      spinup_writer->write_once_at(catchment->spinup_duration);
+      sim->addWriter(LSDProfile::timed(spinup_writer, "writer:spinup_cache"));
+    }
+
+  // Check for instability and roll back if need be, before the water budget
+  // and the model clock advance for the step
+  if(catchment->stability_check_interval > 0)
+    {
+      LSDStability::initialise();
+      LSDStability::max_velocity = catchment->stability_max_velocity;
+      LSDStability::depth_tolerance = catchment->stability_depth_tolerance;
+      sim->addSteerer(LSDProfile::timed(new StabilitySteerer(catchment, catchment->stability_check_interval, catchment->stability_snapshot_interval, \
+					   catchment->stability_snapshots, catchment->stability_courant_factor, catchment->stability_min_courant), "steerer:stability"));
+    }
+
+  // End the run, or thin out the outputs, once the catchment stops changing
+  if(catchment->steady_state_interval > 0)
+    {
+      LSDConvergence::initialise();
+      sim->addSteerer(LSDProfile::timed(new ConvergenceSteerer(catchment, catchment->steady_state_interval, catchment->steady_state_depth_tolerance, \
+					     catchment->steady_state_discharge_tolerance, catchment->steady_state_max_ratio, \
+					     catchment->steady_state_checks, catchment->steady_state_action == "stop", \
+					     catchment->steady_state_output_factor), "steerer:convergence"));
+    }
+
+  // Reduce the water budget across ranks every mass_balance_interval steps
+  LSDMassBalance::initialise();
+  sim->addSteerer(LSDProfile::timed(new MassBalanceSteerer(catchment, catchment->mass_balance_interval), "steerer:mass_balance"));
+
+  // Advance model time once per step, ahead of the cell updates
+  sim->addSteerer(LSDProfile::timed(new ModelClockSteerer(catchment), "steerer:model_clock"));
+
+  // Start the counters after all other steerers
+  if(hardware_counters)
+    {
+      sim->addSteerer(new HardwareCounterSteerer(catchment->profile_sample_interval));
     }
 
   // Write out simulation progress
-  if (LibGeoDecomp::MPILayer().rank() == 0){ sim->addWriter(new LibGeoDecomp::TracingWriter<Cell>(1, catchment->no_of_iterations)); }
+  if (LSDEnsemble::rank() == 0){ sim->addWriter(LSDProfile::timed(new LibGeoDecomp::TracingWriter<Cell>(1, catchment->no_of_iterations), "writer:tracing")); }
 
-  if( LibGeoDecomp::MPILayer().rank() == 0){ std::cout << "\nStarting parallel simulation... \n\n"; }
+  if( LSDEnsemble::rank() == 0){ std::cout << "\nStarting parallel simulation... \n\n"; }
+  double run_start = LSDProfile::now();
   sim->run();
-      
-  LibGeoDecomp::MPILayer().barrier(); 
+  LSDEnsemble::barrier();
+  if( LSDEnsemble::rank() == 0)
+    {
+      std::cout << "Simulation wall time: " << LSDProfile::now() - run_start << " seconds" << std::endl;
+    }
+
+  if(catchment->profile_output)
+    {
+      std::string profile_file = catchment->profile_file.empty() ? catchment->write_path + "/profile.csv" : catchment->profile_file;
+      LSDProfile::write_report(profile_file, ProfileSteerer::steps, ProfileSteerer::sampled_steps);
+    }
+  if(hardware_counters)
+    {
+      LSDHardwareCounters::write_report(catchment->profile_counters_file.empty() ? catchment->write_path + "/profile_counters.csv" : catchment->profile_counters_file);
+      LSDHardwareCounters::close();
+    }
+  if(catchment->comm_matrix_output)
+    {
+      LSDCommMatrix::recording = false;
+      LSDCommMatrix::write_report(catchment->comm_matrix_prefix.empty() ? catchment->write_path + "/comm" : catchment->comm_matrix_prefix);
+    }
+
+  // the grid goes before the next ensemble member is set up
+  delete sim;
+  LSDEnsemble::barrier(); 
 }
 
@@ -0,0 +1,289 @@
+// LSDCheckpoint.cpp
+
+// Checkpoint/restart of the catchment model
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+#include "boostserialization.h"
+#include "catchmentmodel/LSDCheckpoint.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDUtils.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+using namespace LSDUtils;
+
+
+
+static std::string checkpoint_directory(const std::string& path, unsigned step)
+{
+  std::stringstream directory;
+  directory << path << "/checkpoint_" << std::setfill('0') << std::setw(8) << step;
+  return directory.str();
+}
+
+static std::string rank_filename(const std::string& directory, int rank)
+{
+  std::stringstream filename;
+  filename << directory << "/rank_" << std::setfill('0') << std::setw(5) << rank << ".bin";
+  return filename.str();
+}
+
+
+
+
+
+CheckpointWriter::CheckpointWriter(LSDCatchmentModel *catchment_in, const std::string& path_in, unsigned period,
+				   double model_interval_in, double wallclock_interval_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, CheckpointWriter>("checkpoint", period),
+  catchment(catchment_in),
+  path(path_in),
+  single(false),
+  done(false),
+  model_interval(model_interval_in),
+  wallclock_interval(wallclock_interval_in),
+  next_model_time(catchment_in->get_cycle() + model_interval_in),
+  last_wallclock(MPI_Wtime()),
+  checkpoint_due(false)
+{}
+
+
+
+void CheckpointWriter::write_once_at(double model_time)
+{
+  single = true;
+  model_interval = 1;
+  wallclock_interval = 0;
+  next_model_time = model_time;
+}
+
+
+
+void CheckpointWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  // a finished run needs no checkpoint
+  if (event == LibGeoDecomp::WRITER_ALL_DONE || done) return;
+
+  if (checkpoint_due)
+    {
+      for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+	{
+	  streaks.push_back(i->origin.y());
+	  streaks.push_back(i->origin.x());
+	  streaks.push_back(i->endX - i->origin.x());
+	  for (int x = i->origin.x(); x < i->endX; x++)
+	    {
+	      cells.push_back(grid.get(CoordType(x, i->origin.y())));
+	    }
+	}
+    }
+
+  if (!lastCall) return;
+
+  if (checkpoint_due)
+    {
+      write_checkpoint(step);
+      done = single;
+      while (next_model_time <= catchment->get_cycle() && model_interval > 0) next_model_time += model_interval;
+      last_wallclock = MPI_Wtime();
+    }
+
+  // decide for the next check, so every rank keeps its cells of that step
+  int due = 0;
+  if (rank == 0)
+    {
+      due = ((model_interval > 0 && catchment->get_cycle() >= next_model_time) ||
+	     (wallclock_interval > 0 && MPI_Wtime() - last_wallclock >= wallclock_interval));
+    }
+  MPI_Bcast(&due, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  checkpoint_due = due;
+}
+
+
+
+void CheckpointWriter::write_checkpoint(unsigned step)
+{
+  int rank = LSDEnsemble::rank();
+  int size = LSDEnsemble::size();
+  std::string directory = checkpoint_directory(path, step);
+
+  // Written to a directory of this writer and renamed when complete, so
+  // ensemble members or task farm groups caching the same spin-up do not
+  // mix their rank files. The name does not start with "checkpoint_", so
+  // CheckpointReader never sees a partial checkpoint.
+  int writer[2] = {LibGeoDecomp::MPILayer(MPI_COMM_WORLD).rank(), int(getpid())};
+  MPI_Bcast(writer, 2, MPI_INT, 0, LSDEnsemble::communicator());
+  std::stringstream scratch_name;
+  scratch_name << path << "/.writing_" << writer[0] << "_" << writer[1] << "_" << step;
+  std::string scratch = scratch_name.str();
+
+  if (rank == 0) system(("mkdir -p " + scratch).c_str());
+  MPI_Barrier(LSDEnsemble::communicator());
+
+  // bounding box of this rank's cells, so a restart only opens the files it needs
+  int box[4] = {0, 0, 0, 0};
+  if (!streaks.empty())
+    {
+      int x0 = streaks[1], y0 = streaks[0], x1 = streaks[1] + streaks[2], y1 = streaks[0] + 1;
+      for (std::size_t s = 0; s < streaks.size(); s += 3)
+	{
+	  y0 = std::min(y0, streaks[s]);
+	  y1 = std::max(y1, streaks[s] + 1);
+	  x0 = std::min(x0, streaks[s + 1]);
+	  x1 = std::max(x1, streaks[s + 1] + streaks[s + 2]);
+	}
+      box[0] = x0; box[1] = y0; box[2] = x1 - x0; box[3] = y1 - y0;
+    }
+
+  {
+    std::ofstream out(rank_filename(scratch, rank).c_str(), std::ios::binary);
+    boost::archive::binary_oarchive archive(out);
+    std::size_t num_streaks = streaks.size() / 3;
+    archive << num_streaks;
+    std::size_t n = 0;
+    for (std::size_t s = 0; s < streaks.size(); s += 3)
+      {
+	archive << streaks[s] << streaks[s + 1] << streaks[s + 2];
+	for (int x = 0; x < streaks[s + 2]; x++)
+	  {
+	    archive << cells[n++];
+	  }
+      }
+  }
+  streaks.clear();
+  cells.clear();
+
+  std::vector<int> boxes(4 * size);
+  MPI_Gather(box, 4, MPI_INT, boxes.data(), 4, MPI_INT, 0, LSDEnsemble::communicator());
+  MPI_Barrier(LSDEnsemble::communicator());
+
+  // the manifest marks the checkpoint as complete, so it is written last
+  if (rank == 0)
+    {
+      {
+	std::ofstream out((scratch + "/manifest").c_str());
+	out << std::setprecision(17);
+	out << "step " << step << std::endl;
+	out << "ranks " << size << std::endl;
+	for (int r = 0; r < size; r++)
+	  {
+	    out << "box " << r << " " << boxes[4 * r] << " " << boxes[4 * r + 1] << " "
+		<< boxes[4 * r + 2] << " " << boxes[4 * r + 3] << std::endl;
+	  }
+	catchment->save_counters(out);
+      }
+
+      // a directory left without a manifest by a run that stopped is replaced
+      if (!does_file_exist(directory + "/manifest")) system(("rm -rf " + directory).c_str());
+      if (std::rename(scratch.c_str(), directory.c_str()) == 0)
+	{
+	  std::cout << "Checkpoint written at step " << step << " to " << directory << std::endl;
+	}
+      else
+	{
+	  system(("rm -rf " + scratch).c_str());
+	  std::cout << "Checkpoint of step " << step << " already written to " << directory << " by another run" << std::endl;
+	}
+    }
+}
+
+
+
+
+
+CheckpointReader::CheckpointReader(const std::string& path) :
+  step_found(false),
+  step(0)
+{
+  DIR *dir = opendir(path.c_str());
+  if (dir == 0) return;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != 0)
+    {
+      std::string name(entry->d_name);
+      if (name.compare(0, 11, "checkpoint_") != 0) continue;
+
+      unsigned candidate = atoi(name.substr(11).c_str());
+      if (does_file_exist(path + "/" + name + "/manifest") && (!step_found || candidate > step))
+	{
+	  step = candidate;
+	  step_found = true;
+	}
+    }
+  closedir(dir);
+
+  if (!step_found) return;
+
+  directory = checkpoint_directory(path, step);
+  std::ifstream manifest((directory + "/manifest").c_str());
+  std::string key;
+  while (manifest >> key)
+    {
+      if (key == "box")
+	{
+	  int r;
+	  manifest >> r;
+	  rank_boxes.resize(std::max(rank_boxes.size(), std::size_t(4 * (r + 1))));
+	  manifest >> rank_boxes[4 * r] >> rank_boxes[4 * r + 1] >> rank_boxes[4 * r + 2] >> rank_boxes[4 * r + 3];
+	}
+      else
+	{
+	  std::string line;
+	  std::getline(manifest, line);
+	}
+    }
+}
+
+
+
+void CheckpointReader::restore_counters(LSDCatchmentModel *catchment) const
+{
+  std::ifstream manifest((directory + "/manifest").c_str());
+  catchment->load_counters(manifest);
+}
+
+
+
+void CheckpointReader::restore_subgrid(LibGeoDecomp::GridBase<Cell, 2> *subgrid) const
+{
+  LibGeoDecomp::CoordBox<2> box = subgrid->boundingBox();
+
+  for (std::size_t r = 0; r < rank_boxes.size() / 4; r++)
+    {
+      const int *rank_box = &rank_boxes[4 * r];
+      if (rank_box[0] >= box.origin.x() + box.dimensions.x() || rank_box[0] + rank_box[2] <= box.origin.x() ||
+	  rank_box[1] >= box.origin.y() + box.dimensions.y() || rank_box[1] + rank_box[3] <= box.origin.y())
+	{
+	  continue;
+	}
+
+      std::ifstream in(rank_filename(directory, r).c_str(), std::ios::binary);
+      boost::archive::binary_iarchive archive(in);
+      std::size_t num_streaks;
+      archive >> num_streaks;
+      for (std::size_t s = 0; s < num_streaks; s++)
+	{
+	  int y, x0, length;
+	  archive >> y >> x0 >> length;
+	  for (int x = x0; x < x0 + length; x++)
+	    {
+	      Cell cell(Cell::INTERNAL, 0.0, 0.0, 0.0, 0.0);
+	      archive >> cell;
+	      LibGeoDecomp::Coord<2> coordinate(x, y);
+	      if (box.inBounds(coordinate)) subgrid->set(coordinate, cell);
+	    }
+	}
+    }
+}
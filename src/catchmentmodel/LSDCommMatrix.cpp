@@ -0,0 +1,431 @@
+// LSDCommMatrix.cpp
+
+// Communication matrix of the catchment model, and the MPI profiling
+// interface wrappers that fill it
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "catchmentmodel/LSDCommMatrix.hpp"
+#include "catchmentmodel/LSDProfile.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+// buffers of send calls became const in MPI-3
+#if MPI_VERSION >= 3
+#define LSD_MPI_CONST const
+#else
+#define LSD_MPI_CONST
+#endif
+
+
+bool LSDCommMatrix::recording = false;
+std::map<MPI_Request, LSDCommMatrix::Request> LSDCommMatrix::pending;
+std::vector<double> LSDCommMatrix::bytes_sent;
+std::vector<double> LSDCommMatrix::messages_sent;
+std::vector<double> LSDCommMatrix::bytes_received;
+std::vector<double> LSDCommMatrix::messages_received;
+std::vector<double> LSDCommMatrix::wait_seconds;
+std::vector<int> LSDCommMatrix::layout(5, 0);
+
+
+
+void LSDCommMatrix::initialise()
+{
+  int size;
+  PMPI_Comm_size(LSDEnsemble::communicator(), &size);
+  bytes_sent.assign(size, 0.0);
+  messages_sent.assign(size, 0.0);
+  bytes_received.assign(size, 0.0);
+  messages_received.assign(size, 0.0);
+  wait_seconds.assign(size, 0.0);
+  pending.clear();
+}
+
+
+
+void LSDCommMatrix::set_layout(const LibGeoDecomp::CoordBox<2>& box, std::size_t cells)
+{
+  layout[0] = box.origin.x();
+  layout[1] = box.origin.y();
+  layout[2] = box.dimensions.x();
+  layout[3] = box.dimensions.y();
+  layout[4] = cells;
+}
+
+
+
+void LSDCommMatrix::add_send(int peer, double bytes)
+{
+  if (peer < 0 || peer >= int(bytes_sent.size())) return;
+  bytes_sent[peer] += bytes;
+  messages_sent[peer] += 1.0;
+}
+
+
+
+void LSDCommMatrix::add_wait(int peer, double seconds)
+{
+  if (peer < 0 || peer >= int(wait_seconds.size())) return;
+  wait_seconds[peer] += seconds;
+}
+
+
+
+int LSDCommMatrix::add_receive(MPI_Comm comm, MPI_Datatype datatype, const MPI_Status& status)
+{
+  int peer = model_rank(comm, status.MPI_SOURCE);
+  int count, size;
+  PMPI_Get_count(&status, datatype, &count);
+  PMPI_Type_size(datatype, &size);
+  if (peer < 0 || peer >= int(bytes_received.size()) || count == MPI_UNDEFINED) return peer;
+  bytes_received[peer] += double(size) * count;
+  messages_received[peer] += 1.0;
+  return peer;
+}
+
+
+
+void LSDCommMatrix::track(MPI_Request request, int peer, MPI_Comm comm, MPI_Datatype receive_type)
+{
+  Request tracked = {peer, comm, receive_type};
+  pending[request] = tracked;
+}
+
+
+
+int LSDCommMatrix::complete(MPI_Request request, const MPI_Status& status)
+{
+  std::map<MPI_Request, Request>::iterator found = pending.find(request);
+  if (found == pending.end()) return -2;
+
+  Request tracked = found->second;
+  pending.erase(found);
+  // receives learn their size, and any source receives their peer, from the status
+  if (tracked.receive_type != MPI_DATATYPE_NULL) return add_receive(tracked.comm, tracked.receive_type, status);
+  return tracked.peer;
+}
+
+
+
+void LSDCommMatrix::forget(MPI_Request request)
+{
+  pending.erase(request);
+}
+
+
+
+int LSDCommMatrix::model_rank(MPI_Comm comm, int rank)
+{
+  if (rank < 0) return -1;  // MPI_ANY_SOURCE, MPI_PROC_NULL
+  MPI_Comm model = LSDEnsemble::communicator();
+  if (comm == model) return rank;
+
+  int result;
+  PMPI_Comm_compare(comm, model, &result);
+  if (result == MPI_IDENT || result == MPI_CONGRUENT) return rank;
+
+  MPI_Group group, model_group;
+  int translated = MPI_UNDEFINED;
+  PMPI_Comm_group(comm, &group);
+  PMPI_Comm_group(model, &model_group);
+  PMPI_Group_translate_ranks(group, 1, &rank, model_group, &translated);
+  PMPI_Group_free(&group);
+  PMPI_Group_free(&model_group);
+  return translated == MPI_UNDEFINED ? -1 : translated;
+}
+
+
+
+void LSDCommMatrix::write_report(const std::string& prefix)
+{
+  int rank, size;
+  PMPI_Comm_rank(LSDEnsemble::communicator(), &rank);
+  PMPI_Comm_size(LSDEnsemble::communicator(), &size);
+
+  // requests never completed are not booked
+  pending.clear();
+
+  const int num_matrices = 5;
+  const std::vector<double> *rows[num_matrices] = {&bytes_sent, &messages_sent, &bytes_received, &messages_received, &wait_seconds};
+  std::vector<double> matrices[num_matrices];
+  for (int m = 0; m < num_matrices; m++)
+    {
+      matrices[m].resize(rank == 0 ? size * size : 0);
+      PMPI_Gather(rows[m]->data(), size, MPI_DOUBLE, matrices[m].data(), size, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+    }
+  std::vector<int> all_layouts(rank == 0 ? size * 5 : 0);
+  PMPI_Gather(layout.data(), 5, MPI_INT, all_layouts.data(), 5, MPI_INT, 0, LSDEnsemble::communicator());
+
+  if (rank != 0) return;
+
+  const char *names[num_matrices] = {"_bytes.csv", "_messages.csv", "_bytes_received.csv", "_messages_received.csv", "_wait.csv"};
+  for (int m = 0; m < num_matrices; m++)
+    {
+      std::ofstream matrix((prefix + names[m]).c_str());
+      matrix << std::setprecision(9) << "rank";
+      for (int peer = 0; peer < size; peer++) matrix << "," << peer;
+      matrix << std::endl;
+      for (int from = 0; from < size; from++)
+	{
+	  matrix << from;
+	  for (int peer = 0; peer < size; peer++) matrix << "," << matrices[m][from * size + peer];
+	  matrix << std::endl;
+	}
+    }
+
+  std::ofstream layout_file((prefix + "_layout.csv").c_str());
+  layout_file << "rank,origin_x,origin_y,width,height,cells" << std::endl;
+  for (int r = 0; r < size; r++)
+    {
+      layout_file << r;
+      for (int v = 0; v < 5; v++) layout_file << "," << all_layouts[r * 5 + v];
+      layout_file << std::endl;
+    }
+  std::cout << "Communication matrix written to " << prefix << "_*.csv" << std::endl;
+}
+
+
+
+
+
+CommMatrixSteerer::CommMatrixSteerer() :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, CommMatrixSteerer>(1)
+{}
+
+
+
+void CommMatrixSteerer::nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+				 unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  // the subdomain may change with load balancing, keep the latest
+  region = region + validRegion;
+  if (!lastCall) return;
+
+  LSDCommMatrix::set_layout(region.boundingBox(), region.size());
+  region = LibGeoDecomp::Region<2>();
+  LSDCommMatrix::recording = (event != LibGeoDecomp::STEERER_ALL_DONE);
+}
+
+
+
+
+
+// MPI profiling interface wrappers: these take the place of the MPI
+// library's own symbols and call the PMPI_ versions.
+
+namespace
+{
+  // Copies the request handles of a call that may complete several, as
+  // completed requests are reset to MPI_REQUEST_NULL
+  std::vector<MPI_Request> handles(int count, const MPI_Request array_of_requests[])
+  {
+    return std::vector<MPI_Request>(array_of_requests, array_of_requests + count);
+  }
+
+  // Books the requests completed by one call, sharing its blocked time
+  // evenly between their peers
+  void complete_some(const std::vector<MPI_Request>& requests, int outcount, const int *indices,
+		     const MPI_Status *statuses, double seconds)
+  {
+    std::vector<int> peers;
+    for (int c = 0; c < outcount; c++)
+      {
+	int r = indices ? indices[c] : c;
+	int peer = LSDCommMatrix::complete(requests[r], statuses[c]);
+	if (peer >= 0) peers.push_back(peer);
+      }
+    if (!LSDCommMatrix::recording) return;
+    for (std::size_t p = 0; p < peers.size(); p++) LSDCommMatrix::add_wait(peers[p], seconds / peers.size());
+  }
+}
+
+
+extern "C" {
+
+int MPI_Isend(LSD_MPI_CONST void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm, MPI_Request *request)
+{
+  int err = PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+  if (LSDCommMatrix::recording && err == MPI_SUCCESS)
+    {
+      int size;
+      int peer = LSDCommMatrix::model_rank(comm, dest);
+      PMPI_Type_size(datatype, &size);
+      LSDCommMatrix::add_send(peer, double(size) * count);
+      LSDCommMatrix::track(*request, peer, comm, MPI_DATATYPE_NULL);
+    }
+  return err;
+}
+
+
+
+int MPI_Send(LSD_MPI_CONST void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm comm)
+{
+  if (!LSDCommMatrix::recording) return PMPI_Send(buf, count, datatype, dest, tag, comm);
+
+  int size;
+  int peer = LSDCommMatrix::model_rank(comm, dest);
+  PMPI_Type_size(datatype, &size);
+  LSDCommMatrix::add_send(peer, double(size) * count);
+  double start = LSDProfile::now();
+  int err = PMPI_Send(buf, count, datatype, dest, tag, comm);
+  LSDCommMatrix::add_wait(peer, LSDProfile::now() - start);
+  return err;
+}
+
+
+
+int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Request *request)
+{
+  int err = PMPI_Irecv(buf, count, datatype, source, tag, comm, request);
+  if (LSDCommMatrix::recording && err == MPI_SUCCESS)
+    {
+      LSDCommMatrix::track(*request, LSDCommMatrix::model_rank(comm, source), comm, datatype);
+    }
+  return err;
+}
+
+
+
+int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+  if (!LSDCommMatrix::recording) return PMPI_Recv(buf, count, datatype, source, tag, comm, status);
+
+  MPI_Status local_status;
+  double start = LSDProfile::now();
+  int err = PMPI_Recv(buf, count, datatype, source, tag, comm, &local_status);
+  double seconds = LSDProfile::now() - start;
+  if (err == MPI_SUCCESS) LSDCommMatrix::add_wait(LSDCommMatrix::add_receive(comm, datatype, local_status), seconds);
+  if (status != MPI_STATUS_IGNORE) *status = local_status;
+  return err;
+}
+
+
+
+int MPI_Wait(MPI_Request *request, MPI_Status *status)
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Wait(request, status);
+
+  MPI_Request handle = *request;
+  MPI_Status local_status;
+  double start = LSDProfile::now();
+  int err = PMPI_Wait(request, &local_status);
+  double seconds = LSDProfile::now() - start;
+  int peer = LSDCommMatrix::complete(handle, local_status);
+  if (LSDCommMatrix::recording && peer >= 0) LSDCommMatrix::add_wait(peer, seconds);
+  if (status != MPI_STATUS_IGNORE) *status = local_status;
+  return err;
+}
+
+
+
+int MPI_Waitall(int count, MPI_Request array_of_requests[], MPI_Status array_of_statuses[])
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Waitall(count, array_of_requests, array_of_statuses);
+
+  std::vector<MPI_Request> requests = handles(count, array_of_requests);
+  std::vector<MPI_Status> local_statuses(array_of_statuses == MPI_STATUSES_IGNORE ? count : 0);
+  MPI_Status *statuses = array_of_statuses == MPI_STATUSES_IGNORE ? local_statuses.data() : array_of_statuses;
+  double start = LSDProfile::now();
+  int err = PMPI_Waitall(count, array_of_requests, statuses);
+  complete_some(requests, count, 0, statuses, LSDProfile::now() - start);
+  return err;
+}
+
+
+
+int MPI_Waitany(int count, MPI_Request array_of_requests[], int *index, MPI_Status *status)
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Waitany(count, array_of_requests, index, status);
+
+  std::vector<MPI_Request> requests = handles(count, array_of_requests);
+  MPI_Status local_status;
+  double start = LSDProfile::now();
+  int err = PMPI_Waitany(count, array_of_requests, index, &local_status);
+  if (*index != MPI_UNDEFINED) complete_some(requests, 1, index, &local_status, LSDProfile::now() - start);
+  if (status != MPI_STATUS_IGNORE) *status = local_status;
+  return err;
+}
+
+
+
+int MPI_Waitsome(int incount, MPI_Request array_of_requests[], int *outcount, int array_of_indices[], MPI_Status array_of_statuses[])
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Waitsome(incount, array_of_requests, outcount, array_of_indices, array_of_statuses);
+
+  std::vector<MPI_Request> requests = handles(incount, array_of_requests);
+  std::vector<MPI_Status> local_statuses(array_of_statuses == MPI_STATUSES_IGNORE ? incount : 0);
+  MPI_Status *statuses = array_of_statuses == MPI_STATUSES_IGNORE ? local_statuses.data() : array_of_statuses;
+  double start = LSDProfile::now();
+  int err = PMPI_Waitsome(incount, array_of_requests, outcount, array_of_indices, statuses);
+  if (*outcount != MPI_UNDEFINED) complete_some(requests, *outcount, array_of_indices, statuses, LSDProfile::now() - start);
+  return err;
+}
+
+
+
+// The Test calls do not block, they only book the requests they complete
+
+int MPI_Test(MPI_Request *request, int *flag, MPI_Status *status)
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Test(request, flag, status);
+
+  MPI_Request handle = *request;
+  MPI_Status local_status;
+  int err = PMPI_Test(request, flag, &local_status);
+  if (*flag) LSDCommMatrix::complete(handle, local_status);
+  if (status != MPI_STATUS_IGNORE) *status = local_status;
+  return err;
+}
+
+
+
+int MPI_Testall(int count, MPI_Request array_of_requests[], int *flag, MPI_Status array_of_statuses[])
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Testall(count, array_of_requests, flag, array_of_statuses);
+
+  std::vector<MPI_Request> requests = handles(count, array_of_requests);
+  std::vector<MPI_Status> local_statuses(array_of_statuses == MPI_STATUSES_IGNORE ? count : 0);
+  MPI_Status *statuses = array_of_statuses == MPI_STATUSES_IGNORE ? local_statuses.data() : array_of_statuses;
+  int err = PMPI_Testall(count, array_of_requests, flag, statuses);
+  if (*flag) complete_some(requests, count, 0, statuses, 0.0);
+  return err;
+}
+
+
+
+int MPI_Testany(int count, MPI_Request array_of_requests[], int *index, int *flag, MPI_Status *status)
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Testany(count, array_of_requests, index, flag, status);
+
+  std::vector<MPI_Request> requests = handles(count, array_of_requests);
+  MPI_Status local_status;
+  int err = PMPI_Testany(count, array_of_requests, index, flag, &local_status);
+  if (*flag && *index != MPI_UNDEFINED) complete_some(requests, 1, index, &local_status, 0.0);
+  if (status != MPI_STATUS_IGNORE) *status = local_status;
+  return err;
+}
+
+
+
+int MPI_Testsome(int incount, MPI_Request array_of_requests[], int *outcount, int array_of_indices[], MPI_Status array_of_statuses[])
+{
+  if (!LSDCommMatrix::tracking()) return PMPI_Testsome(incount, array_of_requests, outcount, array_of_indices, array_of_statuses);
+
+  std::vector<MPI_Request> requests = handles(incount, array_of_requests);
+  std::vector<MPI_Status> local_statuses(array_of_statuses == MPI_STATUSES_IGNORE ? incount : 0);
+  MPI_Status *statuses = array_of_statuses == MPI_STATUSES_IGNORE ? local_statuses.data() : array_of_statuses;
+  int err = PMPI_Testsome(incount, array_of_requests, outcount, array_of_indices, statuses);
+  if (*outcount != MPI_UNDEFINED) complete_some(requests, *outcount, array_of_indices, statuses, 0.0);
+  return err;
+}
+
+
+
+int MPI_Request_free(MPI_Request *request)
+{
+  if (LSDCommMatrix::tracking()) LSDCommMatrix::forget(*request);
+  return PMPI_Request_free(request);
+}
+
+}
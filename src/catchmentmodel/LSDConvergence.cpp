@@ -0,0 +1,105 @@
+// LSDConvergence.cpp
+
+// Steady state monitor for the catchment model
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+#include "catchmentmodel/LSDConvergence.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+
+// The per-thread partials are defined with the kernel, in cell.cpp
+
+
+
+
+
+ConvergenceSteerer::ConvergenceSteerer(LSDCatchmentModel *catchment_in, unsigned interval_in, double depth_tolerance_in,
+				       double discharge_tolerance_in, double max_ratio_in, unsigned num_checks_in, bool stop_in,
+				       double output_factor_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ConvergenceSteerer>(1),
+  catchment(catchment_in),
+  interval(interval_in > 0 ? interval_in : 1),
+  depth_tolerance(depth_tolerance_in),
+  discharge_tolerance(discharge_tolerance_in),
+  max_ratio(max_ratio_in),
+  num_checks(num_checks_in > 0 ? num_checks_in : 1),
+  stop(stop_in),
+  output_factor(output_factor_in),
+  checking(false),
+  sampled_time_step(0.0),
+  passed_checks(0),
+  coarsened(false),
+  timeseries_interval(catchment_in->output_file_save_interval),
+  gauge_interval(catchment_in->gauge_save_interval)
+{}
+
+
+
+void ConvergenceSteerer::nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+				  unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  if (!lastCall || event == LibGeoDecomp::STEERER_ALL_DONE) return;
+
+  // the changes were measured during the last update
+  if (checking)
+    {
+      passed_checks = check() ? passed_checks + 1 : 0;
+
+      if (passed_checks >= num_checks)
+	{
+	  if (stop)
+	    {
+	      if (rank == 0 && passed_checks == num_checks) std::cout << "Steady state reached at model time " << catchment->get_cycle() << ", ending the run" << std::endl;
+	      if (feedback) feedback->endSimulation();
+	    }
+	  else if (!coarsened)
+	    {
+	      if (rank == 0) std::cout << "Steady state reached at model time " << catchment->get_cycle() << ", coarsening the outputs" << std::endl;
+	      catchment->output_file_save_interval = timeseries_interval * output_factor;
+	      catchment->gauge_save_interval = gauge_interval * output_factor;
+	      coarsened = true;
+	    }
+	}
+      else if (passed_checks == 0 && coarsened)
+	{
+	  if (rank == 0) std::cout << "Catchment active again at model time " << catchment->get_cycle() << ", restoring the outputs" << std::endl;
+	  catchment->output_file_save_interval = timeseries_interval;
+	  catchment->gauge_save_interval = gauge_interval;
+	  coarsened = false;
+	}
+    }
+
+  // measure the change during this step's update, as in LSDCatchmentModel::increment_counters()
+  LSDConvergence::sample = (step % interval == 0);
+  checking = LSDConvergence::sample;
+  if (checking)
+    {
+      Cell::set_global_timefactor();
+      sampled_time_step = Cell::set_local_timefactor();
+    }
+}
+
+
+
+bool ConvergenceSteerer::check()
+{
+  double local_maxima[2], maxima[2];
+  double local_sums[3], sums[3];
+
+  LSDConvergence::collect(local_maxima, local_sums);
+  MPI_Allreduce(local_maxima, maxima, 2, MPI_DOUBLE, MPI_MAX, LSDEnsemble::communicator());
+  MPI_Allreduce(local_sums, sums, 3, MPI_DOUBLE, MPI_SUM, LSDEnsemble::communicator());
+
+  double num_cells = std::max(sums[2], 1.0);
+  double max_depth_rate = maxima[0] / sampled_time_step;
+  double max_discharge_rate = maxima[1] / sampled_time_step;
+  double l2_depth_rate = std::sqrt(sums[0] / num_cells) / sampled_time_step;
+  double l2_discharge_rate = std::sqrt(sums[1] / num_cells) / sampled_time_step;
+
+  return (l2_depth_rate <= depth_tolerance && l2_discharge_rate <= discharge_tolerance &&
+	  max_depth_rate <= max_ratio * depth_tolerance && max_discharge_rate <= max_ratio * discharge_tolerance);
+}
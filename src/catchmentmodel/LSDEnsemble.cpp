@@ -0,0 +1,425 @@
+// LSDEnsemble.cpp
+
+// Ensemble mode: many parameter sets of one catchment in one job
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <libgeodecomp/io/simpleinitializer.h>
+#include <libgeodecomp/io/parallelwriter.h>
+#include <libgeodecomp/misc/clonable.h>
+#include <libgeodecomp/parallelization/hiparsimulator.h>
+#include <libgeodecomp/loadbalancer/noopbalancer.h>
+#include <libgeodecomp/geometry/partitions/recursivebisectionpartition.h>
+
+#include "catchmentmodel/LSDEnsemble.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+#include "catchmentmodel/LSDUtils.hpp"
+#include "catchmentmodel/ensemble_cell_kernel.hpp"
+
+using namespace LSDUtils;
+
+
+MPI_Comm LSDEnsemble::comm = MPI_COMM_WORLD;
+
+
+
+// Sets up the lanes of every cell from the terrain and initial state of the base model
+template<int LANES>
+class EnsembleCellInitializer : public LibGeoDecomp::SimpleInitializer<EnsembleCell<LANES> >
+{
+public:
+  EnsembleCellInitializer(const LSDCatchmentModel *catchment_in) :
+    LibGeoDecomp::SimpleInitializer<EnsembleCell<LANES> >(LibGeoDecomp::Coord<2>(catchment_in->jmax, catchment_in->imax),
+							  catchment_in->no_of_iterations),
+    catchment(catchment_in)
+  {}
+
+  void grid(LibGeoDecomp::GridBase<EnsembleCell<LANES>, 2> *subgrid)
+  {
+    LibGeoDecomp::CoordBox<2> subgridBoundingBox = subgrid->boundingBox();
+    for (int x = 0; x < int(catchment->jmax); x++)
+      {
+	for (int y = 0; y < int(catchment->imax); y++)
+	  {
+	    LibGeoDecomp::Coord<2> coordinate(x, y);
+	    if (!subgridBoundingBox.inBounds(coordinate)) continue;
+
+	    EnsembleCell<LANES> cell(catchment->cell_type(x, y), catchment->elev[y][x], catchment->water_depth[y][x]);
+	    for (int l = 0; l < LANES; l++)
+	      {
+		cell.qx[l] = catchment->initial_qx[y][x];
+		cell.qy[l] = catchment->initial_qy[y][x];
+	      }
+	    subgrid->set(coordinate, cell);
+	  }
+      }
+  }
+
+private:
+  const LSDCatchmentModel *catchment;
+};
+
+
+
+// Writes the water depth of each member lane to an ArcMap float raster in
+// the member's directory, every period steps and at the end, with MPI-IO
+// as DerivedFieldWriter does. The lanes take their own time steps, so the
+// rasters of one step are at different model times; each member directory
+// gets an index (water_depth_times.txt) of its rasters with the model time
+// of the member at each.
+template<int LANES>
+class LaneRasterWriter : public LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<EnsembleCell<LANES> >, LaneRasterWriter<LANES> >
+{
+public:
+  typedef typename LibGeoDecomp::ParallelWriter<EnsembleCell<LANES> >::GridType GridType;
+  typedef LibGeoDecomp::Region<2> RegionType;
+  typedef LibGeoDecomp::Coord<2> CoordType;
+
+  /// @param directories_in one per member lane; padding lanes have none
+  /// @param header_in the .hdr text of the DEM
+  LaneRasterWriter(const std::vector<std::string>& directories_in, const std::string& header_in, unsigned period) :
+    LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<EnsembleCell<LANES> >, LaneRasterWriter<LANES> >("water_depth", period),
+    directories(directories_in),
+    header(header_in),
+    values(directories_in.size()),
+    last_step(-1),
+    index_started(false)
+  {}
+
+  void stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+		    unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+  {
+    if (event == LibGeoDecomp::WRITER_INITIALIZED || int(step) == last_step) return;
+
+    for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+      {
+	streak_offsets.push_back((MPI_Offset(i->origin.y()) * globalDimensions.x() + i->origin.x()) * sizeof(float));
+	streak_lengths.push_back(i->endX - i->origin.x());
+	for (int x = i->origin.x(); x < i->endX; x++)
+	  {
+	    EnsembleCell<LANES> cell = grid.get(CoordType(x, i->origin.y()));
+	    bool outside = (cell.celltype == Cell::NODATA || cell.elevation == LSDCatchmentModel::no_data_value);
+	    for (std::size_t l = 0; l < values.size(); l++) values[l].push_back(float(outside ? LSDCatchmentModel::no_data_value : cell.water_depth[l]));
+	  }
+      }
+
+    if (lastCall)
+      {
+	write_rasters(step);
+	last_step = step;
+      }
+  }
+
+private:
+  std::vector<std::string> directories;
+  std::string header;
+  std::vector< std::vector<float> > values;
+  std::vector<MPI_Offset> streak_offsets;
+  std::vector<int> streak_lengths;
+  int last_step;
+  bool index_started;
+
+  void write_rasters(unsigned step)
+  {
+    for (std::size_t l = 0; l < directories.size(); l++)
+      {
+	std::stringstream filename;
+	filename << directories[l] << "/" << this->prefix << "_" << std::setfill('0') << std::setw(6) << step;
+	if (LSDEnsemble::rank() == 0)
+	  {
+	    std::ofstream header_ofs((filename.str() + ".hdr").c_str());
+	    header_ofs << header;
+
+	    // the model time of the member, as the cycle of a Cell run (minutes)
+	    std::string index_filename = directories[l] + "/" + this->prefix + "_times.txt";
+	    std::ofstream index(index_filename.c_str(), index_started ? std::ios::app : std::ios::trunc);
+	    if (!index_started) index << "# raster step model_time_minutes" << std::endl;
+	    index << filename.str().substr(directories[l].size() + 1) << " " << step << " "
+		  << step * EnsembleCell<LANES>::time_step[l] / 60 << std::endl;
+	  }
+
+	MPI_File file;
+	std::string data_filename = filename.str() + ".flt";
+	MPI_File_open(LSDEnsemble::communicator(), const_cast<char*>(data_filename.c_str()), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+	std::size_t position = 0;
+	for (std::size_t n = 0; n < streak_offsets.size(); n++)
+	  {
+	    MPI_File_write_at(file, streak_offsets[n], &values[l][position], streak_lengths[n], MPI_FLOAT, MPI_STATUS_IGNORE);
+	    position += streak_lengths[n];
+	  }
+	MPI_File_close(&file);
+	values[l].clear();
+      }
+    streak_offsets.clear();
+    streak_lengths.clear();
+    index_started = true;
+  }
+};
+
+
+
+std::vector<LSDEnsemble::Member> LSDEnsemble::read_table(const std::string& filename)
+{
+  if (!does_file_exist(filename))
+    {
+      std::cout << "No ensemble table found by name of: " << filename
+		<< std::endl
+		<< "You must supply a correct path and filename "
+		<< "in the input parameter file" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+  std::ifstream table(filename.c_str());
+  std::vector<std::string> keys;
+  std::vector<Member> members;
+  std::string line;
+  while (std::getline(table, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::replace(line.begin(), line.end(), ',', ' ');
+      std::istringstream fields(line);
+      std::vector<std::string> values;
+      std::string value;
+      while (fields >> value) values.push_back(value);
+      if (values.empty()) continue;
+
+      // the header row: member, then the parameter names
+      if (keys.empty())
+	{
+	  keys = values;
+	  continue;
+	}
+      if (values.size() != keys.size())
+	{
+	  std::cout << "Ensemble table " << filename << ": member " << values[0] << " has " << values.size() - 1
+		    << " values for " << keys.size() - 1 << " parameters" << std::endl;
+	  exit(EXIT_FAILURE);
+	}
+
+      Member member;
+      member.name = values[0];
+      for (std::size_t k = 1; k < keys.size(); k++) member.overrides.push_back(std::make_pair(keys[k], values[k]));
+      members.push_back(member);
+    }
+
+  if (members.empty())
+    {
+      std::cout << "Ensemble table " << filename << " has no members" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  return members;
+}
+
+
+
+void LSDEnsemble::write_member_parameters(const std::string& pfname, const Member& member,
+					  const std::string& directory, const std::string& member_pfname)
+{
+  std::ifstream base(pfname.c_str());
+  std::ofstream params(member_pfname.c_str());
+  params << base.rdbuf();
+
+  // later lines win, see LSDCatchmentModel::initialise_variables()
+  params << std::endl << std::endl
+	 << "# ENSEMBLE MEMBER " << member.name << std::endl
+	 << "#================" << std::endl;
+  for (std::size_t o = 0; o < member.overrides.size(); o++)
+    {
+      params << member.overrides[o].first << ": " << member.overrides[o].second << std::endl;
+    }
+  params << "write_path: " << directory << std::endl
+	 << "ensemble_table: none" << std::endl;
+}
+
+
+
+bool LSDEnsemble::lane_parameter(const std::string& key)
+{
+  return key == "mannings_n" || key == "courant_number" || key == "froude_limit";
+}
+
+
+
+template<int LANES>
+void LSDEnsemble::run_lanes(LSDCatchmentModel *base, const std::vector<Member>& batch, const std::vector<std::string>& directories)
+{
+  // the base parameters in every lane, then the overrides of its member;
+  // lanes past the last member repeat it and are not written
+  for (int l = 0; l < LANES; l++)
+    {
+      const Member& member = batch[std::min(l, int(batch.size()) - 1)];
+      double courant_number = LSDCatchmentModel::courant_number;
+      EnsembleCell<LANES>::mannings[l] = LSDCatchmentModel::mannings;
+      EnsembleCell<LANES>::froude_limit[l] = LSDCatchmentModel::froude_limit;
+      for (std::size_t o = 0; o < member.overrides.size(); o++)
+	{
+	  double value = atof(member.overrides[o].second.c_str());
+	  if (member.overrides[o].first == "mannings_n") EnsembleCell<LANES>::mannings[l] = value;
+	  else if (member.overrides[o].first == "courant_number") courant_number = value;
+	  else if (member.overrides[o].first == "froude_limit") EnsembleCell<LANES>::froude_limit[l] = value;
+	}
+      EnsembleCell<LANES>::time_step[l] = EnsembleCell<LANES>::courant_time_step(courant_number);
+    }
+
+  // the base model holds the terrain; its other arrays give the initial state
+  base->initialise_arrays();
+
+  std::stringstream header;
+  header << "ncols         " << base->jmax
+	 << "\nnrows         " << base->imax
+	 << "\nxllcorner     " << std::setprecision(14) << base->xll
+	 << "\nyllcorner     " << std::setprecision(14) << base->yll
+	 << "\ncellsize      " << LSDCatchmentModel::DX
+	 << "\nNODATA_value  " << LSDCatchmentModel::no_data_value
+	 << "\nbyteorder     LSBFIRST" << std::endl;
+
+  EnsembleCellInitializer<LANES> *initialiser = new EnsembleCellInitializer<LANES>(base);
+  LibGeoDecomp::HiParSimulator<EnsembleCell<LANES>, LibGeoDecomp::RecursiveBisectionPartition<2> > sim(
+    initialiser, rank() ? 0 : new LibGeoDecomp::NoOpBalancer(), 1, 1, comm);
+  unsigned period = (base->ensemble_raster_interval > 0) ? base->ensemble_raster_interval : base->no_of_iterations;
+  sim.addWriter(new LaneRasterWriter<LANES>(directories, header.str(), period));
+  sim.run();
+}
+
+
+
+void LSDEnsemble::run(const std::string& pfname, LSDCatchmentModel *base)
+{
+  std::vector<Member> members = read_table(base->read_path + "/" + base->ensemble_table);
+
+  int world_rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  // the kernel adds water_input_depth to every cell until the rainfall
+  // input is ported, so members that only scale the rainfall records would
+  // all give the same hydraulics
+  for (std::size_t m = 0; m < members.size(); m++)
+    {
+      for (std::size_t o = 0; o < members[m].overrides.size(); o++)
+	{
+	  if (members[m].overrides[o].first != "rainfall_scale") continue;
+	  if (world_rank == 0)
+	    {
+	      std::cout << "Ensemble member " << members[m].name << " overrides rainfall_scale, which does not change the"
+			<< " water input of the kernel yet; vary water_input_depth instead" << std::endl;
+	    }
+	  exit(EXIT_FAILURE);
+	}
+    }
+
+  // with lanes, each group runs batches of members in one EnsembleCell grid
+  int lanes = base->ensemble_lanes;
+  if (lanes != 1 && lanes != 4 && lanes != 8)
+    {
+      if (world_rank == 0) std::cout << "ensemble_lanes must be 1, 4 or 8, not " << lanes << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  if (lanes > 1)
+    {
+      for (std::size_t m = 0; m < members.size(); m++)
+	{
+	  for (std::size_t o = 0; o < members[m].overrides.size(); o++)
+	    {
+	      if (lane_parameter(members[m].overrides[o].first)) continue;
+	      if (world_rank == 0)
+		{
+		  std::cout << "Ensemble member " << members[m].name << " overrides " << members[m].overrides[o].first
+			    << ", which ensemble_lanes cannot vary per lane (only mannings_n, courant_number and froude_limit)" << std::endl;
+		}
+	      exit(EXIT_FAILURE);
+	    }
+	}
+      if (world_rank == 0 && !LSDCatchmentModel::fast_friction)
+	{
+	  std::cout << "ensemble_lanes: the lanes only vectorize with fast_friction: yes" << std::endl;
+	}
+    }
+  int batches = (members.size() + lanes - 1) / lanes;
+
+  int ranks = std::max(1, std::min(base->ensemble_ranks_per_member, world_size));
+  int groups = std::min(world_size / ranks, batches);
+
+  // ranks left over join the last group
+  int group = std::min(world_rank / ranks, groups - 1);
+  MPI_Comm_split(MPI_COMM_WORLD, group, world_rank, &comm);
+  int group_rank;
+  MPI_Comm_rank(comm, &group_rank);
+
+  if (world_rank == 0)
+    {
+      std::cout << "Ensemble of " << members.size() << " members from " << base->ensemble_table
+		<< ", running " << groups << " at a time on " << ranks << " ranks each";
+      if (lanes > 1) std::cout << ", " << lanes << " members per run";
+      std::cout << std::endl;
+    }
+
+  // every member starts from the parameters and terrain of the base model
+  LSDCatchmentModel::StaticParameters statics = LSDCatchmentModel::get_static_parameters();
+  for (int batch_index = group; batch_index < batches; batch_index += groups)
+    {
+      std::vector<Member> batch(members.begin() + batch_index * lanes, members.begin() + std::min(std::size_t(batch_index + 1) * lanes, members.size()));
+      std::vector<std::string> directories;
+      std::vector<std::string> member_pfnames;
+      for (std::size_t b = 0; b < batch.size(); b++)
+	{
+	  directories.push_back(base->write_path + "/" + batch[b].name);
+	  member_pfnames.push_back(directories[b] + "/" + batch[b].name + ".params");
+	  if (group_rank == 0)
+	    {
+	      system(("mkdir -p " + directories[b]).c_str());
+	      write_member_parameters(pfname, batch[b], directories[b], member_pfnames[b]);
+	    }
+	}
+      MPI_Barrier(comm);
+
+      double start = MPI_Wtime();
+      LSDCatchmentModel::set_static_parameters(statics);
+      if (lanes == 4)
+	{
+	  run_lanes<4>(base, batch, directories);
+	}
+      else if (lanes == 8)
+	{
+	  run_lanes<8>(base, batch, directories);
+	}
+      else
+	{
+	  LSDCatchmentModel *catchment = new LSDCatchmentModel(member_pfnames[0]);
+	  catchment->ensemble_member = batch[0].name;
+	  if (catchment->simulator == "openmp")
+	    {
+	      // the shared-memory engine reads its own DEM, on the first rank of the group
+	      if (group_rank == 0) runSharedMemorySimulation(member_pfnames[0]);
+	      MPI_Barrier(comm);
+	    }
+	  else
+	    {
+	      catchment->share_terrain(*base);
+	      runCatchment(catchment);
+	    }
+	  delete catchment;
+	}
+
+      if (group_rank == 0)
+	{
+	  for (std::size_t b = 0; b < batch.size(); b++)
+	    {
+	      std::cout << "Ensemble member " << batch[b].name << " (" << batch_index * lanes + b + 1 << " of " << members.size()
+			<< ") finished in " << MPI_Wtime() - start << " s, outputs in " << directories[b] << std::endl;
+	    }
+	}
+    }
+
+  MPI_Comm_free(&comm);
+  comm = MPI_COMM_WORLD;
+  LSDCatchmentModel::set_static_parameters(statics);
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (world_rank == 0) std::cout << "Ensemble finished" << std::endl;
+}
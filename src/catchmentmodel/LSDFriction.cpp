@@ -0,0 +1,59 @@
+// LSDFriction.cpp
+
+// Validation of the fast friction kernel against the reference one
+
+#include <algorithm>
+#include <iostream>
+
+#include "catchmentmodel/LSDFriction.hpp"
+
+
+namespace LSDFriction
+{
+  Deviation validate(double gravity, double mannings, double froude_limit,
+		     double hflow_threshold, double max_depth, double time_step)
+  {
+    const int DEPTHS = 400, VELOCITIES = 41;
+    const double slopes[] = {0.0, 1e-5, 1e-4, 1e-3, 1e-2, 0.1, 1.0};
+
+    Deviation deviation = {0.0, 0.0, 0};
+    double lowest = std::max(hflow_threshold, 1e-6);
+    for (int d = 0; d < DEPTHS; d++)
+      {
+	// log spaced flow depths
+	double hflow = lowest * std::pow(max_depth / lowest, d / double(DEPTHS - 1));
+	double reference_pow = std::pow(hflow, (10.0 / 3.0));
+	deviation.pow_10_3 = std::max(deviation.pow_10_3, std::abs(pow_10_3(hflow) - reference_pow) / reference_pow);
+
+	for (int v = 0; v < VELOCITIES; v++)
+	  {
+	    double q_old = (-10.0 + 20.0 * v / (VELOCITIES - 1)) * hflow;
+	    for (double slope : slopes)
+	      {
+		for (int sign = -1; sign <= 1; sign += 2)
+		  {
+		    double reference = froude_check<false>(update_q<false>(q_old, hflow, sign * slope, time_step, gravity, mannings),
+							   hflow, gravity, froude_limit);
+		    double fast = froude_check<true>(update_q<true>(q_old, hflow, sign * slope, time_step, gravity, mannings),
+						     hflow, gravity, froude_limit);
+		    double difference = std::abs(fast - reference);
+		    if (reference != 0.0) difference /= std::abs(reference);
+		    deviation.discharge = std::max(deviation.discharge, difference);
+		    deviation.samples++;
+		  }
+	      }
+	  }
+      }
+    return deviation;
+  }
+
+
+
+  void report(const Deviation& deviation)
+  {
+    std::cout << "Fast friction kernel, largest relative deviation from the reference kernel over "
+	      << deviation.samples << " face states:" << std::endl
+	      << "  hflow^(10/3):                     " << deviation.pow_10_3 << std::endl
+	      << "  discharge after the Froude limit: " << deviation.discharge << std::endl;
+  }
+}
@@ -0,0 +1,336 @@
+// LSDHardwareCounters.cpp
+
+// Hardware counter sampling of the catchment model
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+#include <omp.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "catchmentmodel/LSDHardwareCounters.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+#include "catchmentmodel/LSDProfile.hpp"
+
+
+bool LSDHardwareCounters::counting = false;
+std::vector<LSDHardwareCounters::Event> LSDHardwareCounters::events[NUM_COUNTERS];
+double LSDHardwareCounters::totals[NUM_COUNTERS] = {0.0, 0.0, 0.0, 0.0, 0.0};
+double LSDHardwareCounters::cell_updates = 0.0;
+unsigned LSDHardwareCounters::samples = 0;
+MPI_Comm LSDHardwareCounters::node_comm = MPI_COMM_NULL;
+
+// bytes per cache line, for the LLC miss estimate of the memory traffic
+static const double LINE_BYTES = 64.0;
+
+
+
+#ifdef __linux__
+namespace
+{
+  int perf_open(unsigned type, unsigned long long config, int pid, int cpu, bool user_only)
+  {
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = user_only;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, pid, cpu, -1, 0);
+  }
+
+  bool read_first_line(const std::string& filename, std::string& line)
+  {
+    std::ifstream file(filename.c_str());
+    return file && std::getline(file, line);
+  }
+}
+#endif
+
+
+
+bool LSDHardwareCounters::open()
+{
+  MPI_Comm_split_type(LSDEnsemble::communicator(), MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+
+#ifdef __linux__
+  // core counters, opened by each thread for itself
+  static const unsigned long long configs[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+  int num_threads = omp_get_max_threads();
+  for (int c = 0; c < 3; c++) events[c].resize(num_threads);
+
+#pragma omp parallel
+  {
+    int thread = omp_get_thread_num();
+    for (int c = 0; c < 3; c++)
+      {
+	Event event = {perf_open(PERF_TYPE_HARDWARE, configs[c], 0, -1, true), 1.0, 0, 0, 0};
+	events[c][thread] = event;
+      }
+  }
+
+  // memory controller counters, socket-wide, on the first rank of the node
+  int node_rank;
+  MPI_Comm_rank(node_comm, &node_rank);
+  if (node_rank == 0)
+    {
+      DIR *devices = opendir("/sys/bus/event_source/devices");
+      if (devices)
+	{
+	  for (struct dirent *entry = readdir(devices); entry; entry = readdir(devices))
+	    {
+	      if (std::strncmp(entry->d_name, "uncore_imc", 10) == 0) open_uncore(entry->d_name);
+	    }
+	  closedir(devices);
+	}
+    }
+
+  // drop what could not be opened
+  int any = 0;
+  for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+      std::vector<Event> opened;
+      for (std::size_t e = 0; e < events[c].size(); e++) if (events[c][e].fd >= 0) opened.push_back(events[c][e]);
+      events[c] = opened;
+      if (!opened.empty()) any = 1;
+    }
+#else
+  int any = 0;
+#endif
+
+  // the same on all ranks, as the report is collective
+  int local_any = any, any_rank = 0;
+  MPI_Allreduce(&local_any, &any_rank, 1, MPI_INT, MPI_MAX, LSDEnsemble::communicator());
+  return any_rank;
+}
+
+
+
+void LSDHardwareCounters::open_uncore(const std::string& pmu)
+{
+#ifdef __linux__
+  std::string dir = "/sys/bus/event_source/devices/" + pmu + "/";
+  std::string type, cpumask;
+  if (!read_first_line(dir + "type", type) || !read_first_line(dir + "cpumask", cpumask)) return;
+
+  static const char *names[2] = {"cas_count_read", "cas_count_write"};
+  for (int n = 0; n < 2; n++)
+    {
+      // e.g. "event=0x04,umask=0x03", each term placed by format/<term>, e.g. "config:8-15"
+      std::string terms;
+      if (!read_first_line(dir + "events/" + names[n], terms)) continue;
+      unsigned long long config = 0;
+      std::stringstream term_list(terms);
+      std::string term;
+      while (std::getline(term_list, term, ','))
+	{
+	  std::size_t equals = term.find('=');
+	  std::string format;
+	  if (equals == std::string::npos || !read_first_line(dir + "format/" + term.substr(0, equals), format)) continue;
+	  if (format.compare(0, 7, "config:") != 0) continue;
+	  int low = std::atoi(format.c_str() + 7);
+	  config |= std::strtoull(term.c_str() + equals + 1, 0, 0) << low;
+	}
+
+      // counts are CAS operations of one line each, unless a scale to MiB is given
+      double scale = LINE_BYTES;
+      std::string scale_text, unit;
+      if (read_first_line(dir + "events/" + names[n] + ".scale", scale_text) &&
+	  read_first_line(dir + "events/" + names[n] + ".unit", unit) && unit == "MiB")
+	{
+	  scale = std::atof(scale_text.c_str()) * 1048576.0;
+	}
+
+      // one counter per socket, on the first CPU listed for each
+      std::stringstream cpu_list(cpumask);
+      std::string cpu;
+      while (std::getline(cpu_list, cpu, ','))
+	{
+	  Event event = {perf_open(std::atoi(type.c_str()), config, -1, std::atoi(cpu.c_str()), false), scale, 0, 0, 0};
+	  if (event.fd >= 0) events[IMC_READ + n].push_back(event);
+	}
+    }
+#endif
+}
+
+
+
+double LSDHardwareCounters::read_delta(Event& event, bool reset)
+{
+#ifdef __linux__
+  unsigned long long values[3];
+  if (read(event.fd, values, sizeof(values)) != sizeof(values)) return 0.0;
+
+  // scale up for the time the counter was multiplexed out
+  double delta = double(values[0] - event.value);
+  double running = double(values[2] - event.running);
+  if (running > 0) delta *= double(values[1] - event.enabled) / running;
+  event.value = values[0];
+  event.enabled = values[1];
+  event.running = values[2];
+  return reset ? 0.0 : delta * event.scale;
+#else
+  return 0.0;
+#endif
+}
+
+
+
+void LSDHardwareCounters::start(double cells)
+{
+#ifdef __linux__
+  for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+      for (std::size_t e = 0; e < events[c].size(); e++)
+	{
+	  read_delta(events[c][e], true);
+	  ioctl(events[c][e].fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+#endif
+  cell_updates += cells;
+  samples++;
+  counting = true;
+}
+
+
+
+void LSDHardwareCounters::stop()
+{
+#ifdef __linux__
+  for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+      for (std::size_t e = 0; e < events[c].size(); e++)
+	{
+	  ioctl(events[c][e].fd, PERF_EVENT_IOC_DISABLE, 0);
+	  totals[c] += read_delta(events[c][e], false);
+	}
+    }
+#endif
+  counting = false;
+}
+
+
+
+void LSDHardwareCounters::close()
+{
+#ifdef __linux__
+  for (int c = 0; c < NUM_COUNTERS; c++)
+    {
+      for (std::size_t e = 0; e < events[c].size(); e++) ::close(events[c][e].fd);
+      events[c].clear();
+    }
+#endif
+  if (node_comm != MPI_COMM_NULL) MPI_Comm_free(&node_comm);
+}
+
+
+
+void LSDHardwareCounters::write_report(const std::string& filename)
+{
+  if (counting) stop();
+
+  // the memory controllers see all ranks of the node
+  double node_cell_updates = 0.0;
+  MPI_Allreduce(&cell_updates, &node_cell_updates, 1, MPI_DOUBLE, MPI_SUM, node_comm);
+
+  // -1 marks counters that are not available
+  const int NUM_VALUES = 7;
+  double values[NUM_VALUES] = {double(samples), cell_updates, -1, -1, -1, -1, -1};
+  for (int c = CYCLES; c <= LLC_MISSES; c++) if (!events[c].empty()) values[2 + c] = totals[c];
+  if (!events[CYCLES].empty() && !events[INSTRUCTIONS].empty() && totals[CYCLES] > 0)
+    {
+      values[5] = totals[INSTRUCTIONS] / totals[CYCLES];
+    }
+  if (!events[IMC_READ].empty() && node_cell_updates > 0)
+    {
+      values[6] = (totals[IMC_READ] + totals[IMC_WRITE]) / node_cell_updates;
+    }
+
+  int rank, size;
+  MPI_Comm_rank(LSDEnsemble::communicator(), &rank);
+  MPI_Comm_size(LSDEnsemble::communicator(), &size);
+  std::vector<double> all_values(rank == 0 ? size * NUM_VALUES : 0);
+  MPI_Gather(values, NUM_VALUES, MPI_DOUBLE, all_values.data(), NUM_VALUES, MPI_DOUBLE, 0, LSDEnsemble::communicator());
+
+  if (rank != 0) return;
+
+  std::ofstream report(filename.c_str());
+  report << "rank,sampled_steps,cell_updates,cycles,instructions,llc_misses,ipc,llc_bytes_per_cell,dram_bytes_per_cell" << std::endl;
+  report << std::setprecision(6);
+  for (int r = 0; r < size; r++)
+    {
+      const double *row = &all_values[r * NUM_VALUES];
+      report << r << "," << row[0] << "," << row[1];
+      for (int v = 2; v < 6; v++)
+	{
+	  report << ",";
+	  if (row[v] >= 0) report << row[v]; else report << "na";
+	}
+      report << ",";
+      if (row[4] >= 0 && row[1] > 0) report << row[4] * LINE_BYTES / row[1]; else report << "na";
+      report << ",";
+      if (row[6] >= 0) report << row[6]; else report << "na";
+      report << std::endl;
+    }
+  std::cout << "Hardware counters written to " << filename << std::endl;
+}
+
+
+
+
+
+HardwareCounterSteerer::HardwareCounterSteerer(unsigned interval_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, HardwareCounterSteerer>(1),
+  interval(interval_in > 1 ? interval_in : 2),
+  cells(0.0)
+{}
+
+
+
+void HardwareCounterSteerer::nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+				      unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  cells += validRegion.size();
+  if (!lastCall) return;
+
+  if (LSDHardwareCounters::counting) LSDHardwareCounters::stop();
+  // half an interval after the steps with timed kernel phases, and without
+  // the clock reads of the phase timing on the counted sweep
+  if (event != LibGeoDecomp::STEERER_ALL_DONE && step % interval == interval / 2)
+    {
+      LSDProfile::sample = false;
+      LSDHardwareCounters::start(cells);
+    }
+  cells = 0.0;
+}
+
+
+
+
+
+HardwareCounterWriter::HardwareCounterWriter() :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, HardwareCounterWriter>("counters", 1)
+{}
+
+
+
+void HardwareCounterWriter::stepFinished(const GridType& grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+					 unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  if (LSDHardwareCounters::counting) LSDHardwareCounters::stop();
+}
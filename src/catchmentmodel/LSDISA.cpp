@@ -0,0 +1,60 @@
+// LSDISA.cpp
+
+// Instruction set dispatch of the catchment model
+
+#include <iostream>
+
+#include "catchmentmodel/LSDISA.hpp"
+
+
+namespace LSDISA
+{
+  Level detect()
+  {
+#ifdef LSD_ISA_X86_64
+    // also checks that the OS saves the vector registers (XGETBV)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return AVX512;
+    if (__builtin_cpu_supports("avx2")) return AVX2;
+#endif
+    return SSE2;
+  }
+
+
+
+  Level select(const std::string& requested)
+  {
+    Level available = detect();
+    if (requested == "auto" || requested.empty()) return available;
+
+    Level level;
+    if (requested == "sse2") level = SSE2;
+    else if (requested == "avx2") level = AVX2;
+    else if (requested == "avx512") level = AVX512;
+    else
+      {
+	std::cout << "isa: unknown value " << requested << ", options are auto, sse2, avx2 or avx512. Using "
+		  << name(available) << std::endl;
+	return available;
+      }
+
+    if (level > available)
+      {
+	std::cout << "isa: " << requested << " is not supported on this node, using " << name(available) << std::endl;
+	return available;
+      }
+    return level;
+  }
+
+
+
+  const char* name(Level level)
+  {
+    switch (level)
+      {
+      case AVX512: return "avx512";
+      case AVX2: return "avx2";
+      default: return "sse2";
+      }
+  }
+}
@@ -0,0 +1,75 @@
+// LSDMassBalance.cpp
+
+// Distributed water mass balance for the catchment model
+
+#include <cmath>
+
+#include "catchmentmodel/LSDMassBalance.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+
+// The per-thread partials are defined with the kernel, in cell.cpp
+
+
+
+
+
+MassBalanceSteerer::MassBalanceSteerer(LSDCatchmentModel *catchment_in, unsigned interval_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, MassBalanceSteerer>(1),
+  catchment(catchment_in),
+  interval(interval_in > 0 ? interval_in : 1),
+  reduction_pending(false),
+  interval_time(0.0)
+{}
+
+
+
+void MassBalanceSteerer::nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+				  unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  if (!lastCall) return;
+
+  // A rollback dropped the steps summed so far (see StabilitySteerer)
+  if (LSDMassBalance::discarded)
+    {
+      LSDMassBalance::discarded = false;
+      reduction_pending = false;
+      interval_time = 0.0;
+    }
+
+  // The storage sample was taken during the previous step's update
+  if (reduction_pending || event == LibGeoDecomp::STEERER_ALL_DONE)
+    {
+      reduce(reduction_pending);
+      reduction_pending = false;
+    }
+  if (event == LibGeoDecomp::STEERER_ALL_DONE) return;
+
+  // timestep the cells are about to use, as in LSDCatchmentModel::increment_counters()
+  Cell::set_global_timefactor();
+  interval_time += Cell::set_local_timefactor();
+
+  LSDMassBalance::sample_storage = ((step + 1) % interval == 0);
+  reduction_pending = LSDMassBalance::sample_storage;
+}
+
+
+
+void MassBalanceSteerer::reduce(bool storage_sampled)
+{
+  double local_totals[LSDMassBalance::NUM_TERMS];
+  double totals[LSDMassBalance::NUM_TERMS];
+
+  LSDMassBalance::collect(local_totals);
+  MPI_Allreduce(local_totals, totals, LSDMassBalance::NUM_TERMS, MPI_DOUBLE, MPI_SUM, LSDEnsemble::communicator());
+
+  catchment->update_water_budget(totals, interval_time, storage_sampled);
+  interval_time = 0.0;
+
+  if (catchment->get_cycle() >= catchment->tx)
+    {
+      if (LSDEnsemble::rank() == 0) catchment->write_output_timeseries();
+      while (catchment->tx <= catchment->get_cycle()) catchment->tx += catchment->output_file_save_interval;
+    }
+}
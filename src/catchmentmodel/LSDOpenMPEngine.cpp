@@ -0,0 +1,1073 @@
+// LSDOpenMPEngine.cpp
+
+// Shared-memory engine of the catchment model, without MPI or LibGeoDecomp
+
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+
+#include <omp.h>
+
+#include "TNT/tnt.h"
+#include "topotools/LSDRaster.hpp"
+#include "catchmentmodel/LSDUtils.hpp"
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+
+using namespace LSDUtils;
+
+
+constexpr double LSDOpenMPEngine::gravity;
+
+
+
+LSDOpenMPEngine::LSDOpenMPEngine(const std::string& pfname)
+{
+  read_parameters(pfname);
+  load_dem(read_fname);
+  attach_nests(pfname);
+
+  isa = LSDISA::select(isa_request);
+  select_tile_kernel();
+}
+
+
+
+LSDOpenMPEngine::LSDOpenMPEngine(const std::string& pfname, const std::string& nest_dem)
+{
+  read_parameters(pfname);
+  nest_dems.clear();
+  nest_maxdepths.clear();
+  ghost = 1;
+  load_dem(nest_dem);
+
+  isa = LSDISA::select(isa_request);
+  select_tile_kernel();
+}
+
+
+
+LSDOpenMPEngine::~LSDOpenMPEngine()
+{
+  for (std::size_t n = 0; n < nests.size(); n++) delete nests[n].grid;
+}
+
+
+
+void LSDOpenMPEngine::select_tile_kernel()
+{
+  tile_kernel = fast_friction ? &LSDOpenMPEngine::update_tile_sse2<true> : &LSDOpenMPEngine::update_tile_sse2<false>;
+#ifdef LSD_ISA_X86_64
+  if (isa == LSDISA::AVX512)
+    {
+      tile_kernel = fast_friction ? &LSDOpenMPEngine::update_tile_avx512<true> : &LSDOpenMPEngine::update_tile_avx512<false>;
+    }
+  else if (isa == LSDISA::AVX2)
+    {
+      tile_kernel = fast_friction ? &LSDOpenMPEngine::update_tile_avx2<true> : &LSDOpenMPEngine::update_tile_avx2<false>;
+    }
+#endif
+
+  for (std::size_t n = 0; n < nests.size(); n++)
+    {
+      nests[n].grid->fast_friction = fast_friction;
+      nests[n].grid->isa = isa;
+      nests[n].grid->select_tile_kernel();
+    }
+}
+
+
+
+void LSDOpenMPEngine::read_parameters(const std::string& pfname)
+{
+  std::cout << "Initialising the model parameters..." << std::endl;
+  std::ifstream infile(pfname.c_str());
+  std::string parameter, value, lower;
+
+  while (infile.good())
+    {
+      parse_line(infile, parameter, value);
+      lower = parameter;
+      if (parameter == "NULL")
+	continue;
+      for (unsigned int i=0; i<parameter.length(); ++i)
+	{
+	  lower[i] = std::tolower(parameter[i]);  // converts to lowercase
+	}
+      value = RemoveControlCharactersFromEndOfString(value);
+
+      // File information
+      if (lower == "dem_read_extension")
+	{
+	  dem_read_extension = value;
+	}
+      else if (lower == "dem_write_extension")
+	{
+	  dem_write_extension = value;
+	}
+      else if (lower == "read_path")
+	{
+	  read_path = value;
+	}
+      else if (lower == "read_fname")
+	{
+	  read_fname = value;
+	  std::cout << "DEM file name: " << read_fname << std::endl;
+	}
+      else if (lower == "write_path")
+	{
+	  write_path = value;
+	  std::cout << "output write path: " << write_path << std::endl;
+	}
+      else if (lower == "write_fname")
+	{
+	  write_fname = value;
+	}
+      else if (lower == "timeseries_save_interval")
+	{
+	  output_file_save_interval = atof(value.c_str());
+	}
+      else if (lower == "mass_balance_interval")
+	{
+	  mass_balance_interval = atoi(value.c_str());
+	}
+      else if (lower == "no_of_iterations")
+	{
+	  no_of_iterations = atoi(value.c_str());
+	  std::cout << "no_of_iterations: " << no_of_iterations << std::endl;
+	}
+
+      // Hydrology
+      else if (lower == "in_out_difference")
+	{
+	  in_out_difference_allowed = atof(value.c_str());
+	}
+      else if (lower == "hflow_threshold")
+	{
+	  hflow_threshold = atof(value.c_str());
+	}
+      else if (lower == "water_depth_erosion_threshold")
+	{
+	  water_depth_erosion_threshold = atof(value.c_str());
+	}
+      else if (lower == "slope_on_edge_cell")
+	{
+	  edgeslope = atof(value.c_str());
+	}
+      else if (lower == "courant_number")
+	{
+	  courant_number = atof(value.c_str());
+	}
+      else if (lower == "maxdepth")
+	{
+	  maxdepth = atof(value.c_str());
+	}
+      else if (lower == "froude_num_limit")
+	{
+	  froude_limit = atof(value.c_str());
+	}
+      else if (lower == "mannings_n")
+	{
+	  mannings = atof(value.c_str());
+	}
+      else if (lower == "water_input_depth")
+	{
+	  water_input_depth = atof(value.c_str());
+	}
+      else if (lower == "fast_friction")
+	{
+	  fast_friction = (value == "yes") ? true : false;
+	}
+      else if (lower == "friction_validation")
+	{
+	  friction_validation = (value == "yes") ? true : false;
+	}
+      else if (lower == "rainfall_data_on")
+	{
+	  // catchment_water_input_and_hydrology does not use the rainfall yet
+	  if (value == "yes") std::cout << "rainfall_data_on: the rainfall series is not used by the openmp simulator" << std::endl;
+	}
+
+      // Engine and outputs
+      else if (lower == "simulator")
+	{
+	  if (value != "openmp") std::cout << "simulator: " << value << " needs the MPI build, running the openmp simulator" << std::endl;
+	}
+      else if (lower == "openmp_tile_rows")
+	{
+	  tile_rows = std::max(1, atoi(value.c_str()));
+	}
+      else if (lower == "openmp_tile_columns")
+	{
+	  tile_columns = std::max(1, atoi(value.c_str()));
+	}
+      else if (lower == "isa")
+	{
+	  isa_request = value;
+	}
+      else if (lower == "write_waterdepth_file")
+	{
+	  write_waterd_file = (value == "yes") ? true : false;
+	}
+      else if (lower == "waterdepth_outfile_name")
+	{
+	  waterdepth_fname = value;
+	}
+      else if (lower == "raster_output_interval")
+	{
+	  raster_output_interval = atof(value.c_str());
+	}
+      else if (lower == "elevation_ppm")
+	{
+	  elevation_ppm = (value == "yes") ? true : false;
+	}
+      else if (lower == "water_depth_ppm")
+	{
+	  water_depth_ppm = (value == "yes") ? true : false;
+	}
+      else if (lower == "elevation_ppm_interval")
+	{
+	  elevation_ppm_interval = std::max(1, atoi(value.c_str()));
+	}
+      else if (lower == "water_depth_ppm_interval")
+	{
+	  water_depth_ppm_interval = std::max(1, atoi(value.c_str()));
+	}
+      else if (lower == "pixels_per_cell")
+	{
+	  pixels_per_cell = std::max(1, atoi(value.c_str()));
+	}
+
+      // Nests, one line each
+      else if (lower == "nest_dem")
+	{
+	  nest_dems.push_back(value);
+	  nest_maxdepths.push_back(0.0);
+	}
+      else if (lower == "nest_maxdepth")
+	{
+	  if (nest_dems.empty())
+	    {
+	      std::cout << "nest_maxdepth: " << value << " needs a nest_dem line before it" << std::endl;
+	      exit(EXIT_FAILURE);
+	    }
+	  nest_maxdepths.back() = atof(value.c_str());
+	}
+      else if (lower == "local_time_stepping")
+	{
+	  local_time_stepping = (value == "yes") ? true : false;
+	}
+    }
+
+  tx = output_file_save_interval;
+  next_raster_time = raster_output_interval;
+  if (mass_balance_interval < 1) mass_balance_interval = 1;
+}
+
+
+
+// With ghost cells, the DEM goes inside a ring of that width, which
+// attach_nests() fills from the outer grid
+void LSDOpenMPEngine::load_dem(const std::string& fname)
+{
+  std::string DEM_FILENAME = read_path + "/" + fname + "." + dem_read_extension;
+  if (!does_file_exist(DEM_FILENAME))
+    {
+      std::cout << "No terrain DEM found by name of: " << DEM_FILENAME
+		<< std::endl
+		<< "You must supply a correct path and filename "
+		<< "in the input parameter file" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+  // the header in double precision, as LSDCatchmentModel::initialise_model_domain_extents()
+  std::ifstream data_in(DEM_FILENAME.c_str());
+  std::string str;
+  data_in >> str >> columns
+	  >> str >> rows
+	  >> str >> xll
+	  >> str >> yll
+	  >> str >> DX
+	  >> str >> no_data_value;
+  DY = DX;
+
+  LSDRaster elevR;
+  elevR.read_ascii_raster(DEM_FILENAME);
+  TNT::Array2D<double> elev = elevR.get_RasterData_dbl();
+  if (rows < 2 || columns < 2)
+    {
+      std::cout << "The DEM needs at least 2 rows and 2 columns" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  rows += 2 * ghost;
+  columns += 2 * ghost;
+
+  // first touch by the threads that update the tiles
+  std::size_t cells = std::size_t(rows) * columns;
+  elevation.resize(cells);
+  for (int b = 0; b < 2; b++)
+    {
+      depth[b].resize(cells);
+      qx[b].resize(cells);
+      qy[b].resize(cells);
+    }
+#pragma omp parallel for schedule(static)
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  std::size_t i = std::size_t(y) * columns + x;
+	  bool inside = (y >= ghost && y < rows - ghost && x >= ghost && x < columns - ghost);
+	  elevation[i] = inside ? elev[y - ghost][x - ghost] : no_data_value;
+	  for (int b = 0; b < 2; b++) depth[b][i] = qx[b][i] = qy[b][i] = 0.0;
+	}
+    }
+  if (!ghost) std::cout << "The model domain is " << columns << " x " << rows << " cells of " << DX << " m" << std::endl;
+}
+
+
+
+void LSDOpenMPEngine::attach_nests(const std::string& pfname)
+{
+  for (std::size_t n = 0; n < nest_dems.size(); n++)
+    {
+      Nest nest;
+      nest.name = nest_dems[n];
+      nest.grid = new LSDOpenMPEngine(pfname, nest_dems[n]);
+      LSDOpenMPEngine& fine = *nest.grid;
+      int nest_rows = fine.rows - 2, nest_columns = fine.columns - 2;
+
+      // whole nest cells per cell, and the nest edges on cell edges
+      double ratio = DX / fine.DX;
+      double column0 = (fine.xll - xll) / DX;
+      double row0 = ((yll + rows * DY) - (fine.yll + nest_rows * fine.DY)) / DY;
+      nest.ratio = int(std::floor(ratio + 0.5));
+      nest.column0 = int(std::floor(column0 + 0.5));
+      nest.row0 = int(std::floor(row0 + 0.5));
+      int block_rows = nest_rows / std::max(nest.ratio, 1), block_columns = nest_columns / std::max(nest.ratio, 1);
+
+      std::string problem;
+      if (nest.ratio < 2 || std::abs(ratio - nest.ratio) > 1e-6)
+	{
+	  problem = "its cell size does not divide that of the catchment DEM";
+	}
+      else if (nest_rows % nest.ratio || nest_columns % nest.ratio
+	       || std::abs(column0 - nest.column0) > 1e-6 || std::abs(row0 - nest.row0) > 1e-6)
+	{
+	  problem = "its edges are not on cell edges of the catchment DEM";
+	}
+      else if (nest.row0 < 1 || nest.column0 < 1 || nest.row0 + block_rows > rows - 1 || nest.column0 + block_columns > columns - 1)
+	{
+	  problem = "it is not at least one cell inside the catchment DEM";
+	}
+      for (std::size_t other = 0; other < nests.size() && problem.empty(); other++)
+	{
+	  const Nest& o = nests[other];
+	  int other_rows = (o.grid->rows - 2) / o.ratio, other_columns = (o.grid->columns - 2) / o.ratio;
+	  if (nest.row0 <= o.row0 + other_rows && o.row0 <= nest.row0 + block_rows
+	      && nest.column0 <= o.column0 + other_columns && o.column0 <= nest.column0 + block_columns)
+	    {
+	      problem = "it is not at least one cell away from nest " + o.name;
+	    }
+	}
+      if (!problem.empty())
+	{
+	  std::cout << "Nest " << nest.name << " does not fit the catchment DEM: " << problem << std::endl;
+	  exit(EXIT_FAILURE);
+	}
+
+      fill_ghosts(nest, elevation, elevation, 0.0, fine.elevation);
+      fine.waterdepth_fname = waterdepth_fname + "_" + nest.name;
+      if (nest_maxdepths[n] > 0) fine.maxdepth = nest_maxdepths[n];
+      nest.flux.resize(2 * (block_rows + block_columns));
+      nests.push_back(nest);
+      std::cout << "Nest " << nest.name << ": " << nest_columns << " x " << nest_rows << " cells of " << fine.DX
+		<< " m over columns " << nest.column0 << " to " << nest.column0 + block_columns - 1
+		<< " and rows " << nest.row0 << " to " << nest.row0 + block_rows - 1;
+      if (local_time_stepping) std::cout << ", " << nest_steps(nest, courant_step()) << " steps per step of the catchment grid";
+      std::cout << std::endl;
+    }
+}
+
+
+
+// The ring of a nest: the outer cells along its edges, each repeated for
+// the nest cells it borders
+void LSDOpenMPEngine::fill_ghosts(const Nest& nest, const std::vector<double>& start, const std::vector<double>& end,
+				  double weight, std::vector<double>& fine) const
+{
+  const int fine_rows = nest.grid->rows, fine_columns = nest.grid->columns;
+  for (int y = 0; y < fine_rows; y++)
+    {
+      bool ring_row = (y == 0 || y == fine_rows - 1);
+      int outer_y = nest.row0 + ((y == 0) ? -1 : (y - 1) / nest.ratio);
+      for (int x = 0; x < fine_columns; x += (ring_row ? 1 : fine_columns - 1))
+	{
+	  int outer_x = nest.column0 + ((x == 0) ? -1 : (x - 1) / nest.ratio);
+	  std::size_t i = std::size_t(outer_y) * columns + outer_x;
+	  fine[std::size_t(y) * fine_columns + x] = start[i] + weight * (end[i] - start[i]);
+	}
+    }
+}
+
+
+
+double LSDOpenMPEngine::courant_step() const
+{
+  double step = courant_number * (DX / std::sqrt(gravity * std::max(maxdepth, 0.1)));
+  if (!local_time_stepping)
+    {
+      for (std::size_t n = 0; n < nests.size(); n++) step = std::min(step, nests[n].grid->courant_step());
+    }
+  return step;
+}
+
+
+
+int LSDOpenMPEngine::nest_steps(const Nest& nest, double local_time_factor) const
+{
+  if (!local_time_stepping) return 1;
+  return std::max(1, int(std::ceil(local_time_factor / nest.grid->courant_step() - 1e-9)));
+}
+
+
+
+void LSDOpenMPEngine::set_global_timefactor()
+{
+  if (maxdepth <= 0.1)
+    {
+      maxdepth = 0.1;
+    }
+  double step = courant_step();
+  if (time_factor < step)
+    {
+      time_factor = step;
+    }
+  if (input_output_difference > in_out_difference_allowed && time_factor > step)
+    {
+      time_factor = step;
+    }
+}
+
+
+
+double LSDOpenMPEngine::local_timefactor() const
+{
+  double local_time_factor = time_factor;
+  if (local_time_factor > courant_step())
+    {
+      local_time_factor = courant_step();
+    }
+  return local_time_factor;
+}
+
+
+
+// The face routing shared with the Cell kernel, so both engines give the
+// same results
+template<bool FAST_FRICTION>
+inline double LSDOpenMPEngine::route(double q_old, double h, double z, double upstream_h, double upstream_z,
+				     double slope, double local_time_factor, double delta) const
+{
+  return LSDFriction::route<FAST_FRICTION>(q_old, h, z, upstream_h, upstream_z, slope, local_time_factor, delta,
+					   hflow_threshold, gravity, mannings, froude_limit);
+}
+
+
+
+// One cell of Cell::update. The cell type follows from the column (a
+// template parameter, so the interior loop carries no edge tests) and the
+// row; corners take the rules of the west and east edges where those of
+// Cell::update do. Returns the water leaving through the domain edge.
+template<LSDOpenMPEngine::Column COLUMN, bool FAST_FRICTION>
+inline double LSDOpenMPEngine::update_cell(const Row& row, int x, double local_time_factor)
+{
+  const bool first = (COLUMN != INNER) && row.first;
+  const bool last = (COLUMN != INNER) && row.last;
+  double h = row.depth[x];
+  double z = row.elevation[x];
+
+  // flow_route_x
+  double west_elevation = no_data_value, west_depth = 0.0, slope_x = edgeslope;
+  if (COLUMN != WEST_EDGE)
+    {
+      west_elevation = row.elevation[x - 1];
+      west_depth = row.depth[x - 1];
+      if (COLUMN == INTERIOR || COLUMN == INNER) slope_x = ((west_elevation + west_depth) - (z + h)) / DX;
+    }
+  row.new_qx[x] = route<FAST_FRICTION>(row.qx[x], h, z, west_depth, west_elevation, slope_x, local_time_factor, DX);
+
+  // flow_route_y
+  double north_elevation = no_data_value, north_depth = 0.0, slope_y = edgeslope;
+  if (!first)
+    {
+      north_elevation = row.north_elevation[x];
+      north_depth = row.north_depth[x];
+      if (!last) slope_y = ((north_elevation + north_depth) - (z + h)) / DY;
+    }
+  row.new_qy[x] = route<FAST_FRICTION>(row.qy[x], h, z, north_depth, north_elevation, slope_y, local_time_factor, DY);
+
+  // depth_update, from the old discharges
+  double east_qx = (COLUMN == EAST_EDGE) ? 0.0 : row.qx[x + 1];
+  double south_qy = last ? 0.0 : row.south_qy[x];
+  double new_depth = water_input_depth + h + local_time_factor * ( (east_qx - row.qx[x])/DX + (south_qy - row.qy[x])/DY );
+
+  // water_flux_out, on every edge cell
+  double edge_out = 0.0;
+  if ((COLUMN == WEST_EDGE || COLUMN == EAST_EDGE || first || last) && h > water_depth_erosion_threshold)
+    {
+      edge_out = (new_depth - water_depth_erosion_threshold) * DX * DY;
+      new_depth = water_depth_erosion_threshold;
+    }
+  row.new_depth[x] = new_depth;
+  return edge_out;
+}
+
+
+
+template<bool FAST_FRICTION>
+void LSDOpenMPEngine::update_tile(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget)
+{
+  const int old_buffer = current, new_buffer = 1 - current;
+  for (int y = y0; y < y1; y++)
+    {
+      std::size_t start = std::size_t(y) * columns;
+      Row row;
+      row.elevation = &elevation[start];
+      row.depth = &depth[old_buffer][start];
+      row.qx = &qx[old_buffer][start];
+      row.qy = &qy[old_buffer][start];
+      row.first = (y == 0);
+      row.last = (y == rows - 1);
+      row.north_elevation = row.first ? 0 : row.elevation - columns;
+      row.north_depth = row.first ? 0 : row.depth - columns;
+      row.south_qy = row.last ? 0 : row.qy + columns;
+      row.new_depth = &depth[new_buffer][start];
+      row.new_qx = &qx[new_buffer][start];
+      row.new_qy = &qy[new_buffer][start];
+
+      // the water_input_depth of the depth update, and the discharges through
+      // the west and north faces of the grid (see Cell::water_flux_out)
+      double input = water_input_depth * DX * DY * (x1 - x0);
+      double west_out = 0.0, east_out = 0.0, row_out = 0.0;
+      if (x0 == 0)
+	{
+	  west_out = row.qx[0] * local_time_factor * DY;
+	  west_out += update_cell<WEST_EDGE, FAST_FRICTION>(row, 0, local_time_factor);
+	}
+      if (row.first)
+	{
+	  for (int x = x0; x < x1; x++) row_out += row.qy[x] * local_time_factor * DX;
+	}
+
+      // the sums run in order, so that every instruction set gives the same budget
+      int x_begin = std::max(x0, 1), x_end = std::min(x1, columns - 1);
+      if (row.first || row.last)
+	{
+	  for (int x = x_begin; x < x_end; x++) row_out += update_cell<INTERIOR, FAST_FRICTION>(row, x, local_time_factor);
+	}
+      else
+	{
+#pragma omp simd
+	  for (int x = x_begin; x < x_end; x++) update_cell<INNER, FAST_FRICTION>(row, x, local_time_factor);
+	}
+
+      if (x1 == columns) east_out = update_cell<EAST_EDGE, FAST_FRICTION>(row, columns - 1, local_time_factor);
+
+      budget.input += input;
+      budget.out_west += west_out;
+      budget.out_east += east_out;
+      if (row.first) budget.out_north += row_out;
+      if (row.last) budget.out_south += row_out;
+
+      // sum_stored_water
+      if (sample_storage)
+	{
+	  double stored = 0.0, wet = 0.0;
+	  for (int x = x0; x < x1; x++)
+	    {
+	      stored += row.new_depth[x] * DX * DY;
+	      wet += (row.new_depth[x] > hflow_threshold) ? 1.0 : 0.0;
+	    }
+	  budget.stored += stored;
+	  budget.wet += wet;
+	}
+    }
+}
+
+
+
+template<bool FAST_FRICTION>
+void LSDOpenMPEngine::update_tile_sse2(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget)
+{
+  update_tile<FAST_FRICTION>(y0, y1, x0, x1, local_time_factor, sample_storage, budget);
+}
+
+#ifdef LSD_ISA_X86_64
+template<bool FAST_FRICTION>
+void LSDOpenMPEngine::update_tile_avx2(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget)
+{
+  update_tile<FAST_FRICTION>(y0, y1, x0, x1, local_time_factor, sample_storage, budget);
+}
+
+template<bool FAST_FRICTION>
+void LSDOpenMPEngine::update_tile_avx512(int y0, int y1, int x0, int x1, double local_time_factor, bool sample_storage, Budget& budget)
+{
+  update_tile<FAST_FRICTION>(y0, y1, x0, x1, local_time_factor, sample_storage, budget);
+}
+#endif
+
+
+
+void LSDOpenMPEngine::sweep(double local_time_factor, bool sample_storage, Budget& budget)
+{
+  int tiles_y = (rows + tile_rows - 1) / tile_rows;
+  int tiles_x = (columns + tile_columns - 1) / tile_columns;
+  int tiles = tiles_y * tiles_x;
+
+  double input = 0.0, out_west = 0.0, out_north = 0.0, out_east = 0.0, out_south = 0.0, stored = 0.0, wet = 0.0;
+#pragma omp parallel for schedule(static) reduction(+:input, out_west, out_north, out_east, out_south, stored, wet)
+  for (int tile = 0; tile < tiles; tile++)
+    {
+      int y0 = (tile / tiles_x) * tile_rows;
+      int x0 = (tile % tiles_x) * tile_columns;
+      Budget tile_budget = {0, 0, 0, 0, 0, 0, 0};
+      (this->*tile_kernel)(y0, std::min(y0 + tile_rows, rows), x0, std::min(x0 + tile_columns, columns),
+			   local_time_factor, sample_storage, tile_budget);
+      input += tile_budget.input;
+      out_west += tile_budget.out_west;
+      out_north += tile_budget.out_north;
+      out_east += tile_budget.out_east;
+      out_south += tile_budget.out_south;
+      stored += tile_budget.stored;
+      wet += tile_budget.wet;
+    }
+
+  budget.input += input;
+  budget.out_west += out_west;
+  budget.out_north += out_north;
+  budget.out_east += out_east;
+  budget.out_south += out_south;
+  budget.stored += stored;
+  budget.wet += wet;
+  current = 1 - current;
+}
+
+
+
+// The nests sweep from the outer depths around them over the step, then
+// their new state replaces that of the outer cells under them. The outer
+// faces along a nest boundary take the mean discharge of the nest faces on
+// them: with one nest step per step, the next depth update of the outer
+// cells outside moves the same water across the boundary as that of the
+// nest cells inside, as both read these discharges. With several, reflux()
+// makes up the difference.
+double LSDOpenMPEngine::sweep_nests(double local_time_factor, bool sample_storage, Budget& budget)
+{
+  double updates = 0.0;
+  for (std::size_t n = 0; n < nests.size(); n++)
+    {
+      Nest& nest = nests[n];
+      LSDOpenMPEngine& fine = *nest.grid;
+      const int r = nest.ratio;
+      const int block_rows = (fine.rows - 2) / r, block_columns = (fine.columns - 2) / r;
+      const int steps = nest_steps(nest, local_time_factor);
+      const double fine_time_factor = local_time_factor / steps;
+      std::fill(nest.flux.begin(), nest.flux.end(), 0.0);
+
+      for (int step = 0; step < steps; step++)
+	{
+	  fill_ghosts(nest, depth[1 - current], depth[current], double(step) / steps, fine.depth[fine.current]);
+
+	  // the budget of the nest is that of its ring, which is not the catchment's
+	  Budget ring = {0, 0, 0, 0, 0, 0, 0};
+	  fine.sweep(fine_time_factor, false, ring);
+	  if (fast_friction) fine.update_nest_boundary<true>(fine_time_factor);
+	  else fine.update_nest_boundary<false>(fine_time_factor);
+
+	  // the boundary discharges the depth update of this step read: west,
+	  // east, north and south, per outer face
+	  const double *old_qx = &fine.qx[1 - fine.current][0];
+	  const double *old_qy = &fine.qy[1 - fine.current][0];
+	  double *flux = &nest.flux[0];
+	  for (int by = 0; by < block_rows; by++)
+	    {
+	      std::size_t f = std::size_t(1 + by * r) * fine.columns;
+	      double west = 0.0, east = 0.0;
+	      for (int k = 0; k < r; k++)
+		{
+		  west += old_qx[f + std::size_t(k) * fine.columns + 1];
+		  east += old_qx[f + std::size_t(k) * fine.columns + fine.columns - 1];
+		}
+	      flux[by] += west;
+	      flux[block_rows + by] += east;
+	    }
+	  flux += 2 * block_rows;
+	  for (int bx = 0; bx < block_columns; bx++)
+	    {
+	      std::size_t f = fine.columns + 1 + bx * r;
+	      std::size_t south = std::size_t(fine.rows - 1) * fine.columns + 1 + bx * r;
+	      double north_sum = 0.0, south_sum = 0.0;
+	      for (int k = 0; k < r; k++)
+		{
+		  north_sum += old_qy[f + k];
+		  south_sum += old_qy[south + k];
+		}
+	      flux[bx] += north_sum;
+	      flux[block_columns + bx] += south_sum;
+	    }
+	  updates += double(fine.rows) * fine.columns;
+	}
+      reflux(nest, steps, local_time_factor, sample_storage, budget);
+
+      // the sweep booked one step of water input for the outer cells under
+      // the nest, whose cells had it on each of their steps
+      budget.input += (steps - 1) * water_input_depth * DX * DY * block_rows * block_columns;
+
+      const double *fine_depth = &fine.depth[fine.current][0];
+      const double *fine_qx = &fine.qx[fine.current][0];
+      const double *fine_qy = &fine.qy[fine.current][0];
+      for (int by = 0; by <= block_rows; by++)
+	{
+	  for (int bx = 0; bx <= block_columns; bx++)
+	    {
+	      // the outer cell, and the first nest cell under it (a ghost past the block)
+	      std::size_t i = std::size_t(nest.row0 + by) * columns + nest.column0 + bx;
+	      std::size_t f = std::size_t(1 + by * r) * fine.columns + 1 + bx * r;
+
+	      if (by < block_rows)
+		{
+		  double west = 0.0;
+		  for (int k = 0; k < r; k++) west += fine_qx[f + std::size_t(k) * fine.columns];
+		  qx[current][i] = west / r;
+		}
+	      if (bx < block_columns)
+		{
+		  double north = 0.0;
+		  for (int k = 0; k < r; k++) north += fine_qy[f + k];
+		  qy[current][i] = north / r;
+		}
+	      if (by < block_rows && bx < block_columns)
+		{
+		  double volume = 0.0;
+		  for (int ky = 0; ky < r; ky++)
+		    {
+		      for (int kx = 0; kx < r; kx++) volume += fine_depth[f + std::size_t(ky) * fine.columns + kx];
+		    }
+		  double mean = volume / (r * r);
+		  if (sample_storage)
+		    {
+		      // the sweep sampled the outer depth
+		      budget.stored += (mean - depth[current][i]) * DX * DY;
+		      budget.wet += ((mean > hflow_threshold) ? 1.0 : 0.0) - ((depth[current][i] > hflow_threshold) ? 1.0 : 0.0);
+		    }
+		  depth[current][i] = mean;
+		}
+	    }
+	}
+    }
+  return updates;
+}
+
+
+
+// The outer cells along the boundary updated their depth from the outer
+// faces on it, over the whole step; the nest moved the mean of its
+// boundary discharges over its steps across them. Each outer cell takes
+// the difference, so the water leaving one level is the water entering
+// the other. With one nest step per step the two are the same.
+void LSDOpenMPEngine::reflux(const Nest& nest, int steps, double local_time_factor, bool sample_storage, Budget& budget)
+{
+  const int r = nest.ratio;
+  const int block_rows = (nest.grid->rows - 2) / r, block_columns = (nest.grid->columns - 2) / r;
+  const double *old_qx = &qx[1 - current][0];
+  const double *old_qy = &qy[1 - current][0];
+  const double *flux = &nest.flux[0];
+
+  // per face: the outer face, the outer cell outside the nest, and the sign
+  // of the face discharge in the depth update of that cell
+  for (int side = 0; side < 4; side++)
+    {
+      const bool along_y = (side < 2);
+      const int faces = along_y ? block_rows : block_columns;
+      for (int b = 0; b < faces; b++)
+	{
+	  std::size_t face, cell;
+	  double sign, delta;
+	  if (along_y)
+	    {
+	      face = std::size_t(nest.row0 + b) * columns + nest.column0 + ((side == 0) ? 0 : block_columns);
+	      cell = (side == 0) ? face - 1 : face;
+	      sign = (side == 0) ? 1.0 : -1.0;
+	      delta = DX;
+	    }
+	  else
+	    {
+	      face = std::size_t(nest.row0 + ((side == 2) ? 0 : block_rows)) * columns + nest.column0 + b;
+	      cell = (side == 2) ? face - columns : face;
+	      sign = (side == 2) ? 1.0 : -1.0;
+	      delta = DY;
+	    }
+	  double outer_q = along_y ? old_qx[face] : old_qy[face];
+	  double nest_q = (flux[b] / r) / steps;
+	  double correction = sign * local_time_factor * (nest_q - outer_q) / delta;
+
+	  double h = depth[current][cell];
+	  if (sample_storage)
+	    {
+	      budget.stored += correction * DX * DY;
+	      budget.wet += ((h + correction > hflow_threshold) ? 1.0 : 0.0) - ((h > hflow_threshold) ? 1.0 : 0.0);
+	    }
+	  depth[current][cell] = h + correction;
+	}
+      flux += faces;
+    }
+}
+
+
+
+// As the interior columns and rows of update_tile, for the west faces of
+// the east ghost column and the north faces of the south ghost row
+template<bool FAST_FRICTION>
+void LSDOpenMPEngine::update_nest_boundary(double local_time_factor)
+{
+  const int old_buffer = 1 - current, new_buffer = current;
+  for (int y = 1; y < rows - 1; y++)
+    {
+      std::size_t i = std::size_t(y) * columns + columns - 1;
+      double h = depth[old_buffer][i], z = elevation[i];
+      double west_depth = depth[old_buffer][i - 1], west_elevation = elevation[i - 1];
+      double slope_x = ((west_elevation + west_depth) - (z + h)) / DX;
+      qx[new_buffer][i] = route<FAST_FRICTION>(qx[old_buffer][i], h, z, west_depth, west_elevation, slope_x, local_time_factor, DX);
+    }
+  for (int x = 1; x < columns - 1; x++)
+    {
+      std::size_t i = std::size_t(rows - 1) * columns + x;
+      double h = depth[old_buffer][i], z = elevation[i];
+      double north_depth = depth[old_buffer][i - columns], north_elevation = elevation[i - columns];
+      double slope_y = ((north_elevation + north_depth) - (z + h)) / DY;
+      qy[new_buffer][i] = route<FAST_FRICTION>(qy[old_buffer][i], h, z, north_depth, north_elevation, slope_y, local_time_factor, DY);
+    }
+}
+
+
+
+void LSDOpenMPEngine::reduce(bool storage_sampled)
+{
+  if (interval_time > 0)
+    {
+      edge_waterOut[0] = interval_budget.out_west / interval_time;
+      edge_waterOut[1] = interval_budget.out_north / interval_time;
+      edge_waterOut[2] = interval_budget.out_east / interval_time;
+      edge_waterOut[3] = interval_budget.out_south / interval_time;
+      waterOut = edge_waterOut[0] + edge_waterOut[1] + edge_waterOut[2] + edge_waterOut[3];
+      waterinput = interval_budget.input / interval_time;
+      input_output_difference = std::abs(waterinput - waterOut);
+    }
+  if (storage_sampled)
+    {
+      stored_water_volume = interval_budget.stored;
+      wetted_cells = interval_budget.wet;
+    }
+  Budget zero = {0, 0, 0, 0, 0, 0, 0};
+  interval_budget = zero;
+  interval_time = 0.0;
+
+  if (cycle >= tx)
+    {
+      if (outputs) write_output_timeseries();
+      while (tx <= cycle) tx += output_file_save_interval;
+    }
+}
+
+
+
+void LSDOpenMPEngine::write_output_timeseries()
+{
+  std::string OUTPUT_FILE = write_path + "/" + write_fname;
+  std::ofstream write_timeseries;
+  write_timeseries.open(OUTPUT_FILE.c_str(), (timeseries_row == 0) ? std::ios_base::trunc : std::ios_base::app);
+
+  timeseries_row++;
+  write_timeseries << timeseries_row << " " << std::setprecision(8) << waterOut << " " << waterinput;
+  for (int edge = 0; edge < 4; edge++)
+    {
+      write_timeseries << " " << edge_waterOut[edge];
+    }
+  write_timeseries << " " << stored_water_volume << " " << wetted_cells << std::endl;
+}
+
+
+
+void LSDOpenMPEngine::write_water_depth_raster()
+{
+  // the DEM cells, without the ghost ring of a nest
+  int dem_rows = rows - 2 * ghost, dem_columns = columns - 2 * ghost;
+  TNT::Array2D<double> water_depth(dem_rows, dem_columns, 0.0);
+  for (int y = 0; y < dem_rows; y++)
+    {
+      for (int x = 0; x < dem_columns; x++)
+	{
+	  std::size_t i = std::size_t(y + ghost) * columns + x + ghost;
+	  water_depth[y][x] = (elevation[i] == no_data_value) ? no_data_value : depth[current][i];
+	}
+    }
+  std::stringstream name;
+  name << write_path << "/" << waterdepth_fname << int(cycle + 0.5);
+  LSDRaster raster(dem_rows, dem_columns, xll, yll, DX, no_data_value, water_depth);
+  raster.write_double_raster(name.str(), dem_write_extension);
+}
+
+
+
+// Greyscale image, pixels_per_cell pixels square per cell, as prefix.<step>.ppm
+void LSDOpenMPEngine::write_ppm(const std::vector<double>& field, double min_value, double max_value, const std::string& prefix, unsigned step) const
+{
+  std::stringstream name;
+  name << prefix << "." << std::setfill('0') << std::setw(5) << step << ".ppm";
+  std::ofstream image(name.str().c_str(), std::ios::binary);
+  int width = columns * pixels_per_cell, height = rows * pixels_per_cell;
+  image << "P6 " << width << " " << height << " 255\n";
+
+  std::vector<unsigned char> line(3 * width);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double scaled = (field[std::size_t(y) * columns + x] - min_value) / (max_value - min_value);
+	  unsigned char grey = (unsigned char)(255.0 * std::min(1.0, std::max(0.0, scaled)));
+	  std::fill(line.begin() + 3 * x * pixels_per_cell, line.begin() + 3 * (x + 1) * pixels_per_cell, grey);
+	}
+      for (int p = 0; p < pixels_per_cell; p++) image.write(reinterpret_cast<const char *>(&line[0]), line.size());
+    }
+}
+
+
+
+void LSDOpenMPEngine::run()
+{
+  if (!outputs)
+    {
+      write_waterd_file = elevation_ppm = water_depth_ppm = false;
+    }
+  if (elevation_ppm) system("mkdir -p elevation/ppm");
+  if (water_depth_ppm) system("mkdir -p water_depth/ppm");
+  if (elevation_ppm) write_ppm(elevation, 0.0, 255.0, "elevation/ppm/elevation", 0);
+  if (water_depth_ppm) write_ppm(depth[current], 0.0, 1.0, "water_depth/ppm/water_depth", 0);
+
+  Budget zero = {0, 0, 0, 0, 0, 0, 0};
+  interval_budget = zero;
+  bool reduction_pending = false;
+  double updates = 0.0;                      // cells, counting each step of the nests
+
+  std::cout << "Cell kernel instruction set: " << LSDISA::name(isa)
+	    << " (this node supports " << LSDISA::name(LSDISA::detect()) << "), "
+	    << (fast_friction ? "fast" : "reference") << " friction kernel" << std::endl;
+  std::cout << "\nStarting the openmp simulation on " << omp_get_max_threads() << " threads... \n\n";
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int step = 0; step < no_of_iterations; step++)
+    {
+      // the water budget and the model clock, as MassBalanceSteerer and ModelClockSteerer
+      if (reduction_pending)
+	{
+	  reduce(true);
+	  reduction_pending = false;
+	}
+      set_global_timefactor();
+      double local_time_factor = local_timefactor();
+      interval_time += local_time_factor;
+      bool sample_storage = ((step + 1) % mass_balance_interval == 0);
+      reduction_pending = sample_storage;
+      cycle += local_time_factor / 60;
+
+      sweep(local_time_factor, sample_storage, interval_budget);
+      updates += double(rows) * columns + sweep_nests(local_time_factor, sample_storage, interval_budget);
+
+      unsigned finished = step + 1;
+      if (elevation_ppm && finished % elevation_ppm_interval == 0) write_ppm(elevation, 0.0, 255.0, "elevation/ppm/elevation", finished);
+      if (water_depth_ppm && finished % water_depth_ppm_interval == 0) write_ppm(depth[current], 0.0, 1.0, "water_depth/ppm/water_depth", finished);
+      if (write_waterd_file && raster_output_interval > 0 && cycle >= next_raster_time)
+	{
+	  write_water_depth_raster();
+	  for (std::size_t n = 0; n < nests.size(); n++)
+	    {
+	      nests[n].grid->cycle = cycle;
+	      nests[n].grid->write_water_depth_raster();
+	    }
+	  while (next_raster_time <= cycle) next_raster_time += raster_output_interval;
+	}
+    }
+  reduce(reduction_pending);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << no_of_iterations << " steps to model time " << cycle << " minutes in " << seconds << " s, "
+	    << updates / seconds << " cell updates/s" << std::endl;
+}
+
+
+
+void LSDOpenMPEngine::validate_friction(const std::string& pfname)
+{
+  LSDFriction::report(LSDFriction::validate(gravity, mannings, froude_limit, hflow_threshold, maxdepth,
+					    courant_number * (DX / std::sqrt(gravity * maxdepth))));
+
+  LSDOpenMPEngine reference(pfname);
+  fast_friction = true;
+  reference.fast_friction = false;
+  select_tile_kernel();
+  reference.select_tile_kernel();
+  outputs = reference.outputs = false;
+  run();
+  reference.run();
+
+  // relative to the reference value, on wet cells and on faces carrying
+  // more than a thousandth of the largest discharge
+  double largest_q = 0.0;
+  for (std::size_t i = 0; i < elevation.size(); i++)
+    {
+      largest_q = std::max(largest_q, std::max(std::abs(reference.qx[reference.current][i]), std::abs(reference.qy[reference.current][i])));
+    }
+  double depth_deviation = 0.0, q_deviation = 0.0;
+  for (std::size_t i = 0; i < elevation.size(); i++)
+    {
+      double h = reference.depth[reference.current][i];
+      if (h > hflow_threshold) depth_deviation = std::max(depth_deviation, std::abs(depth[current][i] - h) / h);
+
+      const double q_fast[2] = {qx[current][i], qy[current][i]};
+      const double q_reference[2] = {reference.qx[reference.current][i], reference.qy[reference.current][i]};
+      for (int d = 0; d < 2; d++)
+	{
+	  if (std::abs(q_reference[d]) > 1e-3 * largest_q)
+	    {
+	      q_deviation = std::max(q_deviation, std::abs(q_fast[d] - q_reference[d]) / std::abs(q_reference[d]));
+	    }
+	}
+    }
+  double outflow_deviation = (reference.waterOut != 0.0) ? std::abs(waterOut - reference.waterOut) / std::abs(reference.waterOut) : std::abs(waterOut);
+
+  std::cout << "Fast friction kernel, largest relative deviation from the reference kernel after "
+	    << no_of_iterations << " steps of this catchment:" << std::endl
+	    << "  water depth (wet cells):          " << depth_deviation << std::endl
+	    << "  discharge:                        " << q_deviation << std::endl
+	    << "  outflow:                          " << outflow_deviation << std::endl;
+}
+
+
+
+void runSharedMemorySimulation(std::string pfname)
+{
+  LSDOpenMPEngine engine(pfname);
+  if (engine.validating_friction())
+    {
+      engine.validate_friction(pfname);
+    }
+  else
+    {
+      engine.run();
+    }
+}
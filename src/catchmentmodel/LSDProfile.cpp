@@ -0,0 +1,286 @@
+// LSDProfile.cpp
+
+// Run time instrumentation of the catchment model
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+
+#include "catchmentmodel/LSDProfile.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+
+// sample and the per-thread phase times are defined with the kernel, in cell.cpp
+bool LSDProfile::enabled = false;
+double LSDProfile::timer_overhead = 0.0;
+double LSDProfile::timed_call_cost = 0.0;
+std::vector<std::string> LSDProfile::region_names;
+std::vector<double> LSDProfile::region_times;
+std::vector<double> LSDProfile::region_calls;
+
+unsigned ProfileSteerer::steps = 0;
+unsigned ProfileSteerer::sampled_steps = 0;
+
+
+
+void LSDProfile::initialise()
+{
+  phase_times.initialise();
+  phase_calls.initialise();
+  calibrate();
+
+  // from zero for each ensemble member run on this rank
+  region_times.assign(region_times.size(), 0.0);
+  region_calls.assign(region_calls.size(), 0.0);
+  ProfileSteerer::steps = 0;
+  ProfileSteerer::sampled_steps = 0;
+}
+
+
+
+// The least mean over a few batches, as the thread may be interrupted
+void LSDProfile::calibrate()
+{
+  const int batches = 5;
+  const int reads = 100000;
+  timer_overhead = timed_call_cost = 1.0;
+  for (int batch = 0; batch < batches; batch++)
+    {
+      double inside = 0.0;
+      double batch_start = now();
+      for (int read = 0; read < reads; read++)
+	{
+	  double phase_start = now();
+	  inside += now() - phase_start;
+	}
+      timer_overhead = std::min(timer_overhead, inside / reads);
+      timed_call_cost = std::min(timed_call_cost, (now() - batch_start) / reads);
+    }
+}
+
+
+
+LibGeoDecomp::ParallelWriter<Cell> *LSDProfile::timed(LibGeoDecomp::ParallelWriter<Cell> *writer, const std::string& name)
+{
+  return enabled ? new TimedWriter(writer, name) : writer;
+}
+
+
+
+LibGeoDecomp::Steerer<Cell> *LSDProfile::timed(LibGeoDecomp::Steerer<Cell> *steerer, const std::string& name)
+{
+  return enabled ? new TimedSteerer(steerer, name) : steerer;
+}
+
+
+
+int LSDProfile::region(const std::string& name)
+{
+  std::vector<std::string>::iterator found = std::find(region_names.begin(), region_names.end(), name);
+  if (found != region_names.end()) return found - region_names.begin();
+
+  region_names.push_back(name);
+  region_times.push_back(0.0);
+  region_calls.push_back(0.0);
+  return region_names.size() - 1;
+}
+
+
+
+void LSDProfile::add_region(int index, double seconds)
+{
+  region_times[index] += seconds;
+  region_calls[index] += 1.0;
+}
+
+
+
+void LSDProfile::write_report(const std::string& filename, unsigned steps, unsigned sampled_steps)
+{
+  static const char *phase_names[NUM_PHASES] = {"kernel:water_input", "kernel:flow_route_x", "kernel:flow_route_y",
+						"kernel:depth_update", "kernel:boundary_flux"};
+  int rank = LSDEnsemble::rank();
+  int size = LSDEnsemble::size();
+
+  // kernel phases: mean thread time on the sampled steps less the clock
+  // reads, scaled up to all steps; the timing itself only on sampled steps
+  int num_threads = std::max(1, phase_times.threads());
+  double scale = sampled_steps > 0 ? double(steps) / sampled_steps : 0.0;
+  std::vector<std::string> names;
+  std::vector<double> times;
+  std::vector<double> calls;
+  double kernel_total = 0.0;
+  double timed_calls = 0.0;
+  for (int phase = 0; phase < NUM_PHASES; phase++)
+    {
+      double seconds = std::max(0.0, phase_times.sum(phase) - phase_calls.sum(phase) * timer_overhead) * scale / num_threads;
+      kernel_total += seconds;
+      timed_calls += phase_calls.sum(phase);
+      names.push_back(phase_names[phase]);
+      times.push_back(seconds);
+      calls.push_back(sampled_steps);
+    }
+  names.push_back("kernel:timer_overhead");
+  times.push_back(timed_calls * timed_call_cost / num_threads);
+  calls.push_back(sampled_steps);
+  kernel_total += times.back();
+
+  // the step time left over by the kernel, writers and steerers
+  double accounted = kernel_total;
+  double step_total = 0.0;
+  for (std::size_t r = 0; r < region_names.size(); r++)
+    {
+      if (region_names[r] == "step") step_total = region_times[r];
+      else accounted += region_times[r];
+      names.push_back(region_names[r]);
+      times.push_back(region_times[r]);
+      calls.push_back(region_calls[r]);
+    }
+  names.push_back("halo_wait_and_other");
+  times.push_back(std::max(0.0, step_total - accounted));
+  calls.push_back(steps);
+
+  // ranks register the same regions in the same order, but guard against stragglers
+  int num_values = times.size();
+  int max_values = 0;
+  MPI_Allreduce(&num_values, &max_values, 1, MPI_INT, MPI_MAX, LSDEnsemble::communicator());
+  times.resize(max_values, 0.0);
+  calls.resize(max_values, 0.0);
+
+  std::vector<double> min_times(max_values), max_times(max_values), sum_times(max_values), sum_calls(max_values);
+  MPI_Reduce(times.data(), min_times.data(), max_values, MPI_DOUBLE, MPI_MIN, 0, LSDEnsemble::communicator());
+  MPI_Reduce(times.data(), max_times.data(), max_values, MPI_DOUBLE, MPI_MAX, 0, LSDEnsemble::communicator());
+  MPI_Reduce(times.data(), sum_times.data(), max_values, MPI_DOUBLE, MPI_SUM, 0, LSDEnsemble::communicator());
+  MPI_Reduce(calls.data(), sum_calls.data(), max_values, MPI_DOUBLE, MPI_SUM, 0, LSDEnsemble::communicator());
+
+  if (rank != 0) return;
+
+  std::ofstream report(filename.c_str());
+  report << "phase,calls_per_rank,min_seconds,mean_seconds,max_seconds" << std::endl;
+  report << std::setprecision(6);
+  for (int v = 0; v < max_values; v++)
+    {
+      report << (v < int(names.size()) ? names[v] : "unnamed") << ","
+	     << sum_calls[v] / size << ","
+	     << min_times[v] << "," << sum_times[v] / size << "," << max_times[v] << std::endl;
+    }
+  std::cout << "Profile written to " << filename << std::endl;
+}
+
+
+
+
+
+TimedWriter::TimedWriter(LibGeoDecomp::ParallelWriter<Cell> *delegate_in, const std::string& name_in) :
+  LibGeoDecomp::ParallelWriter<Cell>("", delegate_in->getPeriod()),
+  delegate(delegate_in),
+  name(name_in),
+  index(LSDProfile::region(name_in))
+{}
+
+
+
+TimedWriter::~TimedWriter()
+{
+  delete delegate;
+}
+
+
+
+LibGeoDecomp::ParallelWriter<Cell> *TimedWriter::clone() const
+{
+  return new TimedWriter(delegate->clone(), name);
+}
+
+
+
+void TimedWriter::setRegion(const RegionType& newRegion)
+{
+  LibGeoDecomp::ParallelWriter<Cell>::setRegion(newRegion);
+  delegate->setRegion(newRegion);
+}
+
+
+
+void TimedWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+			       unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  double start = LSDProfile::now();
+  delegate->stepFinished(grid, validRegion, globalDimensions, step, event, rank, lastCall);
+  LSDProfile::add_region(index, LSDProfile::now() - start);
+}
+
+
+
+
+
+TimedSteerer::TimedSteerer(LibGeoDecomp::Steerer<Cell> *delegate_in, const std::string& name_in) :
+  LibGeoDecomp::Steerer<Cell>(delegate_in->getPeriod()),
+  delegate(delegate_in),
+  name(name_in),
+  index(LSDProfile::region(name_in))
+{}
+
+
+
+TimedSteerer::~TimedSteerer()
+{
+  delete delegate;
+}
+
+
+
+LibGeoDecomp::Steerer<Cell> *TimedSteerer::clone() const
+{
+  return new TimedSteerer(delegate->clone(), name);
+}
+
+
+
+void TimedSteerer::setRegion(const RegionType& newRegion)
+{
+  LibGeoDecomp::Steerer<Cell>::setRegion(newRegion);
+  delegate->setRegion(newRegion);
+}
+
+
+
+void TimedSteerer::nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+			    unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  double start = LSDProfile::now();
+  delegate->nextStep(grid, validRegion, globalDimensions, step, event, rank, lastCall, feedback);
+  LSDProfile::add_region(index, LSDProfile::now() - start);
+}
+
+
+
+
+
+ProfileSteerer::ProfileSteerer(unsigned interval_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, ProfileSteerer>(1),
+  interval(interval_in > 0 ? interval_in : 1),
+  index(LSDProfile::region("step")),
+  last_time(-1.0)
+{}
+
+
+
+void ProfileSteerer::nextStep(GridType *grid, const LibGeoDecomp::Region<2>& validRegion, const LibGeoDecomp::Coord<2>& globalDimensions,
+			      unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  if (!lastCall) return;
+
+  // the time since the last call covers one whole step
+  double time = LSDProfile::now();
+  if (last_time >= 0)
+    {
+      LSDProfile::add_region(index, time - last_time);
+      steps++;
+      if (LSDProfile::sample) sampled_steps++;
+    }
+  last_time = time;
+
+  LSDProfile::sample = (event != LibGeoDecomp::STEERER_ALL_DONE) && (step % interval == 0);
+}
@@ -0,0 +1,152 @@
+// LSDSpinup.cpp
+
+// Coarse grid spin-up of the catchment model
+
+#include <cmath>
+#include <algorithm>
+
+#include "catchmentmodel/LSDSpinup.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+
+
+TNT::Array2D<double> block_average(const TNT::Array2D<double>& fine, int factor, double no_data_value)
+{
+  int rows = (fine.dim1() + factor - 1) / factor;
+  int cols = (fine.dim2() + factor - 1) / factor;
+  TNT::Array2D<double> coarse(rows, cols, no_data_value);
+
+  for (int i = 0; i < rows; i++)
+    {
+      for (int j = 0; j < cols; j++)
+	{
+	  double sum = 0.0;
+	  int count = 0;
+	  for (int fi = i * factor; fi < std::min((i + 1) * factor, fine.dim1()); fi++)
+	    {
+	      for (int fj = j * factor; fj < std::min((j + 1) * factor, fine.dim2()); fj++)
+		{
+		  if (fine[fi][fj] != no_data_value)
+		    {
+		      sum += fine[fi][fj];
+		      count++;
+		    }
+		}
+	    }
+	  if (count > 0) coarse[i][j] = sum / count;
+	}
+    }
+  return coarse;
+}
+
+
+
+void prolong_spinup(const std::vector<double>& state, int coarse_rows, int coarse_cols, int factor,
+		    const TNT::Array2D<double>& elevation, double no_data_value,
+		    TNT::Array2D<double>& water_depth, TNT::Array2D<double>& qx, TNT::Array2D<double>& qy)
+{
+  int num_coarse = coarse_rows * coarse_cols;
+  std::vector<double> block;
+
+  for (int ci = 0; ci < coarse_rows; ci++)
+    {
+      for (int cj = 0; cj < coarse_cols; cj++)
+	{
+	  int c = ci * coarse_cols + cj;
+	  int i1 = std::min((ci + 1) * factor, elevation.dim1());
+	  int j1 = std::min((cj + 1) * factor, elevation.dim2());
+
+	  // the fine elevations of the block, lowest first
+	  block.clear();
+	  for (int i = ci * factor; i < i1; i++)
+	    {
+	      for (int j = cj * factor; j < j1; j++)
+		{
+		  water_depth[i][j] = qx[i][j] = qy[i][j] = 0.0;
+		  if (elevation[i][j] != no_data_value) block.push_back(elevation[i][j]);
+		}
+	    }
+	  if (block.empty() || !(state[c] > 0.0)) continue;
+	  std::sort(block.begin(), block.end());
+
+	  // the water surface that holds the coarse volume, filling the
+	  // lowest cells first
+	  double volume = state[c] * block.size();
+	  double surface = block[0] + volume;
+	  double below = block[0];
+	  for (std::size_t n = 1; n < block.size() && surface > block[n]; n++)
+	    {
+	      below += block[n];
+	      surface = (volume + below) / (n + 1);
+	    }
+
+	  for (int i = ci * factor; i < i1; i++)
+	    {
+	      for (int j = cj * factor; j < j1; j++)
+		{
+		  if (elevation[i][j] == no_data_value || elevation[i][j] >= surface) continue;
+		  water_depth[i][j] = surface - elevation[i][j];
+		  qx[i][j] = state[num_coarse + c];
+		  qy[i][j] = state[2 * num_coarse + c];
+		}
+	    }
+	}
+    }
+}
+
+
+
+
+
+CoarseSpinupSteerer::CoarseSpinupSteerer(LSDCatchmentModel *catchment_in, double end_time_in, std::vector<double> *state_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, CoarseSpinupSteerer>(1),
+  catchment(catchment_in),
+  end_time(end_time_in),
+  state(state_in),
+  capture_due(false),
+  captured(false)
+{}
+
+
+
+void CoarseSpinupSteerer::nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				   unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  if (captured) return;
+
+  bool capture = capture_due || event == LibGeoDecomp::STEERER_ALL_DONE;
+  if (capture)
+    {
+      int num_cells = globalDimensions.x() * globalDimensions.y();
+      local_state.resize(3 * num_cells, 0.0);
+      for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+	{
+	  for (int x = i->origin.x(); x < i->endX; x++)
+	    {
+	      const Cell& cell = grid->get(CoordType(x, i->origin.y()));
+	      int c = i->origin.y() * globalDimensions.x() + x;
+	      local_state[c] = cell.water_depth;
+	      local_state[num_cells + c] = cell.qx;
+	      local_state[2 * num_cells + c] = cell.qy;
+	    }
+	}
+    }
+
+  if (!lastCall) return;
+
+  if (capture)
+    {
+      state->resize(local_state.size());
+      MPI_Allreduce(local_state.data(), state->data(), local_state.size(), MPI_DOUBLE, MPI_SUM, LSDEnsemble::communicator());
+      local_state.clear();
+      captured = true;
+      if (feedback) feedback->endSimulation();
+      return;
+    }
+
+  int due = 0;
+  if (rank == 0) due = (catchment->get_cycle() >= end_time);
+  MPI_Bcast(&due, 1, MPI_INT, 0, LSDEnsemble::communicator());
+  capture_due = due;
+}
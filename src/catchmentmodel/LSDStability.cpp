@@ -0,0 +1,179 @@
+// LSDStability.cpp
+
+// Stability monitor and in-memory rollback for the catchment model
+
+#include <cmath>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#include "catchmentmodel/LSDStability.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+
+
+// The per-thread counters are defined with the kernel, in cell.cpp
+
+
+
+
+
+StabilitySteerer::StabilitySteerer(LSDCatchmentModel *catchment_in, unsigned check_interval_in, unsigned snapshot_interval,
+				   unsigned num_snapshots_in, double courant_factor_in, double min_courant_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::Steerer<Cell>, StabilitySteerer>(1),
+  catchment(catchment_in),
+  check_interval(check_interval_in > 0 ? check_interval_in : 1),
+  num_snapshots(num_snapshots_in > 0 ? num_snapshots_in : 1),
+  courant_factor(courant_factor_in),
+  min_courant(min_courant_in),
+  first_step(true),
+  checking(false),
+  taking_snapshot(false),
+  rollback_pending(false),
+  checks_since_snapshot(0),
+  consecutive_rollbacks(0)
+{
+  checks_per_snapshot = std::max(1u, (snapshot_interval + check_interval - 1) / check_interval);
+}
+
+
+
+void StabilitySteerer::nextStep(GridType *grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				unsigned step, LibGeoDecomp::SteererEvent event, std::size_t rank, bool lastCall, LibGeoDecomp::SteererFeedback *feedback)
+{
+  if (event == LibGeoDecomp::STEERER_ALL_DONE) return;
+
+  // The starting state is trusted, so it is the first snapshot
+  if (first_step)
+    {
+      taking_snapshot = true;
+      first_step = !lastCall;
+    }
+
+  if (rollback_pending)
+    {
+      restore(grid, validRegion);
+    }
+  else if (taking_snapshot)
+    {
+      store(*grid, validRegion);
+    }
+
+  if (!lastCall) return;
+
+  if (rollback_pending)
+    {
+      finish_rollback();
+    }
+  else
+    {
+      // this step's grid is the state the cells checked during the last update
+      long unstable = 0;
+      if (checking)
+	{
+	  long local_unstable = LSDStability::collect();
+	  MPI_Allreduce(&local_unstable, &unstable, 1, MPI_LONG, MPI_SUM, LSDEnsemble::communicator());
+	}
+
+      if (unstable > 0)
+	{
+	  rollback_pending = !ring.empty();
+	  // go further back if the last rollback did not get past the instability
+	  if (consecutive_rollbacks > 0 && ring.size() > 1) ring.pop_back();
+	  if (rank == 0)
+	    {
+	      std::cout << "Instability detected in " << unstable << " cells at step " << step
+			<< (ring.empty() ? ", no snapshot to roll back to" : ", rolling back") << std::endl;
+	    }
+	}
+      else if (taking_snapshot)
+	{
+	  pending.step = step;
+	  std::stringstream counters;
+	  counters.precision(17);
+	  catchment->save_counters(counters);
+	  pending.counters = counters.str();
+	  ring.push_back(pending);
+	  if (ring.size() > num_snapshots) ring.pop_front();
+	  checks_since_snapshot = 0;
+	  consecutive_rollbacks = 0;
+	}
+      else if (checking)
+	{
+	  checks_since_snapshot++;
+	}
+    }
+  pending.streaks.clear();
+  pending.cells.clear();
+
+  // the update of this step checks its cells, the next step reduces the counts
+  LSDStability::sample = (step % check_interval == 0);
+  checking = LSDStability::sample;
+  taking_snapshot = checking && !rollback_pending && (checks_since_snapshot + 1 >= checks_per_snapshot);
+}
+
+
+
+void StabilitySteerer::store(const GridType& grid, const RegionType& validRegion)
+{
+  for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+    {
+      pending.streaks.push_back(i->origin.y());
+      pending.streaks.push_back(i->origin.x());
+      pending.streaks.push_back(i->endX - i->origin.x());
+      for (int x = i->origin.x(); x < i->endX; x++)
+	{
+	  pending.cells.push_back(grid.get(CoordType(x, i->origin.y())));
+	}
+    }
+}
+
+
+
+void StabilitySteerer::restore(GridType *grid, const RegionType& validRegion)
+{
+  const Snapshot& snapshot = ring.back();
+
+  std::size_t n = 0;
+  for (std::size_t s = 0; s < snapshot.streaks.size(); s += 3)
+    {
+      int y = snapshot.streaks[s];
+      int x0 = snapshot.streaks[s + 1];
+      for (int x = x0; x < x0 + snapshot.streaks[s + 2]; x++, n++)
+	{
+	  CoordType coordinate(x, y);
+	  if (validRegion.count(coordinate)) grid->set(coordinate, snapshot.cells[n]);
+	}
+    }
+}
+
+
+
+void StabilitySteerer::finish_rollback()
+{
+  const Snapshot& snapshot = ring.back();
+  double courant_number = LSDCatchmentModel::courant_number;
+
+  std::stringstream counters(snapshot.counters);
+  catchment->load_counters(counters);
+  bool root = (LSDEnsemble::rank() == 0);
+  if (root) catchment->truncate_outputs();
+
+  // the outflow and input summed during the discarded steps are dropped too
+  LSDMassBalance::discard();
+  LSDStability::collect();
+
+  LSDCatchmentModel::courant_number = std::max(min_courant, courant_number * courant_factor);
+  LSDCatchmentModel::time_factor = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)));
+
+  if (root)
+    {
+      std::cout << "Rolled back to the snapshot of step " << snapshot.step << " (model time " << catchment->get_cycle()
+		<< "), courant number now " << LSDCatchmentModel::courant_number << std::endl;
+    }
+
+  rollback_pending = false;
+  consecutive_rollbacks++;
+  checks_since_snapshot = 0;
+}
@@ -0,0 +1,368 @@
+// LSDTaskFarm.cpp
+
+// Task farm mode: many independent catchments in one job
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include "catchmentmodel/LSDTaskFarm.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+#include "catchmentmodel/LSDUtils.hpp"
+
+using namespace LSDUtils;
+
+
+namespace
+{
+  // largest catchment first, then in manifest order
+  struct LargerFirst
+  {
+    const std::vector<LSDTaskFarm::Catchment> *catchments;
+    bool operator()(int a, int b) const
+    {
+      if ((*catchments)[a].cells != (*catchments)[b].cells) return (*catchments)[a].cells > (*catchments)[b].cells;
+      return a < b;
+    }
+  };
+
+  // One finished catchment, as gathered on rank 0: its index in the
+  // manifest, the ranks it ran on, its wall time and whether it was stolen
+  const int record_size = 4;
+}
+
+
+
+std::vector<LSDTaskFarm::Catchment> LSDTaskFarm::read_manifest(const std::string& filename, const std::string& read_path)
+{
+  if (!does_file_exist(filename))
+    {
+      std::cout << "No task farm manifest found by name of: " << filename
+		<< std::endl
+		<< "You must supply a correct path and filename "
+		<< "in the input parameter file" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+  std::ifstream manifest(filename.c_str());
+  std::vector<Catchment> catchments;
+  std::set<std::string> names;
+  std::string line;
+  while (std::getline(manifest, line))
+    {
+      line = line.substr(0, line.find('#'));
+      std::istringstream fields(line);
+      std::vector<std::string> values;
+      std::string value;
+      while (fields >> value) values.push_back(value);
+      if (values.empty()) continue;
+      if (values.size() > 2)
+	{
+	  std::cout << "Task farm manifest " << filename << ": expected a params file and a name, not \"" << line << "\"" << std::endl;
+	  exit(EXIT_FAILURE);
+	}
+
+      Catchment catchment;
+      catchment.pfname = (values[0][0] == '/') ? values[0] : read_path + "/" + values[0];
+      if (values.size() == 2)
+	{
+	  catchment.name = values[1];
+	}
+      else
+	{
+	  // the file name without directories and extension
+	  std::string stem = values[0].substr(values[0].find_last_of('/') + 1);
+	  catchment.name = stem.substr(0, stem.find_last_of('.'));
+	}
+      catchment.cells = 0;
+      if (!names.insert(catchment.name).second)
+	{
+	  std::cout << "Task farm manifest " << filename << ": two catchments are named " << catchment.name << std::endl;
+	  exit(EXIT_FAILURE);
+	}
+      catchments.push_back(catchment);
+    }
+
+  if (catchments.empty())
+    {
+      std::cout << "Task farm manifest " << filename << " has no catchments" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  return catchments;
+}
+
+
+
+long LSDTaskFarm::size_catchment(const std::string& pfname)
+{
+  if (!does_file_exist(pfname)) return -1;
+  LSDCatchmentModel catchment(pfname);
+  if (!does_file_exist(catchment.read_path + "/" + catchment.read_fname + "." + catchment.dem_read_extension)) return -1;
+  catchment.initialise_model_domain_extents();
+  return long(catchment.imax) * long(catchment.jmax);
+}
+
+
+
+void LSDTaskFarm::run_catchment(const Catchment& catchment, const std::string& directory)
+{
+  MPI_Comm comm = LSDEnsemble::communicator();
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  // its own params file, with the outputs in its directory; later lines
+  // win, see LSDCatchmentModel::initialise_variables()
+  std::string pfname = directory + "/" + catchment.name + ".params";
+  if (rank == 0)
+    {
+      system(("mkdir -p " + directory).c_str());
+      std::ifstream source(catchment.pfname.c_str());
+      std::ofstream params(pfname.c_str());
+      params << source.rdbuf();
+      params << std::endl << std::endl
+	     << "# TASK FARM CATCHMENT " << catchment.name << std::endl
+	     << "#=====================" << std::endl
+	     << "write_path: " << directory << std::endl
+	     << "task_farm_manifest: none" << std::endl
+	     << "ensemble_table: none" << std::endl;
+    }
+  MPI_Barrier(comm);
+
+  LSDCatchmentModel *model = new LSDCatchmentModel(pfname);
+  if (model->simulator == "openmp")
+    {
+      // the shared-memory engine reads its own DEM, on the first rank
+      if (rank == 0) runSharedMemorySimulation(pfname);
+      MPI_Barrier(comm);
+    }
+  else
+    {
+      model->load_terrain();
+      runCatchment(model);
+    }
+  delete model;
+}
+
+
+
+// The queues are slices [begin, end) of the slots; the window of the rank
+// that owns a queue holds its next front and back slot, then one claim
+// count per slot. The front and back only ever move inwards, and a slot
+// goes to whoever claims it first, so an owner and a thief meeting in the
+// middle never both run a catchment. An owner takes from its own window,
+// so only steals wait on the progress of another rank, see LSDTaskFarm.hpp.
+bool LSDTaskFarm::take(MPI_Win window, const Queue& queue, bool front, int *slot)
+{
+  int step = front ? 1 : -1;
+  int next;
+  MPI_Fetch_and_op(&step, &next, MPI_INT, queue.owner, queue.offset + (front ? 0 : 1), MPI_SUM, window);
+  MPI_Win_flush(queue.owner, window);
+  if (!front) next -= 1;
+  if (next < queue.begin || next >= queue.end) return false;
+
+  int one = 1;
+  int claims;
+  MPI_Fetch_and_op(&one, &claims, MPI_INT, queue.owner, queue.offset + 2 + next - queue.begin, MPI_SUM, window);
+  MPI_Win_flush(queue.owner, window);
+  if (claims != 0) return false;
+  *slot = next;
+  return true;
+}
+
+
+
+void LSDTaskFarm::run(LSDCatchmentModel *base)
+{
+  std::vector<Catchment> catchments = read_manifest(base->read_path + "/" + base->task_farm_manifest, base->read_path);
+  int count = catchments.size();
+
+  int world_rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  // every catchment starts from the parameters of the manifest's params file
+  LSDCatchmentModel::StaticParameters defaults = LSDCatchmentModel::get_static_parameters();
+
+  // size the catchments from their DEM headers on rank 0
+  std::vector<long> cells(count);
+  if (world_rank == 0)
+    {
+      for (int c = 0; c < count; c++)
+	{
+	  cells[c] = size_catchment(catchments[c].pfname);
+	  LSDCatchmentModel::set_static_parameters(defaults);
+	}
+    }
+  MPI_Bcast(cells.empty() ? 0 : &cells[0], count, MPI_LONG, 0, MPI_COMM_WORLD);
+  for (int c = 0; c < count; c++) catchments[c].cells = cells[c];
+
+  int ranks = std::max(1, std::min(base->task_farm_ranks_per_group, world_size));
+  int groups = world_size / ranks;
+
+  // ranks left over join the last group
+  int group = std::min(world_rank / ranks, groups - 1);
+  MPI_Comm group_comm;
+  MPI_Comm_split(MPI_COMM_WORLD, group, world_rank, &group_comm);
+  int group_rank, group_size;
+  MPI_Comm_rank(group_comm, &group_rank);
+  MPI_Comm_size(group_comm, &group_size);
+
+  // deal the large catchments to the groups and the small ones to the
+  // ranks, round robin, largest first
+  std::vector<int> large, small;
+  int missing = 0;
+  for (int c = 0; c < count; c++)
+    {
+      if (catchments[c].cells < 0) missing++;
+      else if (catchments[c].cells > base->task_farm_serial_cells) large.push_back(c);
+      else small.push_back(c);
+    }
+  LargerFirst larger_first = {&catchments};
+  std::sort(large.begin(), large.end(), larger_first);
+  std::sort(small.begin(), small.end(), larger_first);
+
+  // a group's queue is kept by its first rank, and a rank's by itself
+  int queues = groups + world_size;
+  std::vector<int> slots;
+  std::vector<Queue> queue(queues);
+  std::vector<int> words(world_size, 0);
+  for (int q = 0; q < queues; q++)
+    {
+      const std::vector<int>& dealt = (q < groups) ? large : small;
+      int first = (q < groups) ? q : q - groups;
+      int stride = (q < groups) ? groups : world_size;
+      queue[q].begin = slots.size();
+      for (std::size_t i = first; i < dealt.size(); i += stride) slots.push_back(dealt[i]);
+      queue[q].end = slots.size();
+      queue[q].owner = (q < groups) ? q * ranks : q - groups;
+      queue[q].offset = words[queue[q].owner];
+      words[queue[q].owner] += 2 + queue[q].end - queue[q].begin;
+    }
+
+  if (world_rank == 0)
+    {
+      std::cout << "Task farm of " << count << " catchments from " << base->task_farm_manifest << ": "
+		<< large.size() << " on " << groups << " groups of " << ranks << " ranks, "
+		<< small.size() << " of up to " << base->task_farm_serial_cells << " cells on single ranks";
+      if (missing) std::cout << ", " << missing << " without a params file or DEM";
+      std::cout << std::endl;
+    }
+
+  int *counters = 0;
+  MPI_Win window;
+  MPI_Win_allocate(words[world_rank] * sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &counters, &window);
+  std::fill(counters, counters + words[world_rank], 0);
+  for (int q = 0; q < queues; q++)
+    {
+      if (queue[q].owner != world_rank) continue;
+      counters[queue[q].offset] = queue[q].begin;
+      counters[queue[q].offset + 1] = queue[q].end;
+    }
+  MPI_Barrier(MPI_COMM_WORLD);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+
+  std::vector<double> records;
+  double start = MPI_Wtime();
+
+  // the large catchments on the groups, then the small ones on every rank
+  for (int phase = 0; phase < 2; phase++)
+    {
+      LSDEnsemble::comm = (phase == 0) ? group_comm : MPI_COMM_SELF;
+      bool leader = (phase == 1 || group_rank == 0);
+      int own = (phase == 0) ? group : groups + world_rank;
+      int first = (phase == 0) ? 0 : groups;
+      int owners = (phase == 0) ? groups : world_size;
+
+      for (;;)
+	{
+	  // [slot, stolen]
+	  int next[2] = {-1, 0};
+	  if (leader)
+	    {
+	      if (!take(window, queue[own], true, &next[0]))
+		{
+		  for (int v = 1; v < owners; v++)
+		    {
+		      if (take(window, queue[first + (own - first + v) % owners], false, &next[0]))
+			{
+			  next[1] = 1;
+			  break;
+			}
+		    }
+		}
+	    }
+	  if (phase == 0) MPI_Bcast(next, 2, MPI_INT, 0, group_comm);
+	  if (next[0] < 0) break;
+
+	  const Catchment& catchment = catchments[slots[next[0]]];
+	  std::string directory = base->write_path + "/" + catchment.name;
+	  int catchment_ranks = (phase == 0) ? group_size : 1;
+	  double catchment_start = MPI_Wtime();
+	  LSDCatchmentModel::set_static_parameters(defaults);
+	  run_catchment(catchment, directory);
+	  double seconds = MPI_Wtime() - catchment_start;
+
+	  if (leader)
+	    {
+	      std::cout << "Catchment " << catchment.name << " (" << catchment.cells << " cells) finished in " << seconds
+			<< " s on " << catchment_ranks << (catchment_ranks == 1 ? " rank" : " ranks")
+			<< ", outputs in " << directory << std::endl;
+	      double record[record_size] = {double(slots[next[0]]), double(catchment_ranks), seconds, double(next[1])};
+	      records.insert(records.end(), record, record + record_size);
+	    }
+	}
+    }
+
+  MPI_Win_unlock_all(window);
+  MPI_Win_free(&window);
+  LSDEnsemble::comm = MPI_COMM_WORLD;
+  MPI_Comm_free(&group_comm);
+  LSDCatchmentModel::set_static_parameters(defaults);
+
+  // gather the finished catchments for the summary on rank 0
+  int record_values = records.size();
+  std::vector<int> counts(world_size), displacements(world_size);
+  MPI_Gather(&record_values, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+  int total = 0;
+  for (int r = 0; r < world_size; r++)
+    {
+      displacements[r] = total;
+      total += counts[r];
+    }
+  std::vector<double> all_records(std::max(total, 1));
+  MPI_Gatherv(records.empty() ? 0 : &records[0], record_values, MPI_DOUBLE, &all_records[0], &counts[0], &displacements[0],
+	      MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+  if (world_rank == 0)
+    {
+      std::vector<int> catchment_ranks(count, 0), stolen(count, 0);
+      std::vector<double> seconds(count, 0.0);
+      int steals = 0;
+      for (int r = 0; r < total; r += record_size)
+	{
+	  int c = int(all_records[r]);
+	  catchment_ranks[c] = int(all_records[r + 1]);
+	  seconds[c] = all_records[r + 2];
+	  stolen[c] = int(all_records[r + 3]);
+	  steals += stolen[c];
+	}
+
+      std::string summary = base->write_path + "/task_farm.csv";
+      std::ofstream csv(summary.c_str());
+      csv << "catchment,params_file,cells,ranks,seconds,stolen" << std::endl;
+      for (int c = 0; c < count; c++)
+	{
+	  csv << catchments[c].name << "," << catchments[c].pfname << "," << catchments[c].cells << ","
+	      << catchment_ranks[c] << "," << seconds[c] << "," << stolen[c] << std::endl;
+	}
+
+      std::cout << "Task farm finished " << total / record_size << " catchments in " << MPI_Wtime() - start << " s ("
+		<< steals << " stolen), summary in " << summary << std::endl;
+    }
+  MPI_Barrier(MPI_COMM_WORLD);
+}
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <ostream>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <catchmentmodel/LSDUtils.hpp>
 
 namespace LSDUtils
@@ -116,4 +117,37 @@ namespace LSDUtils
       std::cout << "Goodbye, parallel region!" << std::endl;
       #endif
     }
+
+    unsigned long long fnv1a_hash(const void *data, std::size_t size, unsigned long long hash)
+    {
+      const unsigned char *bytes = static_cast<const unsigned char*>(data);
+      for (std::size_t i = 0; i < size; i++)
+      {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+      }
+      return hash;
+    }
+
+    void truncate_lines(const std::string& filename, long lines)
+    {
+      std::ifstream in(filename.c_str(), std::ios::binary);
+      std::string line;
+      long offset = 0;
+      for (long n = 0; n < lines && std::getline(in, line); n++)
+      {
+        offset += line.size() + 1;
+      }
+      if (in.good()) truncate_bytes(filename, offset);
+    }
+
+    void truncate_bytes(const std::string& filename, long bytes)
+    {
+      struct stat buffer;
+      if (stat(filename.c_str(), &buffer) == 0 && buffer.st_size > bytes)
+      {
+        if (truncate(filename.c_str(), bytes) != 0)
+          std::cout << "Could not cut " << filename << " back to " << bytes << " bytes" << std::endl;
+      }
+    }
 }
@@ -2,3 +2,729 @@
 
 // Collection of functions for dealing with I/O
 // for the catchment model
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+
+#ifdef HAIL_CAESAR_ZLIB
+#include <zlib.h>
+#endif
+
+#include "catchmentmodel/LSDio.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDEnsemble.hpp"
+#include "catchmentmodel/LSDUtils.hpp"
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// GAUGE POINT HYDROGRAPHS
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+GaugeWriter::GaugeWriter(LSDCatchmentModel *catchment_in, const std::string& filename_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, GaugeWriter>("gauges", 1),
+  catchment(catchment_in),
+  filename(filename_in),
+  binary(catchment_in->gauge_output_format == "binary"),
+  owned_resolved(false)
+{}
+
+
+
+void GaugeWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+			       unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  if (!owned_resolved)
+    {
+      resolve_owned_cells();
+      // a restarted run appends to the file that truncate_outputs() cut
+      // back to the checkpoint; a new run, or a warm start from a cached
+      // spin-up (see reset_outputs()), has no rows yet and begins one
+      bool no_rows = catchment->gauge_rows_written == 0 && catchment->gauge_row_buffer.empty();
+      if (rank == 0 && (no_rows || !LSDUtils::does_file_exist(filename)))
+	{
+	  write_header();
+	  catchment->gauge_rows_written = 0;
+	  catchment->gauge_row_buffer.clear();
+	}
+    }
+
+  // The same output decision is made on every rank, as all ranks share the model clock
+  double time = catchment->get_cycle();
+  bool output_due = (time >= catchment->gauge_next_output_time) || (event == LibGeoDecomp::WRITER_ALL_DONE);
+  if (!output_due) return;
+
+  // HiParSimulator may hand over the subdomain in several pieces per step
+  for (std::size_t n = 0; n < owned_coord.size(); n++)
+    {
+      if (!validRegion.count(owned_coord[n])) continue;
+
+      Cell cell = grid.get(owned_coord[n]);
+      double *sums = &local_sums[owned_gauge[n] * NUM_SUM_FIELDS];
+      if (owned_is_centre[n])
+	{
+	  sums[0] = cell.water_depth;
+	  sums[1] = cell.elevation + cell.water_depth;
+	  sums[2] = cell.qx;
+	  sums[3] = cell.qy;
+	}
+      sums[4] += cell.water_depth;
+      sums[5] += 1.0;
+      local_max[owned_gauge[n]] = std::max(local_max[owned_gauge[n]], cell.water_depth);
+    }
+
+  if (!lastCall) return;
+
+  gather_and_buffer(time);
+  // a zero interval writes a row every step
+  do
+    {
+      catchment->gauge_next_output_time += catchment->gauge_save_interval;
+    } while (catchment->gauge_next_output_time <= time && catchment->gauge_save_interval > 0);
+
+  std::size_t row_length = 1 + catchment->gauge_rows.size() * NUM_OUTPUT_FIELDS;
+  int buffered_rows = catchment->gauge_row_buffer.size() / row_length;
+  if (rank == 0 && (buffered_rows >= catchment->gauge_buffer_rows || event == LibGeoDecomp::WRITER_ALL_DONE))
+    {
+      flush_rows();
+    }
+}
+
+
+
+// Works out which cells of each gauge window lie in this rank's
+// subdomain. Windows are clipped to the model domain.
+void GaugeWriter::resolve_owned_cells()
+{
+  int radius = catchment->gauge_window_radius;
+  std::size_t num_gauges = catchment->gauge_rows.size();
+
+  for (std::size_t g = 0; g < num_gauges; g++)
+    {
+      int row = catchment->gauge_rows[g];
+      int col = catchment->gauge_cols[g];
+      for (int y = std::max(0, row - radius); y <= std::min(int(catchment->imax) - 1, row + radius); y++)
+	{
+	  for (int x = std::max(0, col - radius); x <= std::min(int(catchment->jmax) - 1, col + radius); x++)
+	    {
+	      CoordType coordinate(x, y);
+	      if (region.count(coordinate))
+		{
+		  owned_gauge.push_back(g);
+		  owned_coord.push_back(coordinate);
+		  owned_is_centre.push_back(x == col && y == row);
+		}
+	    }
+	}
+    }
+
+  reset_partials();
+  owned_resolved = true;
+}
+
+
+
+void GaugeWriter::reset_partials()
+{
+  std::size_t num_gauges = catchment->gauge_rows.size();
+  local_sums.assign(num_gauges * NUM_SUM_FIELDS, 0.0);
+  local_max.assign(num_gauges, 0.0);
+}
+
+
+
+// Reduces the partial gauge values of all ranks onto rank 0 and appends
+// one row to the buffer there.
+void GaugeWriter::gather_and_buffer(double time)
+{
+  std::size_t num_gauges = catchment->gauge_rows.size();
+  std::vector<double> sums(local_sums.size(), 0.0);
+  std::vector<double> maxima(local_max.size(), 0.0);
+
+  MPI_Reduce(local_sums.data(), sums.data(), local_sums.size(), MPI_DOUBLE, MPI_SUM, 0, LSDEnsemble::communicator());
+  MPI_Reduce(local_max.data(), maxima.data(), local_max.size(), MPI_DOUBLE, MPI_MAX, 0, LSDEnsemble::communicator());
+  reset_partials();
+
+  if (LSDEnsemble::rank() != 0) return;
+
+  std::vector<double>& row_buffer = catchment->gauge_row_buffer;
+  row_buffer.push_back(time);
+  for (std::size_t g = 0; g < num_gauges; g++)
+    {
+      const double *gauge = &sums[g * NUM_SUM_FIELDS];
+      double window_mean = (gauge[5] > 0) ? gauge[4] / gauge[5] : 0.0;
+
+      // qx crosses the west face, DY wide, and qy the north face, DX wide
+      row_buffer.push_back(gauge[0]);
+      row_buffer.push_back(gauge[1]);
+      row_buffer.push_back(gauge[2]);
+      row_buffer.push_back(gauge[3]);
+      row_buffer.push_back(gauge[2] * LSDCatchmentModel::DY);
+      row_buffer.push_back(gauge[3] * LSDCatchmentModel::DX);
+      row_buffer.push_back(window_mean);
+      row_buffer.push_back(maxima[g]);
+    }
+}
+
+
+
+// Starts a new time series file. For binary output the column layout
+// is written to a separate .hdr text file instead.
+void GaugeWriter::write_header()
+{
+  static const char *columns[] = {"depth", "stage", "qx_west_face", "qy_north_face", "discharge_west_face",
+				  "discharge_north_face", "window_mean_depth", "window_max_depth"};
+
+  std::ofstream header;
+  if (binary)
+    {
+      std::ofstream(filename.c_str(), std::ios::binary | std::ios::trunc);
+      header.open((filename + ".hdr").c_str(), std::ios::trunc);
+      header << "# " << catchment->gauge_rows.size() * NUM_OUTPUT_FIELDS + 1 << " little-endian doubles per row" << std::endl;
+    }
+  else
+    {
+      header.open(filename.c_str(), std::ios::trunc);
+    }
+
+  header << "time_mins";
+  for (std::size_t g = 0; g < catchment->gauge_names.size(); g++)
+    {
+      for (int c = 0; c < NUM_OUTPUT_FIELDS; c++)
+	{
+	  header << "," << catchment->gauge_names[g] << "_" << columns[c];
+	}
+    }
+  header << std::endl;
+}
+
+
+
+void GaugeWriter::flush_rows()
+{
+  std::vector<double>& row_buffer = catchment->gauge_row_buffer;
+  std::size_t row_length = 1 + catchment->gauge_rows.size() * NUM_OUTPUT_FIELDS;
+  long buffered_rows = row_buffer.size() / row_length;
+  if (buffered_rows == 0) return;
+
+  if (binary)
+    {
+      std::ofstream out(filename.c_str(), std::ios::binary | std::ios::app);
+      out.write(reinterpret_cast<const char*>(row_buffer.data()), row_buffer.size() * sizeof(double));
+    }
+  else
+    {
+      std::ofstream out(filename.c_str(), std::ios::app);
+      out << std::setprecision(10);
+      for (std::size_t n = 0; n < row_buffer.size(); n++)
+	{
+	  out << row_buffer[n] << (((n + 1) % row_length == 0) ? "\n" : ",");
+	}
+    }
+
+  row_buffer.clear();
+  catchment->gauge_rows_written += buffered_rows;
+}
+
+
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// DERIVED FIELD RASTERS (VELOCITY, FROUDE NUMBER ETC.)
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+DerivedFieldWriter::DerivedFieldWriter(LSDCatchmentModel *catchment_in, const std::string& field_list,
+				       const std::string& prefix, unsigned period) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, DerivedFieldWriter>(prefix, period),
+  catchment(catchment_in)
+{
+  std::stringstream list(field_list);
+  std::string name;
+  while (std::getline(list, name, ','))
+    {
+      bool found = false;
+      for (int f = 0; f < NUM_FIELDS; f++)
+	{
+	  if (name == field_name(Field(f)))
+	    {
+	      fields.push_back(Field(f));
+	      found = true;
+	    }
+	}
+      if (!found && LSDEnsemble::rank() == 0)
+	{
+	  std::cout << "WARNING: unknown derived field " << name << ", skipping it." << std::endl;
+	}
+    }
+  values.resize(fields.size());
+}
+
+
+
+std::string DerivedFieldWriter::field_name(Field field)
+{
+  switch (field){
+  case VELOCITY:
+    return "velocity";
+  case VELOCITY_DIRECTION:
+    return "velocity_direction";
+  case UNIT_DISCHARGE:
+    return "unit_discharge";
+  case FROUDE:
+    return "froude";
+  default:
+    return "unknown";
+  }
+}
+
+
+
+// qx is the discharge across the west face of the cell and is positive
+// for westward flow; qy is across the north face and positive for northward
+// flow (see Cell::flow_route_x and Cell::flow_route_y). Velocities of dry
+// cells are zero, and the direction is the compass bearing the water flows
+// towards, in degrees. Cells outside the DEM are no_data_value.
+float DerivedFieldWriter::derived_value(Field field, const Cell& cell)
+{
+  if (cell.celltype == Cell::NODATA || cell.elevation == LSDCatchmentModel::no_data_value) return float(LSDCatchmentModel::no_data_value);
+
+  double unit_discharge = std::sqrt(cell.qx * cell.qx + cell.qy * cell.qy);
+  if (field == UNIT_DISCHARGE) return float(unit_discharge);
+
+  if (cell.water_depth <= LSDCatchmentModel::hflow_threshold) return 0.0f;
+
+  double velocity = unit_discharge / cell.water_depth;
+  switch (field){
+  case VELOCITY:
+    return float(velocity);
+  case VELOCITY_DIRECTION:
+    {
+      double bearing = std::atan2(-cell.qx, cell.qy) * 180.0 / M_PI;
+      return float((bearing < 0) ? bearing + 360.0 : bearing);
+    }
+  case FROUDE:
+    return float(velocity / std::sqrt(Cell::gravity * cell.water_depth));
+  default:
+    return 0.0f;
+  }
+}
+
+
+
+void DerivedFieldWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				      unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+    {
+      int length = i->endX - i->origin.x();
+      streak_offsets.push_back((MPI_Offset(i->origin.y()) * globalDimensions.x() + i->origin.x()) * sizeof(float));
+      streak_lengths.push_back(length);
+
+      for (int x = i->origin.x(); x < i->endX; x++)
+	{
+	  Cell cell = grid.get(CoordType(x, i->origin.y()));
+	  for (std::size_t f = 0; f < fields.size(); f++)
+	    {
+	      values[f].push_back(derived_value(fields[f], cell));
+	    }
+	}
+    }
+
+  if (lastCall) write_rasters(step);
+}
+
+
+
+void DerivedFieldWriter::write_rasters(unsigned step)
+{
+  for (std::size_t f = 0; f < fields.size(); f++)
+    {
+      std::stringstream filename;
+      filename << prefix << "_" << field_name(fields[f]) << "_" << std::setfill('0') << std::setw(6) << step;
+
+      if (LSDEnsemble::rank() == 0)
+	{
+	  std::ofstream header_ofs((filename.str() + ".hdr").c_str());
+	  header_ofs << "ncols         " << catchment->jmax
+		     << "\nnrows         " << catchment->imax
+		     << "\nxllcorner     " << std::setprecision(14) << catchment->xll
+		     << "\nyllcorner     " << std::setprecision(14) << catchment->yll
+		     << "\ncellsize      " << LSDCatchmentModel::DX
+		     << "\nNODATA_value  " << LSDCatchmentModel::no_data_value
+		     << "\nbyteorder     LSBFIRST" << std::endl;
+	}
+
+      MPI_File file;
+      std::string data_filename = filename.str() + ".flt";
+      MPI_File_open(LSDEnsemble::communicator(), const_cast<char*>(data_filename.c_str()), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+
+      std::size_t position = 0;
+      for (std::size_t n = 0; n < streak_offsets.size(); n++)
+	{
+	  MPI_File_write_at(file, streak_offsets[n], &values[f][position], streak_lengths[n], MPI_FLOAT, MPI_STATUS_IGNORE);
+	  position += streak_lengths[n];
+	}
+      MPI_File_close(&file);
+      values[f].clear();
+    }
+
+  streak_offsets.clear();
+  streak_lengths.clear();
+}
+
+
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// DOWNSAMPLED PREVIEW IMAGES
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+PreviewWriter::PreviewWriter(double Cell::*member_in, double min_value_in, double max_value_in, const std::string& prefix,
+			     unsigned period, int block_size_in, bool use_max_in, bool compress_in) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, PreviewWriter>(prefix, period),
+  member(member_in),
+  min_value(min_value_in),
+  max_value(max_value_in),
+  block_size(block_size_in > 0 ? block_size_in : 1),
+  use_max(use_max_in),
+  compress(compress_in)
+{
+#ifndef HAIL_CAESAR_ZLIB
+  if (compress && LSDEnsemble::rank() == 0)
+    {
+      std::cout << "WARNING: built without HAIL_CAESAR_ZLIB, preview images will be uncompressed PGM." << std::endl;
+    }
+  compress = false;
+#endif
+}
+
+
+
+void PreviewWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				 unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  int width = (globalDimensions.x() + block_size - 1) / block_size;
+  int height = (globalDimensions.y() + block_size - 1) / block_size;
+  if (block_sums.empty())
+    {
+      block_sums.assign(2 * width * height, 0.0);
+      block_max.assign(width * height, -std::numeric_limits<double>::max());
+    }
+
+  for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+    {
+      int row = (i->origin.y() / block_size) * width;
+      for (int x = i->origin.x(); x < i->endX; x++)
+	{
+	  Cell cell = grid.get(CoordType(x, i->origin.y()));
+	  if (cell.celltype == Cell::NODATA || cell.elevation == LSDCatchmentModel::no_data_value) continue;
+
+	  int block = row + x / block_size;
+	  block_sums[2 * block] += cell.*member;
+	  block_sums[2 * block + 1] += 1.0;
+	  block_max[block] = std::max(block_max[block], cell.*member);
+	}
+    }
+
+  if (!lastCall) return;
+
+  std::vector<unsigned char> image = assemble_image(width, height);
+  if (rank == 0)
+    {
+      std::stringstream filename;
+      filename << prefix << "." << std::setfill('0') << std::setw(6) << step;
+      if (compress)
+	{
+	  write_png(filename.str() + ".png", image, width, height);
+	}
+      else
+	{
+	  write_pgm(filename.str() + ".pgm", image, width, height);
+	}
+    }
+}
+
+
+
+// Combines the block grids of all ranks onto rank 0 and scales them to
+// 8 bit grey levels. Blocks without any data are black.
+std::vector<unsigned char> PreviewWriter::assemble_image(int width, int height)
+{
+  std::vector<double> sums(block_sums.size());
+  std::vector<double> maxima(block_max.size());
+  MPI_Reduce(block_sums.data(), sums.data(), block_sums.size(), MPI_DOUBLE, MPI_SUM, 0, LSDEnsemble::communicator());
+  if (use_max)
+    {
+      MPI_Reduce(block_max.data(), maxima.data(), block_max.size(), MPI_DOUBLE, MPI_MAX, 0, LSDEnsemble::communicator());
+    }
+  std::fill(block_sums.begin(), block_sums.end(), 0.0);
+  std::fill(block_max.begin(), block_max.end(), -std::numeric_limits<double>::max());
+
+  std::vector<unsigned char> image(width * height, 0);
+  if (LSDEnsemble::rank() != 0) return image;
+
+  for (int block = 0; block < width * height; block++)
+    {
+      if (sums[2 * block + 1] == 0) continue;
+      double value = use_max ? maxima[block] : sums[2 * block] / sums[2 * block + 1];
+      double scaled = 255.0 * (value - min_value) / (max_value - min_value);
+      image[block] = static_cast<unsigned char>(std::min(255.0, std::max(0.0, scaled)));
+    }
+  return image;
+}
+
+
+
+void PreviewWriter::write_pgm(const std::string& filename, const std::vector<unsigned char>& image, int width, int height)
+{
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  out << "P5\n" << width << " " << height << "\n255\n";
+  out.write(reinterpret_cast<const char*>(image.data()), image.size());
+}
+
+
+
+#ifdef HAIL_CAESAR_ZLIB
+// Appends a PNG chunk (big-endian length, type, data, CRC of type and data)
+static void write_png_chunk(std::ofstream& out, const char *type, const std::vector<unsigned char>& data)
+{
+  unsigned char length[4] = {static_cast<unsigned char>(data.size() >> 24), static_cast<unsigned char>(data.size() >> 16),
+			     static_cast<unsigned char>(data.size() >> 8), static_cast<unsigned char>(data.size())};
+  uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+  if (!data.empty()) crc = crc32(crc, data.data(), data.size());
+  unsigned char crc_bytes[4] = {static_cast<unsigned char>(crc >> 24), static_cast<unsigned char>(crc >> 16),
+				static_cast<unsigned char>(crc >> 8), static_cast<unsigned char>(crc)};
+
+  out.write(reinterpret_cast<const char*>(length), 4);
+  out.write(type, 4);
+  if (!data.empty()) out.write(reinterpret_cast<const char*>(data.data()), data.size());
+  out.write(reinterpret_cast<const char*>(crc_bytes), 4);
+}
+#endif
+
+
+
+// 8 bit greyscale PNG, one zlib-compressed IDAT chunk with no row filtering
+void PreviewWriter::write_png(const std::string& filename, const std::vector<unsigned char>& image, int width, int height)
+{
+#ifdef HAIL_CAESAR_ZLIB
+  std::vector<unsigned char> scanlines;
+  scanlines.reserve((width + 1) * height);
+  for (int y = 0; y < height; y++)
+    {
+      scanlines.push_back(0);  // filter type: none
+      scanlines.insert(scanlines.end(), image.begin() + y * width, image.begin() + (y + 1) * width);
+    }
+
+  uLongf compressed_size = compressBound(scanlines.size());
+  std::vector<unsigned char> compressed(compressed_size);
+  compress2(compressed.data(), &compressed_size, scanlines.data(), scanlines.size(), Z_BEST_SPEED);
+  compressed.resize(compressed_size);
+
+  std::vector<unsigned char> header(13, 0);
+  for (int n = 0; n < 4; n++)
+    {
+      header[n] = static_cast<unsigned char>(width >> (24 - 8 * n));
+      header[4 + n] = static_cast<unsigned char>(height >> (24 - 8 * n));
+    }
+  header[8] = 8;  // bit depth
+  header[9] = 0;  // colour type: greyscale
+
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  out.write(reinterpret_cast<const char*>(signature), 8);
+  write_png_chunk(out, "IHDR", header);
+  write_png_chunk(out, "IDAT", compressed);
+  write_png_chunk(out, "IEND", std::vector<unsigned char>());
+#else
+  write_pgm(filename, image, width, height);
+#endif
+}
+
+
+
+
+
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// REGION OF INTEREST OUTPUTS
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Even-odd rule on the cell centre
+bool OutputRegion::contains(int x, int y) const
+{
+  if (x < x0 || x > x1 || y < y0 || y > y1) return false;
+  if (polygon_x.empty()) return true;
+
+  double px = x + 0.5;
+  double py = y + 0.5;
+  bool inside = false;
+  for (std::size_t i = 0, j = polygon_x.size() - 1; i < polygon_x.size(); j = i++)
+    {
+      if (((polygon_y[i] > py) != (polygon_y[j] > py)) &&
+	  (px < (polygon_x[j] - polygon_x[i]) * (py - polygon_y[i]) / (polygon_y[j] - polygon_y[i]) + polygon_x[i]))
+	{
+	  inside = !inside;
+	}
+    }
+  return inside;
+}
+
+
+
+RegionWriter::RegionWriter(LSDCatchmentModel *catchment_in, const OutputRegion& output_region_in, const std::string& prefix) :
+  LibGeoDecomp::Clonable<LibGeoDecomp::ParallelWriter<Cell>, RegionWriter>(prefix, output_region_in.interval),
+  catchment(catchment_in),
+  output_region(output_region_in),
+  communicator_created(false),
+  region_comm(MPI_COMM_NULL)
+{
+  static const char *raw_names[] = {"water_depth", "elevation", "qx", "qy"};
+
+  std::stringstream list(output_region.fields);
+  std::string name;
+  while (std::getline(list, name, ','))
+    {
+      int field = -1;
+      for (int f = 0; f < NUM_RAW_FIELDS; f++)
+	{
+	  if (name == raw_names[f]) field = f;
+	}
+      for (int f = 0; f < DerivedFieldWriter::NUM_FIELDS; f++)
+	{
+	  if (name == DerivedFieldWriter::field_name(DerivedFieldWriter::Field(f))) field = NUM_RAW_FIELDS + f;
+	}
+
+      if (field < 0)
+	{
+	  if (LSDEnsemble::rank() == 0)
+	    {
+	      std::cout << "WARNING: unknown field " << name << " in output region "
+			<< output_region.name << ", skipping it." << std::endl;
+	    }
+	  continue;
+	}
+      fields.push_back(field);
+      field_names.push_back(name);
+    }
+  values.resize(fields.size());
+}
+
+
+
+float RegionWriter::field_value(int field, const Cell& cell) const
+{
+  if (cell.celltype == Cell::NODATA || cell.elevation == LSDCatchmentModel::no_data_value) return float(LSDCatchmentModel::no_data_value);
+
+  switch (field){
+  case WATER_DEPTH:
+    return float(cell.water_depth);
+  case ELEVATION:
+    return float(cell.elevation);
+  case QX:
+    return float(cell.qx);
+  case QY:
+    return float(cell.qy);
+  default:
+    return DerivedFieldWriter::derived_value(DerivedFieldWriter::Field(field - NUM_RAW_FIELDS), cell);
+  }
+}
+
+
+
+void RegionWriter::stepFinished(const GridType& grid, const RegionType& validRegion, const CoordType& globalDimensions,
+				unsigned step, LibGeoDecomp::WriterEvent event, std::size_t rank, bool lastCall)
+{
+  int width = output_region.x1 - output_region.x0 + 1;
+
+  for (RegionType::StreakIterator i = validRegion.beginStreak(); i != validRegion.endStreak(); ++i)
+    {
+      int y = i->origin.y();
+      int start = std::max(i->origin.x(), output_region.x0);
+      int end = std::min(i->endX, output_region.x1 + 1);
+      if (y < output_region.y0 || y > output_region.y1 || start >= end) continue;
+
+      streak_offsets.push_back((MPI_Offset(y - output_region.y0) * width + (start - output_region.x0)) * sizeof(float));
+      streak_lengths.push_back(end - start);
+      for (int x = start; x < end; x++)
+	{
+	  bool inside = output_region.contains(x, y);
+	  Cell cell = grid.get(CoordType(x, y));
+	  for (std::size_t f = 0; f < fields.size(); f++)
+	    {
+	      values[f].push_back(inside ? field_value(fields[f], cell) : float(LSDCatchmentModel::no_data_value));
+	    }
+	}
+    }
+
+  if (!lastCall) return;
+
+  if (!communicator_created) create_communicator();
+  if (region_comm != MPI_COMM_NULL) write_rasters(step);
+}
+
+
+
+// Splits off the ranks whose subdomain overlaps the region. This is the
+// only collective call involving every rank, and happens once.
+void RegionWriter::create_communicator()
+{
+  bool overlaps = false;
+  for (RegionType::StreakIterator i = region.beginStreak(); i != region.endStreak(); ++i)
+    {
+      int y = i->origin.y();
+      if (y >= output_region.y0 && y <= output_region.y1 &&
+	  i->origin.x() <= output_region.x1 && i->endX > output_region.x0)
+	{
+	  overlaps = true;
+	  break;
+	}
+    }
+
+  MPI_Comm_split(LSDEnsemble::communicator(), overlaps ? 0 : MPI_UNDEFINED, LSDEnsemble::rank(), &region_comm);
+  communicator_created = true;
+}
+
+
+
+void RegionWriter::write_rasters(unsigned step)
+{
+  int region_rank;
+  MPI_Comm_rank(region_comm, &region_rank);
+
+  for (std::size_t f = 0; f < fields.size(); f++)
+    {
+      std::stringstream filename;
+      filename << prefix << "_" << field_names[f] << "_" << std::setfill('0') << std::setw(6) << step;
+
+      if (region_rank == 0)
+	{
+	  std::ofstream header_ofs((filename.str() + ".hdr").c_str());
+	  header_ofs << "ncols         " << output_region.x1 - output_region.x0 + 1
+		     << "\nnrows         " << output_region.y1 - output_region.y0 + 1
+		     << "\nxllcorner     " << std::setprecision(14) << catchment->xll + output_region.x0 * LSDCatchmentModel::DX
+		     << "\nyllcorner     " << std::setprecision(14)
+		     << catchment->yll + (int(catchment->imax) - 1 - output_region.y1) * LSDCatchmentModel::DY
+		     << "\ncellsize      " << LSDCatchmentModel::DX
+		     << "\nNODATA_value  " << LSDCatchmentModel::no_data_value
+		     << "\nbyteorder     LSBFIRST" << std::endl;
+	}
+
+      MPI_File file;
+      std::string data_filename = filename.str() + ".flt";
+      MPI_File_open(region_comm, const_cast<char*>(data_filename.c_str()), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file);
+
+      std::size_t position = 0;
+      for (std::size_t n = 0; n < streak_offsets.size(); n++)
+	{
+	  MPI_File_write_at(file, streak_offsets[n], &values[f][position], streak_lengths[n], MPI_FLOAT, MPI_STATUS_IGNORE);
+	  position += streak_lengths[n];
+	}
+      MPI_File_close(&file);
+      values[f].clear();
+    }
+
+  streak_offsets.clear();
+  streak_lengths.clear();
+}
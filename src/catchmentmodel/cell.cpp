@@ -0,0 +1,195 @@
+// cell.cpp
+
+// The non-template Cell members, the model parameters they read and the
+// per-thread state of the monitors that Cell::update adds to. Nothing here
+// calls MPI or LibGeoDecomp, so the kernel benchmark and the tests in
+// test/catchmentmodel link this object without the rest of the model.
+
+#include <cmath>
+#include <algorithm>
+
+#include "catchmentmodel/cell.hpp"
+#include "catchmentmodel/LSDCatchmentModel.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+#include "catchmentmodel/LSDStability.hpp"
+#include "catchmentmodel/LSDConvergence.hpp"
+#include "catchmentmodel/LSDProfile.hpp"
+
+
+// Initialising default values for static Cell variables
+double LSDCatchmentModel::DX = 1.0;
+double LSDCatchmentModel::DY = LSDCatchmentModel::DX;
+double LSDCatchmentModel::no_data_value = -9999;
+double LSDCatchmentModel::water_depth_erosion_threshold = 1.0;
+double LSDCatchmentModel::edgeslope = 0.001;
+double LSDCatchmentModel::hflow_threshold = 0.00001;
+double LSDCatchmentModel::mannings = 0.04;
+double LSDCatchmentModel::froude_limit = 0.8;
+double LSDCatchmentModel::time_factor = 1;
+double LSDCatchmentModel::courant_number = 0.7;
+double LSDCatchmentModel::maxdepth = 10;
+double LSDCatchmentModel::input_output_difference = 0;
+double LSDCatchmentModel::in_out_difference_allowed = 0;
+bool LSDCatchmentModel::fast_friction = false;
+double LSDCatchmentModel::water_input_depth = 0.005;
+
+// Per-thread partials of the monitors, combined by their steerers
+bool LSDMassBalance::sample_storage = false;
+bool LSDMassBalance::discarded = false;
+LSDThreadSlots<double, LSDMassBalance::NUM_TERMS> LSDMassBalance::partials;
+
+bool LSDStability::sample = false;
+double LSDStability::max_velocity = 20.0;
+double LSDStability::depth_tolerance = 0.0;
+LSDThreadSlots<long, 1> LSDStability::unstable_cells;
+
+bool LSDConvergence::sample = false;
+LSDThreadSlots<double, LSDConvergence::NUM_TERMS> LSDConvergence::partials;
+
+bool LSDProfile::sample = false;
+LSDThreadSlots<double, LSDProfile::NUM_PHASES> LSDProfile::phase_times;
+LSDThreadSlots<double, LSDProfile::NUM_PHASES> LSDProfile::phase_calls;
+
+
+
+
+
+
+// Cell default constructor
+Cell::Cell(Cell::CellType celltype_in = INTERNAL,	\
+	   double elevation_in = 0.0,			\
+	   double water_depth_in = 0.0,			\
+	   double qx_in = 0.0,				\
+	   double qy_in = 0.0) : celltype(celltype_in), elevation(elevation_in), water_depth(water_depth_in), qx(qx_in), qy(qy_in)
+{}
+
+
+
+
+
+
+void Cell::set_global_timefactor()
+{
+  if (LSDCatchmentModel::maxdepth <= 0.1)
+    {
+      LSDCatchmentModel::maxdepth = 0.1;
+    }
+  if (LSDCatchmentModel::time_factor < (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
+    {
+     LSDCatchmentModel::time_factor = (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth))));
+    }
+  // input_output_difference comes from the last mass balance reduction (see MassBalanceSteerer)
+  if (LSDCatchmentModel::input_output_difference > LSDCatchmentModel::in_out_difference_allowed && LSDCatchmentModel::time_factor > (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
+    {
+      LSDCatchmentModel::time_factor = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)));
+    }
+
+}
+
+
+
+
+
+
+void Cell::sum_stored_water()
+{
+  if (celltype == Cell::NODATA) return;
+  LSDMassBalance::add(LSDMassBalance::STORED_VOLUME, water_depth * LSDCatchmentModel::DX * LSDCatchmentModel::DY);
+  if (water_depth > LSDCatchmentModel::hflow_threshold) LSDMassBalance::add(LSDMassBalance::WET_CELLS, 1.0);
+}
+
+
+
+
+
+
+// Counts this cell for StabilitySteerer if its new state is NaN, has a
+// negative water depth or an implausible flow velocity
+void Cell::check_stability()
+{
+  if (celltype == Cell::NODATA) return;
+  // NaN fails every comparison, so the negated tests catch it as well
+  if (!(water_depth >= -LSDStability::depth_tolerance))
+    {
+      LSDStability::flag();
+    }
+  else if (water_depth > LSDCatchmentModel::hflow_threshold &&
+	   !(std::max(std::abs(qx), std::abs(qy)) <= LSDStability::max_velocity * water_depth))
+    {
+      LSDStability::flag();
+    }
+}
+
+
+
+double Cell::set_local_timefactor()
+{
+  double local_time_factor = LSDCatchmentModel::time_factor;
+  if (local_time_factor > (LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX  / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)))))
+    {
+      local_time_factor = LSDCatchmentModel::courant_number * (LSDCatchmentModel::DX / std::sqrt(Cell::gravity * (LSDCatchmentModel::maxdepth)));
+    }
+  return local_time_factor;
+}
+
+
+
+
+
+
+void LSDMassBalance::initialise()
+{
+  partials.initialise();
+}
+
+
+
+void LSDMassBalance::collect(double *totals)
+{
+  for (int term = 0; term < NUM_TERMS; term++) totals[term] = partials.sum(term);
+  partials.zero();
+}
+
+
+
+void LSDMassBalance::discard()
+{
+  partials.zero();
+  discarded = true;
+}
+
+
+
+void LSDStability::initialise()
+{
+  unstable_cells.initialise();
+}
+
+
+
+long LSDStability::collect()
+{
+  long total = unstable_cells.sum(0);
+  unstable_cells.zero();
+  return total;
+}
+
+
+
+void LSDConvergence::initialise()
+{
+  partials.initialise();
+}
+
+
+
+void LSDConvergence::collect(double *maxima, double *sums)
+{
+  for (int term = 0; term < SUM_SQ_DEPTH_CHANGE; term++)
+    {
+      maxima[term] = 0.0;
+      for (int thread = 0; thread < partials.threads(); thread++) maxima[term] = std::max(maxima[term], partials.slot(thread)[term]);
+    }
+  for (int term = SUM_SQ_DEPTH_CHANGE; term < NUM_TERMS; term++) sums[term - SUM_SQ_DEPTH_CHANGE] = partials.sum(term);
+  partials.zero();
+}
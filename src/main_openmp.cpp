@@ -0,0 +1,55 @@
+// main_openmp.cpp
+//
+// Driver of HAIL-CAESAR.omp, the shared-memory build of the model without
+// MPI or LibGeoDecomp (see LSDOpenMPEngine.hpp). Built with "make openmp";
+// not part of the MPI build.
+
+#include <iostream>
+#include <cstdlib>
+#include <string>
+
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+
+#ifndef GIT_REVISION
+#define GIT_REVISION "N/A"
+#endif
+#define CHM_VERS 1.0
+
+
+
+int main(int argc, char *argv[])
+{
+  std::cout << "##################################" << std::endl;
+  std::cout << "#  CATCHMENT HYDROGEOMORPHOLOGY  #" << std::endl;
+  std::cout << "#        MODEL version ?.?       #" << std::endl;
+  std::cout << "#          (HAIL-CAESAR)         #" << std::endl;
+  std::cout << "#     shared-memory (OpenMP)     #" << std::endl;
+  std::cout << "##################################" << std::endl;
+  std::cout << " Version: "<< CHM_VERS << std::endl;
+  std::cout << " at git commit number: " GIT_REVISION << std::endl;
+  std::cout << "=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-" << std::endl;
+
+  if (argc < 2)
+    {
+      std::cout << "\n###################################################" << std::endl;
+      std::cout << "No parameter file supplied" << std::endl;
+      std::cout << "You must supply a path and parameter file!" << std::endl;
+      std::cout << "see https://dvalters.github.io/HAIL-CAESAR/" << std::endl;
+      std::cout << "for assistance." << std::endl;
+      std::cout << "###################################################" << std::endl;
+      exit(0);
+    }
+
+  if (argc > 2)
+    {
+      std::cout << "Too many input arguments supplied (should be 3...)" << std::endl;
+      exit(0);
+    }
+
+  std::string pfname(argv[1]);
+  std::cout << "Parameter file is: " << pfname << std::endl;
+
+  runSharedMemorySimulation(pfname);
+
+  return 0;
+}
@@ -107,6 +107,7 @@
 #include "topotools/LSDStatsTools.hpp"
 #include "topotools/LSDIndexRaster.hpp"
 #include "topotools/LSDShapeTools.hpp"
+#include "catchmentmodel/LSDISA.hpp"
 using namespace std;
 using namespace TNT;
 using namespace JAMA;
@@ -9771,6 +9772,7 @@ void LSDRaster::GetVectors(LSDRaster Magnitude, LSDRaster Direction, string outp
 //  Modified by David Milodowski, May 2012- generates grid of recording filtered noise
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+LSD_TARGET_CLONES
 LSDRaster LSDRaster::NonLocalMeansFilter(int WindowRadius, int SimilarityRadius, int DegreeFiltering, float Sigma)
 {
 
@@ -9995,6 +9997,7 @@ void LSDRaster::MakeGaussianKernel(Array2D<float>& Kernel, float sigma, int Simi
 //  David Milodowski, Feb 2015
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+LSD_TARGET_CLONES
 LSDRaster LSDRaster::GaussianFilter(float sigma, int kr)
 {
   // This is the default setting
@@ -10069,6 +10072,7 @@ LSDRaster LSDRaster::GaussianFilter(float sigma, int kr)
 //  David Milodowski, Feb 2015
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+LSD_TARGET_CLONES
 LSDRaster LSDRaster::PeronaMalikFilter(int timesteps, float percentile_for_lambda, float dt)
 {
   float sigma = 0.05;
@@ -0,0 +1,280 @@
+// kernelbench.cpp
+//
+// Single node microbenchmark of the Cell::update kernel, without an MPI
+// launcher or a LibGeoDecomp simulator; the kernel's headers still include
+// those of MPI and LibGeoDecomp, see test/catchmentmodel/kerneltest.hpp.
+// Cells are updated through a mock neighbourhood on a synthetic grid (a
+// tilted plane with some roughness) of configurable size, where a given
+// fraction of the cells is wet. Every sweep reads the same old grid and
+// writes a new one, so the wet fraction stays as set.
+//
+// Build with "make benchmark", then run
+//   OMP_NUM_THREADS=4 bin/kernelbench [columns] [rows] [wet_fraction] [sweeps]
+//
+// Reports cell updates per second, ns per cell update and an estimate of
+// the bytes moved per cell update: the old cell is read and the new cell
+// written (plus the write allocate), assuming the neighbouring rows are
+// still in cache.
+//
+// Before the kernels run, the machine's limits are measured: the memory
+// bandwidth with a STREAM-like triad and the peak FLOP rate with
+// independent multiply-add chains, both on all threads. The FLOP count of
+// a cell update comes from a model of the LISFLOOD kernel (see
+// cell_flop_model), evaluated on the synthetic grid. The roofline report
+// then gives per kernel the arithmetic intensity, the achieved bandwidth
+// and FLOP rate as fractions of the measured limits, and which limit the
+// kernel is up against.
+//
+// Kernel variants (e.g. a SoA layout, single precision or a branch-free
+// kernel) are compared by adding a sweep function to the list in main().
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+
+
+
+std::vector<Cell> synthetic_grid(int columns, int rows, double wet_fraction)
+{
+  std::vector<Cell> grid;
+  grid.reserve(columns * rows);
+  unsigned long long seed = 12345;
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  // linear congruential generator, the same grid on every platform
+	  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	  double random = double(seed >> 11) / double(1ULL << 53);
+	  double elevation = 100.0 - 0.01 * x * KernelTest::grid_spacing() + 0.05 * random;
+	  double water_depth = (random < wet_fraction) ? 0.05 + 0.5 * random : 0.0;
+	  grid.push_back(Cell(cell_type(x, y, columns, rows), elevation, water_depth, 0.0, 0.0));
+	}
+    }
+  return grid;
+}
+
+
+
+// The production kernel: array of structures, double precision
+void sweep_cell(const std::vector<Cell>& old_grid, std::vector<Cell>& new_grid, int columns, int rows)
+{
+#pragma omp parallel for schedule(static)
+  for (int y = 0; y < rows; y++)
+    {
+      MockNeighborhood<Cell> neighborhood(old_grid, columns);
+      for (int x = 0; x < columns; x++)
+	{
+	  neighborhood.move_to(x, y);
+	  Cell& cell = new_grid[y * columns + x];
+	  cell = old_grid[y * columns + x];
+	  cell.update(neighborhood, 0);
+	}
+    }
+}
+
+
+
+// FLOPs per cell update of the LISFLOOD kernel, averaged over the grid.
+// Additions, multiplications, divisions, square roots and powers count as
+// one FLOP each; comparisons, abs, max and copysign are not counted. Per cell:
+//   set_global_timefactor                                  4
+//   set_local_timefactor, in the water input, both flow
+//   routes and the depth update (4 x 4)                    16
+//   water surface slope in x and y (2 x 4)                 8
+//   depth update                                           8
+// and per direction (x and y) where either cell is wet:
+//   hflow                                                  3
+// and where hflow is above the threshold, so the flow is routed:
+//   update_q                                               13
+//   froude_check                                           4
+//   discharge_check                                        2
+// The limiting branches of froude_check and discharge_check are left out.
+// Edge cells are counted as internal cells.
+double cell_flop_model(const std::vector<Cell>& grid, int columns, int rows)
+{
+  const double FIXED = 4 + 16 + 8 + 8, WET = 3, FLOWING = 13 + 4 + 2;
+  double wet = 0.0, flowing = 0.0;
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  const Cell& cell = grid[y * columns + x];
+	  for (int direction = 0; direction < 2; direction++)
+	    {
+	      if ((direction == 0 && x == 0) || (direction == 1 && y == 0)) continue;
+	      const Cell& upstream = direction == 0 ? grid[y * columns + x - 1] : grid[(y - 1) * columns + x];
+	      if (cell.water_depth <= 0 && upstream.water_depth <= 0) continue;
+	      wet++;
+	      double hflow = std::max(cell.elevation + cell.water_depth, upstream.elevation + upstream.water_depth)
+		- std::max(cell.elevation, upstream.elevation);
+	      if (hflow > KernelTest::hflow_threshold()) flowing++;
+	    }
+	}
+    }
+  double cells = double(columns) * rows;
+  return FIXED + (WET * wet + FLOWING * flowing) / cells;
+}
+
+
+
+struct Kernel
+{
+  std::string name;
+  void (*sweep)(const std::vector<Cell>&, std::vector<Cell>&, int, int);
+  double bytes_per_cell;
+  double flops_per_cell;
+};
+
+
+
+// Bytes per second of a STREAM-like triad a = b + s * c over arrays much
+// larger than the last level cache, best of a few runs. The bytes include
+// the write allocate of a, as in the kernel estimates.
+double measure_bandwidth()
+{
+  const long ELEMENTS = 1L << 24;   // 128 MiB per array
+  const int RUNS = 5;
+  std::vector<double> a(ELEMENTS), b(ELEMENTS), c(ELEMENTS);
+
+  // first touch by the threads that use the pages
+#pragma omp parallel for schedule(static)
+  for (long i = 0; i < ELEMENTS; i++)
+    {
+      a[i] = 0.0;
+      b[i] = 1.0;
+      c[i] = 2.0;
+    }
+
+  double best = 0.0;
+  for (int run = 0; run < RUNS; run++)
+    {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#pragma omp parallel for schedule(static)
+      for (long i = 0; i < ELEMENTS; i++) a[i] = b[i] + 3.0 * c[i];
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      best = std::max(best, 4.0 * sizeof(double) * ELEMENTS / seconds);
+    }
+  // keep the stores
+  if (a[ELEMENTS / 2] != 7.0) std::cout << "bandwidth probe: unexpected result" << std::endl;
+  return best;
+}
+
+
+
+// FLOPs per second of independent multiply-add chains in registers on all
+// threads, best of a few runs. The chains are wide enough to fill the
+// vector units and hide the latency of the multiply-adds.
+// This is the peak of code built with the same compiler flags as the
+// kernels, e.g. without -march=native it will not use wider vectors.
+double measure_peak_flops()
+{
+  const int CHAINS = 32;
+  const long ITERATIONS = 1L << 24;
+  const int RUNS = 3;
+  double best = 0.0;
+  for (int run = 0; run < RUNS; run++)
+    {
+      double check = 0.0;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#pragma omp parallel reduction(+:check)
+      {
+	double chain[CHAINS];
+	for (int c = 0; c < CHAINS; c++) chain[c] = 1.0 + 1e-3 * (c + omp_get_thread_num());
+	const double scale = 0.999999, offset = 1e-6;
+	for (long i = 0; i < ITERATIONS; i++)
+	  {
+#pragma omp simd
+	    for (int c = 0; c < CHAINS; c++) chain[c] = chain[c] * scale + offset;
+	  }
+	for (int c = 0; c < CHAINS; c++) check += chain[c];
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      best = std::max(best, 2.0 * CHAINS * ITERATIONS * omp_get_max_threads() / seconds);
+      // keep the chains
+      if (!(check > 0.0)) std::cout << "FLOP probe: unexpected result" << std::endl;
+    }
+  return best;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int columns = argc > 1 ? std::atoi(argv[1]) : 1024;
+  int rows = argc > 2 ? std::atoi(argv[2]) : 1024;
+  double wet_fraction = argc > 3 ? std::atof(argv[3]) : 0.5;
+  int sweeps = argc > 4 ? std::atoi(argv[4]) : 50;
+  if (columns < 3 || rows < 3 || sweeps < 1)
+    {
+      std::cout << "Usage: kernelbench [columns >= 3] [rows >= 3] [wet_fraction] [sweeps >= 1]" << std::endl;
+      return 1;
+    }
+
+  KernelTest::set_grid_spacing(10.0);
+  LSDMassBalance::initialise();
+
+  std::vector<Cell> old_grid = synthetic_grid(columns, rows, wet_fraction);
+  std::vector<Cell> new_grid = old_grid;
+  double cells = double(columns) * rows;
+  double cell_flops = cell_flop_model(old_grid, columns, rows);
+
+  std::vector<Kernel> kernels;
+  Kernel cell_kernel = {"cell", &sweep_cell, 3.0 * sizeof(Cell), cell_flops};
+  kernels.push_back(cell_kernel);
+
+  std::cout << "grid " << columns << " x " << rows << ", wet fraction " << wet_fraction
+	    << ", " << sweeps << " sweeps, " << omp_get_max_threads() << " threads" << std::endl;
+
+  double bandwidth = measure_bandwidth();
+  double peak_flops = measure_peak_flops();
+  std::cout << "measured limits: " << bandwidth / 1e9 << " GB/s (triad), " << peak_flops / 1e9
+	    << " GFLOP/s (multiply-add), ridge point " << peak_flops / bandwidth << " FLOP/byte" << std::endl << std::endl;
+
+  std::vector<double> rates(kernels.size());
+  std::cout << std::left << std::setw(12) << "kernel" << std::setw(18) << "updates/s"
+	    << std::setw(14) << "ns/cell" << "bytes/cell (est.)" << std::endl;
+
+  for (std::size_t k = 0; k < kernels.size(); k++)
+    {
+      // warm up the caches and the thread team
+      kernels[k].sweep(old_grid, new_grid, columns, rows);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (int sweep = 0; sweep < sweeps; sweep++) kernels[k].sweep(old_grid, new_grid, columns, rows);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      double updates = cells * sweeps;
+      rates[k] = updates / seconds;
+      std::cout << std::left << std::setw(12) << kernels[k].name << std::setw(18) << updates / seconds
+		<< std::setw(14) << 1e9 * seconds / updates << kernels[k].bytes_per_cell << std::endl;
+    }
+
+  // roofline: the attainable rate is the lower of the two limits at the kernel's intensity
+  std::cout << std::endl << std::left << std::setw(12) << "kernel" << std::setw(12) << "FLOP/cell"
+	    << std::setw(12) << "FLOP/byte" << std::setw(10) << "GB/s" << std::setw(10) << "of peak"
+	    << std::setw(10) << "GFLOP/s" << std::setw(10) << "of peak" << std::setw(14) << "of roofline" << "bound" << std::endl;
+  for (std::size_t k = 0; k < kernels.size(); k++)
+    {
+      double intensity = kernels[k].flops_per_cell / kernels[k].bytes_per_cell;
+      double achieved_bandwidth = rates[k] * kernels[k].bytes_per_cell;
+      double achieved_flops = rates[k] * kernels[k].flops_per_cell;
+      double attainable_flops = std::min(peak_flops, intensity * bandwidth);
+      std::cout << std::left << std::setprecision(3) << std::setw(12) << kernels[k].name
+		<< std::setw(12) << kernels[k].flops_per_cell << std::setw(12) << intensity
+		<< std::setw(10) << achieved_bandwidth / 1e9 << std::setw(10) << achieved_bandwidth / bandwidth
+		<< std::setw(10) << achieved_flops / 1e9 << std::setw(10) << achieved_flops / peak_flops
+		<< std::setw(14) << achieved_flops / attainable_flops
+		<< (intensity < peak_flops / bandwidth ? "memory" : "compute") << std::endl;
+    }
+  return 0;
+}
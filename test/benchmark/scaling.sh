@@ -0,0 +1,140 @@
+#!/bin/bash
+#
+# Strong and weak scaling series of the catchment model on synthetic
+# terrains, run under mpirun on this machine.
+#
+#   make scaling                      (builds the model and terraingen, then runs this)
+#   test/benchmark/scaling.sh [strong|weak|both]
+#
+# Settings come from the environment:
+#   RANKS        rank counts of each series          (default "1 2 4")
+#   SHAPES       terrains, see terraingen.cpp        (default "plane valley fractal")
+#   STRONG_SIZE  columns and rows of the strong grid (default 1024)
+#   WEAK_SIZE    columns and rows per rank of the weak grid, which grows
+#                along the columns                   (default 512)
+#   ITERATIONS   time steps per run                  (default 200)
+#   SIMULATOR    hipar or striping                   (default hipar)
+#   SEED         seed of the fractal terrain         (default 1)
+#   MPIRUN       launcher                            (default "mpirun -np")
+#   OUT          working directory                   (default scaling_runs)
+#
+# Each rank runs one OpenMP thread (OMP_NUM_THREADS=1), so ranks are cores.
+# Every case is run twice. The timed run has profile_output off, and the
+# table takes its wall time from the "Simulation wall time" line of the
+# run log. The profiled run writes the run time profile, from which the
+# table takes the cell update (kernel) time and the time left for the halo
+# exchange and other overheads (the compute/communication split). With B
+# ranks and wall time T(B) in the first run of a series, efficiency is
+# B T(B) / (N T(N)) for the strong series and T(B) / T(N) for the weak one.
+# The table is printed and written to $OUT/scaling.csv.
+
+SERIES=${1:-both}
+RANKS=${RANKS:-"1 2 4"}
+SHAPES=${SHAPES:-"plane valley fractal"}
+STRONG_SIZE=${STRONG_SIZE:-1024}
+WEAK_SIZE=${WEAK_SIZE:-512}
+ITERATIONS=${ITERATIONS:-200}
+SIMULATOR=${SIMULATOR:-hipar}
+SEED=${SEED:-1}
+MPIRUN=${MPIRUN:-"mpirun -np"}
+OUT=${OUT:-scaling_runs}
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+MODEL=$ROOT/bin/HAIL-CAESAR.mpi
+TERRAINGEN=$ROOT/bin/terraingen
+
+for binary in "$MODEL" "$TERRAINGEN"; do
+    if [ ! -x "$binary" ]; then
+	echo "$binary not found, run make and make terraingen first"
+	exit 1
+    fi
+done
+
+mkdir -p "$OUT"
+OUT=$(cd "$OUT" && pwd)
+TABLE=$OUT/scaling.csv
+echo "series,terrain,ranks,columns,rows,wall_seconds,updates_per_second_per_core,efficiency,compute_seconds,comm_seconds,comm_fraction" > "$TABLE"
+
+export OMP_NUM_THREADS=1
+
+
+# run_case <series> <shape> <ranks> <columns> <rows>
+# prints the wall time of the timed run, and the kernel time and the
+# halo/other time of the profiled run
+run_case()
+{
+    local series=$1 shape=$2 ranks=$3 columns=$4 rows=$5
+    local terrain_dir=$OUT/terrains
+    local name=${shape}_${columns}x${rows}
+    local run_dir=$OUT/$series/$name/np$ranks
+
+    mkdir -p "$terrain_dir" "$run_dir/timed" "$run_dir/profiled"
+    if [ ! -f "$terrain_dir/$name.params" ]; then
+	"$TERRAINGEN" "$shape" "$columns" "$rows" "$terrain_dir" "$ITERATIONS" "$SEED" "$SIMULATOR" > /dev/null || return 1
+    fi
+
+    local mode profile
+    for mode in timed profiled; do
+	profile=no
+	[ "$mode" == "profiled" ] && profile=yes
+	sed -e "s|^write_path:.*|write_path:                    $run_dir/$mode|" \
+	    -e "s|^profile_output:.*|profile_output:                $profile|" \
+	    "$terrain_dir/$name.params" > "$run_dir/$mode/$name.params"
+	(cd "$run_dir/$mode" && $MPIRUN "$ranks" "$MODEL" "$run_dir/$mode/$name.params" > "$run_dir/$mode/run.log" 2>&1) || return 1
+    done
+
+    # wall: timed run; kernel and halo/other: mean over the ranks
+    local wall
+    wall=$(awk '/^Simulation wall time:/ { print $4 }' "$run_dir/timed/run.log")
+    [ -n "$wall" ] || return 1
+    awk -F, -v wall="$wall" \
+	'$1 ~ /^kernel:/ { kernel += $4 }
+	 $1 == "halo_wait_and_other" { comm = $4 }
+	 END { printf "%g %g %g\n", wall, kernel, comm }' "$run_dir/profiled/profile.csv"
+}
+
+
+# run_series <strong|weak> <shape>
+run_series()
+{
+    local series=$1 shape=$2
+    local base_wall="" base_ranks=""
+    for ranks in $RANKS; do
+	local columns=$STRONG_SIZE rows=$STRONG_SIZE
+	if [ "$series" == "weak" ]; then
+	    columns=$((WEAK_SIZE * ranks))
+	    rows=$WEAK_SIZE
+	fi
+
+	local result
+	if ! result=$(run_case "$series" "$shape" "$ranks" "$columns" "$rows"); then
+	    echo "$series $shape on $ranks ranks failed, see $OUT/$series/${shape}_${columns}x${rows}/np$ranks/*/run.log"
+	    continue
+	fi
+	read wall compute comm <<< "$result"
+	if [ -z "$base_wall" ]; then
+	    base_wall=$wall
+	    base_ranks=$ranks
+	fi
+
+	awk -v series="$series" -v shape="$shape" -v ranks="$ranks" -v columns="$columns" -v rows="$rows" \
+	    -v iterations="$ITERATIONS" -v wall="$wall" -v base="$base_wall" -v base_ranks="$base_ranks" \
+	    -v compute="$compute" -v comm="$comm" \
+	    'BEGIN {
+	       rate = (wall > 0) ? columns * rows * iterations / (wall * ranks) : 0;
+	       efficiency = (wall > 0) ? ((series == "strong") ? base_ranks * base / (ranks * wall) : base / wall) : 0;
+	       fraction = (compute + comm > 0) ? comm / (compute + comm) : 0;
+	       printf "%s,%s,%d,%d,%d,%g,%g,%.3f,%g,%g,%.3f\n", series, shape, ranks, columns, rows,
+		      wall, rate, efficiency, compute, comm, fraction }' >> "$TABLE"
+    done
+}
+
+
+for shape in $SHAPES; do
+    if [ "$SERIES" == "strong" ] || [ "$SERIES" == "both" ]; then run_series strong "$shape"; fi
+    if [ "$SERIES" == "weak" ] || [ "$SERIES" == "both" ]; then run_series weak "$shape"; fi
+done
+
+column -s, -t < "$TABLE" 2>/dev/null || cat "$TABLE"
+echo
+echo "Scaling table written to $TABLE"
@@ -0,0 +1,152 @@
+// terraingen.cpp
+//
+// Writes a synthetic catchment DEM of any size, and a params file to run
+// the model on it, for the scaling benchmarks (see scaling.sh).
+//
+//   bin/terraingen <plane|valley|fractal> <columns> <rows> <output_dir> [iterations] [seed] [simulator]
+//
+// plane    a plane sloping down to the east, away from the west edge where
+//          the model adds water
+// valley   a V-shaped valley along the rows, draining east
+// fractal  a diamond square pseudo-fractal surface (LSDRaster::DiamondSquare)
+//          on top of the tilted plane, the same surface for the same seed
+//
+// The DEM is written as <output_dir>/<shape>_<columns>x<rows>.asc and the
+// params file as <output_dir>/<shape>_<columns>x<rows>.params. Runs write
+// their outputs (including the run time profile) into write_path, which
+// scaling.sh replaces per run.
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "TNT/tnt.h"
+#include "topotools/LSDRaster.hpp"
+#include "topotools/LSDStatsTools.hpp"
+
+using namespace TNT;
+
+
+const double CELLSIZE = 10.0;
+const double NO_DATA = -9999.0;
+const double SLOPE = 0.01;          // of the tilted plane, down to the east
+const double VALLEY_SLOPE = 0.05;   // of the valley sides
+const float FRACTAL_RELIEF = 20.0;  // metres
+
+
+
+Array2D<double> make_terrain(const std::string& shape, int columns, int rows, long seed)
+{
+  Array2D<double> elevation(rows, columns, 0.0);
+  for (int row = 0; row < rows; row++)
+    {
+      for (int col = 0; col < columns; col++)
+	{
+	  elevation[row][col] = 10.0 + SLOPE * (columns - 1 - col) * CELLSIZE;
+	  if (shape == "valley") elevation[row][col] += VALLEY_SLOPE * std::abs(row - 0.5 * (rows - 1)) * CELLSIZE;
+	}
+    }
+
+  if (shape == "fractal")
+    {
+      // a negative seed restarts ran3, which DiamondSquare draws from
+      long ran3_seed = -std::labs(seed) - 1;
+      ran3(&ran3_seed);
+
+      Array2D<float> blank(rows, columns, 0.0f);
+      LSDRaster base(rows, columns, 0.0f, 0.0f, float(CELLSIZE), float(NO_DATA), blank);
+      int feature_order = int(std::floor(std::log(double(std::min(rows, columns))) / std::log(2.0)));
+      LSDRaster fractal = base.DiamondSquare(feature_order, FRACTAL_RELIEF);
+
+      // the fractal surface is padded to powers of 2, keep the requested size
+      double lowest = 0.0;
+      for (int row = 0; row < rows; row++)
+	{
+	  for (int col = 0; col < columns; col++) lowest = std::min(lowest, double(fractal.get_data_element(row, col)));
+	}
+      for (int row = 0; row < rows; row++)
+	{
+	  for (int col = 0; col < columns; col++) elevation[row][col] += fractal.get_data_element(row, col) - lowest;
+	}
+    }
+  return elevation;
+}
+
+
+
+void write_params(const std::string& filename, const std::string& dem_name, const std::string& output_dir,
+		  int iterations, const std::string& simulator)
+{
+  std::ofstream params(filename.c_str());
+  params << "# SYNTHETIC SCALING BENCHMARK, WRITTEN BY terraingen" << std::endl
+	 << "#==================================================" << std::endl
+	 << "read_fname:                    " << dem_name << std::endl
+	 << "dem_read_extension:            asc" << std::endl
+	 << "dem_write_extension:           asc" << std::endl
+	 << "read_path:                     " << output_dir << std::endl
+	 << "write_path:                    " << output_dir << std::endl
+	 << "write_fname:                   " << dem_name << ".dat" << std::endl
+	 << "timeseries_save_interval:      60" << std::endl
+	 << std::endl
+	 << "# NUMERICAL" << std::endl
+	 << "#===========" << std::endl
+	 << "no_of_iterations:              " << iterations << std::endl
+	 << "simulator:                     " << simulator << std::endl
+	 << std::endl
+	 << "# HYDROLOGY" << std::endl
+	 << "#===========" << std::endl
+	 << "hydro_model_only:              yes" << std::endl
+	 << "rainfall_data_on:              no" << std::endl
+	 << "water_depth_erosion_threshold: 0.01" << std::endl
+	 << "slope_on_edge_cell:            " << SLOPE << std::endl
+	 << "courant_number:                0.5" << std::endl
+	 << "froude_num_limit:              0.8" << std::endl
+	 << "mannings_n:                    0.04" << std::endl
+	 << "hflow_threshold:               0.00001" << std::endl
+	 << std::endl
+	 << "# OUTPUTS" << std::endl
+	 << "#=========" << std::endl
+	 << "profile_output:                yes" << std::endl
+	 << "profile_sample_interval:       10" << std::endl;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  if (argc < 5)
+    {
+      std::cout << "Usage: terraingen <plane|valley|fractal> <columns> <rows> <output_dir> [iterations] [seed] [simulator]" << std::endl;
+      return 1;
+    }
+  std::string shape(argv[1]);
+  int columns = std::atoi(argv[2]);
+  int rows = std::atoi(argv[3]);
+  std::string output_dir(argv[4]);
+  int iterations = argc > 5 ? std::atoi(argv[5]) : 200;
+  long seed = argc > 6 ? std::atol(argv[6]) : 1;
+  std::string simulator = argc > 7 ? argv[7] : "hipar";
+
+  if (shape != "plane" && shape != "valley" && shape != "fractal")
+    {
+      std::cout << "Unknown terrain " << shape << ", options are plane, valley or fractal" << std::endl;
+      return 1;
+    }
+  if (columns < 3 || rows < 3)
+    {
+      std::cout << "The grid needs at least 3 columns and 3 rows" << std::endl;
+      return 1;
+    }
+
+  std::stringstream name;
+  name << shape << "_" << columns << "x" << rows;
+  Array2D<double> elevation = make_terrain(shape, columns, rows, seed);
+
+  LSDRaster dem(rows, columns, 0.0, 0.0, CELLSIZE, NO_DATA, elevation);
+  dem.write_double_raster(output_dir + "/" + name.str(), "asc");
+  write_params(output_dir + "/" + name.str() + ".params", name.str(), output_dir, iterations, simulator);
+  return 0;
+}
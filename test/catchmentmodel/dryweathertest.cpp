@@ -0,0 +1,109 @@
+// dryweathertest.cpp
+//
+// Checks the dry weather fast-forward on a small dry catchment whose
+// rainfall series starts with a dry spell, with water_input_depth set to
+// 0: once MassBalanceSteerer has sampled the storage and found no wet
+// cells, skip_dry_weather() moves the model clock to the first record of
+// rain. With the default water input every cell is wet after the first
+// step, so the clock may never jump. The steerers and the clock run in the
+// order runCatchment adds them, on a LibGeoDecomp grid of one rank; the
+// cells are updated as in the kernel tests. runCatchment itself refuses
+// dry_weather_skip until the rainfall input is ported to the kernel, so
+// this tests the clock alone.
+//
+// Needs MPI and LibGeoDecomp, build and run with "make mpitests".
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include <mpi.h>
+
+#include <libgeodecomp/storage/grid.h>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+
+
+
+// Runs the catchment for a number of steps, and returns the model time
+// (minutes) the clock jumped to, or -1 if it never did
+double run(double water_input_depth, int steps)
+{
+  const int columns = 12, rows = 10;
+  LSDCatchmentModel::StaticParameters statics = LSDCatchmentModel::get_static_parameters();
+  LSDCatchmentModel catchment("dryweathertest.params");
+  catchment.load_rainfall_data();
+  KernelTest::set_grid_spacing(10.0);
+  KernelTest::set_water_input_depth(water_input_depth);
+
+  LibGeoDecomp::Coord<2> dimensions(columns, rows);
+  Cell edge_cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0);
+  LibGeoDecomp::Grid<Cell> grid(dimensions, edge_cell, edge_cell);
+  LibGeoDecomp::Region<2> region;
+  region << LibGeoDecomp::CoordBox<2>(LibGeoDecomp::Coord<2>(0, 0), dimensions);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double elevation = 100.0 + 0.02 * x * KernelTest::grid_spacing() + 0.01 * y * KernelTest::grid_spacing();
+	  grid.set(LibGeoDecomp::Coord<2>(x, y), Cell(cell_type(x, y, columns, rows), elevation, 0.0, 0.0, 0.0));
+	}
+    }
+
+  // a storage sample every 10 steps
+  LSDMassBalance::initialise();
+  MassBalanceSteerer mass_balance(&catchment, 10);
+  LibGeoDecomp::SteererFeedback feedback;
+
+  std::vector<Cell> cells(columns * rows, edge_cell);
+  double jumped_to = -1.0;
+  for (int step = 0; step < steps; step++)
+    {
+      mass_balance.nextStep(&grid, region, dimensions, step, LibGeoDecomp::STEERER_NEXT_STEP, 0, true, &feedback);
+      if (catchment.skip_dry_weather() && jumped_to < 0) jumped_to = catchment.get_cycle();
+      catchment.increment_counters();
+
+      for (int i = 0; i < columns * rows; i++) cells[i] = grid.get(LibGeoDecomp::Coord<2>(i % columns, i / columns));
+      update_grid(cells, columns, rows);
+      for (int i = 0; i < columns * rows; i++) grid.set(LibGeoDecomp::Coord<2>(i % columns, i / columns), cells[i]);
+    }
+
+  LSDCatchmentModel::set_static_parameters(statics);
+  return jumped_to;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  MPI_Init(&argc, &argv);
+  std::cout << "running dry weather test" << std::endl;
+
+  // 5 minute records, dry for the first 10
+  const int dry_records = 10;
+  const double record_minutes = 5.0;
+  {
+    std::ofstream params("dryweathertest.params");
+    params << "read_path: .\nwrite_path: .\nwrite_fname: dryweathertest_timeseries.dat\n"
+	   << "rainfall_data_on: yes\nrainfall_data_file: dryweathertest_rain.txt\n"
+	   << "rain_data_time_step: " << record_minutes << "\ndry_weather_skip: yes\n";
+    std::ofstream rain("dryweathertest_rain.txt");
+    for (int record = 0; record < dry_records; record++) rain << "0\n";
+    rain << "2\n2\n";
+  }
+
+  int failures = 0;
+  const double default_input = KernelTest::water_input_depth();
+  double jumped_to = run(0.0, 40);
+  std::cout << "  dry catchment jumped to model time " << jumped_to << " minutes" << std::endl;
+  check(jumped_to == dry_records * record_minutes, "the clock jumps to the first rain", failures);
+  check(run(default_input, 40) < 0, "no dry weather with the default water input", failures);
+
+  std::remove("dryweathertest.params");
+  std::remove("dryweathertest_rain.txt");
+  std::remove("dryweathertest_timeseries.dat");
+  std::cout << (failures ? "dry weather test failed" : "done.") << std::endl;
+  MPI_Finalize();
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+// kernelequivalencetest.cpp
+//
+// Checks that the three kernels give the same results on the same grid:
+// Cell::update (through the mock neighbourhood of the kernel tests), the
+// tiles of the shared-memory engine (LSDOpenMPEngine) and the lanes of
+// EnsembleCell::update, with every lane set to the model parameters. The
+// grid is that of the mass balance test, with a dry block so that the
+// faces with no water on either side are covered, and is run with the
+// reference and the fast friction kernel. The depths and discharges must
+// be equal after every step, not just close: all three route their faces
+// with LSDFriction::route, and the kernels are built without contractions.
+//
+// Build and run with "make kerneltests".
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/ensemble_cell_kernel.hpp"
+
+
+
+typedef EnsembleCell<4> Lanes;
+
+
+
+// Runs the three kernels side by side, and returns the number of steps
+// after which they still agree
+int run(bool fast_friction, int steps)
+{
+  {
+    std::ofstream params("kernelequivalencetest.params");
+    params << "read_path: .\nread_fname: kernelequivalencetest_dem\ndem_read_extension: asc\n"
+	   << "fast_friction: " << (fast_friction ? "yes" : "no") << "\n";
+  }
+  LSDOpenMPEngine engine("kernelequivalencetest.params");
+  const int columns = engine.get_columns(), rows = engine.get_rows();
+  KernelTest::set_grid_spacing(10.0);
+  KernelTest::set_fast_friction(fast_friction);
+  LSDMassBalance::initialise();
+
+  // every lane a copy of the model, as LSDEnsemble sets up its members
+  for (int l = 0; l < Lanes::lanes; l++)
+    {
+      Lanes::mannings[l] = KernelTest::mannings();
+      Lanes::froude_limit[l] = KernelTest::froude_limit();
+      Lanes::time_step[l] = Lanes::courant_time_step(KernelTest::courant_number());
+    }
+
+  // the elevations as the engine read them from the DEM
+  std::vector<Cell> cells;
+  std::vector<Lanes> lanes;
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  int i = y * columns + x;
+	  double elevation = KernelTest::elevation(engine)[i];
+	  double water_depth = 0.1 + 0.01 * ((x * 7 + y * 3) % 5);
+	  double qx = (x == 0) ? 0.05 : 0.0;
+	  double qy = (y == 0) ? 0.05 : 0.0;
+	  if ((x == columns - 1 || y == rows - 1) && (x + y) % 3 == 0) water_depth = KernelTest::water_depth_erosion_threshold() + 0.2;
+	  if (x >= 5 && x < 9 && y >= 4 && y < 7) water_depth = 0.0;
+	  KernelTest::water_depth(engine)[i] = water_depth;
+	  KernelTest::qx(engine)[i] = qx;
+	  KernelTest::qy(engine)[i] = qy;
+	  cells.push_back(Cell(cell_type(x, y, columns, rows), elevation, water_depth, qx, qy));
+	  lanes.push_back(Lanes(cell_type(x, y, columns, rows), elevation, water_depth));
+	  for (int l = 0; l < Lanes::lanes; l++)
+	    {
+	      lanes.back().qx[l] = qx;
+	      lanes.back().qy[l] = qy;
+	    }
+	}
+    }
+
+  double input = 0.0, outflow = 0.0;
+  for (int step = 0; step < steps; step++)
+    {
+      KernelTest::step(engine, input, outflow);
+      update_grid(cells, columns, rows);
+      update_grid(lanes, columns, rows);
+      bool same = true;
+      for (int i = 0; i < columns * rows; i++)
+	{
+	  same = same && KernelTest::water_depth(engine)[i] == cells[i].water_depth
+	    && KernelTest::qx(engine)[i] == cells[i].qx && KernelTest::qy(engine)[i] == cells[i].qy;
+	  for (int l = 0; l < Lanes::lanes; l++)
+	    {
+	      same = same && lanes[i].water_depth[l] == cells[i].water_depth
+		&& lanes[i].qx[l] == cells[i].qx && lanes[i].qy[l] == cells[i].qy;
+	    }
+	}
+      if (!same)
+	{
+	  KernelTest::set_fast_friction(false);
+	  return step;
+	}
+    }
+
+  KernelTest::set_fast_friction(false);
+  return steps;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  std::cout << "running kernel equivalence test" << std::endl;
+
+  // sloping down to the west and north, as the grid of the mass balance test
+  const int columns = 16, rows = 12, steps = 200;
+  {
+    std::ofstream dem("kernelequivalencetest_dem.asc");
+    dem << "ncols " << columns << "\nnrows " << rows << "\nxllcorner 0\nyllcorner 0\ncellsize 10\nNODATA_value -9999\n";
+    for (int y = 0; y < rows; y++)
+      {
+	for (int x = 0; x < columns; x++) dem << 100.0 + 0.2 * x + 0.1 * y << " ";
+	dem << "\n";
+      }
+  }
+
+  int failures = 0;
+  int reference = run(false, steps);
+  std::cout << "  reference friction: the kernels agree for " << reference << " steps" << std::endl;
+  check(reference == steps, "Cell, engine and lanes agree with the reference friction kernel", failures);
+  int fast = run(true, steps);
+  std::cout << "  fast friction: the kernels agree for " << fast << " steps" << std::endl;
+  check(fast == steps, "Cell, engine and lanes agree with the fast friction kernel", failures);
+
+  std::remove("kernelequivalencetest.params");
+  std::remove("kernelequivalencetest_dem.asc");
+  std::cout << (failures ? "kernel equivalence test failed" : "done.") << std::endl;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+// kerneltest.hpp
+//
+// Runs the Cell::update kernel on a grid held in a std::vector, without an
+// MPI launcher or a LibGeoDecomp simulator, for the kernel tests in this
+// directory and the kernel benchmark (test/benchmark/kernelbench.cpp).
+// Both link the kernel alone (build/catchmentmodel/cell.o, see the
+// Makefile), not the LibGeoDecomp library or the MPI parts of the model.
+// They still need the MPI and LibGeoDecomp headers and the MPI compiler:
+// cell_kernel.hpp includes cell.hpp (the LibGeoDecomp API traits and the
+// MPI typemaps) and the monitors, which include mpi.h and the steerer
+// header of LibGeoDecomp. The grid
+// may also hold EnsembleCells, and KernelTest reaches into the
+// shared-memory engine, for the kernel equivalence test.
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "catchmentmodel/cell_kernel.hpp"
+#include "catchmentmodel/LSDOpenMPEngine.hpp"
+
+#ifndef KERNELTEST_H
+#define KERNELTEST_H
+
+
+
+// Sets the model parameters the kernel reads, and steps the shared-memory
+// engine (a friend of LSDCatchmentModel and LSDOpenMPEngine)
+class KernelTest
+{
+public:
+  static void set_grid_spacing(double spacing)
+  {
+    LSDCatchmentModel::DX = LSDCatchmentModel::DY = spacing;
+  }
+
+  static double grid_spacing()
+  {
+    return LSDCatchmentModel::DX;
+  }
+
+  static double hflow_threshold()
+  {
+    return LSDCatchmentModel::hflow_threshold;
+  }
+
+  static double water_depth_erosion_threshold()
+  {
+    return LSDCatchmentModel::water_depth_erosion_threshold;
+  }
+
+  static double water_input_depth()
+  {
+    return LSDCatchmentModel::water_input_depth;
+  }
+
+  static void set_water_input_depth(double depth)
+  {
+    LSDCatchmentModel::water_input_depth = depth;
+  }
+
+  static double courant_number()
+  {
+    return LSDCatchmentModel::courant_number;
+  }
+
+  static void set_courant_number(double courant_number)
+  {
+    LSDCatchmentModel::courant_number = courant_number;
+  }
+
+  static double mannings()
+  {
+    return LSDCatchmentModel::mannings;
+  }
+
+  static void set_mannings(double mannings)
+  {
+    LSDCatchmentModel::mannings = mannings;
+  }
+
+  static double froude_limit()
+  {
+    return LSDCatchmentModel::froude_limit;
+  }
+
+  static void set_froude_limit(double froude_limit)
+  {
+    LSDCatchmentModel::froude_limit = froude_limit;
+  }
+
+  static void set_fast_friction(bool fast)
+  {
+    LSDCatchmentModel::fast_friction = fast;
+  }
+
+  static double timeseries_interval(const LSDCatchmentModel& catchment)
+  {
+    return catchment.output_file_save_interval;
+  }
+
+  // the current buffers of the engine's fields, row major
+  static std::vector<double>& elevation(LSDOpenMPEngine& engine) { return engine.elevation; }
+  static std::vector<double>& water_depth(LSDOpenMPEngine& engine) { return engine.depth[engine.current]; }
+  static std::vector<double>& qx(LSDOpenMPEngine& engine) { return engine.qx[engine.current]; }
+  static std::vector<double>& qy(LSDOpenMPEngine& engine) { return engine.qy[engine.current]; }
+
+  // One step of the engine and its nests, as LSDOpenMPEngine::run() takes
+  // it; adds the water input and the outflow through the edges of the step
+  static void step(LSDOpenMPEngine& engine, double& input, double& outflow)
+  {
+    LSDOpenMPEngine::Budget budget = {0, 0, 0, 0, 0, 0, 0};
+    engine.set_global_timefactor();
+    double local_time_factor = engine.local_timefactor();
+    engine.sweep(local_time_factor, false, budget);
+    engine.sweep_nests(local_time_factor, false, budget);
+    input += budget.input;
+    outflow += budget.out_west + budget.out_north + budget.out_east + budget.out_south;
+  }
+};
+
+
+
+// Stands in for LibGeoDecomp's neighbourhood: offsets are relative to the
+// cell being updated, in the old grid.
+template<typename CELL>
+class MockNeighborhood
+{
+public:
+  MockNeighborhood(const std::vector<CELL>& grid_in, int columns_in) :
+    grid(grid_in), columns(columns_in), centre(0)
+  {}
+
+  inline void move_to(int x, int y)
+  {
+    centre = y * columns + x;
+  }
+
+  inline const CELL& operator[](const LibGeoDecomp::Coord<2>& offset) const
+  {
+    return grid[centre + offset.y() * columns + offset.x()];
+  }
+
+private:
+  const std::vector<CELL>& grid;
+  int columns;
+  int centre;
+};
+
+
+
+// Cell types as set by the CellInitializer, so no cell reads outside the grid
+inline Cell::CellType cell_type(int x, int y, int columns, int rows)
+{
+  if (y == 0) return x == 0 ? Cell::CORNER_NW : (x == columns - 1 ? Cell::CORNER_NE : Cell::EDGE_NORTH);
+  if (y == rows - 1) return x == 0 ? Cell::CORNER_SW : (x == columns - 1 ? Cell::CORNER_SE : Cell::EDGE_SOUTH);
+  if (x == 0) return Cell::EDGE_WEST;
+  if (x == columns - 1) return Cell::EDGE_EAST;
+  return Cell::INTERNAL;
+}
+
+
+
+// One step of the whole grid on the calling thread, as the simulators do
+// it: every cell starts from its old state and reads the old grid.
+template<typename CELL>
+inline void update_grid(std::vector<CELL>& grid, int columns, int rows)
+{
+  std::vector<CELL> old_grid = grid;
+  MockNeighborhood<CELL> neighborhood(old_grid, columns);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  neighborhood.move_to(x, y);
+	  grid[y * columns + x].update(neighborhood, 0);
+	}
+    }
+}
+
+
+
+// Water volume held by the cells of a grid
+inline double stored_volume(const std::vector<Cell>& grid)
+{
+  double volume = 0.0;
+  for (std::size_t i = 0; i < grid.size(); i++) volume += grid[i].water_depth;
+  return volume * KernelTest::grid_spacing() * KernelTest::grid_spacing();
+}
+
+
+
+// Prints the outcome of a check, and counts the failures
+inline void check(bool passed, const std::string& what, int& failures)
+{
+  std::cout << (passed ? "  passed: " : "  FAILED: ") << what << std::endl;
+  if (!passed) failures++;
+}
+
+#endif
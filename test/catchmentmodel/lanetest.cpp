@@ -0,0 +1,132 @@
+// lanetest.cpp
+//
+// Checks that each lane of a batch of EnsembleCell<4> gives the results of
+// a Cell run with that member's parameters: the four lanes differ in
+// Manning's n, the Froude limit and the Courant number (so in their time
+// steps), as an ensemble_table with ensemble_lanes: 4 would set them, and
+// each is compared with a Cell grid run with the model parameters set to
+// those of its member. The grid is that of the kernel equivalence test.
+// The depths and discharges must be equal after every step, with the
+// reference and the fast friction kernel.
+//
+// Build and run with "make kerneltests".
+
+#include <cstdlib>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/ensemble_cell_kernel.hpp"
+
+
+
+typedef EnsembleCell<4> Lanes;
+
+// the parameters of the members, one per lane
+const double lane_mannings[Lanes::lanes] = {0.03, 0.04, 0.05, 0.04};
+const double lane_froude_limit[Lanes::lanes] = {0.8, 0.8, 0.6, 1.0};
+const double lane_courant_number[Lanes::lanes] = {0.7, 0.5, 0.6, 0.3};
+
+
+
+// The cells of the test grid, sloping down to the west and north
+std::vector<Cell> initial_grid(int columns, int rows)
+{
+  std::vector<Cell> grid;
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double elevation = 100.0 + 0.02 * x * KernelTest::grid_spacing() + 0.01 * y * KernelTest::grid_spacing();
+	  double water_depth = 0.1 + 0.01 * ((x * 7 + y * 3) % 5);
+	  if ((x == columns - 1 || y == rows - 1) && (x + y) % 3 == 0) water_depth = KernelTest::water_depth_erosion_threshold() + 0.2;
+	  if (x >= 5 && x < 9 && y >= 4 && y < 7) water_depth = 0.0;
+	  grid.push_back(Cell(cell_type(x, y, columns, rows), elevation, water_depth, 0.0, 0.0));
+	}
+    }
+  return grid;
+}
+
+
+
+// Runs the lanes and a Cell grid per lane side by side, and returns the
+// number of steps after which they still agree; distinct is set if the
+// members end up with different depths
+int run(bool fast_friction, int steps, bool& distinct)
+{
+  const int columns = 16, rows = 12;
+  const double mannings = KernelTest::mannings(), froude_limit = KernelTest::froude_limit();
+  const double courant_number = KernelTest::courant_number();
+  KernelTest::set_grid_spacing(10.0);
+  KernelTest::set_fast_friction(fast_friction);
+  LSDMassBalance::initialise();
+
+  // the lanes as LSDEnsemble sets them up from the overrides of the members
+  for (int l = 0; l < Lanes::lanes; l++)
+    {
+      Lanes::mannings[l] = lane_mannings[l];
+      Lanes::froude_limit[l] = lane_froude_limit[l];
+      Lanes::time_step[l] = Lanes::courant_time_step(lane_courant_number[l]);
+    }
+  std::vector< std::vector<Cell> > members(Lanes::lanes, initial_grid(columns, rows));
+  std::vector<Lanes> lanes;
+  for (int i = 0; i < columns * rows; i++)
+    {
+      lanes.push_back(Lanes(members[0][i].celltype, members[0][i].elevation, members[0][i].water_depth));
+    }
+
+  int agreed = steps;
+  for (int step = 0; step < steps && agreed == steps; step++)
+    {
+      update_grid(lanes, columns, rows);
+      for (int l = 0; l < Lanes::lanes; l++)
+	{
+	  KernelTest::set_mannings(lane_mannings[l]);
+	  KernelTest::set_froude_limit(lane_froude_limit[l]);
+	  KernelTest::set_courant_number(lane_courant_number[l]);
+	  update_grid(members[l], columns, rows);
+
+	  for (int i = 0; i < columns * rows; i++)
+	    {
+	      if (lanes[i].water_depth[l] != members[l][i].water_depth
+		  || lanes[i].qx[l] != members[l][i].qx || lanes[i].qy[l] != members[l][i].qy)
+		{
+		  agreed = step;
+		}
+	    }
+	}
+    }
+
+  distinct = true;
+  for (int l = 1; l < Lanes::lanes; l++)
+    {
+      bool same = true;
+      for (int i = 0; i < columns * rows; i++) same = same && lanes[i].water_depth[l] == lanes[i].water_depth[0];
+      distinct = distinct && !same;
+    }
+
+  KernelTest::set_mannings(mannings);
+  KernelTest::set_froude_limit(froude_limit);
+  KernelTest::set_courant_number(courant_number);
+  KernelTest::set_fast_friction(false);
+  return agreed;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  std::cout << "running lane test" << std::endl;
+
+  const int steps = 200;
+  int failures = 0;
+  bool distinct;
+  int reference = run(false, steps, distinct);
+  std::cout << "  reference friction: the lanes agree with the Cell runs for " << reference << " steps" << std::endl;
+  check(reference == steps, "each lane is the Cell run of its member, reference friction kernel", failures);
+  check(distinct, "the members differ", failures);
+  int fast = run(true, steps, distinct);
+  std::cout << "  fast friction: the lanes agree with the Cell runs for " << fast << " steps" << std::endl;
+  check(fast == steps, "each lane is the Cell run of its member, fast friction kernel", failures);
+
+  std::cout << (failures ? "lane test failed" : "done.") << std::endl;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+// massbalancetest.cpp
+//
+// Checks that the water budget the kernel books in LSDMassBalance accounts
+// for every change of the water stored on a small grid: over a run of
+// steps, the change of storage must equal the water input minus the
+// outflow through the four edges. The grid slopes down to the west and
+// north, starts with discharge leaving the west and north faces and with
+// edge cells above water_depth_erosion_threshold, so every outflow term
+// of Cell::water_flux_out is exercised.
+//
+// Build and run with "make kerneltests".
+
+#include <cstdlib>
+#include <iomanip>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+
+
+
+int main(int argc, char *argv[])
+{
+  std::cout << "running mass balance test" << std::endl;
+
+  const int columns = 16, rows = 12, steps = 200;
+  KernelTest::set_grid_spacing(10.0);
+  LSDMassBalance::initialise();
+
+  std::vector<Cell> grid;
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double elevation = 100.0 + 0.02 * x * KernelTest::grid_spacing() + 0.01 * y * KernelTest::grid_spacing();
+	  double water_depth = 0.1 + 0.01 * ((x * 7 + y * 3) % 5);
+	  double qx = (x == 0) ? 0.05 : 0.0;
+	  double qy = (y == 0) ? 0.05 : 0.0;
+	  if ((x == columns - 1 || y == rows - 1) && (x + y) % 3 == 0) water_depth = KernelTest::water_depth_erosion_threshold() + 0.2;
+	  grid.push_back(Cell(cell_type(x, y, columns, rows), elevation, water_depth, qx, qy));
+	}
+    }
+
+  double initial_volume = stored_volume(grid);
+  for (int step = 0; step < steps; step++)
+    {
+      LSDMassBalance::sample_storage = (step == steps - 1);
+      update_grid(grid, columns, rows);
+    }
+  double totals[LSDMassBalance::NUM_TERMS];
+  LSDMassBalance::collect(totals);
+  double final_volume = stored_volume(grid);
+
+  double outflow = totals[LSDMassBalance::OUTFLOW_WEST] + totals[LSDMassBalance::OUTFLOW_NORTH]
+    + totals[LSDMassBalance::OUTFLOW_EAST] + totals[LSDMassBalance::OUTFLOW_SOUTH];
+  double input = totals[LSDMassBalance::WATER_INPUT];
+  double error = (final_volume - initial_volume) - (input - outflow);
+
+  std::cout << std::setprecision(12)
+	    << "  stored " << initial_volume << " -> " << final_volume << " m3" << std::endl
+	    << "  input " << input << " m3, outflow west " << totals[LSDMassBalance::OUTFLOW_WEST]
+	    << " north " << totals[LSDMassBalance::OUTFLOW_NORTH] << " east " << totals[LSDMassBalance::OUTFLOW_EAST]
+	    << " south " << totals[LSDMassBalance::OUTFLOW_SOUTH] << " m3" << std::endl
+	    << "  storage change - (input - outflow) = " << error << " m3" << std::endl;
+
+  int failures = 0;
+  double cell_input = KernelTest::water_input_depth() * KernelTest::grid_spacing() * KernelTest::grid_spacing();
+  check(std::abs(input - cell_input * columns * rows * steps) <= 1e-9 * input, "input is water_input_depth on every cell and step", failures);
+  check(totals[LSDMassBalance::OUTFLOW_WEST] > 0 && totals[LSDMassBalance::OUTFLOW_NORTH] > 0
+	&& totals[LSDMassBalance::OUTFLOW_EAST] > 0 && totals[LSDMassBalance::OUTFLOW_SOUTH] > 0, "water leaves through every edge", failures);
+  check(std::abs(error) <= 1e-9 * (initial_volume + input), "storage change equals input minus outflow", failures);
+  check(std::abs(totals[LSDMassBalance::STORED_VOLUME] - final_volume) <= 1e-9 * final_volume, "sampled storage equals the grid's", failures);
+
+  std::cout << (failures ? "mass balance test failed" : "done.") << std::endl;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+// nestmassbalancetest.cpp
+//
+// Checks that the shared-memory engine conserves water with a nest: over a
+// run of steps, the water stored on the catchment grid (which holds the
+// mean depths of the nest under it) must equal the water input minus the
+// outflow through the edges, as the engine books them for its time series.
+// A 2 m nest sits in the middle of a 10 m catchment sloping down to the
+// west and north, which starts dry and fills with water_input_depth, so
+// water crosses all four boundaries of the nest. The catchment is run
+// without the nest, with it (all grids on the time step of the nest), and
+// with local_time_stepping (the nest taking 5 steps per step of the
+// catchment, with the discharges across its boundary refluxed).
+//
+// Build and run with "make kerneltests".
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+
+
+
+// Writes an ArcMap ascii DEM of the plane of the test catchment; x and y
+// are measured from the north west corner of the catchment
+void write_dem(const std::string& filename, int columns, int rows, double xll, double yll, double cellsize, double x0, double y0)
+{
+  std::ofstream dem(filename.c_str());
+  dem << "ncols " << columns << "\nnrows " << rows << "\nxllcorner " << xll << "\nyllcorner " << yll
+      << "\ncellsize " << cellsize << "\nNODATA_value -9999\n";
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++) dem << 100.0 + 0.02 * (x0 + (x + 0.5) * cellsize) + 0.01 * (y0 + (y + 0.5) * cellsize) << " ";
+      dem << "\n";
+    }
+}
+
+
+
+// Runs the catchment and returns the water stored at the end less the
+// input and plus the outflow, relative to the input
+double run(const std::string& nest_params, int steps)
+{
+  {
+    std::ofstream params("nestmassbalancetest.params");
+    params << "read_path: .\nread_fname: nestmassbalancetest_dem\ndem_read_extension: asc\n" << nest_params;
+  }
+  LSDOpenMPEngine engine("nestmassbalancetest.params");
+  const double cell_area = KernelTest::grid_spacing() * KernelTest::grid_spacing();
+
+  double input = 0.0, outflow = 0.0;
+  for (int step = 0; step < steps; step++) KernelTest::step(engine, input, outflow);
+
+  double stored = 0.0;
+  for (std::size_t i = 0; i < KernelTest::water_depth(engine).size(); i++) stored += KernelTest::water_depth(engine)[i] * cell_area;
+  std::cout << "  input " << input << " m3, outflow " << outflow << " m3, stored " << stored << " m3" << std::endl;
+  return (stored - (input - outflow)) / input;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  std::cout << "running nest mass balance test" << std::endl;
+
+  // the catchment, 16 x 12 cells of 10 m, and a nest of 2 m cells over
+  // columns 5 to 8 and rows 3 to 6
+  const int columns = 16, rows = 12, steps = 300;
+  KernelTest::set_grid_spacing(10.0);
+  write_dem("nestmassbalancetest_dem.asc", columns, rows, 0.0, 0.0, 10.0, 0.0, 0.0);
+  write_dem("nestmassbalancetest_nest.asc", 20, 20, 50.0, 50.0, 2.0, 50.0, 30.0);
+
+  int failures = 0;
+  const double tolerance = 1e-10;
+  double error = run("", steps);
+  check(std::abs(error) < tolerance, "no nest: storage equals input minus outflow", failures);
+  error = run("nest_dem: nestmassbalancetest_nest\n", steps);
+  check(std::abs(error) < tolerance, "nest: storage equals input minus outflow", failures);
+  error = run("nest_dem: nestmassbalancetest_nest\nlocal_time_stepping: yes\n", steps);
+  check(std::abs(error) < tolerance, "nest with local time stepping: storage equals input minus outflow", failures);
+
+  std::remove("nestmassbalancetest.params");
+  std::remove("nestmassbalancetest_dem.asc");
+  std::remove("nestmassbalancetest_nest.asc");
+  std::cout << (failures ? "nest mass balance test failed" : "done.") << std::endl;
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
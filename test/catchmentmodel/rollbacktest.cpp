@@ -0,0 +1,136 @@
+// rollbacktest.cpp
+//
+// Forces one rollback of StabilitySteerer and checks that it puts the run
+// back where the snapshot was taken: the grid and the model clock are
+// restored, the courant number is reduced once, the time series loses the
+// rows written after the snapshot, and MassBalanceSteerer starts a new
+// interval instead of booking the discarded steps. The steerers run in the
+// order runCatchment adds them, on a LibGeoDecomp grid of one rank; the
+// cells are updated as in the kernel tests. The instability is forced by
+// setting LSDStability::max_velocity to zero for the update of one step.
+//
+// Needs MPI and LibGeoDecomp, build and run with "make mpitests".
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <mpi.h>
+
+#include <libgeodecomp/storage/grid.h>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/LSDStability.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+
+
+
+int main(int argc, char *argv[])
+{
+  MPI_Init(&argc, &argv);
+  std::cout << "running rollback test" << std::endl;
+
+  // snapshots are taken at the even steps, so the rollback goes back to
+  // the start of the step before the unstable one
+  const int columns = 12, rows = 10, steps = 16, unstable_step = 9, snapshot_step = 8;
+  const std::string series_file = "rollbacktest_timeseries.dat";
+  {
+    // a time series row at every mass balance reduction
+    std::ofstream params("rollbacktest.params");
+    params << "write_path: .\nwrite_fname: " << series_file << "\ntimeseries_save_interval: 1e-4\n";
+  }
+  LSDCatchmentModel catchment("rollbacktest.params");
+  KernelTest::set_grid_spacing(10.0);
+
+  LibGeoDecomp::Coord<2> dimensions(columns, rows);
+  Cell edge_cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0);
+  LibGeoDecomp::Grid<Cell> grid(dimensions, edge_cell, edge_cell);
+  LibGeoDecomp::Region<2> region;
+  region << LibGeoDecomp::CoordBox<2>(LibGeoDecomp::Coord<2>(0, 0), dimensions);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double elevation = 100.0 + 0.02 * x * KernelTest::grid_spacing() + 0.01 * y * KernelTest::grid_spacing();
+	  grid.set(LibGeoDecomp::Coord<2>(x, y), Cell(cell_type(x, y, columns, rows), elevation, 0.1 + 0.01 * ((x * 7 + y * 3) % 5), 0.0, 0.0));
+	}
+    }
+
+  // as set up by runCatchment: check every step, a snapshot every other step
+  LSDStability::initialise();
+  LSDMassBalance::initialise();
+  StabilitySteerer stability(&catchment, 1, 2, 3, 0.5, 0.05);
+  MassBalanceSteerer mass_balance(&catchment, 1);
+  LibGeoDecomp::SteererFeedback feedback;
+  double initial_courant = KernelTest::courant_number();
+
+  // the state at the start of each step, before the steerers run
+  std::vector<std::vector<Cell> > step_cells;
+  std::vector<double> step_cycle;
+  std::vector<Cell> cells(columns * rows, edge_cell);
+  int failures = 0;
+  int rollback_step = -1;
+  for (int step = 0; step < steps; step++)
+    {
+      step_cycle.push_back(catchment.get_cycle());
+      for (int i = 0; i < columns * rows; i++) cells[i] = grid.get(LibGeoDecomp::Coord<2>(i % columns, i / columns));
+      step_cells.push_back(cells);
+
+      double courant_number = KernelTest::courant_number();
+      stability.nextStep(&grid, region, dimensions, step, LibGeoDecomp::STEERER_NEXT_STEP, 0, true, &feedback);
+      if (KernelTest::courant_number() != courant_number) rollback_step = step;
+      mass_balance.nextStep(&grid, region, dimensions, step, LibGeoDecomp::STEERER_NEXT_STEP, 0, true, &feedback);
+      catchment.increment_counters();
+
+      if (step == rollback_step)
+	{
+	  // detected on the step after the unstable update, restored on the next
+	  std::vector<Cell> restored(columns * rows, edge_cell);
+	  for (int i = 0; i < columns * rows; i++) restored[i] = grid.get(LibGeoDecomp::Coord<2>(i % columns, i / columns));
+	  bool same = true;
+	  for (int i = 0; i < columns * rows; i++)
+	    {
+	      same = same && restored[i].water_depth == step_cells[snapshot_step][i].water_depth
+		&& restored[i].qx == step_cells[snapshot_step][i].qx && restored[i].qy == step_cells[snapshot_step][i].qy;
+	    }
+	  check(step == unstable_step + 2, "rolled back two steps after the unstable update", failures);
+	  check(same, "grid restored to the snapshot", failures);
+	  check(catchment.get_cycle() > step_cycle[snapshot_step] && catchment.get_cycle() < step_cycle[snapshot_step + 1],
+		"model clock restored to the snapshot", failures);
+	}
+
+      for (int i = 0; i < columns * rows; i++) cells[i] = grid.get(LibGeoDecomp::Coord<2>(i % columns, i / columns));
+      LSDStability::max_velocity = (step == unstable_step) ? 0.0 : 20.0;
+      update_grid(cells, columns, rows);
+      for (int i = 0; i < columns * rows; i++) grid.set(LibGeoDecomp::Coord<2>(i % columns, i / columns), cells[i]);
+    }
+
+  // rows numbered 1, 2, ..., each with the input of a whole interval
+  std::ifstream series(series_file.c_str());
+  std::string line;
+  int lines = 0;
+  bool numbered = true, input_booked = true;
+  while (std::getline(series, line))
+    {
+      std::istringstream fields(line);
+      int row;
+      double water_out, water_input;
+      fields >> row >> water_out >> water_input;
+      numbered = numbered && (row == ++lines);
+      input_booked = input_booked && water_input > 0;
+    }
+
+  check(rollback_step >= 0 && KernelTest::courant_number() == initial_courant * 0.5, "courant number reduced once", failures);
+  check(numbered, "time series rows after the snapshot dropped", failures);
+  check(input_booked, "mass balance intervals restart after the rollback", failures);
+  // the rows of the steps since the snapshot are dropped, and the step of
+  // the rollback reduces nothing
+  check(lines == steps - 1 - (rollback_step - snapshot_step) - 1, "one row per kept step", failures);
+
+  std::remove("rollbacktest.params");
+  std::remove(series_file.c_str());
+  std::cout << (failures ? "rollback test failed" : "done.") << std::endl;
+  MPI_Finalize();
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
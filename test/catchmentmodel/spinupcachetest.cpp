@@ -0,0 +1,189 @@
+// spinupcachetest.cpp
+//
+// Checks the spin-up cache: the key is the same for two models read from
+// the same parameter file, and changes with a static parameter, a member
+// parameter and the initial water depths; two runs writing the same
+// cache entry (as ensemble members or task farm groups with the same key
+// do) leave one complete checkpoint that restores the grid they wrote; and
+// a warm start from a cache entry begins its time series and gauge files
+// afresh, rather than appending to those of the run that cached it.
+//
+// Needs MPI and LibGeoDecomp, build and run with "make mpitests".
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <dirent.h>
+
+#include <mpi.h>
+
+#include <libgeodecomp/storage/grid.h>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/LSDCheckpoint.hpp"
+#include "catchmentmodel/LSDio.hpp"
+
+
+
+// The number of lines of a file
+int count_lines(const std::string& filename)
+{
+  std::ifstream file(filename.c_str());
+  std::string line;
+  int lines = 0;
+  while (std::getline(file, line)) lines++;
+  return lines;
+}
+
+
+
+// The cache key of a model read from a parameter file, on the test DEM
+std::string key(const std::string& extra_params)
+{
+  {
+    std::ofstream params("spinupcachetest.params");
+    params << "read_path: .\nread_fname: spinupcachetest_dem\ndem_read_extension: asc\n"
+	   << "write_path: .\nspinup_duration: 60\n" << extra_params;
+  }
+  LSDCatchmentModel catchment("spinupcachetest.params");
+  catchment.load_terrain();
+  catchment.initialise_arrays();
+  return catchment.spinup_cache_key();
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  MPI_Init(&argc, &argv);
+  std::cout << "running spin-up cache test" << std::endl;
+
+  const int columns = 6, rows = 5;
+  {
+    std::ofstream dem("spinupcachetest_dem.asc");
+    dem << "ncols " << columns << "\nnrows " << rows << "\nxllcorner 0\nyllcorner 0\ncellsize 10\nNODATA_value -9999\n";
+    for (int y = 0; y < rows; y++)
+      {
+	for (int x = 0; x < columns; x++) dem << 100.0 + x + 0.5 * y << " ";
+	dem << "\n";
+      }
+  }
+
+  int failures = 0;
+  LSDCatchmentModel::StaticParameters statics = LSDCatchmentModel::get_static_parameters();
+  std::string base = key("");
+  check(key("") == base, "same parameters, same key", failures);
+  check(key("rainfall_scale: 2\n") != base, "rainfall_scale changes the key", failures);
+  check(key("stability_depth_tolerance: 0.001\n") != base, "a member parameter changes the key", failures);
+  check(key("mannings_n: 0.05\n") != base, "a static parameter changes the key", failures);
+  LSDCatchmentModel::set_static_parameters(statics);
+  check(key("") == base, "restored statics, same key", failures);
+
+  // two writers of the same entry, one after the other
+  LSDCatchmentModel catchment("spinupcachetest.params");
+  LibGeoDecomp::Coord<2> dimensions(columns, rows);
+  LibGeoDecomp::Grid<Cell> grid(dimensions, Cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0), Cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0));
+  LibGeoDecomp::Region<2> region;
+  region << LibGeoDecomp::CoordBox<2>(LibGeoDecomp::Coord<2>(0, 0), dimensions);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  grid.set(LibGeoDecomp::Coord<2>(x, y), Cell(cell_type(x, y, columns, rows), 100.0 + x, 0.01 * (x + y), 0.001 * x, 0.002 * y));
+	}
+    }
+  const std::string path = "spinupcachetest_cache";
+  for (int writer = 0; writer < 2; writer++)
+    {
+      CheckpointWriter checkpoint(&catchment, path, 1, 0, 0);
+      checkpoint.write_once_at(0.0);
+      for (unsigned step = 0; step < 2; step++)
+	{
+	  checkpoint.stepFinished(grid, region, dimensions, step, LibGeoDecomp::WRITER_STEP_FINISHED, 0, true);
+	}
+    }
+
+  CheckpointReader reader(path);
+  LibGeoDecomp::Grid<Cell> restored(dimensions, Cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0), Cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0));
+  bool same = reader.found();
+  if (same) reader.restore_subgrid(&restored);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  LibGeoDecomp::Coord<2> coordinate(x, y);
+	  same = same && restored.get(coordinate).water_depth == grid.get(coordinate).water_depth
+	    && restored.get(coordinate).qx == grid.get(coordinate).qx && restored.get(coordinate).qy == grid.get(coordinate).qy;
+	}
+    }
+  check(reader.found() && reader.get_step() == 1, "cache entry complete", failures);
+  check(same, "cache entry restores the grid written", failures);
+
+  int entries = 0;
+  DIR *dir = opendir(path.c_str());
+  for (struct dirent *entry = dir ? readdir(dir) : 0; entry != 0; entry = readdir(dir))
+    {
+      if (entry->d_name[0] != '.' || std::string(entry->d_name).compare(0, 9, ".writing_") == 0) entries++;
+    }
+  if (dir) closedir(dir);
+  check(entries == 1, "one checkpoint, no scratch directories left", failures);
+
+  // a run that writes three rows of each file and then caches its state,
+  // and a warm start from that entry in the same write_path
+  {
+    std::ofstream gauge_points("spinupcachetest_gauges.txt");
+    gauge_points << "outlet 2 3\n";
+    std::ofstream params("spinupcachetest.params", std::ios::app);
+    params << "write_fname: spinupcachetest_series.dat\ngauge_file: spinupcachetest_gauges.txt\n"
+	   << "gauge_coordinates: grid\ngauge_fname: spinupcachetest_gauges.csv\ngauge_save_interval: 0\n";
+  }
+  const std::string warm_path = "spinupcachetest_warm";
+  {
+    LSDCatchmentModel cached("spinupcachetest.params");
+    cached.load_terrain();
+    cached.read_gauge_points();
+    GaugeWriter gauges(&cached, "./spinupcachetest_gauges.csv");
+    gauges.setRegion(region);
+    for (unsigned step = 0; step < 3; step++)
+      {
+	cached.increment_counters();
+	cached.write_output_timeseries();
+	gauges.stepFinished(grid, region, dimensions, step, LibGeoDecomp::WRITER_STEP_FINISHED, 0, true);
+      }
+    gauges.stepFinished(grid, region, dimensions, 3, LibGeoDecomp::WRITER_ALL_DONE, 0, true);
+    CheckpointWriter checkpoint(&cached, warm_path, 1, 0, 0);
+    checkpoint.write_once_at(0.0);
+    for (unsigned step = 3; step < 5; step++)
+      {
+	checkpoint.stepFinished(grid, region, dimensions, step, LibGeoDecomp::WRITER_STEP_FINISHED, 0, true);
+      }
+  }
+  {
+    LSDCatchmentModel warm("spinupcachetest.params");
+    warm.load_terrain();
+    warm.read_gauge_points();
+    CheckpointReader cache_entry(warm_path);
+    check(cache_entry.found(), "cache entry of the cached run complete", failures);
+    cache_entry.restore_counters(&warm);
+    warm.reset_outputs();
+    GaugeWriter gauges(&warm, "./spinupcachetest_gauges.csv");
+    gauges.setRegion(region);
+    warm.increment_counters();
+    warm.write_output_timeseries();
+    gauges.stepFinished(grid, region, dimensions, 0, LibGeoDecomp::WRITER_ALL_DONE, 0, true);
+    check(warm.get_cycle() > 0, "warm start restores the model clock", failures);
+  }
+  check(count_lines("spinupcachetest_series.dat") == 1, "warm start begins a new time series", failures);
+  check(count_lines("spinupcachetest_gauges.csv") == 2, "warm start begins a new gauge file, with its header", failures);
+  LSDCatchmentModel::set_static_parameters(statics);
+
+  system(("rm -rf " + path + " " + warm_path).c_str());
+  std::remove("spinupcachetest_series.dat");
+  std::remove("spinupcachetest_gauges.txt");
+  std::remove("spinupcachetest_gauges.csv");
+  std::remove("spinupcachetest.params");
+  std::remove("spinupcachetest_dem.asc");
+  std::cout << (failures ? "spin-up cache test failed" : "done.") << std::endl;
+  MPI_Finalize();
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
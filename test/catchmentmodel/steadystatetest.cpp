@@ -0,0 +1,110 @@
+// steadystatetest.cpp
+//
+// Checks that ConvergenceSteerer finds the steady state of a small sloping
+// catchment that has drained, left with a film of water too shallow to
+// flow, with water_input_depth set to 0: the "stop" action ends the run,
+// and the "coarsen" action multiplies the time series interval by the
+// output factor. With the default water input the depth of every cell
+// keeps rising, so neither may happen. The
+// steerers run in the order runCatchment adds them, on a LibGeoDecomp grid
+// of one rank; the cells are updated as in the kernel tests.
+//
+// Needs MPI and LibGeoDecomp, build and run with "make mpitests".
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+#include <mpi.h>
+
+#include <libgeodecomp/storage/grid.h>
+
+#include "test/catchmentmodel/kerneltest.hpp"
+#include "catchmentmodel/LSDConvergence.hpp"
+#include "catchmentmodel/LSDMassBalance.hpp"
+
+
+
+// Runs the catchment until ConvergenceSteerer ends it or max_steps, and
+// returns the steps run; coarsened is set if the time series interval grew
+int run(double water_input_depth, bool stop, int max_steps, bool& coarsened)
+{
+  const int columns = 12, rows = 10;
+  LSDCatchmentModel::StaticParameters statics = LSDCatchmentModel::get_static_parameters();
+  LSDCatchmentModel catchment("steadystatetest.params");
+  KernelTest::set_grid_spacing(10.0);
+  KernelTest::set_water_input_depth(water_input_depth);
+
+  LibGeoDecomp::Coord<2> dimensions(columns, rows);
+  Cell edge_cell(Cell::NODATA, 0.0, 0.0, 0.0, 0.0);
+  LibGeoDecomp::Grid<Cell> grid(dimensions, edge_cell, edge_cell);
+  LibGeoDecomp::Region<2> region;
+  region << LibGeoDecomp::CoordBox<2>(LibGeoDecomp::Coord<2>(0, 0), dimensions);
+  for (int y = 0; y < rows; y++)
+    {
+      for (int x = 0; x < columns; x++)
+	{
+	  double elevation = 100.0 + 0.02 * x * KernelTest::grid_spacing() + 0.01 * y * KernelTest::grid_spacing();
+	  grid.set(LibGeoDecomp::Coord<2>(x, y), Cell(cell_type(x, y, columns, rows), elevation, 0.5 * KernelTest::hflow_threshold(), 0.0, 0.0));
+	}
+    }
+
+  // checks every 10 steps, steady after 3 passing checks in a row
+  LSDConvergence::initialise();
+  LSDMassBalance::initialise();
+  ConvergenceSteerer convergence(&catchment, 10, 1e-5, 1e-5, 10.0, 3, stop, 10.0);
+  MassBalanceSteerer mass_balance(&catchment, 10);
+  LibGeoDecomp::SteererFeedback feedback;
+  double timeseries_interval = KernelTest::timeseries_interval(catchment);
+
+  std::vector<Cell> cells(columns * rows, edge_cell);
+  int step = 0;
+  coarsened = false;
+  for (; step < max_steps && !feedback.simulationEnded(); step++)
+    {
+      convergence.nextStep(&grid, region, dimensions, step, LibGeoDecomp::STEERER_NEXT_STEP, 0, true, &feedback);
+      mass_balance.nextStep(&grid, region, dimensions, step, LibGeoDecomp::STEERER_NEXT_STEP, 0, true, &feedback);
+      catchment.increment_counters();
+      coarsened = coarsened || KernelTest::timeseries_interval(catchment) != timeseries_interval;
+
+      for (int i = 0; i < columns * rows; i++) cells[i] = grid.get(LibGeoDecomp::Coord<2>(i % columns, i / columns));
+      update_grid(cells, columns, rows);
+      for (int i = 0; i < columns * rows; i++) grid.set(LibGeoDecomp::Coord<2>(i % columns, i / columns), cells[i]);
+    }
+
+  LSDCatchmentModel::set_static_parameters(statics);
+  return step;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  MPI_Init(&argc, &argv);
+  std::cout << "running steady state test" << std::endl;
+
+  {
+    std::ofstream params("steadystatetest.params");
+    params << "write_path: .\nwrite_fname: steadystatetest_timeseries.dat\n";
+  }
+
+  int failures = 0;
+  const int max_steps = 1000;
+  const double default_input = KernelTest::water_input_depth();
+  bool coarsened;
+  int steps = run(0.0, true, max_steps, coarsened);
+  std::cout << "  drained catchment stopped after " << steps << " steps" << std::endl;
+  check(steps < max_steps, "stop ends the run of a drained catchment", failures);
+
+  run(0.0, false, steps, coarsened);
+  check(coarsened, "coarsen multiplies the time series interval", failures);
+
+  check(run(default_input, true, 2 * steps, coarsened) == 2 * steps && !coarsened,
+	"no steady state with the default water input", failures);
+
+  std::remove("steadystatetest.params");
+  std::remove("steadystatetest_timeseries.dat");
+  std::cout << (failures ? "steady state test failed" : "done.") << std::endl;
+  MPI_Finalize();
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}